@@ -0,0 +1,383 @@
+// This file is part of Net Failover Manager.
+//
+// Net Failover Manager is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Net Failover Manager is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Net Failover Manager.  If not, see
+// <https://www.gnu.org/licenses/>.
+
+// Microbenchmarks of the hot paths of the route manager and of the probes,
+// on synthetic routing tables and route stores of 10 to 100k entries and on
+// recorded echo replies. Besides ns/op, every benchmark reports the heap
+// allocations per iteration as allocs/op.
+
+#include <arpa/inet.h>
+#include <benchmark/benchmark.h>
+#include <netinet/icmp6.h>
+#include <netinet/ip.h>
+#include <netinet/ip_icmp.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cstdio>
+#include <new>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "src/netctl/icmp_prober.h"
+#include "src/netctl/interface_registry.h"
+#include "src/netctl/netlink_socket.h"
+#include "src/netctl/route_table.h"
+
+namespace {
+
+std::atomic<size_t> allocations(0);
+
+}  // namespace
+
+// Counts every heap allocation of the process.
+void *operator new(size_t size) {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  void *p = malloc(size == 0 ? 1 : size);
+  if (p == nullptr) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+void operator delete(void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+
+namespace net_failover_manager {
+namespace {
+
+// Number of interfaces the synthetic routes are spread over.
+const int kInterfaces = 4;
+
+// Starts counting the allocations of a benchmark.
+size_t StartCountingAllocations() {
+  return allocations.load(std::memory_order_relaxed);
+}
+
+// Reports the allocations since `start` as allocs/op.
+void ReportAllocations(benchmark::State &state, size_t start) {
+  state.counters["allocs/op"] =
+      benchmark::Counter(allocations.load(std::memory_order_relaxed) - start,
+                         benchmark::Counter::kAvgIterations);
+}
+
+std::string EthName(int i) { return "eth" + std::to_string(i); }
+
+// Content of /proc/net/route with `entries` routes: one default route per
+// interface, the rest /24 routes.
+std::string MakeIpv4Table(int entries) {
+  std::string table =
+      "Iface\tDestination\tGateway \tFlags\tRefCnt\tUse\tMetric\tMask\t\t"
+      "MTU\tWindow\tIRTT\n";
+  char line[128];
+  for (int i = 0; i < entries; i++) {
+    int interface = i % kInterfaces;
+    bool is_default = i < kInterfaces;
+    uint32_t dst = is_default ? 0 : htonl(0x0a000000 | (i << 8));
+    uint32_t gw = htonl(0xc0a80001 | (interface << 8));
+    uint32_t mask = is_default ? 0 : htonl(0xffffff00);
+    snprintf(line, sizeof(line),
+             "%s\t%08X\t%08X\t0003\t0\t0\t%d\t%08X\t0\t0\t0\n",
+             EthName(interface).c_str(), dst, gw, 100 + i, mask);
+    table += line;
+  }
+  return table;
+}
+
+// Answer to a RTM_GETROUTE dump of the IPv6 routes, with `entries` routes
+// through the loopback interface, whose index is always 1.
+std::vector<char> MakeIpv6Dump(int entries) {
+  NetlinkRequest dump;
+  for (int i = 0; i < entries; i++) {
+    bool is_default = i == 0;
+    auto *route = static_cast<rtmsg *>(
+        dump.BeginMessage(RTM_NEWROUTE, NLM_F_MULTI, sizeof(rtmsg)));
+    route->rtm_family = AF_INET6;
+    route->rtm_dst_len = is_default ? 0 : 64;
+    route->rtm_table = RT_TABLE_MAIN;
+    route->rtm_protocol = RTPROT_BOOT;
+    route->rtm_scope = RT_SCOPE_UNIVERSE;
+    route->rtm_type = RTN_UNICAST;
+    in6_addr dst = {};
+    if (!is_default) {
+      dst.s6_addr[0] = 0xfd;
+      dst.s6_addr[6] = i >> 8;
+      dst.s6_addr[7] = i & 0xff;
+      dump.AddAttribute(RTA_DST, &dst, sizeof(dst));
+    }
+    in6_addr gw = {};
+    gw.s6_addr[0] = 0xfe;
+    gw.s6_addr[1] = 0x80;
+    gw.s6_addr[15] = 1;
+    dump.AddAttribute(RTA_GATEWAY, &gw, sizeof(gw));
+    dump.AddAttribute<uint32_t>(RTA_TABLE, RT_TABLE_MAIN);
+    dump.AddAttribute<uint32_t>(RTA_OIF, 1);
+    dump.AddAttribute<uint32_t>(RTA_PRIORITY, 1024 + i);
+  }
+  dump.BeginMessage(NLMSG_DONE, NLM_F_MULTI, sizeof(int));
+  return dump.Buffer();
+}
+
+// Store of `entries` routes. Interfaces that do not exist get made up
+// indexes.
+void MakeStore(int entries, RouteStore *store) {
+  std::string table = MakeIpv4Table(entries);
+  std::vector<RoutingEntry> parsed;
+  ParseRouteTable(table.data(), table.size(), &parsed);
+  for (auto &entry : parsed) {
+    entry.if_index = 1000 + entry.if_name[3] - '0';
+  }
+  store->ReplaceFamily(AF_INET, parsed);
+}
+
+void BM_ParseRouteTable(benchmark::State &state) {
+  std::string table = MakeIpv4Table(state.range(0));
+  std::vector<RoutingEntry> entries;
+  entries.reserve(state.range(0));
+  size_t start = StartCountingAllocations();
+  for (auto _ : state) {
+    entries.clear();
+    benchmark::DoNotOptimize(
+        ParseRouteTable(table.data(), table.size(), &entries));
+  }
+  ReportAllocations(state, start);
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_ParseRouteTable)->RangeMultiplier(10)->Range(10, 100000);
+
+// What a periodic resync does with the IPv4 table: read it, hash it, parse
+// it. Read from memory.
+void BM_SyncIpv4FromBuffer(benchmark::State &state) {
+  RecordedRouteTableSource source(MakeIpv4Table(state.range(0)), {});
+  std::vector<char> buffer;
+  std::vector<RoutingEntry> entries;
+  entries.reserve(state.range(0));
+  size_t start = StartCountingAllocations();
+  for (auto _ : state) {
+    size_t len = 0;
+    source.ReadIpv4Table(&buffer, &len);
+    benchmark::DoNotOptimize(HashContent(buffer.data(), len));
+    entries.clear();
+    ParseRouteTable(buffer.data(), len, &entries);
+  }
+  ReportAllocations(state, start);
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_SyncIpv4FromBuffer)->RangeMultiplier(10)->Range(10, 100000);
+
+// Same, read from a file in the format of /proc/net/route.
+void BM_SyncIpv4FromFile(benchmark::State &state) {
+  char path[] = "/tmp/netctl_benchmark_routeXXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0) {
+    state.SkipWithError("Could not create the routing table file.");
+    return;
+  }
+  std::string table = MakeIpv4Table(state.range(0));
+  bool written = write(fd, table.data(), table.size()) ==
+                 static_cast<ssize_t>(table.size());
+  close(fd);
+  if (!written) {
+    unlink(path);
+    state.SkipWithError("Could not write the routing table file.");
+    return;
+  }
+  KernelRouteTableSource source(path);
+  std::vector<char> buffer;
+  std::vector<RoutingEntry> entries;
+  entries.reserve(state.range(0));
+  size_t start = StartCountingAllocations();
+  for (auto _ : state) {
+    size_t len = 0;
+    source.ReadIpv4Table(&buffer, &len);
+    benchmark::DoNotOptimize(HashContent(buffer.data(), len));
+    entries.clear();
+    ParseRouteTable(buffer.data(), len, &entries);
+  }
+  ReportAllocations(state, start);
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+  unlink(path);
+}
+BENCHMARK(BM_SyncIpv4FromFile)->RangeMultiplier(10)->Range(10, 100000);
+
+// What a periodic resync does with the IPv6 table, on a replayed dump.
+void BM_SyncIpv6FromNetlinkReplay(benchmark::State &state) {
+  RecordedRouteTableSource source("", MakeIpv6Dump(state.range(0)));
+  std::vector<RoutingEntry> entries;
+  entries.reserve(state.range(0));
+  size_t start = StartCountingAllocations();
+  for (auto _ : state) {
+    entries.clear();
+    source.DumpIpv6Routes([&entries](const nlmsghdr *message) {
+      RoutingEntry entry;
+      if (ParseRouteMessage(message, &entry)) {
+        entries.push_back(entry);
+      }
+    });
+  }
+  ReportAllocations(state, start);
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_SyncIpv6FromNetlinkReplay)
+    ->RangeMultiplier(10)
+    ->Range(10, 100000);
+
+// A full read of the table into the store, with one default route that
+// changes every time.
+void BM_RouteStoreReplaceFamily(benchmark::State &state) {
+  std::string table = MakeIpv4Table(state.range(0));
+  std::vector<RoutingEntry> entries[2];
+  for (auto &version : entries) {
+    ParseRouteTable(table.data(), table.size(), &version);
+    for (auto &entry : version) {
+      entry.if_index = 1000 + entry.if_name[3] - '0';
+    }
+  }
+  entries[1][0].metric = 1;
+  RouteStore store;
+  size_t start = StartCountingAllocations();
+  int i = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(store.ReplaceFamily(AF_INET, entries[i++ % 2]));
+  }
+  ReportAllocations(state, start);
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_RouteStoreReplaceFamily)->RangeMultiplier(10)->Range(10, 100000);
+
+void BM_PrimaryDefaultRoute(benchmark::State &state) {
+  RouteStore store;
+  MakeStore(state.range(0), &store);
+  size_t start = StartCountingAllocations();
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(store.PrimaryDefaultRoute());
+  }
+  ReportAllocations(state, start);
+}
+BENCHMARK(BM_PrimaryDefaultRoute)->RangeMultiplier(10)->Range(10, 100000);
+
+// The two route events that follow a gateway swap: each default route takes
+// the metric of the other one.
+void BM_RouteStoreSwap(benchmark::State &state) {
+  RouteStore store;
+  MakeStore(state.range(0), &store);
+  RoutingEntry first = *store.PrimaryDefaultRoute();
+  RoutingEntry second =
+      *store.DefaultRoute(AF_INET, first.if_index + 1, std::nullopt);
+  RoutingEntry replaced;
+  size_t start = StartCountingAllocations();
+  for (auto _ : state) {
+    std::swap(first.metric, second.metric);
+    store.Replace(first, &replaced);
+    store.Replace(second, &replaced);
+    benchmark::DoNotOptimize(store.PrimaryDefaultRoute());
+  }
+  ReportAllocations(state, start);
+}
+BENCHMARK(BM_RouteStoreSwap)->RangeMultiplier(10)->Range(10, 100000);
+
+// One of the known gateways has lost its default route.
+void BM_FindMissingGateways(benchmark::State &state) {
+  RouteStore store;
+  MakeStore(state.range(0), &store);
+  InterfaceRegistry registry;
+  InterfaceSet known;
+  for (int i = 0; i <= kInterfaces; i++) {
+    known.set(registry.Intern(EthName(i)));
+  }
+  size_t start = StartCountingAllocations();
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(FindMissingGateways(store, &registry, &known));
+  }
+  ReportAllocations(state, start);
+}
+BENCHMARK(BM_FindMissingGateways)->RangeMultiplier(10)->Range(10, 100000);
+
+// A packet received on an ICMP socket, as recorded.
+typedef struct {
+  std::vector<uint8_t> packet;
+  int family;
+  bool raw_socket;
+} RecordedReply;
+
+const uint16_t kIdentifier = 0x4242;
+
+// Echo reply with a 16 bytes payload, preceded by an IPv4 header with
+// `ip_options` bytes of options if set.
+std::vector<uint8_t> MakeEchoReply(uint8_t type, uint16_t sequence,
+                                   std::optional<size_t> ip_options) {
+  std::vector<uint8_t> packet;
+  if (ip_options.has_value()) {
+    packet.resize(sizeof(iphdr) + *ip_options);
+    auto *ip = reinterpret_cast<iphdr *>(packet.data());
+    ip->version = 4;
+    ip->ihl = packet.size() / 4;
+    ip->protocol = IPPROTO_ICMP;
+  }
+  size_t icmp_offset = packet.size();
+  packet.resize(icmp_offset + sizeof(icmphdr) + 16);
+  auto *icmp = reinterpret_cast<icmphdr *>(packet.data() + icmp_offset);
+  icmp->type = type;
+  icmp->un.echo.id = htons(kIdentifier);
+  icmp->un.echo.sequence = htons(sequence);
+  return packet;
+}
+
+// The replies a prober sees: from datagram and raw sockets, with a few that
+// are not for it.
+std::vector<RecordedReply> RecordedReplies() {
+  std::vector<RecordedReply> replies;
+  for (uint16_t sequence = 0; sequence < 8; sequence++) {
+    replies.push_back(
+        {MakeEchoReply(ICMP_ECHOREPLY, sequence, std::nullopt), AF_INET,
+         false});
+    replies.push_back(
+        {MakeEchoReply(ICMP_ECHOREPLY, sequence, 0), AF_INET, true});
+    replies.push_back(
+        {MakeEchoReply(ICMP6_ECHO_REPLY, sequence, std::nullopt), AF_INET6,
+         false});
+  }
+  // IP options, an echo request looped back, and the reply of another
+  // prober on a raw socket.
+  replies.push_back({MakeEchoReply(ICMP_ECHOREPLY, 1, 8), AF_INET, true});
+  replies.push_back({MakeEchoReply(ICMP_ECHO, 1, 0), AF_INET, true});
+  auto other = MakeEchoReply(ICMP_ECHOREPLY, 1, 0);
+  other[sizeof(iphdr) + 4] ^= 0xff;
+  replies.push_back({other, AF_INET, true});
+  return replies;
+}
+
+void BM_ParseEchoReply(benchmark::State &state) {
+  std::vector<RecordedReply> replies = RecordedReplies();
+  size_t start = StartCountingAllocations();
+  for (auto _ : state) {
+    for (const auto &reply : replies) {
+      uint16_t sequence = 0;
+      benchmark::DoNotOptimize(
+          ParseEchoReply(reply.packet.data(), reply.packet.size(),
+                         reply.family, reply.raw_socket, kIdentifier,
+                         &sequence));
+      benchmark::DoNotOptimize(sequence);
+    }
+  }
+  ReportAllocations(state, start);
+  state.SetItemsProcessed(state.iterations() * replies.size());
+}
+BENCHMARK(BM_ParseEchoReply);
+
+}  // namespace
+}  // namespace net_failover_manager
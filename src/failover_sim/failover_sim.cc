@@ -0,0 +1,450 @@
+// This file is part of Net Failover Manager.
+//
+// Net Failover Manager is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Net Failover Manager is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Net Failover Manager.  If not, see
+// <https://www.gnu.org/licenses/>.
+
+// Failover simulation: runs InterfaceChecker, RouteManager and
+// GatewayConfigManager against two simulated uplinks, breaks the preferred
+// one repeatedly and reports how long failover and failback take, along
+// with the CPU and memory used.
+//
+// The process moves itself into new network namespaces, inside a new user
+// namespace when not run as root, so the host network is never touched:
+//
+//   this process                      upstream namespace
+//   u0 10.100.0.1/24  <-- veth -->  p0 10.100.0.2/24
+//   u1 10.101.0.1/24  <-- veth -->  p1 10.101.0.2/24
+//                                     lo 10.200.0.1/32, the probe target
+//
+// Each uplink has a default route, u0 being preferred. Latency and loss are
+// shaped with tc netem on u0 and u1. Outages drop all the traffic of u0
+// while its link stays up: with netem if available, with a blackhole route
+// towards u0 in the upstream namespace otherwise.
+//
+// The daemon flags apply, except --flap_hold_down_s which defaults to 0 so
+// that the trials do not depend on each other, e.g.
+//   failover_sim --trials=50 --fast_detection --failback_dwell_s=0
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include "src/netctl/gateway_config_manager.h"
+#include "src/netctl/interface_checker.h"
+#include "src/netctl/interface_registry.h"
+#include "src/netctl/link_monitor.h"
+#include "src/netctl/route_manager.h"
+
+DEFINE_int32(trials, 10, "Number of outages of the preferred uplink.");
+DEFINE_int32(delay_ms, 10, "Round trip time added to both uplinks.");
+DEFINE_int32(jitter_ms, 2, "Jitter of the added delay.");
+DEFINE_double(baseline_loss, 0, "Loss of both uplinks, in percent.");
+DEFINE_int32(outage_s, 0,
+             "Time the outage lasts after the traffic has been rerouted.");
+DEFINE_int32(phase_timeout_s, 120,
+             "Time after which a failover or failback is counted as missed.");
+
+DECLARE_string(probe_targets);
+
+namespace {
+
+using net_failover_manager::EventDispatcher;
+using net_failover_manager::GatewayConfigManager;
+using net_failover_manager::InterfaceChecker;
+using net_failover_manager::InterfaceName;
+using net_failover_manager::LinkMonitor;
+using net_failover_manager::RouteManager;
+
+typedef std::chrono::steady_clock Clock;
+
+const char kPrimary[] = "u0";
+const char kBackup[] = "u1";
+const char kTarget[] = "10.200.0.1";
+
+// Runs a shell command, in the network namespace of `netns_pid` if not 0.
+bool Run(const std::string &command, pid_t netns_pid = 0) {
+  int netns_fd = -1;
+  if (netns_pid != 0) {
+    std::string path = "/proc/" + std::to_string(netns_pid) + "/ns/net";
+    netns_fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (netns_fd < 0) {
+      LOG(ERROR) << "Could not open " << path << ": " << strerror(errno);
+      return false;
+    }
+  }
+  pid_t pid = fork();
+  if (pid == 0) {
+    if (netns_fd >= 0 && setns(netns_fd, CLONE_NEWNET) < 0) {
+      _exit(127);
+    }
+    execl("/bin/sh", "sh", "-c", command.c_str(), nullptr);
+    _exit(127);
+  }
+  if (netns_fd >= 0) {
+    close(netns_fd);
+  }
+  int status = -1;
+  if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+      WEXITSTATUS(status) != 0) {
+    DLOG(INFO) << "Command failed: " << command;
+    return false;
+  }
+  return true;
+}
+
+bool WriteFile(const std::string &path, const std::string &content) {
+  std::ofstream file(path);
+  file << content;
+  return file.good();
+}
+
+// Moves this process into a new network namespace, and a new user namespace
+// first if it is not privileged.
+bool EnterSandbox() {
+  if (geteuid() == 0) {
+    return unshare(CLONE_NEWNET) == 0;
+  }
+  uid_t uid = geteuid();
+  gid_t gid = getegid();
+  if (unshare(CLONE_NEWUSER | CLONE_NEWNET) < 0) {
+    return false;
+  }
+  return WriteFile("/proc/self/setgroups", "deny") &&
+         WriteFile("/proc/self/uid_map", "0 " + std::to_string(uid) + " 1") &&
+         WriteFile("/proc/self/gid_map", "0 " + std::to_string(gid) + " 1");
+}
+
+// Starts a process that only holds the upstream network namespace. Returns
+// its pid, 0 on failure.
+pid_t StartUpstream() {
+  int ready[2];
+  if (pipe(ready) < 0) {
+    return 0;
+  }
+  pid_t pid = fork();
+  if (pid == 0) {
+    close(ready[0]);
+    char ok = unshare(CLONE_NEWNET) == 0;
+    if (write(ready[1], &ok, 1) != 1 || !ok) {
+      _exit(1);
+    }
+    while (true) {
+      pause();
+    }
+  }
+  close(ready[1]);
+  char ok = 0;
+  if (pid < 0 || read(ready[0], &ok, 1) != 1 || !ok) {
+    pid = 0;
+  }
+  close(ready[0]);
+  return pid;
+}
+
+bool BuildTopology(pid_t upstream) {
+  std::vector<std::pair<std::string, pid_t>> commands = {
+      {"ip link set lo up", 0},
+      {"ip link set lo up", upstream},
+      {"ip addr add " + std::string(kTarget) + "/32 dev lo", upstream},
+  };
+  for (int i = 0; i < 2; i++) {
+    std::string u = "u" + std::to_string(i);
+    std::string p = "p" + std::to_string(i);
+    std::string net = "10.10" + std::to_string(i) + ".0.";
+    commands.push_back({"ip link add " + u + " type veth peer name " + p +
+                            " netns " + std::to_string(upstream),
+                        0});
+    commands.push_back({"ip addr add " + net + "1/24 dev " + u, 0});
+    commands.push_back({"ip link set " + u + " up", 0});
+    commands.push_back({"ip addr add " + net + "2/24 dev " + p, upstream});
+    commands.push_back({"ip link set " + p + " up", upstream});
+    commands.push_back({"ip route add default via " + net + "2 dev " + u +
+                            " metric " + std::to_string(100 * (i + 1)),
+                        0});
+  }
+  for (const auto &command : commands) {
+    if (!Run(command.first, command.second)) {
+      LOG(ERROR) << "Could not run: " << command.first;
+      return false;
+    }
+  }
+  return true;
+}
+
+std::string NetemArgs(double loss) {
+  return "netem delay " + std::to_string(FLAGS_delay_ms / 2) + "ms " +
+         std::to_string(FLAGS_jitter_ms / 2) + "ms loss " +
+         std::to_string(loss) + "%";
+}
+
+// Breaks or repairs the primary uplink.
+class Impairment {
+ public:
+  explicit Impairment(pid_t upstream) : upstream_(upstream), netem_(false) {}
+
+  // Shapes both uplinks. Without netem, the uplinks are left as they are.
+  void Setup() {
+    netem_ = Run(std::string("tc qdisc add dev ") + kPrimary + " root " +
+                 NetemArgs(FLAGS_baseline_loss)) &&
+             Run(std::string("tc qdisc add dev ") + kBackup + " root " +
+                 NetemArgs(FLAGS_baseline_loss));
+    if (!netem_) {
+      LOG(WARNING) << "tc netem not available: no delay nor loss added, "
+                   << "outages are simulated with a blackhole route.";
+    }
+  }
+
+  bool Break() {
+    if (netem_) {
+      return Run(std::string("tc qdisc change dev ") + kPrimary + " root " +
+                 NetemArgs(100));
+    }
+    return Run("ip route add blackhole 10.100.0.1/32", upstream_);
+  }
+
+  bool Repair() {
+    if (netem_) {
+      return Run(std::string("tc qdisc change dev ") + kPrimary + " root " +
+                 NetemArgs(FLAGS_baseline_loss));
+    }
+    return Run("ip route del blackhole 10.100.0.1/32", upstream_);
+  }
+
+ private:
+  pid_t upstream_;
+  bool netem_;
+};
+
+// Records when the notifications of interest were posted.
+class EventRecorder {
+ public:
+  void OnEvent(const EventDispatcher::NetworkEvent &event) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (event.type == EventDispatcher::NetworkEvent::IF_STATUS_CHANGED) {
+      status_[InterfaceName(event.if_id)] = {event.new_status,
+                                             event.posted_at};
+    } else if (event.type == EventDispatcher::NetworkEvent::GW_CHANGED) {
+      gateway_ = {InterfaceName(event.if_id), event.posted_at};
+    } else {
+      return;
+    }
+    changed_.notify_all();
+  }
+
+  // Waits until if_name has `status`, returns when it got it.
+  std::optional<Clock::time_point> WaitStatus(
+      const std::string &if_name, InterfaceChecker::InterfaceStatus status,
+      Clock::time_point deadline) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    bool reached = changed_.wait_until(lock, deadline, [&] {
+      auto it = status_.find(if_name);
+      return it != status_.end() && it->second.first == status;
+    });
+    if (!reached) {
+      return std::nullopt;
+    }
+    return status_[if_name].second;
+  }
+
+  // Waits until if_name is the default gateway, returns when it became it.
+  std::optional<Clock::time_point> WaitGateway(const std::string &if_name,
+                                               Clock::time_point deadline) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    bool reached = changed_.wait_until(
+        lock, deadline, [&] { return gateway_.first == if_name; });
+    if (!reached) {
+      return std::nullopt;
+    }
+    return gateway_.second;
+  }
+
+ private:
+  std::mutex mutex_;
+  std::condition_variable changed_;
+  std::map<std::string,
+           std::pair<InterfaceChecker::InterfaceStatus, Clock::time_point>>
+      status_;
+  std::pair<std::string, Clock::time_point> gateway_;
+};
+
+// Durations in milliseconds, of the trials where the phase completed.
+typedef struct {
+  std::string name;
+  std::vector<double> samples;
+  int missed;
+} Distribution;
+
+void Record(Distribution *distribution,
+            std::optional<Clock::time_point> reached, Clock::time_point from) {
+  if (!reached.has_value()) {
+    distribution->missed++;
+    return;
+  }
+  distribution->samples.push_back(
+      std::chrono::duration<double, std::milli>(reached.value() - from)
+          .count());
+}
+
+// Nearest rank percentile of sorted samples.
+double Percentile(const std::vector<double> &sorted, double fraction) {
+  size_t rank = std::max<size_t>(
+      1, static_cast<size_t>(std::ceil(fraction * sorted.size())));
+  return sorted[rank - 1];
+}
+
+// One line per distribution, so that runs can be diffed.
+void Report(std::vector<Distribution> distributions,
+            std::chrono::duration<double> elapsed) {
+  for (auto &distribution : distributions) {
+    auto &samples = distribution.samples;
+    std::sort(samples.begin(), samples.end());
+    printf("%-26s n=%zu missed=%d", (distribution.name + "_ms").c_str(),
+           samples.size(), distribution.missed);
+    if (!samples.empty()) {
+      printf(" min=%.1f p50=%.1f p90=%.1f p99=%.1f max=%.1f", samples.front(),
+             Percentile(samples, 0.5), Percentile(samples, 0.9),
+             Percentile(samples, 0.99), samples.back());
+    }
+    printf("\n");
+  }
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  double cpu_s = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+                 usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+  printf("%-26s %.3f\n", "cpu_s", cpu_s);
+  printf("%-26s %.3f\n", "cpu_percent", 100 * cpu_s / elapsed.count());
+  printf("%-26s %ld\n", "max_rss_kb", usage.ru_maxrss);
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  // Outages in a row would otherwise be damped as flaps, and each trial be
+  // held down longer than the previous one.
+  gflags::SetCommandLineOptionWithMode("flap_hold_down_s", "0",
+                                       gflags::SET_FLAGS_DEFAULT);
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+  if (!EnterSandbox()) {
+    LOG(ERROR) << "Could not create the namespaces, root or unprivileged "
+               << "user namespaces are needed: " << strerror(errno);
+    return EXIT_FAILURE;
+  }
+  pid_t upstream = StartUpstream();
+  if (upstream == 0 || !BuildTopology(upstream)) {
+    LOG(ERROR) << "Could not build the simulated uplinks.";
+    if (upstream != 0) {
+      kill(upstream, SIGKILL);
+    }
+    return EXIT_FAILURE;
+  }
+  Impairment impairment(upstream);
+  impairment.Setup();
+  FLAGS_probe_targets = std::string("icmp:") + kTarget;
+
+  auto started_at = Clock::now();
+  LinkMonitor link_monitor;
+  InterfaceChecker ic({kPrimary, kBackup}, &link_monitor);
+  RouteManager rm;
+  GatewayConfigManager gm(&ic, &rm);
+  gm.SetPreferredGatewayInterfaces({kPrimary, kBackup});
+  EventRecorder recorder;
+  gm.AddEventObserver([&recorder](const EventDispatcher::NetworkEvent &event) {
+    recorder.OnEvent(event);
+  });
+  // The default gateway must be known before the first probe result.
+  rm.StartChecks();
+  ic.StartChecks();
+
+  Distribution detect = {"time_to_detect", {}, 0};
+  Distribution reroute = {"time_to_reroute", {}, 0};
+  Distribution recover = {"time_to_recover", {}, 0};
+  Distribution failback = {"time_to_failback", {}, 0};
+  auto timeout = std::chrono::seconds(FLAGS_phase_timeout_s);
+  bool ready =
+      recorder.WaitStatus(kPrimary, InterfaceChecker::HEALTHY,
+                          Clock::now() + timeout)
+          .has_value() &&
+      recorder.WaitGateway(kPrimary, Clock::now() + timeout).has_value();
+  if (!ready) {
+    LOG(ERROR) << kPrimary << " never became the healthy default gateway.";
+  }
+  for (int trial = 0; ready && trial < FLAGS_trials; trial++) {
+    LOG(INFO) << "Trial " << trial + 1 << " of " << FLAGS_trials;
+    if (!impairment.Break()) {
+      LOG(ERROR) << "Could not break " << kPrimary;
+      break;
+    }
+    auto broken_at = Clock::now();
+    auto deadline = broken_at + timeout;
+    Record(&detect,
+           recorder.WaitStatus(kPrimary, InterfaceChecker::UNHEALTHY,
+                               deadline),
+           broken_at);
+    auto rerouted = recorder.WaitGateway(kBackup, deadline);
+    Record(&reroute, rerouted, broken_at);
+    if (rerouted.has_value()) {
+      std::this_thread::sleep_for(std::chrono::seconds(FLAGS_outage_s));
+    }
+
+    if (!impairment.Repair()) {
+      LOG(ERROR) << "Could not repair " << kPrimary;
+      break;
+    }
+    if (!rerouted.has_value()) {
+      // There is nothing to fail back from.
+      LOG(ERROR) << "No failover to " << kBackup << ", stopping.";
+      break;
+    }
+    auto repaired_at = Clock::now();
+    deadline = repaired_at + timeout;
+    Record(&recover,
+           recorder.WaitStatus(kPrimary, InterfaceChecker::HEALTHY, deadline),
+           repaired_at);
+    auto failed_back = recorder.WaitGateway(kPrimary, deadline);
+    Record(&failback, failed_back, repaired_at);
+    if (!failed_back.has_value()) {
+      // The next trials would not measure anything.
+      LOG(ERROR) << "No failback to " << kPrimary << ", stopping.";
+      break;
+    }
+  }
+  Report({detect, reroute, recover, failback}, Clock::now() - started_at);
+
+  rm.StopChecks();
+  ic.StopChecks();
+  kill(upstream, SIGKILL);
+  waitpid(upstream, nullptr, 0);
+  return ready ? EXIT_SUCCESS : EXIT_FAILURE;
+}
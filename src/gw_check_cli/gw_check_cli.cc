@@ -7,6 +7,33 @@
 #include <grpcpp/grpcpp.h>
 #include "src/proto/net_failover_manager_service.grpc.pb.h"
 
+// Delay before opening a new stream when the daemon is not reachable.
+const std::chrono::seconds kReconnectDelay(5);
+
+void PrintUpdate(const net_failover_manager::NetworkStateUpdate &update) {
+  switch (update.update_case()) {
+    case net_failover_manager::NetworkStateUpdate::kSnapshot:
+      std::cout << update.snapshot().default_gw_interface() << std::endl;
+      for (const auto &if_status : update.snapshot().interface_status()) {
+        std::cout << "  " << if_status.if_name() << ": " << if_status.status()
+                  << std::endl;
+      }
+      break;
+    case net_failover_manager::NetworkStateUpdate::kDefaultGwChange:
+      std::cout << update.default_gw_change().default_gw_interface()
+                << std::endl;
+      break;
+    case net_failover_manager::NetworkStateUpdate::kIfStatusChange:
+      std::cout << "  " << update.if_status_change().if_name() << ": "
+                << update.if_status_change().old_status() << " -> "
+                << update.if_status_change().new_status() << std::endl;
+      break;
+    default:
+      // Probe metrics are not displayed.
+      break;
+  }
+}
+
 int main(int argc, char *argv[]) {
   gflags::ParseCommandLineFlags(&argc, &argv, true);
   google::InitGoogleLogging(argv[0]);
@@ -16,11 +43,17 @@ int main(int argc, char *argv[]) {
                                      grpc::InsecureChannelCredentials());
   stub_ = net_failover_manager::NetworkConfig::NewStub(channel);
   while (true) {
+    // Changes are pushed by the daemon as they happen, a new stream is only
+    // needed if the previous one broke.
     grpc::ClientContext context;
-    net_failover_manager::DefaultGwRequest request;
-    net_failover_manager::DefaultGwResponse response;
-    grpc::Status status = stub_->GetDefaultGw(&context, request, &response);
-    std::cout << response.default_gw_interface() << std::endl;
-    std::this_thread::sleep_for(std::chrono::seconds(5));
+    net_failover_manager::WatchNetworkStateRequest request;
+    auto reader = stub_->WatchNetworkState(&context, request);
+    net_failover_manager::NetworkStateUpdate update;
+    while (reader->Read(&update)) {
+      PrintUpdate(update);
+    }
+    grpc::Status status = reader->Finish();
+    LOG(WARNING) << "Stream ended: " << status.error_message();
+    std::this_thread::sleep_for(kReconnectDelay);
   }
 }
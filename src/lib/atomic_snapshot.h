@@ -0,0 +1,61 @@
+// This file is part of Net Failover Manager.
+//
+// Net Failover Manager is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Net Failover Manager is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Net Failover Manager.  If not, see
+// <https://www.gnu.org/licenses/>.
+
+#ifndef NET_FAILOVER_MANAGER_LIB_ATOMIC_SNAPSHOT
+#define NET_FAILOVER_MANAGER_LIB_ATOMIC_SNAPSHOT
+
+#include <atomic>
+#include <memory>
+#include <utility>
+
+namespace net_failover_manager {
+
+// Holds the latest version of an immutable value. Readers get a reference to
+// the version current at the time of the call, which stays valid for as long
+// as they hold it, while a writer builds the next version on the side and
+// publishes it with a pointer swap. Readers never wait for the writer, nor
+// for each other beyond the reference count update.
+template <typename T>
+class AtomicSnapshot {
+ public:
+  explicit AtomicSnapshot(std::shared_ptr<const T> initial)
+      : current_(std::move(initial)) {}
+
+  // Can be called from any thread.
+  std::shared_ptr<const T> Load() const {
+    return std::atomic_load_explicit(&current_, std::memory_order_acquire);
+  }
+
+  // Replaces the current version. Concurrent writers must be serialized by
+  // the caller, otherwise updates made from a stale copy can be lost.
+  void Publish(std::shared_ptr<const T> next) {
+    std::atomic_store_explicit(&current_, std::move(next),
+                               std::memory_order_release);
+  }
+
+ protected:
+  // Delete copy and move constructors.
+  AtomicSnapshot(const AtomicSnapshot &) = delete;
+  AtomicSnapshot &operator=(const AtomicSnapshot &) = delete;
+
+ private:
+  // Only accessed through the atomic shared_ptr functions.
+  std::shared_ptr<const T> current_;
+};  // class AtomicSnapshot
+
+}  // namespace net_failover_manager
+
+#endif  // NET_FAILOVER_MANAGER_LIB_ATOMIC_SNAPSHOT
@@ -0,0 +1,257 @@
+// This file is part of Net Failover Manager.
+//
+// Net Failover Manager is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Net Failover Manager is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Net Failover Manager.  If not, see
+// <https://www.gnu.org/licenses/>.
+
+#include "metrics.h"
+
+#include <glog/logging.h>
+
+#include <algorithm>
+#include <cstdio>
+
+namespace net_failover_manager {
+
+namespace {
+// Shard of the calling thread.
+size_t ThisThreadShard() {
+  static std::atomic<size_t> next_shard(0);
+  thread_local size_t shard =
+      next_shard.fetch_add(1, std::memory_order_relaxed) % kMetricShards;
+  return shard;
+}
+
+// fetch_add on atomic<double> is only available from C++20. The shard is
+// only written by its own thread(s), so the loop almost never retries.
+void AtomicAdd(std::atomic<double> *target, double value) {
+  double current = target->load(std::memory_order_relaxed);
+  while (!target->compare_exchange_weak(current, current + value,
+                                        std::memory_order_relaxed)) {
+  }
+}
+
+std::string EscapeLabelValue(const std::string &value) {
+  std::string ret;
+  for (char c : value) {
+    switch (c) {
+      case '\\':
+        ret += "\\\\";
+        break;
+      case '"':
+        ret += "\\\"";
+        break;
+      case '\n':
+        ret += "\\n";
+        break;
+      default:
+        ret += c;
+    }
+  }
+  return ret;
+}
+
+// Labels as they appear between the braces, without them.
+std::string RenderLabels(const MetricLabels &labels) {
+  std::string ret;
+  for (const auto &label : labels) {
+    if (!ret.empty()) {
+      ret += ",";
+    }
+    ret += label.first + "=\"" + EscapeLabelValue(label.second) + "\"";
+  }
+  return ret;
+}
+
+std::string FormatDouble(double value) {
+  char buffer[32];
+  snprintf(buffer, sizeof(buffer), "%.9g", value);
+  return buffer;
+}
+
+// Appends "name{labels} value\n", `extra_label` is appended to the labels.
+void AppendSample(const std::string &name, const std::string &labels,
+                  const std::string &extra_label, const std::string &value,
+                  std::string *out) {
+  *out += name;
+  if (!labels.empty() || !extra_label.empty()) {
+    *out += "{" + labels;
+    if (!labels.empty() && !extra_label.empty()) {
+      *out += ",";
+    }
+    *out += extra_label + "}";
+  }
+  *out += " " + value + "\n";
+}
+}  // namespace
+
+void Counter::Increment(uint64_t value) {
+  shards_[ThisThreadShard()].value.fetch_add(value, std::memory_order_relaxed);
+}
+
+uint64_t Counter::Value() const {
+  uint64_t ret = 0;
+  for (const auto &shard : shards_) {
+    ret += shard.value.load(std::memory_order_relaxed);
+  }
+  return ret;
+}
+
+Histogram::Histogram(const std::vector<double> &bounds) : bounds_(bounds) {
+  for (auto &shard : shards_) {
+    shard.counts.reset(new std::atomic<uint64_t>[bounds_.size() + 1]);
+    for (size_t i = 0; i <= bounds_.size(); i++) {
+      shard.counts[i].store(0, std::memory_order_relaxed);
+    }
+    shard.sum.store(0, std::memory_order_relaxed);
+  }
+}
+
+void Histogram::Observe(double value) {
+  size_t bucket =
+      std::lower_bound(bounds_.begin(), bounds_.end(), value) - bounds_.begin();
+  auto &shard = shards_[ThisThreadShard()];
+  shard.counts[bucket].fetch_add(1, std::memory_order_relaxed);
+  AtomicAdd(&shard.sum, value);
+}
+
+Histogram::Snapshot Histogram::Collect() const {
+  Snapshot snapshot;
+  snapshot.cumulative_counts.assign(bounds_.size() + 1, 0);
+  snapshot.sum = 0;
+  for (const auto &shard : shards_) {
+    for (size_t i = 0; i <= bounds_.size(); i++) {
+      snapshot.cumulative_counts[i] +=
+          shard.counts[i].load(std::memory_order_relaxed);
+    }
+    snapshot.sum += shard.sum.load(std::memory_order_relaxed);
+  }
+  for (size_t i = 1; i <= bounds_.size(); i++) {
+    snapshot.cumulative_counts[i] += snapshot.cumulative_counts[i - 1];
+  }
+  snapshot.count = snapshot.cumulative_counts.back();
+  return snapshot;
+}
+
+const std::vector<double> &LatencyBuckets() {
+  static const std::vector<double> buckets = {
+      0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05,
+      0.1,    0.25,  0.5,    1,     2.5,  5,     10};
+  return buckets;
+}
+
+MetricsRegistry *MetricsRegistry::Default() {
+  static MetricsRegistry *registry = new MetricsRegistry();
+  return registry;
+}
+
+MetricsRegistry::Family *MetricsRegistry::GetFamily(const std::string &name,
+                                                    const std::string &help,
+                                                    MetricType type) {
+  // Lock must be held by caller.
+  auto it = families_.find(name);
+  if (it == families_.end()) {
+    Family &family = families_[name];
+    family.help = help;
+    family.type = type;
+    return &family;
+  }
+  if (it->second.type != type) {
+    // The metric still works, it is just not exported.
+    LOG(ERROR) << "Metric " << name << " registered with different types.";
+  }
+  return &it->second;
+}
+
+Counter *MetricsRegistry::GetCounter(const std::string &name,
+                                     const std::string &help,
+                                     const MetricLabels &labels) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  auto &counter =
+      GetFamily(name, help, COUNTER)->counters[RenderLabels(labels)];
+  if (!counter) {
+    counter = std::make_unique<Counter>();
+  }
+  return counter.get();
+}
+
+Gauge *MetricsRegistry::GetGauge(const std::string &name,
+                                 const std::string &help,
+                                 const MetricLabels &labels) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  auto &gauge = GetFamily(name, help, GAUGE)->gauges[RenderLabels(labels)];
+  if (!gauge) {
+    gauge = std::make_unique<Gauge>();
+  }
+  return gauge.get();
+}
+
+Histogram *MetricsRegistry::GetHistogram(const std::string &name,
+                                         const std::string &help,
+                                         const std::vector<double> &bounds,
+                                         const MetricLabels &labels) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  auto &histogram =
+      GetFamily(name, help, HISTOGRAM)->histograms[RenderLabels(labels)];
+  if (!histogram) {
+    histogram = std::make_unique<Histogram>(bounds);
+  }
+  return histogram.get();
+}
+
+std::string MetricsRegistry::Render() const {
+  std::unique_lock<std::mutex> lock(mutex_);
+  std::string out;
+  for (const auto &entry : families_) {
+    const auto &name = entry.first;
+    const auto &family = entry.second;
+    out += "# HELP " + name + " " + family.help + "\n";
+    switch (family.type) {
+      case COUNTER:
+        out += "# TYPE " + name + " counter\n";
+        for (const auto &counter : family.counters) {
+          AppendSample(name, counter.first, "",
+                       std::to_string(counter.second->Value()), &out);
+        }
+        break;
+      case GAUGE:
+        out += "# TYPE " + name + " gauge\n";
+        for (const auto &gauge : family.gauges) {
+          AppendSample(name, gauge.first, "",
+                       FormatDouble(gauge.second->Value()), &out);
+        }
+        break;
+      case HISTOGRAM:
+        out += "# TYPE " + name + " histogram\n";
+        for (const auto &histogram : family.histograms) {
+          const auto &bounds = histogram.second->Bounds();
+          auto snapshot = histogram.second->Collect();
+          for (size_t i = 0; i < bounds.size(); i++) {
+            AppendSample(name + "_bucket", histogram.first,
+                         "le=\"" + FormatDouble(bounds[i]) + "\"",
+                         std::to_string(snapshot.cumulative_counts[i]), &out);
+          }
+          AppendSample(name + "_bucket", histogram.first, "le=\"+Inf\"",
+                       std::to_string(snapshot.count), &out);
+          AppendSample(name + "_sum", histogram.first, "",
+                       FormatDouble(snapshot.sum), &out);
+          AppendSample(name + "_count", histogram.first, "",
+                       std::to_string(snapshot.count), &out);
+        }
+        break;
+    }
+  }
+  return out;
+}
+
+}  // namespace net_failover_manager
@@ -0,0 +1,167 @@
+// This file is part of Net Failover Manager.
+//
+// Net Failover Manager is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Net Failover Manager is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Net Failover Manager.  If not, see
+// <https://www.gnu.org/licenses/>.
+
+// Counters, gauges and histograms exported in the Prometheus text format.
+// Updates never take a lock: every metric is split in per-thread shards that
+// are only summed when the metrics are collected.
+
+#ifndef NET_FAILOVER_MANAGER_LIB_METRICS
+#define NET_FAILOVER_MANAGER_LIB_METRICS
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace net_failover_manager {
+
+// Number of shards of each metric. Threads are assigned a shard in turn, so
+// up to this many threads update a metric without sharing a cache line.
+constexpr size_t kMetricShards = 8;
+
+// Label name and value pairs, e.g. {{"interface", "eth1"}}.
+typedef std::vector<std::pair<std::string, std::string>> MetricLabels;
+
+class Counter {
+ public:
+  Counter() {}
+
+  void Increment(uint64_t value = 1);
+  uint64_t Value() const;
+
+ protected:
+  // Delete copy and move constructors.
+  Counter(const Counter &) = delete;
+  Counter &operator=(const Counter &) = delete;
+
+ private:
+  typedef struct alignas(64) {
+    std::atomic<uint64_t> value{0};
+  } Shard;
+  Shard shards_[kMetricShards];
+};  // class Counter
+
+// Last value set wins, no sharding needed.
+class Gauge {
+ public:
+  Gauge() : value_(0) {}
+
+  void Set(double value) { value_.store(value, std::memory_order_relaxed); }
+  double Value() const { return value_.load(std::memory_order_relaxed); }
+
+ protected:
+  // Delete copy and move constructors.
+  Gauge(const Gauge &) = delete;
+  Gauge &operator=(const Gauge &) = delete;
+
+ private:
+  std::atomic<double> value_;
+};  // class Gauge
+
+class Histogram {
+ public:
+  // Cumulative view of the histogram, as exported.
+  typedef struct {
+    // Number of observations less than or equal to each bound.
+    std::vector<uint64_t> cumulative_counts;
+    uint64_t count;
+    double sum;
+  } Snapshot;
+
+  // Args:
+  //   bounds: upper bounds of the buckets, in increasing order. A last
+  //           bucket for values above all bounds is implicit.
+  explicit Histogram(const std::vector<double> &bounds);
+
+  void Observe(double value);
+  Snapshot Collect() const;
+  const std::vector<double> &Bounds() const { return bounds_; }
+
+ protected:
+  // Delete copy and move constructors.
+  Histogram(const Histogram &) = delete;
+  Histogram &operator=(const Histogram &) = delete;
+
+ private:
+  typedef struct alignas(64) {
+    std::unique_ptr<std::atomic<uint64_t>[]> counts;
+    std::atomic<double> sum;
+  } Shard;
+
+  const std::vector<double> bounds_;
+  Shard shards_[kMetricShards];
+};  // class Histogram
+
+// Bucket bounds, in seconds, suitable for network round trip times and
+// other sub-second durations.
+const std::vector<double> &LatencyBuckets();
+
+// Owns the metrics and renders them. Getting a metric takes a lock, so hot
+// paths should get their metrics once and keep the pointers, which stay
+// valid for the lifetime of the registry.
+class MetricsRegistry {
+ public:
+  MetricsRegistry() {}
+
+  // Registry used by the daemon.
+  static MetricsRegistry *Default();
+
+  // Return the metric with the given name and labels, creating it if needed.
+  // All the metrics sharing a name must be of the same type; `help` and
+  // `bounds` are only used when the first one is created.
+  Counter *GetCounter(const std::string &name, const std::string &help,
+                      const MetricLabels &labels = {});
+  Gauge *GetGauge(const std::string &name, const std::string &help,
+                  const MetricLabels &labels = {});
+  Histogram *GetHistogram(const std::string &name, const std::string &help,
+                          const std::vector<double> &bounds,
+                          const MetricLabels &labels = {});
+
+  // All the metrics in the Prometheus text exposition format.
+  std::string Render() const;
+
+ protected:
+  // Delete copy and move constructors.
+  MetricsRegistry(const MetricsRegistry &) = delete;
+  MetricsRegistry &operator=(const MetricsRegistry &) = delete;
+
+ private:
+  typedef enum { COUNTER, GAUGE, HISTOGRAM } MetricType;
+
+  // All the metrics with the same name, keyed by their rendered labels.
+  typedef struct {
+    std::string help;
+    MetricType type;
+    std::map<std::string, std::unique_ptr<Counter>> counters;
+    std::map<std::string, std::unique_ptr<Gauge>> gauges;
+    std::map<std::string, std::unique_ptr<Histogram>> histograms;
+  } Family;
+
+  Family *GetFamily(const std::string &name, const std::string &help,
+                    MetricType type);
+
+  mutable std::mutex mutex_;
+  // Sorted by name, so that the output is stable. Protected by mutex_.
+  std::map<std::string, Family> families_;
+};  // class MetricsRegistry
+
+}  // namespace net_failover_manager
+
+#endif  // NET_FAILOVER_MANAGER_LIB_METRICS
@@ -0,0 +1,134 @@
+// This file is part of Net Failover Manager.
+//
+// Net Failover Manager is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Net Failover Manager is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Net Failover Manager.  If not, see
+// <https://www.gnu.org/licenses/>.
+
+#ifndef NET_FAILOVER_MANAGER_LIB_MPSC_QUEUE
+#define NET_FAILOVER_MANAGER_LIB_MPSC_QUEUE
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <optional>
+#include <utility>
+
+namespace net_failover_manager {
+
+// Bounded, lock-free queue for many producers and a single consumer. Each
+// cell carries a sequence number that tells whether it is free for the
+// producer at a given position or ready for the consumer, so producers only
+// contend on the tail index and never on a lock.
+// Push can be called from any thread, Pop only from the consumer thread.
+template <typename T>
+class BoundedMpscQueue {
+ public:
+  // Capacity is rounded up to the next power of two.
+  explicit BoundedMpscQueue(size_t capacity)
+      : capacity_(RoundUpToPowerOfTwo(capacity)),
+        mask_(capacity_ - 1),
+        cells_(new Cell[capacity_]),
+        tail_(0),
+        head_(0) {
+    for (size_t i = 0; i < capacity_; i++) {
+      cells_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  // Returns false, without modifying `value`, if the queue is full.
+  bool Push(T &&value) {
+    size_t position = tail_.load(std::memory_order_relaxed);
+    Cell *cell;
+    while (true) {
+      cell = &cells_[position & mask_];
+      size_t sequence = cell->sequence.load(std::memory_order_acquire);
+      intptr_t diff =
+          static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position);
+      if (diff == 0) {
+        if (tail_.compare_exchange_weak(position, position + 1,
+                                        std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        position = tail_.load(std::memory_order_relaxed);
+      }
+    }
+    cell->value = std::move(value);
+    cell->sequence.store(position + 1, std::memory_order_seq_cst);
+    return true;
+  }
+
+  // Consumer only. Returns nullopt if the queue is empty.
+  std::optional<T> Pop() {
+    size_t position = head_.load(std::memory_order_relaxed);
+    Cell &cell = cells_[position & mask_];
+    if (cell.sequence.load(std::memory_order_seq_cst) != position + 1) {
+      return std::nullopt;
+    }
+    std::optional<T> ret(std::move(cell.value));
+    cell.value = T();
+    head_.store(position + 1, std::memory_order_relaxed);
+    cell.sequence.store(position + capacity_, std::memory_order_release);
+    return ret;
+  }
+
+  // Consumer only. A producer may be about to publish an element even if this
+  // returns true.
+  bool Empty() const {
+    size_t position = head_.load(std::memory_order_relaxed);
+    return cells_[position & mask_].sequence.load(std::memory_order_seq_cst) !=
+           position + 1;
+  }
+
+  // Approximate number of elements, can be called from any thread.
+  size_t Size() const {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    size_t head = head_.load(std::memory_order_relaxed);
+    return tail > head ? tail - head : 0;
+  }
+
+  size_t Capacity() const { return capacity_; }
+
+ protected:
+  // Delete copy and move constructors.
+  BoundedMpscQueue(const BoundedMpscQueue &) = delete;
+  BoundedMpscQueue &operator=(const BoundedMpscQueue &) = delete;
+
+ private:
+  // Cells are aligned to a cache line so that producers writing adjacent
+  // cells do not invalidate each other's cache lines.
+  typedef struct alignas(64) {
+    std::atomic<size_t> sequence;
+    T value;
+  } Cell;
+
+  static size_t RoundUpToPowerOfTwo(size_t value) {
+    size_t ret = 2;
+    while (ret < value) {
+      ret <<= 1;
+    }
+    return ret;
+  }
+
+  const size_t capacity_;
+  const size_t mask_;
+  std::unique_ptr<Cell[]> cells_;
+  alignas(64) std::atomic<size_t> tail_;
+  alignas(64) std::atomic<size_t> head_;
+};  // class BoundedMpscQueue
+
+}  // namespace net_failover_manager
+
+#endif  // NET_FAILOVER_MANAGER_LIB_MPSC_QUEUE
@@ -14,9 +14,16 @@
 // along with Net Failover Manager.  If not, see
 // <https://www.gnu.org/licenses/>.
 
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <chrono>
 #include <iostream>
+#include <sstream>
 #include <string>
 #include <thread>
 #include <vector>
@@ -24,59 +31,205 @@
 #include <gflags/gflags.h>
 #include <glog/logging.h>
 #include <grpcpp/grpcpp.h>
+#include "src/netctl/config_loader.h"
 #include "src/netctl/gateway_config_manager.h"
 #include "src/netctl/interface_checker.h"
+#include "src/netctl/interface_registry.h"
+#include "src/netctl/link_monitor.h"
+#include "src/lib/metrics.h"
 #include "src/netctl/route_manager.h"
+#include "src/netctl/state_snapshot.h"
+#include "src/netctl/trace_dumper.h"
+#include "src/netctl/trace_log.h"
+#include "src/service/metrics_http_server.h"
 #include "src/service/net_failover_manager_service_impl.h"
 
+DEFINE_string(config, "",
+              "Configuration file, see DaemonConfig in "
+              "src/proto/net_failover_manager_config.proto. Reloaded on "
+              "SIGHUP and whenever it is rewritten.");
+DEFINE_string(interfaces, "eth1,usb0",
+              "Without --config: comma separated interfaces to check, most "
+              "preferred first.");
+DEFINE_string(state_file, "",
+              "File the state of the interfaces is saved to, and restored "
+              "from at startup. Not saved if empty.");
+DEFINE_string(metrics_address, "127.0.0.1",
+              "Address the Prometheus metrics are served on.");
+DEFINE_int32(metrics_port, 9464,
+             "Port the Prometheus metrics are served on, 0 to disable.");
+DEFINE_string(trace_dump_path, "/run/net_failover_manager.trace",
+              "File the trace of the failover decisions is written to on "
+              "SIGUSR1, see src/trace_decoder. Empty to ignore SIGUSR1.");
+
+using net_failover_manager::ConfigLoader;
 using net_failover_manager::GatewayConfigManager;
 using net_failover_manager::InterfaceChecker;
+using net_failover_manager::InterfaceName;
+using net_failover_manager::LinkMonitor;
+using net_failover_manager::MetricsHttpServer;
+using net_failover_manager::MetricsRegistry;
 using net_failover_manager::RouteManager;
+using net_failover_manager::StateSnapshot;
+using net_failover_manager::TraceDumper;
+using net_failover_manager::TraceLog;
+using net_failover_manager::kNoInterface;
+
+namespace {
+
+// Written to by the SIGTERM and SIGINT handler, watched by RunServer.
+int shutdown_pipe[2] = {-1, -1};
+
+void OnShutdownSignal(int) {
+  int saved_errno = errno;
+  char byte = 0;
+  if (write(shutdown_pipe[1], &byte, 1) < 0) {
+    // Pipe full: the shutdown is already pending.
+  }
+  errno = saved_errno;
+}
 
-void RunServer(RouteManager *rm, InterfaceChecker *ic) {
+// Makes SIGTERM and SIGINT shut the gRPC server down, so that main tears
+// everything down, saving the state, instead of the process being killed.
+void HandleShutdownSignals() {
+  if (pipe2(shutdown_pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+    LOG(ERROR) << "pipe2 failed, SIGTERM kills the daemon: "
+               << strerror(errno);
+    return;
+  }
+  struct sigaction action = {};
+  action.sa_handler = OnShutdownSignal;
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGTERM, &action, nullptr);
+  sigaction(SIGINT, &action, nullptr);
+}
+
+}  // namespace
+
+void RunServer(RouteManager *rm, GatewayConfigManager *gm) {
   std::string address = "0.0.0.0";
   std::string port = "50051";
   std::string server_address = address + ":" + port;
-  net_failover_manager::NetworkConfigImpl service(rm, ic);
+  net_failover_manager::NetworkConfigImpl service(rm, gm);
 
   grpc::ServerBuilder builder;
   // Listen on the given address without any authentication mechanism.
   builder.AddListeningPort(server_address, grpc::InsecureServerCredentials());
   // Register "service" as the instance through which we'll communicate with
-  // clients. In this case it corresponds to an *synchronous* service.
+  // clients. Reads are *asynchronous*, the other calls are synchronous.
   builder.RegisterService(&service);
+  std::unique_ptr<grpc::ServerCompletionQueue> cq =
+      builder.AddCompletionQueue();
   // Finally assemble the server.
   std::unique_ptr<grpc::Server> server(builder.BuildAndStart());
   std::cout << "Server listening on " << server_address << std::endl;
+  std::thread async_thread([&service, &cq] { service.HandleRpcs(cq.get()); });
+  std::thread shutdown_thread;
+  if (shutdown_pipe[0] >= 0) {
+    shutdown_thread = std::thread([&server] {
+      pollfd fd = {shutdown_pipe[0], POLLIN, 0};
+      while (poll(&fd, 1, -1) < 0 && errno == EINTR) {
+      }
+      LOG(INFO) << "Shutting down.";
+      // The watch streams only end when cancelled.
+      server->Shutdown(std::chrono::system_clock::now() +
+                       std::chrono::seconds(1));
+    });
+  }
 
-  // Wait for the server to shutdown. Note that some other thread must be
-  // responsible for shutting down the server for this call to ever return.
+  // Wait for the server to shutdown, on SIGTERM or SIGINT.
   server->Wait();
+  if (shutdown_thread.joinable()) {
+    shutdown_thread.join();
+  }
+  cq->Shutdown();
+  async_thread.join();
 }
 
 int main(int argc, char *argv[]) {
   gflags::ParseCommandLineFlags(&argc, &argv, true);
   google::InitGoogleLogging(argv[0]);
   google::InstallFailureSignalHandler();
-  std::vector<std::string> interfaces = {"eth1", "usb0"};
-  InterfaceChecker ic(interfaces);
+  // After the failure handler, which also catches SIGTERM.
+  HandleShutdownSignals();
+  // Shared by the components following the links, so that they agree on
+  // which ones exist.
+  LinkMonitor link_monitor;
+  // The configuration sets flags read by the constructors below.
+  ConfigLoader config_loader(FLAGS_config, &link_monitor);
+  std::vector<std::string> interfaces;
+  if (!FLAGS_config.empty()) {
+    auto status = config_loader.Load();
+    if (status.Error() != net_failover_manager::Status::OK) {
+      LOG(ERROR) << "Invalid configuration: " << status.ErrorMessage();
+      return EXIT_FAILURE;
+    }
+  } else {
+    std::stringstream names(FLAGS_interfaces);
+    std::string name;
+    while (std::getline(names, name, ',')) {
+      interfaces.push_back(name);
+    }
+  }
+  InterfaceChecker ic(interfaces, &link_monitor);
   RouteManager rm;
   GatewayConfigManager gm(&ic, &rm);
-  gm.SetPreferredGatewayInterfaces(interfaces);
+  if (!FLAGS_config.empty()) {
+    auto status = config_loader.Start(&ic, &gm);
+    if (status.Error() != net_failover_manager::Status::OK) {
+      LOG(ERROR) << "Configuration not watched: " << status.ErrorMessage();
+    }
+  } else {
+    gm.SetPreferredGatewayInterfaces(interfaces);
+  }
+  // Restored once the interfaces are known, before they are probed.
+  StateSnapshot state_snapshot(FLAGS_state_file, &ic, &rm, &gm);
+  if (!FLAGS_state_file.empty()) {
+    auto status = state_snapshot.Restore();
+    if (status.Error() != net_failover_manager::Status::OK) {
+      LOG(INFO) << "State not restored: " << status.ErrorMessage();
+    }
+    status = state_snapshot.Start();
+    if (status.Error() != net_failover_manager::Status::OK) {
+      LOG(ERROR) << "State not saved: " << status.ErrorMessage();
+    }
+  }
+  TraceDumper trace_dumper(TraceLog::Default(), FLAGS_trace_dump_path);
+  if (!FLAGS_trace_dump_path.empty()) {
+    auto status = trace_dumper.Start();
+    if (status.Error() != net_failover_manager::Status::OK) {
+      LOG(ERROR) << "Trace not dumped on SIGUSR1: " << status.ErrorMessage();
+    }
+  }
   LOG(INFO) << "Starting the interface checks";
-  ic.StartChecks();
+  // The default gateway must be known before the first probe result, or a
+  // less preferred interface found healthy first could take over.
   rm.StartChecks();
+  ic.StartChecks();
+  MetricsHttpServer metrics_server(MetricsRegistry::Default(),
+                                   FLAGS_metrics_address, FLAGS_metrics_port);
+  if (FLAGS_metrics_port != 0) {
+    auto status = metrics_server.Start();
+    if (status.Error() != net_failover_manager::Status::OK) {
+      LOG(ERROR) << "Metrics not served: " << status.ErrorMessage();
+    }
+  }
 
   auto default_interface = rm.PrimaryDefaultGwInterface();
-  if (default_interface.has_value()) {
-    LOG(INFO) << "Default interface " << rm.PrimaryDefaultGwInterface().value();
+  if (default_interface != kNoInterface) {
+    LOG(INFO) << "Default interface " << InterfaceName(default_interface);
   } else {
     LOG(WARNING) << "No default interface";
   }
   LOG(WARNING) << "\nSetting gw\n";
   LOG(WARNING) << "\nSetting gw done\n";
 
-  RunServer(&rm, &ic);
+  RunServer(&rm, &gm);
+  config_loader.Stop();
+  state_snapshot.Stop();
+  trace_dumper.Stop();
   rm.StopChecks();
   ic.StopChecks();
+  link_monitor.Stop();
 }
@@ -0,0 +1,502 @@
+// This file is part of Net Failover Manager.
+//
+// Net Failover Manager is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Net Failover Manager is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Net Failover Manager.  If not, see
+// <https://www.gnu.org/licenses/>.
+
+#include "config_loader.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <google/protobuf/text_format.h>
+#include <net/if.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <fstream>
+#include <set>
+#include <sstream>
+
+#include "tunables.h"
+
+namespace net_failover_manager {
+
+namespace {
+// Writes done in quick succession, e.g. by an editor, trigger one reload.
+const std::chrono::milliseconds kReloadDelay(200);
+
+// Flags only read when the components are created. The others are
+// tunables.
+const std::set<std::string> kStartupOnlyFlags = {
+    "fast_detection", "load_balance", "multipath_metric", "policy_routing",
+    "flush_conntrack"};
+
+Tunables ToTunables(const DaemonConfig &config) {
+  Tunables tunables;
+  tunables.probe_quorum = config.probe_quorum();
+  tunables.fast_probe_interval_ms = config.fast_probe_interval_ms();
+  tunables.fast_probe_min_interval_ms = config.fast_probe_min_interval_ms();
+  tunables.fast_probe_timeout_ms = config.fast_probe_timeout_ms();
+  tunables.probes_to_healthy = config.probes_to_healthy();
+  tunables.probes_to_unhealthy = config.probes_to_unhealthy();
+  tunables.flap_hold_down_s = config.flap_hold_down_s();
+  tunables.flap_hold_down_max_s = config.flap_hold_down_max_s();
+  tunables.max_p95_rtt_ms = config.max_p95_rtt_ms();
+  tunables.min_quality_score = config.min_quality_score();
+  tunables.failback_dwell_s = config.failback_dwell_s();
+  return tunables;
+}
+
+// Written to by the SIGHUP handler, watched by the started ConfigLoader.
+int signal_pipe[2] = {-1, -1};
+struct sigaction previous_sighup_action;
+
+void OnSighup(int) {
+  int saved_errno = errno;
+  char byte = 0;
+  if (write(signal_pipe[1], &byte, 1) < 0) {
+    // Pipe full: a reload is already pending.
+  }
+  errno = saved_errno;
+}
+
+std::string JoinTargets(
+    const google::protobuf::RepeatedPtrField<std::string> &targets) {
+  std::string spec;
+  for (const auto &target : targets) {
+    spec += (spec.empty() ? "" : ",") + target;
+  }
+  return spec;
+}
+
+// Spec an interface is probed with, empty for --probe_targets.
+std::string InterfaceTargets(const DaemonConfig &config,
+                             const InterfaceConfig &interface) {
+  return interface.probe_targets_size() > 0
+             ? JoinTargets(interface.probe_targets())
+             : JoinTargets(config.probe_targets());
+}
+
+Status ValidateTargets(const std::string &spec, const std::string &where) {
+  std::vector<ProbeTarget> targets;
+  auto status = ParseProbeTargets(spec, &targets);
+  if (status.Error() != Status::OK) {
+    return Status(Status::INVALID_ARGUMENTS,
+                  "Invalid probe_targets of " + where + ": " +
+                      status.ErrorMessage());
+  }
+  return status;
+}
+
+// Interfaces of `config`, followed by the links of `links` matching its
+// patterns, in the order of the file then of their names.
+std::vector<InterfaceConfig> ExpandInterfaces(
+    const DaemonConfig &config, const std::map<std::string, bool> &links) {
+  std::vector<InterfaceConfig> interfaces(config.interfaces().begin(),
+                                          config.interfaces().end());
+  std::set<std::string> names;
+  for (const auto &interface : interfaces) {
+    names.insert(interface.name());
+  }
+  for (const auto &pattern : config.interface_patterns()) {
+    for (const auto &link : links) {
+      if (names.count(link.first) != 0 ||
+          fnmatch(pattern.name().c_str(), link.first.c_str(), 0) != 0) {
+        continue;
+      }
+      InterfaceConfig interface = pattern;
+      interface.set_name(link.first);
+      interfaces.push_back(interface);
+      names.insert(link.first);
+    }
+  }
+  return interfaces;
+}
+
+// Names of `interfaces`, most preferred first.
+std::vector<std::string> PreferredInterfaces(
+    std::vector<InterfaceConfig> interfaces) {
+  std::stable_sort(interfaces.begin(), interfaces.end(),
+                   [](const InterfaceConfig &a, const InterfaceConfig &b) {
+                     return a.priority() < b.priority();
+                   });
+  std::vector<std::string> names;
+  for (const auto &interface : interfaces) {
+    names.push_back(interface.name());
+  }
+  return names;
+}
+
+Status Validate(const DaemonConfig &config) {
+  if (config.interfaces_size() == 0 && config.interface_patterns_size() == 0) {
+    return Status(Status::INVALID_ARGUMENTS, "No interface configured.");
+  }
+  for (const auto &pattern : config.interface_patterns()) {
+    if (pattern.name().empty()) {
+      return Status(Status::INVALID_ARGUMENTS, "Empty interface pattern.");
+    }
+    if (pattern.probe_targets_size() > 0) {
+      auto status = ValidateTargets(JoinTargets(pattern.probe_targets()),
+                                    "pattern " + pattern.name());
+      if (status.Error() != Status::OK) {
+        return status;
+      }
+    }
+  }
+  std::set<std::string> names;
+  for (const auto &interface : config.interfaces()) {
+    const auto &name = interface.name();
+    if (name.empty() || name.size() >= IF_NAMESIZE) {
+      return Status(Status::INVALID_ARGUMENTS,
+                    "Invalid interface name \"" + name + "\".");
+    }
+    if (!names.insert(name).second) {
+      return Status(Status::INVALID_ARGUMENTS,
+                    "Interface " + name + " configured twice.");
+    }
+    if (interface.probe_targets_size() > 0) {
+      auto status = ValidateTargets(JoinTargets(interface.probe_targets()),
+                                    "interface " + name);
+      if (status.Error() != Status::OK) {
+        return status;
+      }
+    }
+  }
+  if (config.probe_targets_size() > 0) {
+    auto status =
+        ValidateTargets(JoinTargets(config.probe_targets()), "the daemon");
+    if (status.Error() != Status::OK) {
+      return status;
+    }
+  }
+  if (config.has_probe_quorum() &&
+      (config.probe_quorum() <= 0 || config.probe_quorum() > 1)) {
+    return Status(Status::INVALID_ARGUMENTS,
+                  "probe_quorum must be in (0, 1].");
+  }
+  if ((config.has_fast_probe_interval_ms() &&
+       config.fast_probe_interval_ms() <= 0) ||
+      (config.has_fast_probe_min_interval_ms() &&
+       config.fast_probe_min_interval_ms() <= 0) ||
+      (config.has_fast_probe_timeout_ms() &&
+       config.fast_probe_timeout_ms() <= 0)) {
+    return Status(Status::INVALID_ARGUMENTS,
+                  "Fast probe intervals and timeout must be positive.");
+  }
+  if ((config.has_probes_to_healthy() && config.probes_to_healthy() < 1) ||
+      (config.has_probes_to_unhealthy() && config.probes_to_unhealthy() < 1)) {
+    return Status(Status::INVALID_ARGUMENTS,
+                  "probes_to_healthy and probes_to_unhealthy must be at "
+                  "least 1.");
+  }
+  if (config.flap_hold_down_s() < 0 || config.flap_hold_down_max_s() < 0 ||
+      config.max_p95_rtt_ms() < 0 || config.failback_dwell_s() < 0 ||
+      config.multipath_metric() < 0) {
+    return Status(Status::INVALID_ARGUMENTS,
+                  "Durations and metrics cannot be negative.");
+  }
+  if (config.has_flap_hold_down_s() && config.has_flap_hold_down_max_s() &&
+      config.flap_hold_down_max_s() < config.flap_hold_down_s()) {
+    return Status(Status::INVALID_ARGUMENTS,
+                  "flap_hold_down_max_s is lower than flap_hold_down_s.");
+  }
+  if (config.min_quality_score() < 0 || config.min_quality_score() > 100) {
+    return Status(Status::INVALID_ARGUMENTS,
+                  "min_quality_score must be in [0, 100].");
+  }
+  return Status(Status::OK, "");
+}
+}  // namespace
+
+ConfigLoader::ConfigLoader(const std::string &path, LinkMonitor *link_monitor)
+    : path_(path),
+      ic_(nullptr),
+      gm_(nullptr),
+      link_monitor_(link_monitor),
+      inotify_fd_(-1),
+      reload_pending_(false) {
+  link_cb_id_ = link_monitor_->AddLinkChangedCb(
+      [this](const std::string &if_name, bool present, bool) {
+        OnLinkChanged(if_name, present);
+      });
+}
+
+ConfigLoader::~ConfigLoader() {
+  Stop();
+  link_monitor_->RemoveLinkChangedCb(link_cb_id_);
+}
+
+Status ConfigLoader::Parse(const std::string &path, DaemonConfig *config) {
+  std::ifstream file(path);
+  if (!file) {
+    return Status(Status::NOT_FOUND, "Could not open " + path + ".");
+  }
+  std::stringstream content;
+  content << file.rdbuf();
+  config->Clear();
+  // Syntax errors are logged by the parser, with their position.
+  if (!google::protobuf::TextFormat::ParseFromString(content.str(), config)) {
+    return Status(Status::INVALID_ARGUMENTS, "Could not parse " + path + ".");
+  }
+  return Validate(*config);
+}
+
+Status ConfigLoader::Load() {
+  DaemonConfig config;
+  auto status = Parse(path_, &config);
+  if (status.Error() != Status::OK) {
+    return status;
+  }
+  std::unique_lock<std::mutex> lock(mutex_);
+  ApplyFlagsLocked(config, true);
+  config_ = config;
+  LOG(INFO) << "Loaded configuration from " << path_ << ", "
+            << config.interfaces_size() << " interfaces and "
+            << config.interface_patterns_size() << " patterns.";
+  return status;
+}
+
+Status ConfigLoader::Start(InterfaceChecker *ic, GatewayConfigManager *gm) {
+  if (signal_pipe[0] >= 0) {
+    return Status(Status::UNKNOWN_ERROR, "A ConfigLoader is already started.");
+  }
+  // Started without mutex_, its callback takes it. The monitor may already
+  // have been started by another of its users.
+  auto link_status = link_monitor_->Start();
+  if (link_status.Error() != Status::OK &&
+      link_status.Error() != Status::NO_OP) {
+    LOG(ERROR) << "Links not monitored, no interface is discovered: "
+               << link_status.ErrorMessage();
+  }
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    ic_ = ic;
+    gm_ = gm;
+    ApplyInterfacesLocked(config_);
+  }
+  if (pipe2(signal_pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+    return Status(Status::UNKNOWN_ERROR,
+                  std::string("pipe2 failed: ") + strerror(errno));
+  }
+  struct sigaction action = {};
+  action.sa_handler = OnSighup;
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGHUP, &action, &previous_sighup_action);
+  reactor_.WatchFd(signal_pipe[0], [this] { OnSignal(); });
+  // The directory is watched, so that files replaced by a rename, as most
+  // editors and configuration management tools do, are noticed too.
+  auto slash = path_.rfind('/');
+  std::string directory =
+      slash == std::string::npos ? "."
+      : slash == 0               ? "/"
+                                 : path_.substr(0, slash);
+  inotify_fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (inotify_fd_ < 0 ||
+      inotify_add_watch(inotify_fd_, directory.c_str(),
+                        IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+    LOG(WARNING) << "Cannot watch " << directory << ": " << strerror(errno)
+                 << ", the configuration is only reloaded on SIGHUP.";
+    if (inotify_fd_ >= 0) {
+      close(inotify_fd_);
+      inotify_fd_ = -1;
+    }
+  } else {
+    reactor_.WatchFd(inotify_fd_, [this] { OnFileEvents(); });
+  }
+  return reactor_.Start();
+}
+
+void ConfigLoader::Stop() {
+  if (signal_pipe[0] < 0 || ic_ == nullptr) {
+    return;
+  }
+  sigaction(SIGHUP, &previous_sighup_action, nullptr);
+  reactor_.Stop();
+  for (int &fd : signal_pipe) {
+    close(fd);
+    fd = -1;
+  }
+  if (inotify_fd_ >= 0) {
+    close(inotify_fd_);
+    inotify_fd_ = -1;
+  }
+  std::unique_lock<std::mutex> lock(mutex_);
+  ic_ = nullptr;
+  gm_ = nullptr;
+}
+
+Status ConfigLoader::Reload() {
+  DaemonConfig config;
+  auto status = Parse(path_, &config);
+  if (status.Error() != Status::OK) {
+    LOG(ERROR) << "Configuration not reloaded, keeping the running one: "
+               << status.ErrorMessage();
+    return status;
+  }
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (config.SerializeAsString() == config_.SerializeAsString()) {
+    return Status(Status::NO_OP, "Configuration unchanged.");
+  }
+  LOG(INFO) << "Reloading the configuration from " << path_;
+  ApplyFlagsLocked(config, false);
+  if (ic_ != nullptr) {
+    ApplyInterfacesLocked(config);
+  }
+  config_ = config;
+  return status;
+}
+
+void ConfigLoader::ApplyFlagsLocked(const DaemonConfig &config,
+                                    bool startup) {
+  const auto *descriptor = config.GetDescriptor();
+  const auto *reflection = config.GetReflection();
+  // Tunables in effect once applied, their other fields unset.
+  DaemonConfig tunables;
+  // Each scalar field overrides the flag of the same name.
+  for (int i = 0; i < descriptor->field_count(); i++) {
+    const auto *field = descriptor->field(i);
+    if (field->is_repeated() ||
+        field->cpp_type() ==
+            google::protobuf::FieldDescriptor::CPPTYPE_MESSAGE) {
+      continue;
+    }
+    const std::string &name = field->name();
+    auto command_line = command_line_flags_.find(name);
+    if (command_line == command_line_flags_.end()) {
+      std::string value;
+      if (!gflags::GetCommandLineOption(name.c_str(), &value)) {
+        LOG(ERROR) << "No flag named " << name << ", field ignored.";
+        continue;
+      }
+      command_line = command_line_flags_.emplace(name, value).first;
+      flag_values_[name] = value;
+    }
+    std::string value = command_line->second;
+    if (reflection->HasField(config, field)) {
+      google::protobuf::TextFormat::PrintFieldValueToString(config, field, -1,
+                                                            &value);
+    }
+    bool startup_only = kStartupOnlyFlags.count(name) != 0;
+    std::string &current = flag_values_[name];
+    if (value != current) {
+      if (!startup && startup_only) {
+        LOG(WARNING) << name << " changed to " << value
+                     << ", restart to apply it.";
+        continue;
+      }
+      // Once started, the flags are read without locking: the tunables are
+      // published instead.
+      if (startup &&
+          gflags::SetCommandLineOption(name.c_str(), value.c_str()).empty()) {
+        LOG(ERROR) << "Could not set " << name << " to " << value;
+        continue;
+      }
+      LOG(INFO) << name << " set to " << value;
+      current = value;
+    }
+    if (!startup_only) {
+      google::protobuf::TextFormat::ParseFieldValueFromString(current, field,
+                                                              &tunables);
+    }
+  }
+  if (!startup) {
+    PublishTunables(ToTunables(tunables));
+  }
+}
+
+void ConfigLoader::ApplyInterfacesLocked(const DaemonConfig &config) {
+  auto interfaces = ExpandInterfaces(config, link_monitor_->Links());
+  std::map<std::string, std::string> targets;
+  for (const auto &interface : interfaces) {
+    targets[interface.name()] = InterfaceTargets(config, interface);
+  }
+  // The removed interfaces must no longer be candidates when gm_ forgets
+  // them, and the added ones are candidates from their first probe.
+  auto preferred_interfaces = PreferredInterfaces(interfaces);
+  if (preferred_interfaces != preferred_interfaces_) {
+    gm_->SetPreferredGatewayInterfaces(preferred_interfaces);
+    preferred_interfaces_ = preferred_interfaces;
+  }
+  for (const auto &entry : interface_targets_) {
+    if (targets.count(entry.first) == 0) {
+      ic_->RemoveInterface(entry.first);
+      gm_->RemoveInterface(entry.first);
+    }
+  }
+  // Unchanged interfaces are left alone.
+  for (const auto &entry : targets) {
+    ic_->AddInterface(entry.first, entry.second);
+  }
+  interface_targets_ = targets;
+}
+
+void ConfigLoader::OnLinkChanged(const std::string &if_name, bool present) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (ic_ == nullptr) {
+    return;
+  }
+  bool matches = false;
+  for (const auto &pattern : config_.interface_patterns()) {
+    matches |= fnmatch(pattern.name().c_str(), if_name.c_str(), 0) == 0;
+  }
+  if (!matches) {
+    return;
+  }
+  LOG(INFO) << "Link " << if_name << (present ? " appeared" : " disappeared")
+            << ", updating the checked interfaces.";
+  ApplyInterfacesLocked(config_);
+}
+
+void ConfigLoader::OnSignal() {
+  char buffer[64];
+  while (read(signal_pipe[0], buffer, sizeof(buffer)) > 0) {
+  }
+  LOG(INFO) << "SIGHUP received.";
+  Reload();
+}
+
+void ConfigLoader::OnFileEvents() {
+  auto slash = path_.rfind('/');
+  std::string file_name =
+      slash == std::string::npos ? path_ : path_.substr(slash + 1);
+  alignas(inotify_event) char buffer[4096];
+  bool changed = false;
+  ssize_t len;
+  while ((len = read(inotify_fd_, buffer, sizeof(buffer))) > 0) {
+    for (char *p = buffer; p < buffer + len;) {
+      auto *event = reinterpret_cast<inotify_event *>(p);
+      if (event->len > 0 && file_name == event->name) {
+        changed = true;
+      }
+      p += sizeof(inotify_event) + event->len;
+    }
+  }
+  if (!changed || reload_pending_) {
+    return;
+  }
+  reload_pending_ = true;
+  reactor_.ScheduleAt(std::chrono::steady_clock::now() + kReloadDelay,
+                      [this] {
+                        reload_pending_ = false;
+                        Reload();
+                      });
+}
+
+}  // namespace net_failover_manager
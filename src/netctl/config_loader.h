@@ -0,0 +1,118 @@
+// This file is part of Net Failover Manager.
+//
+// Net Failover Manager is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Net Failover Manager is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Net Failover Manager.  If not, see
+// <https://www.gnu.org/licenses/>.
+
+// Reads the configuration of the daemon from a file, see DaemonConfig in
+// src/proto/net_failover_manager_config.proto, and keeps the running daemon
+// in line with it.
+
+#ifndef NET_FAILOVER_MANAGER_NETCTL_CONFIG_LOADER
+#define NET_FAILOVER_MANAGER_NETCTL_CONFIG_LOADER
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "gateway_config_manager.h"
+#include "interface_checker.h"
+#include "link_monitor.h"
+#include "probe_reactor.h"
+#include "src/lib/status.h"
+#include "src/proto/net_failover_manager_config.pb.h"
+
+namespace net_failover_manager {
+
+class ConfigLoader {
+ public:
+  // link_monitor, which must outlive this object, discovers the links
+  // matching the interface patterns. It should be the one given to the
+  // InterfaceChecker, so that both agree on which links exist.
+  ConfigLoader(const std::string &path, LinkMonitor *link_monitor);
+  virtual ~ConfigLoader();
+
+  // Reads and validates `path`, without applying it.
+  static Status Parse(const std::string &path, DaemonConfig *config);
+
+  // Reads the file and sets the flags it overrides, modes included. Must be
+  // called once, before the components reading the flags are created.
+  Status Load();
+  // Adds the interfaces of the loaded configuration to ic and gm, which must
+  // outlive this object, then reloads the file on SIGHUP and whenever it is
+  // rewritten. Links matching the interface patterns are added and removed
+  // as they appear and disappear. Only one ConfigLoader can be started at a
+  // time.
+  Status Start(InterfaceChecker *ic, GatewayConfigManager *gm);
+  void Stop();
+
+  // Reads the file again and applies the differences with the running
+  // configuration: added and removed interfaces are started and stopped,
+  // the probes of an interface are restarted if its targets changed, and
+  // the other interfaces keep their probes and state. An invalid file
+  // changes nothing.
+  Status Reload();
+
+ protected:
+  // Delete copy and move constructors.
+  ConfigLoader(const ConfigLoader &) = delete;
+  ConfigLoader &operator=(const ConfigLoader &) = delete;
+
+ private:
+  // Sets the flags overridden by `config`, and restores the command line
+  // value of the others. Once started, only the tunables change, and they
+  // are published rather than written to their flags. Must be called with
+  // mutex_ held.
+  void ApplyFlagsLocked(const DaemonConfig &config, bool startup);
+  // Brings the interfaces of ic_ and gm_ in line with `config` and the
+  // current links. Must be called with mutex_ held.
+  void ApplyInterfacesLocked(const DaemonConfig &config);
+  // Called by link_monitor_.
+  void OnLinkChanged(const std::string &if_name, bool present);
+
+  // Run on the reactor thread.
+  void OnSignal();
+  void OnFileEvents();
+
+  const std::string path_;
+  std::mutex mutex_;
+  // Running configuration. Protected by mutex_.
+  DaemonConfig config_;
+  // Value of the overridable flags before the first Load. Protected by
+  // mutex_.
+  std::map<std::string, std::string> command_line_flags_;
+  // Value in effect of the overridable flags. Protected by mutex_.
+  std::map<std::string, std::string> flag_values_;
+  // Set only at Start.
+  InterfaceChecker *ic_;
+  GatewayConfigManager *gm_;
+  // Probe targets each interface of ic_ was added with, and order of
+  // preference given to gm_. Protected by mutex_.
+  std::map<std::string, std::string> interface_targets_;
+  std::vector<std::string> preferred_interfaces_;
+  // Discovers the interfaces matching the patterns. Set only at
+  // constructor.
+  LinkMonitor *link_monitor_;
+  int link_cb_id_;
+  // Watches the signal pipe and the inotify fd.
+  ProbeReactor reactor_;
+  int inotify_fd_;
+  // Set while a reload is scheduled, to coalesce the events of a write.
+  // Only used from the reactor thread.
+  bool reload_pending_;
+};  // class ConfigLoader
+
+}  // namespace net_failover_manager
+
+#endif  // #ifndef NET_FAILOVER_MANAGER_NETCTL_CONFIG_LOADER
@@ -0,0 +1,264 @@
+// This file is part of Net Failover Manager.
+//
+// Net Failover Manager is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Net Failover Manager is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Net Failover Manager.  If not, see
+// <https://www.gnu.org/licenses/>.
+
+#include "conntrack_flusher.h"
+
+#include <arpa/inet.h>
+#include <glog/logging.h>
+#include <ifaddrs.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter/nfnetlink_conntrack.h>
+#include <string.h>
+
+#include <algorithm>
+
+namespace net_failover_manager {
+
+namespace {
+// Deletions sent at once. Small enough that few entries are buffered while
+// the dump streams in, large enough that big tables are flushed in a few
+// hundred syscalls.
+const int kBatchSize = 256;
+// Maximum time the kernel has to answer a dump or a batch.
+constexpr std::chrono::milliseconds kConntrackTimeout =
+    std::chrono::seconds(5);
+
+uint16_t ConntrackMessageType(uint8_t message) {
+  return (NFNL_SUBSYS_CTNETLINK << 8) | message;
+}
+
+// First attribute of type `type` nested in `parent`, nullptr if none.
+const rtattr *FindNested(const rtattr *parent, uint16_t type) {
+  int len = RTA_PAYLOAD(parent);
+  for (auto *attribute = static_cast<const rtattr *>(RTA_DATA(parent));
+       RTA_OK(attribute, len); attribute = RTA_NEXT(attribute, len)) {
+    if ((attribute->rta_type & NLA_TYPE_MASK) == type) {
+      return attribute;
+    }
+  }
+  return nullptr;
+}
+
+// Address `type` (e.g. CTA_IP_V4_SRC) of a CTA_TUPLE_ORIG/CTA_TUPLE_REPLY
+// tuple. Returns false if it is missing.
+bool TupleAddress(const rtattr *tuple, uint16_t type, in6_addr *address) {
+  const rtattr *ip = tuple != nullptr ? FindNested(tuple, CTA_TUPLE_IP)
+                                      : nullptr;
+  const rtattr *value = ip != nullptr ? FindNested(ip, type) : nullptr;
+  if (value == nullptr || RTA_PAYLOAD(value) > sizeof(*address)) {
+    return false;
+  }
+  *address = {};
+  memcpy(address, RTA_DATA(value), RTA_PAYLOAD(value));
+  return true;
+}
+}  // namespace
+
+ConntrackFlusher::ConntrackFlusher()
+    : socket_(NETLINK_NETFILTER),
+      delete_socket_(NETLINK_NETFILTER),
+      started_(false),
+      flushed_entries_(MetricsRegistry::Default()->GetCounter(
+          "nfm_conntrack_flushed_total",
+          "Connection tracking entries removed after failovers.")),
+      flush_duration_(MetricsRegistry::Default()->GetHistogram(
+          "nfm_conntrack_flush_duration_seconds",
+          "Time spent removing the connection tracking entries of an "
+          "interface.",
+          LatencyBuckets())) {}
+
+Status ConntrackFlusher::Start() {
+  if (started_) {
+    return Status(Status::NO_OP, "Already started.");
+  }
+  started_ = true;
+  return reactor_.Start();
+}
+
+void ConntrackFlusher::Stop() {
+  if (!started_) {
+    return;
+  }
+  started_ = false;
+  reactor_.Stop();
+  socket_.Close();
+  delete_socket_.Close();
+}
+
+void ConntrackFlusher::Flush(const std::string &if_name) {
+  auto job = std::make_shared<Job>();
+  job->if_name = if_name;
+  job->started_at = std::chrono::steady_clock::now();
+  job->scanned = 0;
+  job->flushed = 0;
+  // Read now: the interface may lose its addresses soon after failing.
+  ifaddrs *addresses = nullptr;
+  if (getifaddrs(&addresses) == 0) {
+    for (auto *address = addresses; address != nullptr;
+         address = address->ifa_next) {
+      if (address->ifa_addr == nullptr || if_name != address->ifa_name) {
+        continue;
+      }
+      in6_addr value = {};
+      if (address->ifa_addr->sa_family == AF_INET) {
+        memcpy(&value,
+               &reinterpret_cast<sockaddr_in *>(address->ifa_addr)->sin_addr,
+               sizeof(in_addr));
+      } else if (address->ifa_addr->sa_family == AF_INET6) {
+        value = reinterpret_cast<sockaddr_in6 *>(address->ifa_addr)->sin6_addr;
+      } else {
+        continue;
+      }
+      job->addresses.emplace_back(address->ifa_addr->sa_family, value);
+    }
+    freeifaddrs(addresses);
+  }
+  if (job->addresses.empty()) {
+    LOG(WARNING) << "Interface " << if_name
+                 << " has no address, no flow to flush.";
+    return;
+  }
+  reactor_.ScheduleAt(std::chrono::steady_clock::now(),
+                      [this, job] { Scan(job); });
+}
+
+void ConntrackFlusher::Scan(std::shared_ptr<Job> job) {
+  if ((socket_.fd() < 0 && socket_.Open().Error() != Status::OK) ||
+      (delete_socket_.fd() < 0 &&
+       delete_socket_.Open().Error() != Status::OK)) {
+    LOG(ERROR) << "Could not open the conntrack socket, flows of "
+               << job->if_name << " not flushed.";
+    return;
+  }
+  for (int family : {AF_INET, AF_INET6}) {
+    bool has_address = std::any_of(
+        job->addresses.begin(), job->addresses.end(),
+        [family](const std::pair<int, in6_addr> &x) {
+          return x.first == family;
+        });
+    if (!has_address) {
+      continue;
+    }
+    uint16_t src_type = family == AF_INET6 ? CTA_IP_V6_SRC : CTA_IP_V4_SRC;
+    uint16_t dst_type = family == AF_INET6 ? CTA_IP_V6_DST : CTA_IP_V4_DST;
+    NetlinkRequest request;
+    auto *header = static_cast<nfgenmsg *>(request.BeginMessage(
+        ConntrackMessageType(IPCTNL_MSG_CT_GET), 0, sizeof(nfgenmsg)));
+    header->nfgen_family = family;
+    header->version = NFNETLINK_V0;
+    // The kernel can only filter dumps by mark, the addresses are matched
+    // here while the dump streams in.
+    auto status = socket_.Dump(
+        &request,
+        [&](const nlmsghdr *message) {
+          job->scanned++;
+          const rtattr *original = nullptr;
+          const rtattr *reply = nullptr;
+          std::vector<const rtattr *> key;
+          NetlinkSocket::ForEachAttribute(
+              message, sizeof(nfgenmsg), [&](const rtattr *attribute) {
+                switch (attribute->rta_type & NLA_TYPE_MASK) {
+                  case CTA_TUPLE_ORIG:
+                    original = attribute;
+                    key.push_back(attribute);
+                    break;
+                  case CTA_TUPLE_REPLY:
+                    reply = attribute;
+                    break;
+                  case CTA_ZONE:
+                  case CTA_ID:
+                    key.push_back(attribute);
+                    break;
+                  default:
+                    break;
+                }
+              });
+          in6_addr source;
+          in6_addr reply_destination;
+          bool has_source = TupleAddress(original, src_type, &source);
+          bool has_reply_destination =
+              TupleAddress(reply, dst_type, &reply_destination);
+          bool matches = std::any_of(
+              job->addresses.begin(), job->addresses.end(),
+              [&](const std::pair<int, in6_addr> &x) {
+                return x.first == family &&
+                       ((has_source &&
+                         memcmp(&x.second, &source, sizeof(source)) == 0) ||
+                        (has_reply_destination &&
+                         memcmp(&x.second, &reply_destination,
+                                sizeof(reply_destination)) == 0));
+              });
+          if (!matches || original == nullptr) {
+            return;
+          }
+          if (job->batch == nullptr) {
+            job->batch = std::make_unique<NetlinkRequest>();
+          }
+          // An entry is deleted by its original tuple, its id guarding
+          // against a new entry that reused the tuple meanwhile.
+          auto *batch = job->batch.get();
+          auto *delete_header = static_cast<nfgenmsg *>(batch->BeginMessage(
+              ConntrackMessageType(IPCTNL_MSG_CT_DELETE), 0,
+              sizeof(nfgenmsg)));
+          delete_header->nfgen_family = family;
+          delete_header->version = NFNETLINK_V0;
+          for (const auto *attribute : key) {
+            batch->Append(attribute, attribute->rta_len);
+          }
+          // Sent right away, the table is never held in memory, and the
+          // kernel's dump cursor is past these entries already.
+          if (batch->MessageCount() >= kBatchSize) {
+            SendBatch(job.get());
+          }
+        },
+        kConntrackTimeout);
+    if (status.Error() != Status::OK) {
+      LOG(ERROR) << "Could not read the conntrack table: "
+                 << status.ErrorMessage();
+    }
+  }
+  SendBatch(job.get());
+  Finish(*job);
+}
+
+void ConntrackFlusher::SendBatch(Job *job) {
+  if (job->batch == nullptr) {
+    return;
+  }
+  std::unique_ptr<NetlinkRequest> batch = std::move(job->batch);
+  int failed = 0;
+  auto status = delete_socket_.Transact(batch.get(), kConntrackTimeout,
+                                        &failed);
+  // Entries that expired since the dump are not an error.
+  if (status.Error() != Status::OK && status.Error() != Status::NOT_FOUND) {
+    LOG_EVERY_N(WARNING, 10) << "Conntrack deletions failed: "
+                             << status.ErrorMessage();
+  }
+  job->flushed += batch->MessageCount() - failed;
+}
+
+void ConntrackFlusher::Finish(const Job &job) {
+  auto duration = std::chrono::steady_clock::now() - job.started_at;
+  flushed_entries_->Increment(job.flushed);
+  flush_duration_->Observe(std::chrono::duration<double>(duration).count());
+  LOG(INFO) << "Flushed " << job.flushed << " of " << job.scanned
+            << " tracked flows for " << job.if_name << " in "
+            << std::chrono::duration_cast<std::chrono::milliseconds>(duration)
+                   .count()
+            << "ms.";
+}
+
+}  // namespace net_failover_manager
@@ -0,0 +1,92 @@
+// This file is part of Net Failover Manager.
+//
+// Net Failover Manager is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Net Failover Manager is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Net Failover Manager.  If not, see
+// <https://www.gnu.org/licenses/>.
+
+// Removes the connection tracking entries of the flows tied to an interface.
+// After a failover, the flows NATed to the old uplink keep using their old
+// mapping, and fail, until their entries time out. Once flushed, they are
+// tracked again, and NATed through the new uplink, at their next packet.
+
+#ifndef NET_FAILOVER_MANAGER_NETCTL_CONNTRACK_FLUSHER
+#define NET_FAILOVER_MANAGER_NETCTL_CONNTRACK_FLUSHER
+
+#include <netinet/in.h>
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "netlink_socket.h"
+#include "probe_reactor.h"
+#include "src/lib/metrics.h"
+#include "src/lib/status.h"
+
+namespace net_failover_manager {
+
+class ConntrackFlusher {
+ public:
+  ConntrackFlusher();
+  virtual ~ConntrackFlusher() { Stop(); }
+
+  // Start/Stop the thread the flushes run on. Pending flushes are dropped
+  // by Stop.
+  Status Start();
+  void Stop();
+
+  // Queues the removal of the entries whose original source, or reply
+  // destination, is one of the current addresses of `if_name`: the flows
+  // originated from the interface and the ones NATed to it. Returns
+  // immediately, flushes run one at a time and their outcome is logged and
+  // exported as metrics.
+  void Flush(const std::string &if_name);
+
+ protected:
+  // Delete copy and move constructors.
+  ConntrackFlusher(const ConntrackFlusher &) = delete;
+  ConntrackFlusher &operator=(const ConntrackFlusher &) = delete;
+
+ private:
+  typedef struct {
+    std::string if_name;
+    // AF_INET or AF_INET6, and the address in network byte order, IPv4 ones
+    // only using the first 4 bytes.
+    std::vector<std::pair<int, in6_addr>> addresses;
+    std::chrono::steady_clock::time_point started_at;
+    // Deletions not sent yet, at most kBatchSize.
+    std::unique_ptr<NetlinkRequest> batch;
+    int scanned;
+    int flushed;
+  } Job;
+
+  // Run on the reactor thread.
+  // Dumps the table, sending the deletions as soon as a batch fills.
+  void Scan(std::shared_ptr<Job> job);
+  void SendBatch(Job *job);
+  void Finish(const Job &job);
+
+  ProbeReactor reactor_;
+  // Only used from the reactor thread. Deletions are sent on their own
+  // socket, the dump is still streaming in on the first one.
+  NetlinkSocket socket_;
+  NetlinkSocket delete_socket_;
+  bool started_;
+  Counter *flushed_entries_;
+  Histogram *flush_duration_;
+};  // class ConntrackFlusher
+
+}  // namespace net_failover_manager
+
+#endif  // #ifndef NET_FAILOVER_MANAGER_NETCTL_CONNTRACK_FLUSHER
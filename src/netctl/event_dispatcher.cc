@@ -0,0 +1,166 @@
+// This file is part of Net Failover Manager.
+//
+// Net Failover Manager is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Net Failover Manager is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Net Failover Manager.  If not, see
+// <https://www.gnu.org/licenses/>.
+
+#include "event_dispatcher.h"
+
+#include <glog/logging.h>
+
+#include "trace_log.h"
+
+namespace net_failover_manager {
+
+EventDispatcher::EventDispatcher(EventHandler handler, size_t capacity)
+    : handler_(handler),
+      queue_(capacity),
+      shed_depth_(queue_.Capacity() - queue_.Capacity() / 4),
+      overflowing_(false),
+      waiting_(false),
+      running_(false),
+      max_queue_depth_(0),
+      dispatched_(0),
+      dropped_(0),
+      last_latency_us_(0),
+      max_latency_us_(0),
+      total_latency_us_(0),
+      latency_histogram_(MetricsRegistry::Default()->GetHistogram(
+          "nfm_event_queue_latency_seconds",
+          "Time between the posting of a notification and its handling.",
+          LatencyBuckets())),
+      dropped_counter_(MetricsRegistry::Default()->GetCounter(
+          "nfm_event_queue_dropped_total",
+          "Probe results shed because the queue was full.")) {}
+
+void EventDispatcher::Start() {
+  if (running_.exchange(true)) {
+    return;
+  }
+  dispatcher_thread_ = std::make_unique<std::thread>([this] { Loop(); });
+}
+
+void EventDispatcher::Stop() {
+  if (!running_.exchange(false)) {
+    return;
+  }
+  {
+    std::unique_lock<std::mutex> lock(wait_mutex_);
+    wait_cond_.notify_all();
+  }
+  dispatcher_thread_->join();
+  dispatcher_thread_.reset();
+}
+
+bool EventDispatcher::Post(NetworkEvent event) {
+  event.posted_at = std::chrono::steady_clock::now();
+  bool shed = event.type == NetworkEvent::PROBE_RESULT;
+  // Nothing goes to the queue while older events wait in the overflow list,
+  // so that the order is kept.
+  bool queued = !overflowing_.load() &&
+                (!shed || queue_.Size() < shed_depth_) &&
+                queue_.Push(std::move(event));
+  if (!queued && shed) {
+    dropped_.fetch_add(1, std::memory_order_relaxed);
+    dropped_counter_->Increment();
+    LOG_EVERY_N(ERROR, 100) << "Event queue full, shedding probe results.";
+    return false;
+  }
+  if (!queued) {
+    std::unique_lock<std::mutex> lock(overflow_mutex_);
+    overflow_.push_back(std::move(event));
+    overflowing_.store(true);
+  }
+  // Both the push and this load are sequentially consistent, as are the
+  // store of waiting_ and the emptiness check done by the dispatcher, so
+  // either the dispatcher sees the event or we see it waiting.
+  if (waiting_.load()) {
+    std::unique_lock<std::mutex> lock(wait_mutex_);
+    wait_cond_.notify_one();
+  }
+  return true;
+}
+
+void EventDispatcher::Loop() {
+  while (running_.load()) {
+    size_t depth = queue_.Size();
+    if (depth > max_queue_depth_.load(std::memory_order_relaxed)) {
+      max_queue_depth_.store(depth, std::memory_order_relaxed);
+    }
+    auto event = queue_.Pop();
+    if (!event.has_value() && overflowing_.load()) {
+      DispatchOverflow();
+      continue;
+    }
+    if (!event.has_value()) {
+      std::unique_lock<std::mutex> lock(wait_mutex_);
+      waiting_.store(true);
+      wait_cond_.wait(lock, [this] {
+        return !queue_.Empty() || overflowing_.load() || !running_.load();
+      });
+      waiting_.store(false);
+      continue;
+    }
+    Dispatch(*event);
+  }
+}
+
+void EventDispatcher::DispatchOverflow() {
+  std::deque<NetworkEvent> events;
+  {
+    std::unique_lock<std::mutex> lock(overflow_mutex_);
+    events.swap(overflow_);
+    overflowing_.store(false);
+  }
+  for (const auto &event : events) {
+    Dispatch(event);
+  }
+}
+
+void EventDispatcher::Dispatch(const NetworkEvent &event) {
+  auto dequeued_at = std::chrono::steady_clock::now();
+  auto queued_for = dequeued_at - event.posted_at;
+  int64_t latency_us =
+      std::chrono::duration_cast<std::chrono::microseconds>(queued_for)
+          .count();
+  last_latency_us_.store(latency_us, std::memory_order_relaxed);
+  total_latency_us_.fetch_add(latency_us, std::memory_order_relaxed);
+  if (latency_us > max_latency_us_.load(std::memory_order_relaxed)) {
+    max_latency_us_.store(latency_us, std::memory_order_relaxed);
+  }
+  latency_histogram_->Observe(latency_us / 1e6);
+  handler_(event);
+  TraceLog::Default()->Record(
+      TraceLog::EVENT_DISPATCH, event.if_id,
+      std::chrono::steady_clock::now() - dequeued_at, event.type,
+      std::chrono::duration_cast<std::chrono::nanoseconds>(queued_for)
+          .count());
+  dispatched_.fetch_add(1, std::memory_order_relaxed);
+}
+
+EventDispatcher::Stats EventDispatcher::GetStats() const {
+  Stats stats;
+  stats.queue_depth = queue_.Size();
+  stats.max_queue_depth = max_queue_depth_.load(std::memory_order_relaxed);
+  stats.dispatched = dispatched_.load(std::memory_order_relaxed);
+  stats.dropped = dropped_.load(std::memory_order_relaxed);
+  stats.last_dispatch_latency = std::chrono::microseconds(
+      last_latency_us_.load(std::memory_order_relaxed));
+  stats.max_dispatch_latency = std::chrono::microseconds(
+      max_latency_us_.load(std::memory_order_relaxed));
+  stats.total_dispatch_latency = std::chrono::microseconds(
+      total_latency_us_.load(std::memory_order_relaxed));
+  return stats;
+}
+
+}  // namespace net_failover_manager
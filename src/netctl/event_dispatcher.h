@@ -0,0 +1,159 @@
+// This file is part of Net Failover Manager.
+//
+// Net Failover Manager is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Net Failover Manager is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Net Failover Manager.  If not, see
+// <https://www.gnu.org/licenses/>.
+
+// Delivers network events, in the order they were posted, to a handler
+// running on a single dedicated thread. Only probe results are shed when the
+// queue fills up: a later result replaces a lost one, while a lost status or
+// gateway change would leave the handler out of sync for good.
+
+#ifndef NET_FAILOVER_MANAGER_NETCTL_EVENT_DISPATCHER
+#define NET_FAILOVER_MANAGER_NETCTL_EVENT_DISPATCHER
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <ctime>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "interface_checker.h"
+#include "src/lib/metrics.h"
+#include "src/lib/mpsc_queue.h"
+
+namespace net_failover_manager {
+
+class EventDispatcher {
+ public:
+  typedef struct NetworkEvent {
+    typedef enum {
+      IF_STATUS_CHANGED,  // if_id, old_status and new_status are set.
+      // if_id is the new default gateway interface, kNoInterface if there
+      // is none.
+      GW_CHANGED,
+      // if_id, probe_result, quality and checked_at are set, new_status is
+      // the status the result was evaluated to.
+      PROBE_RESULT,
+      // if_id is no longer checked, and has been removed from the state.
+      IF_REMOVED,
+      // Applies the state passed to GatewayConfigManager::RestoreState. Not
+      // reported.
+      STATE_RESTORE,
+    } EventType;
+
+    EventType type;
+    InterfaceId if_id = kNoInterface;
+    InterfaceChecker::InterfaceStatus old_status = InterfaceChecker::UNKNOWN;
+    InterfaceChecker::InterfaceStatus new_status = InterfaceChecker::UNKNOWN;
+    ProbeResult probe_result;
+    LinkQuality quality;
+    // Wall clock time at which probe_result was obtained.
+    std::time_t checked_at;
+    // PROBE_RESULT: unset for the fast detection probes that only feed the
+    // damping, see InterfaceChecker::ProbeResultCallback. Neither the state
+    // nor the observers see those. Always unset for STATE_RESTORE.
+    bool report = true;
+    // Set by Post.
+    std::chrono::steady_clock::time_point posted_at;
+  } NetworkEvent;
+
+  typedef std::function<void(const NetworkEvent &)> EventHandler;
+
+  // Counters describing the behavior of the queue.
+  typedef struct {
+    // Events posted but not dispatched yet.
+    size_t queue_depth;
+    size_t max_queue_depth;
+    uint64_t dispatched;
+    // Probe results shed because the queue was full.
+    uint64_t dropped;
+    // Time between Post and the start of the handler.
+    std::chrono::microseconds last_dispatch_latency;
+    std::chrono::microseconds max_dispatch_latency;
+    std::chrono::microseconds total_dispatch_latency;
+  } Stats;
+
+  // Args:
+  //   handler: called on the dispatcher thread for each event. Must outlive
+  //            this object.
+  //   capacity: maximum number of events waiting in the lock free queue.
+  //             Probe results are shed once it is 3/4 full, the rest is
+  //             kept for the other events.
+  explicit EventDispatcher(EventHandler handler, size_t capacity = 1024);
+  virtual ~EventDispatcher() { Stop(); }
+
+  // Start/Stop the dispatcher thread. Events still queued at Stop are
+  // discarded.
+  void Start();
+  void Stop();
+
+  // Queues an event, can be called from any thread and never blocks. Returns
+  // false if the event is a probe result and was shed. Other events are
+  // never dropped: if the queue is full they wait in an overflow list, and
+  // probe results are shed until it has been delivered.
+  bool Post(NetworkEvent event);
+
+  Stats GetStats() const;
+
+ protected:
+  // Delete copy and move constructors.
+  EventDispatcher(const EventDispatcher &) = delete;
+  EventDispatcher &operator=(const EventDispatcher &) = delete;
+
+ private:
+  void Loop();
+  // Delivers the overflow list, once the queue is empty.
+  void DispatchOverflow();
+  void Dispatch(const NetworkEvent &event);
+
+  const EventHandler handler_;
+  BoundedMpscQueue<NetworkEvent> queue_;
+  // Probe results are only queued below this depth.
+  const size_t shed_depth_;
+
+  // Events that did not fit in queue_, posted after everything in it.
+  // Protected by overflow_mutex_, overflowing_ is set while it is not empty.
+  std::mutex overflow_mutex_;
+  std::deque<NetworkEvent> overflow_;
+  std::atomic<bool> overflowing_;
+
+  // Only used to put the dispatcher thread to sleep when the queue is empty,
+  // producers only take it if the dispatcher is waiting.
+  std::mutex wait_mutex_;
+  std::condition_variable wait_cond_;
+  std::atomic<bool> waiting_;
+  std::atomic<bool> running_;
+  std::unique_ptr<std::thread> dispatcher_thread_;
+
+  // Written by the dispatcher thread only, except dropped_.
+  std::atomic<size_t> max_queue_depth_;
+  std::atomic<uint64_t> dispatched_;
+  std::atomic<uint64_t> dropped_;
+  std::atomic<int64_t> last_latency_us_;
+  std::atomic<int64_t> max_latency_us_;
+  std::atomic<int64_t> total_latency_us_;
+  // Same as above, exported.
+  Histogram *latency_histogram_;
+  Counter *dropped_counter_;
+};  // class EventDispatcher
+
+}  // namespace net_failover_manager
+
+#endif  // #ifndef NET_FAILOVER_MANAGER_NETCTL_EVENT_DISPATCHER
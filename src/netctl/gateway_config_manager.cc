@@ -18,45 +18,573 @@
 
 #include <gflags/gflags.h>
 #include <glog/logging.h>
+#include <algorithm>
 #include <functional>
 
+#include "trace_log.h"
+#include "tunables.h"
+
+DEFINE_bool(load_balance, false,
+            "Spread the traffic over all the healthy preferred interfaces "
+            "with a multipath default route weighted by their quality, "
+            "instead of using one interface at a time.");
+DEFINE_int32(multipath_metric, 0,
+             "Load balancing: metric of the multipath default route, lower "
+             "than the metrics of the default routes of the interfaces.");
+DEFINE_bool(flush_conntrack, false,
+            "After a failover, remove the connection tracking entries of the "
+            "flows of the old gateway interface, so that NATed flows are "
+            "moved to the new one instead of stalling until they expire.");
+
 namespace net_failover_manager {
 
+namespace {
+// Number of transitions kept in the history.
+const size_t kMaxTransitionHistory = 100;
+// Probes needed before the quality of an interface is trusted.
+const int kMinQualitySamples = 20;
+
+// Load balancing: share of the traffic of an interface, from 1 to 4. Coarse,
+// so that small changes of quality do not reprogram the route.
+int MultipathWeight(const LinkQuality &quality) {
+  if (quality.samples < kMinQualitySamples) {
+    return 1;
+  }
+  return 1 + std::min(static_cast<int>(quality.score / 25), 3);
+}
+
+// Returns the reason why the quality of a link is not acceptable, nullopt if
+// it is acceptable or not known well enough yet.
+std::optional<std::string> QualityDegradation(const LinkQuality &quality) {
+  if (quality.samples < kMinQualitySamples) {
+    return std::nullopt;
+  }
+  auto tunables = CurrentTunables();
+  auto p95_budget = std::chrono::milliseconds(tunables.max_p95_rtt_ms);
+  if (tunables.max_p95_rtt_ms > 0 && quality.rtt_p95 > p95_budget) {
+    return "p95 RTT " + std::to_string(quality.rtt_p95.count()) +
+           "us above budget";
+  }
+  if (quality.score < tunables.min_quality_score) {
+    return "quality score " + std::to_string(quality.score) + " too low";
+  }
+  return std::nullopt;
+}
+
+InterfaceStateMachine::Config StateMachineConfig() {
+  auto tunables = CurrentTunables();
+  InterfaceStateMachine::Config config;
+  config.up_threshold = tunables.probes_to_healthy;
+  config.down_threshold = tunables.probes_to_unhealthy;
+  config.hold_down_base = std::chrono::seconds(tunables.flap_hold_down_s);
+  config.hold_down_max = std::chrono::seconds(tunables.flap_hold_down_max_s);
+  return config;
+}
+
+// Builds the first version of the state from whatever ic and rm know.
+std::shared_ptr<const NetworkState> InitialState(InterfaceChecker *ic,
+                                                 RouteManager *rm) {
+  auto state = std::make_shared<NetworkState>();
+  state->version = 0;
+  auto default_gw = rm->PrimaryDefaultGwInterface();
+  if (default_gw != kNoInterface) {
+    state->default_gw_interface = default_gw;
+  }
+  // Already sorted by id.
+  for (auto if_id : ic->Interfaces()) {
+    InterfaceState interface;
+    interface.id = if_id;
+    interface.status = InterfaceChecker::UNKNOWN;
+    interface.last_checked_at = 0;
+    state->interfaces.push_back(interface);
+  }
+  return state;
+}
+}  // namespace
+
 GatewayConfigManager::GatewayConfigManager(InterfaceChecker *ic,
                                            RouteManager *rm)
-    : ic_(ic), rm_(rm) {
-  ic_->RegisterIfStatusChangedCb(
-      [this](const std::string &if_name,
-             InterfaceChecker::InterfaceStatus old_status,
-             InterfaceChecker::InterfaceStatus new_status) {
-        IfChangedCb(if_name, old_status, new_status);
-      });
-  rm_->RegisterGwChangedCb(
-      [this](const std::string &new_gw) { GwChangedCb(new_gw); });
+    : ic_(ic),
+      rm_(rm),
+      state_(InitialState(ic, rm)),
+      failovers_(MetricsRegistry::Default()->GetCounter(
+          "nfm_failovers_total",
+          "Number of times the default gateway was moved automatically.")),
+      failover_duration_(MetricsRegistry::Default()->GetHistogram(
+          "nfm_failover_duration_seconds",
+          "Time from the detection of a status change to the new default "
+          "route being programmed.",
+          LatencyBuckets())),
+      dispatcher_([this](const EventDispatcher::NetworkEvent &event) {
+        HandleEvent(event);
+      }),
+      next_observer_id_(0) {
+  preference_rank_.fill(kNotPreferred);
+  dispatcher_.Start();
+  if (FLAGS_flush_conntrack) {
+    auto status = conntrack_flusher_.Start();
+    if (status.Error() != Status::OK) {
+      LOG(ERROR) << "Could not start the conntrack flusher: "
+                 << status.ErrorMessage();
+    }
+  }
+  // The callbacks only queue the notification, they are called with the
+  // locks of ic_ and rm_ held. The raw status changes of ic_ are not used,
+  // every probe result comes with its status and feeds the state machines,
+  // which post the damped changes.
+  ic_->RegisterProbeResultCb([this](InterfaceId if_id,
+                                    const ProbeResult &result,
+                                    InterfaceChecker::InterfaceStatus status,
+                                    const LinkQuality &quality,
+                                    bool report) {
+    EventDispatcher::NetworkEvent event;
+    event.type = EventDispatcher::NetworkEvent::PROBE_RESULT;
+    event.if_id = if_id;
+    event.probe_result = result;
+    event.new_status = status;
+    event.quality = quality;
+    event.checked_at = std::time(nullptr);
+    event.report = report;
+    dispatcher_.Post(std::move(event));
+  });
+  rm_->RegisterGwChangedCb([this](InterfaceId new_gw) {
+    EventDispatcher::NetworkEvent event;
+    event.type = EventDispatcher::NetworkEvent::GW_CHANGED;
+    event.if_id = new_gw;
+    dispatcher_.Post(std::move(event));
+  });
+}
+
+GatewayConfigManager::~GatewayConfigManager() {
+  ic_->RegisterProbeResultCb(nullptr);
+  rm_->RegisterGwChangedCb(nullptr);
+  dispatcher_.Stop();
+}
+
+void GatewayConfigManager::HandleEvent(
+    const EventDispatcher::NetworkEvent &event) {
+  // Published first, readers should not wait for a failover to see it.
+  if (event.report) {
+    UpdateState(event);
+  }
+  switch (event.type) {
+    case EventDispatcher::NetworkEvent::IF_STATUS_CHANGED:
+      IfChangedCb(event.if_id, event.old_status, event.new_status,
+                  event.posted_at);
+      break;
+    case EventDispatcher::NetworkEvent::GW_CHANGED:
+      GwChangedCb(event.if_id);
+      break;
+    case EventDispatcher::NetworkEvent::PROBE_RESULT:
+      ApplyProbeStatus(event);
+      break;
+    case EventDispatcher::NetworkEvent::IF_REMOVED:
+      ForgetInterface(event);
+      break;
+    case EventDispatcher::NetworkEvent::STATE_RESTORE:
+      ApplyRestoredState();
+      break;
+  }
+  if (!event.report) {
+    return;
+  }
+  std::unique_lock<std::mutex> lock(observers_mutex_);
+  for (const auto &observer : observers_) {
+    observer.second(event);
+  }
+}
+
+void GatewayConfigManager::UpdateState(
+    const EventDispatcher::NetworkEvent &event) {
+  auto state = std::make_shared<NetworkState>(*state_.Load());
+  state->version++;
+  if (event.type == EventDispatcher::NetworkEvent::GW_CHANGED) {
+    if (event.if_id != kNoInterface) {
+      state->default_gw_interface = event.if_id;
+    } else {
+      state->default_gw_interface.reset();
+    }
+  } else if (event.type == EventDispatcher::NetworkEvent::IF_REMOVED) {
+    state->interfaces.erase(
+        std::remove_if(state->interfaces.begin(), state->interfaces.end(),
+                       [&event](const InterfaceState &interface) {
+                         return interface.id == event.if_id;
+                       }),
+        state->interfaces.end());
+  } else {
+    auto *interface = state->Find(event.if_id);
+    if (interface == nullptr) {
+      InterfaceState new_interface;
+      new_interface.id = event.if_id;
+      new_interface.status = InterfaceChecker::UNKNOWN;
+      new_interface.last_checked_at = 0;
+      auto position = std::find_if(
+          state->interfaces.begin(), state->interfaces.end(),
+          [&event](const InterfaceState &other) {
+            return other.id > event.if_id;
+          });
+      interface = &*state->interfaces.insert(position, new_interface);
+    }
+    if (event.type == EventDispatcher::NetworkEvent::IF_STATUS_CHANGED) {
+      interface->status = event.new_status;
+      auto *state_machine = StateMachine(event.if_id);
+      if (state_machine != nullptr) {
+        interface->damping = state_machine->Save();
+      }
+    } else {
+      interface->last_probe_result = event.probe_result;
+      interface->quality = event.quality;
+      interface->last_checked_at = event.checked_at;
+    }
+  }
+  state_.Publish(std::move(state));
+}
+
+int GatewayConfigManager::RestoreState(const NetworkState &saved) {
+  auto request = std::make_unique<RestoreRequest>();
+  request->saved = saved;
+  auto restored = request->restored.get_future();
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    restore_request_ = std::move(request);
+  }
+  // Queued like any other notification, so it cannot race the handling of
+  // an interface removed meanwhile.
+  EventDispatcher::NetworkEvent event;
+  event.type = EventDispatcher::NetworkEvent::STATE_RESTORE;
+  event.report = false;
+  dispatcher_.Post(std::move(event));
+  return restored.get();
+}
+
+void GatewayConfigManager::ApplyRestoredState() {
+  std::unique_ptr<RestoreRequest> request;
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    request = std::move(restore_request_);
+  }
+  if (!request) {
+    return;
+  }
+  const auto &saved = request->saved;
+  auto checked = ic_->Interfaces();
+  auto state = std::make_shared<NetworkState>(*state_.Load());
+  state->version++;
+  int restored = 0;
+  for (const auto &saved_interface : saved.interfaces) {
+    auto if_id = saved_interface.id;
+    if (!std::binary_search(checked.begin(), checked.end(), if_id)) {
+      continue;
+    }
+    auto *interface = state->Find(if_id);
+    if (interface == nullptr) {
+      state->interfaces.push_back(saved_interface);
+    } else {
+      *interface = saved_interface;
+    }
+    if (saved_interface.damping.has_value()) {
+      auto state_machine =
+          std::make_unique<InterfaceStateMachine>(StateMachineConfig());
+      state_machine->Restore(saved_interface.damping.value());
+      if (if_id >= state_machines_.size()) {
+        state_machines_.resize(if_id + 1);
+      }
+      state_machines_[if_id] = std::move(state_machine);
+    }
+    restored++;
+  }
+  std::sort(state->interfaces.begin(), state->interfaces.end(),
+            [](const InterfaceState &a, const InterfaceState &b) {
+              return a.id < b.id;
+            });
+  state_.Publish(std::move(state));
+  request->restored.set_value(restored);
+}
+
+void GatewayConfigManager::ForgetInterface(
+    const EventDispatcher::NetworkEvent &event) {
+  if (event.if_id == kNoInterface) {
+    return;
+  }
+  auto status = DampedStatus(event.if_id);
+  if (status == InterfaceChecker::HEALTHY) {
+    IfChangedCb(event.if_id, status, InterfaceChecker::UNHEALTHY,
+                event.posted_at);
+  }
+  if (event.if_id < state_machines_.size()) {
+    state_machines_[event.if_id].reset();
+  }
+  awaiting_failback_.reset(event.if_id);
+  if (FLAGS_load_balance) {
+    UpdateMultipathRoute();
+  }
+}
+
+void GatewayConfigManager::ApplyProbeStatus(
+    const EventDispatcher::NetworkEvent &event) {
+  if (event.if_id >= state_machines_.size()) {
+    state_machines_.resize(event.if_id + 1);
+  }
+  auto &state_machine = state_machines_[event.if_id];
+  if (!state_machine) {
+    state_machine =
+        std::make_unique<InterfaceStateMachine>(StateMachineConfig());
+  } else {
+    // The thresholds can be reloaded at any time.
+    state_machine->SetConfig(StateMachineConfig());
+  }
+  // A reachable but degraded link is no better than a broken one, and goes
+  // through the same damping.
+  auto reading = event.new_status;
+  auto degradation = QualityDegradation(event.quality);
+  if (reading == InterfaceChecker::HEALTHY && degradation.has_value()) {
+    LOG_EVERY_N(WARNING, 10) << "Interface " << InterfaceName(event.if_id)
+                             << " degraded: " << degradation.value();
+    reading = InterfaceChecker::UNHEALTHY;
+  }
+  // The kernel knows for sure, no need for probe rounds to agree.
+  auto transition = event.probe_result.link_down
+                        ? state_machine->LinkDown(event.posted_at)
+                        : state_machine->Update(reading, event.posted_at);
+  if (transition.has_value()) {
+    RecordTransition(event.if_id, transition.value());
+    // Handled like any other notification, before the observers see the
+    // probe result that caused it.
+    EventDispatcher::NetworkEvent change;
+    change.type = EventDispatcher::NetworkEvent::IF_STATUS_CHANGED;
+    change.if_id = event.if_id;
+    change.old_status = transition.value().old_status;
+    change.new_status = transition.value().new_status;
+    change.checked_at = event.checked_at;
+    change.posted_at = event.posted_at;
+    HandleEvent(change);
+  } else if (awaiting_failback_.test(event.if_id)) {
+    FailBack(event.if_id, event.posted_at);
+  }
+  if (FLAGS_load_balance) {
+    // Quality changes can move the weights even without a transition.
+    UpdateMultipathRoute();
+  }
+}
+
+void GatewayConfigManager::RecordTransition(
+    InterfaceId if_id,
+    const InterfaceStateMachine::Transition &transition) {
+  LOG(INFO) << "Damped status of " << InterfaceName(if_id) << " went from "
+            << InterfaceChecker::InterfaceStatusAsString(transition.old_status)
+            << " to "
+            << InterfaceChecker::InterfaceStatusAsString(transition.new_status)
+            << ": " << transition.reason;
+  TraceLog::Default()->Record(TraceLog::STATUS_TRANSITION, if_id,
+                              std::chrono::nanoseconds(0),
+                              transition.old_status, transition.new_status);
+  StatusTransition record;
+  record.if_id = if_id;
+  record.old_status = transition.old_status;
+  record.new_status = transition.new_status;
+  record.at = std::time(nullptr);
+  record.reason = transition.reason;
+  std::unique_lock<std::mutex> lock(history_mutex_);
+  if (history_.size() >= kMaxTransitionHistory) {
+    history_.pop_front();
+  }
+  history_.push_back(record);
+}
+
+std::vector<GatewayConfigManager::StatusTransition>
+GatewayConfigManager::TransitionHistory() const {
+  std::unique_lock<std::mutex> lock(history_mutex_);
+  return std::vector<StatusTransition>(history_.begin(), history_.end());
+}
+
+InterfaceChecker::InterfaceStatus GatewayConfigManager::DampedStatus(
+    InterfaceId if_id) const {
+  auto *state_machine = StateMachine(if_id);
+  if (state_machine == nullptr) {
+    return InterfaceChecker::UNKNOWN;
+  }
+  return state_machine->Status();
+}
+
+int GatewayConfigManager::AddEventObserver(
+    EventDispatcher::EventHandler observer) {
+  std::unique_lock<std::mutex> lock(observers_mutex_);
+  int id = next_observer_id_++;
+  observers_[id] = observer;
+  return id;
+}
+
+void GatewayConfigManager::RemoveEventObserver(int observer_id) {
+  std::unique_lock<std::mutex> lock(observers_mutex_);
+  observers_.erase(observer_id);
 }
 
 void GatewayConfigManager::SetPreferredGatewayInterfaces(
     const std::vector<std::string> &interfaces) {
   std::unique_lock<std::mutex> lock(mutex_);
   gw_interface_order_.clear();
+  preference_rank_.fill(kNotPreferred);
   LOG(INFO) << "Resetting preferred interfaces list.";
   for (const auto &if_name : interfaces) {
+    auto if_id = InterfaceRegistry::Default()->Intern(if_name);
+    if (if_id == kNoInterface) {
+      LOG(ERROR) << "Cannot prefer " << if_name;
+      continue;
+    }
     LOG(INFO) << "Adding " << if_name;
     // TODO(crepric): check for duplicates.
-    gw_interface_order_.push_back(if_name);
+    if (preference_rank_[if_id] == kNotPreferred) {
+      preference_rank_[if_id] = gw_interface_order_.size();
+    }
+    gw_interface_order_.push_back(if_id);
   }
 }
 
-void GatewayConfigManager::GwChangedCb(const std::string &new_gw) {
-  LOG(INFO) << "New Gateway!!! " << new_gw;
+void GatewayConfigManager::RemoveInterface(const std::string &if_name) {
+  auto if_id = InterfaceRegistry::Default()->Find(if_name);
+  if (if_id == kNoInterface) {
+    return;
+  }
+  EventDispatcher::NetworkEvent event;
+  event.type = EventDispatcher::NetworkEvent::IF_REMOVED;
+  event.if_id = if_id;
+  // Never shed, unlike probe results.
+  dispatcher_.Post(std::move(event));
+}
+
+void GatewayConfigManager::SwitchDefaultGw(
+    InterfaceId if_id,
+    std::chrono::steady_clock::time_point detected_at) {
+  auto old_gateway = rm_->PrimaryDefaultGwInterface();
+  auto status = rm_->SetDefaultGw(if_id);
+  auto took = std::chrono::steady_clock::now() - detected_at;
+  TraceLog::Default()->Record(TraceLog::GATEWAY_SWITCH, if_id, took,
+                              old_gateway, status.Error());
+  if (status.Error() != Status::OK) {
+    return;
+  }
+  failovers_->Increment();
+  failover_duration_->Observe(std::chrono::duration<double>(took).count());
+  // Only once the new route is in place, and off this thread.
+  if (FLAGS_flush_conntrack && old_gateway != kNoInterface &&
+      old_gateway != if_id) {
+    conntrack_flusher_.Flush(InterfaceName(old_gateway));
+  }
+}
+
+void GatewayConfigManager::UpdateMultipathRoute() {
+  auto state = state_.Load();
+  std::vector<RouteManager::Nexthop> nexthops;
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (auto if_id : gw_interface_order_) {
+      if (DampedStatus(if_id) != InterfaceChecker::HEALTHY) {
+        continue;
+      }
+      const auto *interface = state->Find(if_id);
+      RouteManager::Nexthop nexthop;
+      nexthop.if_id = if_id;
+      nexthop.weight =
+          MultipathWeight(interface ? interface->quality : LinkQuality());
+      nexthops.push_back(nexthop);
+    }
+  }
+  if (nexthops == multipath_nexthops_) {
+    return;
+  }
+  auto status = rm_->SetMultipathDefaultGw(nexthops, FLAGS_multipath_metric);
+  if (status.Error() != Status::OK && status.Error() != Status::NO_OP) {
+    LOG_EVERY_N(ERROR, 10) << "Could not program the multipath route: "
+                           << status.ErrorMessage();
+    return;
+  }
+  if (FLAGS_flush_conntrack) {
+    for (const auto &old_nexthop : multipath_nexthops_) {
+      bool kept = std::any_of(nexthops.begin(), nexthops.end(),
+                              [&](const RouteManager::Nexthop &nexthop) {
+                                return nexthop.if_id == old_nexthop.if_id;
+                              });
+      if (!kept) {
+        conntrack_flusher_.Flush(InterfaceName(old_nexthop.if_id));
+      }
+    }
+  }
+  multipath_nexthops_ = nexthops;
+}
+
+void GatewayConfigManager::FailBack(
+    InterfaceId if_id,
+    std::chrono::steady_clock::time_point detected_at) {
+  bool was_waiting = awaiting_failback_.test(if_id);
+  awaiting_failback_.reset(if_id);
+  const auto &if_name = InterfaceName(if_id);
+  // Check if the interface that became healthy is higher in priority compared
+  // the the current gateway, if it is, switch them over.
+  auto current_gateway = rm_->PrimaryDefaultGwInterface();
+  auto trace_decision = [&](TraceLog::Decision decision) {
+    TraceLog::Default()->Record(TraceLog::GATEWAY_SELECTION, if_id,
+                                std::chrono::nanoseconds(0), decision,
+                                current_gateway);
+  };
+  if (current_gateway == if_id) {
+    trace_decision(TraceLog::ALREADY_GATEWAY);
+    LOG(INFO) << "New healthy interface " << if_name
+              << " is already preferred gateway, nothing to do.";
+    return;
+  }
+  std::unique_lock<std::mutex> lock(mutex_);
+  int new_if_priority = PreferenceRankLocked(if_id);
+  if (new_if_priority == kNotPreferred) {
+    trace_decision(TraceLog::NOT_PREFERRED);
+    LOG(WARNING) << "Interface " << if_name
+                 << " not in the preferred gateways list";
+    return;
+  }
+  // The failover found no healthy alternative when the gateway went down,
+  // any healthy interface is better than staying on it.
+  if (DampedStatus(current_gateway) != InterfaceChecker::HEALTHY) {
+    LOG(INFO) << "The current gateway is not healthy, switching to " << if_name;
+    trace_decision(TraceLog::FAILOVER);
+    SwitchDefaultGw(if_id, detected_at);
+    return;
+  }
+  int old_if_priority = PreferenceRankLocked(current_gateway);
+  if (new_if_priority >= old_if_priority) {
+    trace_decision(TraceLog::LOWER_PRIORITY);
+    LOG(INFO) << "The new healthy interface is lower priority than the "
+                 "current gateway. Skip.";
+    return;
+  }
+  // Moving away from a working gateway resets connections, so the preferred
+  // interface must prove stable first. Checked again at each of its probe
+  // results.
+  auto healthy_for = detected_at - StateMachine(if_id)->StatusSince();
+  int dwell_s = CurrentTunables().failback_dwell_s;
+  if (healthy_for < std::chrono::seconds(dwell_s)) {
+    awaiting_failback_.set(if_id);
+    if (!was_waiting) {
+      trace_decision(TraceLog::FAILBACK_DEFERRED);
+      LOG(INFO) << "Failing back to " << if_name << " once it has been "
+                << "healthy for " << dwell_s << "s.";
+    }
+    return;
+  }
+  trace_decision(TraceLog::FAILBACK);
+  SwitchDefaultGw(if_id, detected_at);
+}
+
+void GatewayConfigManager::GwChangedCb(InterfaceId new_gw) {
+  LOG(INFO) << "New Gateway!!! " << InterfaceName(new_gw);
   // TODO(crepric): there's a new gateway, unless it is the first one in the
   // preference list in a HEALTHY status, we should revert back to the correct
   // onw.
 }
 
 void GatewayConfigManager::IfChangedCb(
-    const std::string &if_name, InterfaceChecker::InterfaceStatus old_status,
-    InterfaceChecker::InterfaceStatus new_status) {
+    InterfaceId if_id, InterfaceChecker::InterfaceStatus old_status,
+    InterfaceChecker::InterfaceStatus new_status,
+    std::chrono::steady_clock::time_point detected_at) {
+  const auto &if_name = InterfaceName(if_id);
   if (old_status == new_status) {
     LOG(WARNING) << "Device " << if_name << " has not changed state, still "
                  << InterfaceChecker::InterfaceStatusAsString(old_status);
@@ -65,48 +593,28 @@ void GatewayConfigManager::IfChangedCb(
   LOG(INFO) << "IF status changed: " << if_name << " went from "
             << InterfaceChecker::InterfaceStatusAsString(old_status)
             << " to: " << InterfaceChecker::InterfaceStatusAsString(new_status);
-  // If new status is HEALTHY, check if the interface that became healthy is
-  // higher in priority compared the the current gateway, if it is, switch
-  // them over.
-  auto current_gateway = rm_->PrimaryDefaultGwInterface();
+  if (FLAGS_load_balance) {
+    // The multipath route has already been updated.
+    return;
+  }
   switch (new_status) {
-    case InterfaceChecker::HEALTHY: {
-      // The device has turned healthy, let's check if it must become the new
-      // gateway.
-      if (current_gateway.has_value() && current_gateway.value() == if_name) {
-        LOG(INFO) << "New healthy interface " << if_name
-                  << "is already preferred gateway, nothing to do.";
-        return;
-      }
-      std::unique_lock<std::mutex> lock(mutex_);
-      auto new_if_it = std::find(gw_interface_order_.begin(),
-                                 gw_interface_order_.end(), if_name);
-      if (new_if_it == gw_interface_order_.end()) {
-        LOG(WARNING) << "Interface " << if_name
-                     << " not in the preferred gateways list";
-        return;
-      } else {
-        if (current_gateway.has_value()) {
-          int new_if_priority = new_if_it - gw_interface_order_.begin();
-          int old_if_priority =
-              std::find(gw_interface_order_.begin(), gw_interface_order_.end(),
-                        current_gateway.value()) -
-              gw_interface_order_.begin();
-          if (new_if_priority >= old_if_priority) {
-            LOG(INFO) << "The new healthy interface is lower priority than the "
-                         "current gateway. Skip.";
-            return;
-          }
-          rm_->SetDefaultGw(if_name);
-        }
-      }
-    } break;
+    case InterfaceChecker::HEALTHY:
+      FailBack(if_id, detected_at);
+      break;
     default:
       // For now let's treat all other cases as unhealthy, if the device was the
       // gateway, switch to an (healthy) alternative.
       {
-        if (!current_gateway.has_value() ||
-            current_gateway.value() != if_name) {
+        awaiting_failback_.reset(if_id);
+        auto current_gateway = rm_->PrimaryDefaultGwInterface();
+        auto trace_decision = [&](TraceLog::Decision decision,
+                                  InterfaceId candidate) {
+          TraceLog::Default()->Record(TraceLog::GATEWAY_SELECTION, candidate,
+                                      std::chrono::nanoseconds(0), decision,
+                                      current_gateway);
+        };
+        if (current_gateway != if_id) {
+          trace_decision(TraceLog::NOT_GATEWAY, if_id);
           LOG(INFO)
               << if_name
               << "is unhealthy but wasn't the default gateway, nothing to do.";
@@ -114,15 +622,16 @@ void GatewayConfigManager::IfChangedCb(
         }
         std::unique_lock<std::mutex> lock(mutex_);
         for (auto interface : gw_interface_order_) {
-          auto if_status = ic_->CheckStatus(interface);
-          if (if_status.has_value() &&
-              if_status.value().first == InterfaceChecker::HEALTHY) {
-            LOG(INFO) << "Interface "
-                      << interface << " is healthy, switching gateway";
-            rm_->SetDefaultGw(interface);
+          if (DampedStatus(interface) == InterfaceChecker::HEALTHY) {
+            LOG(INFO) << "Interface " << InterfaceName(interface)
+                      << " is healthy, switching gateway";
+            trace_decision(TraceLog::FAILOVER, interface);
+            awaiting_failback_.reset(interface);
+            SwitchDefaultGw(interface, detected_at);
             return;
           }
         }
+        trace_decision(TraceLog::NO_HEALTHY_ALTERNATIVE, if_id);
       }
       break;
   }
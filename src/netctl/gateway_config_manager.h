@@ -15,28 +15,89 @@
 // <https://www.gnu.org/licenses/>.
 
 // Monitors the status of the current routing table and interfaces, and if
-// necessary, triggers a change in the default interface.
+// necessary, triggers a change in the default interface. Notifications are
+// queued and handled one at a time, in order, on a dedicated thread. The
+// status of each interface is damped by an InterfaceStateMachine, and only
+// its transitions move the default gateway.
 
 #ifndef NET_FAILOVER_MANAGER_NETCTL_GATEWAY_CONFIG_MANAGER
 #define NET_FAILOVER_MANAGER_NETCTL_GATEWAY_CONFIG_MANAGER
 
+#include <array>
+#include <chrono>
+#include <climits>
+#include <ctime>
+#include <deque>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <string>
-#include <thread>
 #include <vector>
 
+#include "conntrack_flusher.h"
+#include "event_dispatcher.h"
 #include "interface_checker.h"
+#include "interface_registry.h"
+#include "interface_state_machine.h"
+#include "network_state.h"
 #include "route_manager.h"
+#include "src/lib/atomic_snapshot.h"
+#include "src/lib/metrics.h"
 
 namespace net_failover_manager {
 
 class GatewayConfigManager {
 public:
+  // A change of the damped status of an interface.
+  typedef struct {
+    InterfaceId if_id;
+    InterfaceChecker::InterfaceStatus old_status;
+    InterfaceChecker::InterfaceStatus new_status;
+    std::time_t at;
+    std::string reason;
+  } StatusTransition;
+
   GatewayConfigManager(InterfaceChecker *ic, RouteManager *rm);
-  virtual ~GatewayConfigManager() {}
+  virtual ~GatewayConfigManager();
   // Sets the list of preferred gateway interfaces based on the list passed in
   // as an argument.
   void
   SetPreferredGatewayInterfaces(const std::vector<std::string> &interfaces);
+  std::vector<InterfaceId> PreferredGatewayInterfaces() const {
+    std::unique_lock<std::mutex> lock(mutex_);
+    return gw_interface_order_;
+  }
+  // Resumes from the state saved by a previous run: the interfaces of
+  // `saved` that ic_ checks take their saved status, damping and quality.
+  // Must be called before the checks of ic_ and rm_ start. Applied on the
+  // dispatcher thread, which owns the state: blocks until done, so must not
+  // be called from an observer. Returns the number of interfaces restored.
+  int RestoreState(const NetworkState &saved);
+  // Forgets an interface that is no longer checked, moving the default
+  // gateway away from it if needed. Must be called after it has been removed
+  // from ic_ and from the preferred interfaces.
+  void RemoveInterface(const std::string &if_name);
+
+  // Latest state of the interfaces and of the default gateway, never blocks.
+  // The returned value is immutable and reflects every notification handled
+  // so far.
+  std::shared_ptr<const NetworkState> State() const { return state_.Load(); }
+
+  // Registers a function called on the dispatcher thread with every
+  // notification, after it has been handled and State() updated. Observers
+  // must return quickly. Returns an id to be used to unregister the
+  // observer.
+  int AddEventObserver(EventDispatcher::EventHandler observer);
+  void RemoveEventObserver(int observer_id);
+
+  // Last status transitions of all the interfaces, oldest first.
+  std::vector<StatusTransition> TransitionHistory() const;
+
+  // Depth and latency counters of the notification queue.
+  EventDispatcher::Stats DispatcherStats() const {
+    return dispatcher_.GetStats();
+  }
 
 protected:
   // Delete copy and move constructors.
@@ -44,20 +105,96 @@ protected:
   GatewayConfigManager &operator=(const GatewayConfigManager &) = delete;
 
 private:
+  // Rank of the interfaces missing from the preferred gateway interfaces.
+  static constexpr int kNotPreferred = INT_MAX;
+
   mutable std::mutex mutex_;
   // Stores the list of preferred gateway devices, in decreasing order of
   // preference. Protected by mutex_.
-  std::vector<std::string> gw_interface_order_;
+  std::vector<InterfaceId> gw_interface_order_;
+  // Position of each interface in gw_interface_order_, indexed by id,
+  // kNotPreferred if absent. Protected by mutex_.
+  std::array<int, InterfaceRegistry::kMaxInterfaces> preference_rank_;
 
+  // Called on the dispatcher thread for each queued notification.
+  void HandleEvent(const EventDispatcher::NetworkEvent &event);
+  // Publishes a new version of state_ with the event applied.
+  void UpdateState(const EventDispatcher::NetworkEvent &event);
+  // Drops the state of an interface, handled as if it had become unhealthy.
+  void ForgetInterface(const EventDispatcher::NetworkEvent &event);
+  // Feeds the status of a probe result to the state machine of the
+  // interface, and handles the resulting transition, if any.
+  void ApplyProbeStatus(const EventDispatcher::NetworkEvent &event);
+  // Applies the pending request of RestoreState.
+  void ApplyRestoredState();
+  void RecordTransition(InterfaceId if_id,
+                        const InterfaceStateMachine::Transition &transition);
+  // State machine of an interface, nullptr if it was never probed.
+  InterfaceStateMachine *StateMachine(InterfaceId if_id) const {
+    return if_id < state_machines_.size() ? state_machines_[if_id].get()
+                                          : nullptr;
+  }
+  // Damped status of an interface, UNKNOWN if it was never probed.
+  InterfaceChecker::InterfaceStatus DampedStatus(InterfaceId if_id) const;
+  // Position of an interface in gw_interface_order_, kNotPreferred if
+  // absent. Must be called with mutex_ held.
+  int PreferenceRankLocked(InterfaceId if_id) const {
+    return if_id < preference_rank_.size() ? preference_rank_[if_id]
+                                           : kNotPreferred;
+  }
   // The two callback functions that are called when the network status changes.
-  void GwChangedCb(const std::string &new_gw);
-  void IfChangedCb(const std::string &if_name,
+  void GwChangedCb(InterfaceId new_gw);
+  void IfChangedCb(InterfaceId if_id,
                    InterfaceChecker::InterfaceStatus old_status,
-                   InterfaceChecker::InterfaceStatus new_status);
+                   InterfaceChecker::InterfaceStatus new_status,
+                   std::chrono::steady_clock::time_point detected_at);
+  // Load balancing mode: programs a multipath default route over the healthy
+  // preferred interfaces, weighted by quality, if it differs from the one
+  // programmed last.
+  void UpdateMultipathRoute();
+  // Makes the healthy if_id the default gateway if it is preferred over the
+  // current one. Failing back from a healthy gateway waits for if_id to have
+  // been healthy for --failback_dwell_s.
+  void FailBack(InterfaceId if_id,
+                std::chrono::steady_clock::time_point detected_at);
+  // Makes if_id the default gateway, in response to a status change
+  // detected at `detected_at`.
+  void SwitchDefaultGw(InterfaceId if_id,
+                       std::chrono::steady_clock::time_point detected_at);
 
   // Set only at constructor, classes are thread safe, no mutex needed.
   InterfaceChecker *ic_;
   RouteManager *rm_;
+  // Only written by the dispatcher thread, once initialized.
+  AtomicSnapshot<NetworkState> state_;
+  // Indexed by id. Only used by the dispatcher thread.
+  std::vector<std::unique_ptr<InterfaceStateMachine>> state_machines_;
+  // Healthy interfaces waiting for the dwell time to replace the gateway.
+  // Only used by the dispatcher thread.
+  InterfaceSet awaiting_failback_;
+  // Handed by RestoreState to the dispatcher thread.
+  typedef struct {
+    NetworkState saved;
+    std::promise<int> restored;
+  } RestoreRequest;
+  // Protected by mutex_.
+  std::unique_ptr<RestoreRequest> restore_request_;
+  // Load balancing mode: nexthops of the last multipath route programmed.
+  // Only used by the dispatcher thread.
+  std::vector<RouteManager::Nexthop> multipath_nexthops_;
+  // Removes the flows of the interfaces traffic was moved away from, with
+  // --flush_conntrack.
+  ConntrackFlusher conntrack_flusher_;
+  mutable std::mutex history_mutex_;
+  std::deque<StatusTransition> history_;  // Protected by history_mutex_.
+  Counter *failovers_;
+  Histogram *failover_duration_;
+  // Serializes the notifications coming from ic_ and rm_.
+  EventDispatcher dispatcher_;
+  mutable std::mutex observers_mutex_;
+  // Protected by observers_mutex_.
+  std::map<int, EventDispatcher::EventHandler> observers_;
+  int next_observer_id_;  // Protected by observers_mutex_.
 }; // class GatewayConfigManager
 
 } // namespace net_failover_manager
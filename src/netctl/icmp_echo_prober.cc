@@ -0,0 +1,91 @@
+// This file is part of Net Failover Manager.
+//
+// Net Failover Manager is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Net Failover Manager is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Net Failover Manager.  If not, see
+// <https://www.gnu.org/licenses/>.
+
+#include "icmp_echo_prober.h"
+
+#include <vector>
+
+namespace net_failover_manager {
+
+IcmpEchoProber::IcmpEchoProber(const std::string &if_name,
+                               const std::string &target,
+                               ProbeReactor *reactor)
+    : prober_(if_name, target), reactor_(reactor) {
+  // A single never ending round, requests are resolved one by one.
+  prober_.StartRound();
+}
+
+IcmpEchoProber::~IcmpEchoProber() {
+  if (prober_.IsOpen()) {
+    reactor_->UnwatchFd(prober_.fd());
+  }
+}
+
+bool IcmpEchoProber::Probe(std::chrono::milliseconds timeout,
+                           DoneCallback done) {
+  if (!prober_.IsOpen()) {
+    // A failed open leaves the prober closed, it is retried at the next
+    // attempt.
+    if (prober_.Open().Error() != Status::OK) {
+      return false;
+    }
+    reactor_->WatchFd(prober_.fd(), [this] { OnReadable(); });
+  }
+  uint16_t sequence;
+  int outstanding = prober_.Outstanding();
+  if (!prober_.SendEcho(&sequence) && prober_.Outstanding() == outstanding) {
+    // Refused before anything was sent. If sending itself failed, the request
+    // times out like a lost one.
+    return false;
+  }
+  pending_[sequence] = std::move(done);
+  reactor_->ScheduleAt(std::chrono::steady_clock::now() + timeout,
+                       [this, sequence] { Complete(sequence, std::nullopt); });
+  return true;
+}
+
+void IcmpEchoProber::OnReadable() {
+  prober_.ReadReplies();
+  std::vector<std::pair<uint16_t, std::chrono::microseconds>> answered;
+  for (const auto &entry : pending_) {
+    auto rtt = prober_.ReplyRtt(entry.first);
+    if (rtt.has_value()) {
+      answered.emplace_back(entry.first, rtt.value());
+    }
+  }
+  for (const auto &entry : answered) {
+    Complete(entry.first, entry.second);
+  }
+}
+
+void IcmpEchoProber::Complete(uint16_t sequence,
+                              std::optional<std::chrono::microseconds> rtt) {
+  auto it = pending_.find(sequence);
+  if (it == pending_.end()) {
+    // Already answered before the timeout.
+    return;
+  }
+  auto done = std::move(it->second);
+  pending_.erase(it);
+  if (!rtt.has_value()) {
+    // Frees its slot, the round never ends and would otherwise fill up
+    // with lost requests.
+    prober_.GiveUp(sequence);
+  }
+  done(rtt);
+}
+
+}  // namespace net_failover_manager
@@ -0,0 +1,63 @@
+// This file is part of Net Failover Manager.
+//
+// Net Failover Manager is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Net Failover Manager is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Net Failover Manager.  If not, see
+// <https://www.gnu.org/licenses/>.
+
+#ifndef NET_FAILOVER_MANAGER_NETCTL_ICMP_ECHO_PROBER
+#define NET_FAILOVER_MANAGER_NETCTL_ICMP_ECHO_PROBER
+
+#include <cstdint>
+#include <map>
+#include <optional>
+#include <string>
+
+#include "icmp_prober.h"
+#include "probe_reactor.h"
+#include "prober.h"
+
+namespace net_failover_manager {
+
+// Each attempt is an ICMP echo request, answered as soon as its reply is
+// read.
+class IcmpEchoProber : public Prober {
+ public:
+  // Args:
+  //   if_name: the interface the echo requests must leave from.
+  //   target: IPv4 address to probe, in dotted notation.
+  //   reactor: drives the prober, must outlive it.
+  IcmpEchoProber(const std::string &if_name, const std::string &target,
+                 ProbeReactor *reactor);
+  ~IcmpEchoProber() override;
+
+  bool Probe(std::chrono::milliseconds timeout, DoneCallback done) override;
+
+ protected:
+  // Delete copy and move constructors.
+  IcmpEchoProber(const IcmpEchoProber &) = delete;
+  IcmpEchoProber &operator=(const IcmpEchoProber &) = delete;
+
+ private:
+  void OnReadable();
+  void Complete(uint16_t sequence,
+                std::optional<std::chrono::microseconds> rtt);
+
+  IcmpProber prober_;
+  ProbeReactor *reactor_;
+  // Attempts waiting for a reply, by sequence number.
+  std::map<uint16_t, DoneCallback> pending_;
+};  // class IcmpEchoProber
+
+}  // namespace net_failover_manager
+
+#endif  // #ifndef NET_FAILOVER_MANAGER_NETCTL_ICMP_ECHO_PROBER
@@ -0,0 +1,296 @@
+// This file is part of Net Failover Manager.
+//
+// Net Failover Manager is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Net Failover Manager is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Net Failover Manager.  If not, see
+// <https://www.gnu.org/licenses/>.
+
+#include "icmp_prober.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <glog/logging.h>
+#include <netinet/icmp6.h>
+#include <netinet/ip.h>
+#include <netinet/ip_icmp.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+
+#include "policy_routing.h"
+
+namespace net_failover_manager {
+
+namespace {
+
+// Size of the payload attached to each echo request.
+const size_t kPayloadSize = 16;
+// Large enough for an IP header with options, the ICMP header and payload.
+const size_t kReceiveBufferSize = 128;
+
+// Used to give each prober a different identifier on raw sockets.
+std::atomic<uint16_t> identifier_counter(0);
+
+// Standard internet checksum (RFC 1071).
+uint16_t InternetChecksum(const uint8_t *data, size_t len) {
+  uint32_t sum = 0;
+  while (len > 1) {
+    sum += (data[0] << 8) | data[1];
+    data += 2;
+    len -= 2;
+  }
+  if (len == 1) {
+    sum += data[0] << 8;
+  }
+  while (sum >> 16) {
+    sum = (sum & 0xffff) + (sum >> 16);
+  }
+  return htons(~sum & 0xffff);
+}
+
+}  // namespace
+
+IcmpProber::IcmpProber(const std::string &if_name, const std::string &target)
+    : if_name_(if_name),
+      family_(AF_UNSPEC),
+      target_(),
+      target_len_(0),
+      fd_(-1),
+      raw_socket_(false),
+      identifier_((getpid() & 0xffff) ^ identifier_counter.fetch_add(1)),
+      next_sequence_(0),
+      in_flight_() {
+  auto *ipv4 = reinterpret_cast<sockaddr_in *>(&target_);
+  auto *ipv6 = reinterpret_cast<sockaddr_in6 *>(&target_);
+  if (inet_pton(AF_INET, target.c_str(), &ipv4->sin_addr) == 1) {
+    family_ = AF_INET;
+    target_len_ = sizeof(sockaddr_in);
+  } else if (inet_pton(AF_INET6, target.c_str(), &ipv6->sin6_addr) == 1) {
+    family_ = AF_INET6;
+    target_len_ = sizeof(sockaddr_in6);
+  } else {
+    LOG(ERROR) << "Invalid probe target " << target;
+  }
+  target_.ss_family = family_;
+  StartRound();
+}
+
+IcmpProber::~IcmpProber() { Close(); }
+
+Status IcmpProber::Open() {
+  if (fd_ >= 0) {
+    return Status(Status::NO_OP, "Prober already open.");
+  }
+  if (family_ == AF_UNSPEC) {
+    return Status(Status::INVALID_ARGUMENTS, "Invalid probe target.");
+  }
+  // Datagram ICMP sockets do not need CAP_NET_RAW if the group is allowed by
+  // net.ipv4.ping_group_range, which also covers ICMPv6, and the kernel
+  // filters replies for us.
+  int protocol = family_ == AF_INET6 ? static_cast<int>(IPPROTO_ICMPV6)
+                                     : static_cast<int>(IPPROTO_ICMP);
+  raw_socket_ = false;
+  fd_ = socket(family_, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, protocol);
+  if (fd_ < 0) {
+    DLOG(INFO) << "Datagram ICMP socket not available: " << strerror(errno)
+               << ", falling back to raw socket.";
+    raw_socket_ = true;
+    fd_ = socket(family_, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, protocol);
+  }
+  if (fd_ < 0) {
+    LOG(ERROR) << "Could not open ICMP socket for " << if_name_ << ": "
+               << strerror(errno);
+    return Status(errno == EPERM || errno == EACCES ? Status::PERMISSION_ERROR
+                                                    : Status::UNKNOWN_ERROR,
+                  "Could not open ICMP socket.");
+  }
+  if (setsockopt(fd_, SOL_SOCKET, SO_BINDTODEVICE, if_name_.c_str(),
+                 if_name_.size() + 1) < 0) {
+    LOG(ERROR) << "Could not bind ICMP socket to " << if_name_ << ": "
+               << strerror(errno);
+    Close();
+    return Status(errno == EPERM ? Status::PERMISSION_ERROR
+                                 : Status::NOT_FOUND,
+                  "Could not bind socket to " + if_name_);
+  }
+  ApplyPolicyFwmark(fd_, if_name_);
+  return Status::Ok();
+}
+
+void IcmpProber::Close() {
+  if (fd_ >= 0) {
+    close(fd_);
+    fd_ = -1;
+  }
+}
+
+void IcmpProber::StartRound() {
+  for (auto &request : in_flight_) {
+    if (!request.answered) {
+      // Given up on, late replies are ignored.
+      request.answered = true;
+      request.rtt = std::chrono::microseconds::max();
+    }
+  }
+  sent_ = 0;
+  received_ = 0;
+}
+
+bool IcmpProber::SendEcho(uint16_t *sequence) {
+  if (fd_ < 0) {
+    return false;
+  }
+  if (!in_flight_[next_sequence_ % kMaxInFlight].answered) {
+    LOG(WARNING) << "Too many requests waiting for a reply for " << if_name_;
+    return false;
+  }
+  if (sequence != nullptr) {
+    *sequence = next_sequence_;
+  }
+  // ICMPv6 echo messages have the same layout as the ICMP ones.
+  uint8_t packet[sizeof(icmphdr) + kPayloadSize] = {};
+  auto *header = reinterpret_cast<icmphdr *>(packet);
+  header->type = family_ == AF_INET6 ? ICMP6_ECHO_REQUEST : ICMP_ECHO;
+  header->code = 0;
+  header->un.echo.id = htons(identifier_);
+  header->un.echo.sequence = htons(next_sequence_);
+  memcpy(packet + sizeof(icmphdr), if_name_.data(),
+         std::min(if_name_.size(), kPayloadSize));
+  if (family_ == AF_INET) {
+    // The ICMPv6 checksum covers the IPv6 addresses, the kernel computes it.
+    header->checksum = InternetChecksum(packet, sizeof(packet));
+  }
+
+  auto &request = in_flight_[next_sequence_ % kMaxInFlight];
+  request.sequence = next_sequence_;
+  request.answered = false;
+  request.sent_at = std::chrono::steady_clock::now();
+  request.rtt = std::chrono::microseconds::max();
+  next_sequence_++;
+  sent_++;
+  if (sendto(fd_, packet, sizeof(packet), 0,
+             reinterpret_cast<const sockaddr *>(&target_), target_len_) < 0) {
+    // Counted as lost: an interface that cannot send is not healthy.
+    DLOG(INFO) << "Could not send echo request on " << if_name_ << ": "
+               << strerror(errno);
+    return false;
+  }
+  return true;
+}
+
+bool ParseEchoReply(const uint8_t *packet, size_t len, int family,
+                    bool raw_socket, uint16_t identifier, uint16_t *sequence) {
+  if (raw_socket && family == AF_INET) {
+    // Raw IPv4 sockets deliver the IP header as well.
+    if (len < sizeof(iphdr)) {
+      return false;
+    }
+    size_t ip_header_len = reinterpret_cast<const iphdr *>(packet)->ihl * 4;
+    if (len < ip_header_len) {
+      return false;
+    }
+    packet += ip_header_len;
+    len -= ip_header_len;
+  }
+  if (len < sizeof(icmphdr)) {
+    return false;
+  }
+  const auto *header = reinterpret_cast<const icmphdr *>(packet);
+  if (header->type !=
+      (family == AF_INET6 ? ICMP6_ECHO_REPLY : ICMP_ECHOREPLY)) {
+    return false;
+  }
+  // On datagram sockets the kernel rewrites the identifier and only delivers
+  // replies belonging to this socket.
+  if (raw_socket && ntohs(header->un.echo.id) != identifier) {
+    return false;
+  }
+  *sequence = ntohs(header->un.echo.sequence);
+  return true;
+}
+
+void IcmpProber::ReadReplies() {
+  if (fd_ < 0) {
+    return;
+  }
+  uint8_t buffer[kReceiveBufferSize];
+  while (true) {
+    sockaddr_storage from = {};
+    socklen_t from_len = sizeof(from);
+    ssize_t len = recvfrom(fd_, buffer, sizeof(buffer), 0,
+                           reinterpret_cast<sockaddr *>(&from), &from_len);
+    if (len < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        LOG(WARNING) << "Error reading ICMP replies on " << if_name_ << ": "
+                     << strerror(errno);
+      }
+      return;
+    }
+    if (!IsTarget(from)) {
+      continue;
+    }
+    uint16_t sequence;
+    if (ParseEchoReply(buffer, len, family_, raw_socket_, identifier_,
+                       &sequence)) {
+      HandleReply(sequence);
+    }
+  }
+}
+
+void IcmpProber::HandleReply(uint16_t sequence) {
+  auto &request = in_flight_[sequence % kMaxInFlight];
+  if (request.answered || request.sequence != sequence) {
+    // Duplicate, or a late reply from a previous round.
+    return;
+  }
+  request.answered = true;
+  auto rtt = std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - request.sent_at);
+  request.rtt = rtt;
+  received_++;
+}
+
+bool IcmpProber::IsTarget(const sockaddr_storage &address) const {
+  if (address.ss_family != family_) {
+    return false;
+  }
+  if (family_ == AF_INET6) {
+    return memcmp(&reinterpret_cast<const sockaddr_in6 *>(&address)->sin6_addr,
+                  &reinterpret_cast<const sockaddr_in6 *>(&target_)->sin6_addr,
+                  sizeof(in6_addr)) == 0;
+  }
+  return reinterpret_cast<const sockaddr_in *>(&address)->sin_addr.s_addr ==
+         reinterpret_cast<const sockaddr_in *>(&target_)->sin_addr.s_addr;
+}
+
+std::optional<std::chrono::microseconds> IcmpProber::ReplyRtt(
+    uint16_t sequence) const {
+  const auto &request = in_flight_[sequence % kMaxInFlight];
+  if (request.sequence != sequence || !request.answered ||
+      request.rtt == std::chrono::microseconds::max()) {
+    return std::nullopt;
+  }
+  return request.rtt;
+}
+
+void IcmpProber::GiveUp(uint16_t sequence) {
+  auto &request = in_flight_[sequence % kMaxInFlight];
+  if (request.sequence == sequence && !request.answered) {
+    request.answered = true;
+    request.rtt = std::chrono::microseconds::max();
+  }
+}
+
+}  // namespace net_failover_manager
@@ -0,0 +1,122 @@
+// This file is part of Net Failover Manager.
+//
+// Net Failover Manager is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Net Failover Manager is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Net Failover Manager.  If not, see
+// <https://www.gnu.org/licenses/>.
+
+// Sends ICMP or ICMPv6 echo requests through a specific interface and
+// collects the replies, without spawning any external process.
+
+#ifndef NET_FAILOVER_MANAGER_NETCTL_ICMP_PROBER
+#define NET_FAILOVER_MANAGER_NETCTL_ICMP_PROBER
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <optional>
+#include <string>
+
+#include "src/lib/status.h"
+
+namespace net_failover_manager {
+
+// Parses a packet received on an ICMP socket of `family`. Returns true, and
+// the sequence number of the reply in `sequence`, if it is an echo reply for
+// `identifier`. Packets of raw sockets start with the IP header on IPv4, and
+// are checked against `identifier`, the ones of datagram sockets are not.
+bool ParseEchoReply(const uint8_t *packet, size_t len, int family,
+                    bool raw_socket, uint16_t identifier, uint16_t *sequence);
+
+class IcmpProber {
+ public:
+  // Args:
+  //   if_name: the interface the echo requests must leave from.
+  //   target: IPv4 or IPv6 address to probe, as a literal.
+  IcmpProber(const std::string &if_name, const std::string &target);
+  virtual ~IcmpProber();
+
+  // Opens the ICMP socket, of the family of the target, and binds it to the
+  // interface. An unprivileged datagram ICMP socket is preferred, a raw
+  // socket is used as fallback.
+  // Calling it on an already open prober is a no-op.
+  Status Open();
+  void Close();
+  bool IsOpen() const { return fd_ >= 0; }
+  // File descriptor to wait on for replies, -1 if the prober is not open.
+  int fd() const { return fd_; }
+
+  // Non blocking primitives, driven by the reactor. A round starts with
+  // StartRound(), each SendEcho() adds one request to it, and ReadReplies()
+  // must be called when fd() is readable. SendEcho() returns the sequence
+  // number of the request in `sequence`, if not null. A request is counted
+  // as sent, and its sequence number returned, even if the send itself
+  // failed.
+  void StartRound();
+  bool SendEcho(uint16_t *sequence = nullptr);
+  void ReadReplies();
+  // Number of requests of the current round still waiting for a reply.
+  int Outstanding() const { return sent_ - received_; }
+  // Round trip time of the request `sequence`, nullopt if it has not been
+  // answered (yet). Only the last kMaxInFlight requests are remembered.
+  std::optional<std::chrono::microseconds> ReplyRtt(uint16_t sequence) const;
+  // Stops waiting for the reply to `sequence`, which is then ignored, so
+  // that its slot can be reused without starting a new round.
+  void GiveUp(uint16_t sequence);
+
+ protected:
+  // Delete copy and move constructors.
+  IcmpProber(const IcmpProber &) = delete;
+  IcmpProber &operator=(const IcmpProber &) = delete;
+
+ private:
+  // Tracks a request that has been sent and possibly answered.
+  typedef struct {
+    uint16_t sequence;
+    bool answered;
+    std::chrono::steady_clock::time_point sent_at;
+    // Only meaningful if answered, and if the reply was received.
+    std::chrono::microseconds rtt;
+  } InFlightRequest;
+
+  // Maximum number of requests that can be waiting for a reply.
+  static constexpr int kMaxInFlight = 64;
+
+  // Records the reply to the request `sequence`.
+  void HandleReply(uint16_t sequence);
+  // True if `address` is the address of the target.
+  bool IsTarget(const sockaddr_storage &address) const;
+
+  const std::string if_name_;
+  // AF_UNSPEC if the target is not valid.
+  int family_;
+  sockaddr_storage target_;
+  socklen_t target_len_;
+  int fd_;
+  // True if fd_ is a raw socket, replies then carry the identifier we chose,
+  // and include the IP header on IPv4.
+  bool raw_socket_;
+  uint16_t identifier_;
+  uint16_t next_sequence_;
+
+  // Current round state.
+  std::array<InFlightRequest, kMaxInFlight> in_flight_;
+  int sent_;
+  int received_;
+};  // class IcmpProber
+
+}  // namespace net_failover_manager
+
+#endif  // #ifndef NET_FAILOVER_MANAGER_NETCTL_ICMP_PROBER
@@ -16,26 +16,42 @@
 
 #include "interface_checker.h"
 
+#include <gflags/gflags.h>
 #include <glog/logging.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <array>
-#include <boost/algorithm/string.hpp>
-#include <boost/tokenizer.hpp>
-#include <iostream>
+
+#include <algorithm>
 #include <memory>
-#include <sstream>
-#include <stdexcept>
+
+#include "icmp_echo_prober.h"
+#include "socket_prober.h"
+#include "trace_log.h"
+#include "tunables.h"
+
+// Google Public DNS.
+static const char kDefaultProbeTargets[] = "icmp:8.8.8.8";
+
+DEFINE_string(probe_targets, kDefaultProbeTargets,
+              "Comma separated targets probed through each interface, as "
+              "type:address[:port][/path][@weight] with type one of icmp, "
+              "tcp, dns and http. Addresses must be IPv4 or IPv6 literals, "
+              "IPv6 ones in brackets when followed by a port.");
+DEFINE_bool(fast_detection, false,
+            "Probe continuously with an adaptive cadence, instead of in "
+            "rounds, to detect failures in less than a second. Each probe "
+            "then counts as a round for --probes_to_unhealthy and "
+            "--probes_to_healthy: with the default settings, a failure is "
+            "detected in 350 to 650ms and a recovery in 650 to 950ms.");
 
 namespace net_failover_manager {
 
 namespace {
 
-// Ping commands arguments.
-const std::string kAddressToPing = "8.8.8.8";  // Google Public DNS.
-const int kPingTimeout = 1;       // seconds, timeout to receive ping reply.
-const int kPingDuration = 3;      // seconds, duration of ping command.
-const float kPingInterval = 0.5;  // seconds, interval between pings.
+// Probe arguments.
+const int kPingCount = 6;  // attempts per target per check.
+// Timeout to receive the answer to an attempt.
+const std::chrono::milliseconds kPingTimeout = std::chrono::seconds(1);
+// Interval between attempts.
+const std::chrono::milliseconds kPingInterval = std::chrono::milliseconds(500);
 
 // Interval between two ping commands.
 const std::chrono::duration kIfCheckInterval = std::chrono::seconds(20);
@@ -43,143 +59,651 @@ const std::chrono::duration kIfCheckInterval = std::chrono::seconds(20);
 // Ping packet loss threshold for healthy interface;
 const int kPingPacketLossThreshold = 25;
 
-InterfaceChecker::InterfaceStatus ParsePingResult(
-    const std::string &ping_result, const std::string &if_name) {
-  boost::char_separator<char> fn("\n");
-  boost::tokenizer<boost::char_separator<char> > tokens(ping_result, fn);
-  for (auto str = tokens.begin(); str != tokens.end(); ++str) {
-    auto pos = (*str).find("packet loss");
-    if (pos != std::string::npos) {
-      // Line looks like this:
-      // 4 packets transmitted, 4 received, 0% packet loss, time 503ms
-      DLOG(INFO) << "Found stats line for interface " << if_name << ": "
-                 << *str;
-      std::string delimiters(",");
-      std::vector<std::string> stats_elements;
-      boost::split(stats_elements, *str, boost::is_any_of(delimiters));
-      for (auto element : stats_elements) {
-        // looking for the packet loss info.
-        auto pl_pos = element.find("% packet loss");
-        if (pl_pos != std::string::npos) {
-          int pl_value = 100;  // default to 100% packet loss.
-          try {
-            pl_value = stoi(element.substr(0, pl_pos));
-          } catch (const std::invalid_argument &ia) {
-            LOG(ERROR) << "Failed to convert packet loss to int value from "
-                       << element;
-            return InterfaceChecker::UNKNOWN;
-          }
-          DLOG(INFO) << "Packet loss for " << if_name << " recorded at "
-                     << pl_value;
-          if (pl_value > kPingPacketLossThreshold) {
-            LOG(WARNING) << "Packet loss for " << if_name
-                         << " higher than threshold, at " << pl_value;
-            return InterfaceChecker::UNHEALTHY;
-          } else {
-            return InterfaceChecker::HEALTHY;
-          }
-        }
-      }
-    }
+// Fast detection: number of probes the loss and RTT are computed on.
+const size_t kFastWindowSize = 20;
+// Fast detection: lost probes in a row that make an interface unhealthy,
+// without waiting for the loss over the window to cross the threshold.
+const int kFastLossesToFail = 3;
+// Fast detection: intervals in a row with every target answering after which
+// the interval doubles, up to --fast_probe_interval_ms.
+const int kFastSuccessesToSlowDown = 10;
+// Fast detection: the probe result callback is called at most this often,
+// unless the status changes.
+const std::chrono::seconds kFastReportInterval(1);
+
+// Time after which no handler of a retired probe can be pending: the longest
+// a probe waits for its next step, plus the longest an attempt waits for its
+// answer.
+std::chrono::milliseconds RetireDelay() {
+  auto tunables = CurrentTunables();
+  return std::max<std::chrono::milliseconds>(
+             kIfCheckInterval,
+             std::chrono::milliseconds(tunables.fast_probe_interval_ms)) +
+         std::max<std::chrono::milliseconds>(
+             kPingTimeout,
+             std::chrono::milliseconds(tunables.fast_probe_timeout_ms)) +
+         kPingInterval;
+}
+
+InterfaceChecker::InterfaceStatus EvaluateProbeWindow(
+    const ProbeWindow &window, const ProbeResult &result) {
+  // Called for every probe, so no logging here.
+  if (window.Size() == 0) {
+    return InterfaceChecker::UNKNOWN;
+  }
+  if (window.ConsecutiveLosses() >= kFastLossesToFail ||
+      result.packet_loss > kPingPacketLossThreshold) {
+    return InterfaceChecker::UNHEALTHY;
+  }
+  return InterfaceChecker::HEALTHY;
+}
+
+InterfaceChecker::InterfaceStatus EvaluateProbeResult(
+    const ProbeResult &result, const std::string &if_name,
+    const ProbeTarget &target) {
+  DLOG(INFO) << "Probe result for " << if_name << " towards "
+             << ProbeTargetAsString(target) << ": " << result.toString();
+  if (result.sent == 0) {
+    // Nothing could be sent, the socket is not usable.
+    return InterfaceChecker::UNKNOWN;
   }
-  return InterfaceChecker::UNKNOWN;
+  if (result.packet_loss > kPingPacketLossThreshold) {
+    LOG(WARNING) << "Packet loss for " << if_name << " towards "
+                 << ProbeTargetAsString(target)
+                 << " higher than threshold, at " << result.packet_loss;
+    return InterfaceChecker::UNHEALTHY;
+  }
+  return InterfaceChecker::HEALTHY;
 }
 
-// Run a command in a subprocess and returns command output.
-std::string exec(const char *cmd) {
-  std::array<char, 256> buffer;
-  std::string output;
-  std::unique_ptr<FILE, decltype(&pclose)> pipe(popen(cmd, "r"), pclose);
-  if (!pipe) {
-    throw std::runtime_error("popen() failed!");
+// Combines the statuses of the targets, weights[i] being the weight of
+// statuses[i]. Targets whose status is unknown, e.g. that could not be
+// probed, are left out.
+InterfaceChecker::InterfaceStatus ApplyQuorum(
+    const std::vector<InterfaceChecker::InterfaceStatus> &statuses,
+    const std::vector<int> &weights) {
+  int total_weight = 0;
+  int healthy_weight = 0;
+  for (size_t i = 0; i < statuses.size(); i++) {
+    if (statuses[i] == InterfaceChecker::UNKNOWN) {
+      continue;
+    }
+    total_weight += weights[i];
+    if (statuses[i] == InterfaceChecker::HEALTHY) {
+      healthy_weight += weights[i];
+    }
   }
-  while (fgets(buffer.data(), buffer.size(), pipe.get()) != nullptr) {
-    output += buffer.data();
+  if (total_weight == 0) {
+    return InterfaceChecker::UNKNOWN;
   }
-  return output;
+  return healthy_weight >= CurrentTunables().probe_quorum * total_weight
+             ? InterfaceChecker::HEALTHY
+             : InterfaceChecker::UNHEALTHY;
 }
 
-// Tests interface connectivity by calling the external command ping.
-// TODO: change this to an internal ICMP sender.
-void TestPing(const std::string &interface,
-              InterfaceChecker::InterfaceStatus *result) {
-  std::stringstream command;
-  command << "ping " << kAddressToPing << " -W " << kPingTimeout << " -w "
-          << kPingDuration << " -i " << kPingInterval << " -I " << interface;
-  DLOG(INFO) << "calling " << command.str() << "\n";
-  auto ping_result = exec(command.str().c_str());
-  DLOG(INFO) << "Ping output:";
-  *result = ParsePingResult(ping_result, interface);
+std::unique_ptr<Prober> CreateProber(const std::string &if_name,
+                                     const ProbeTarget &target,
+                                     ProbeReactor *reactor) {
+  if (target.type == ProbeTarget::ICMP) {
+    return std::make_unique<IcmpEchoProber>(if_name, target.address, reactor);
+  }
+  return std::make_unique<SocketProber>(if_name, target, reactor);
 }
+
 }  // namespace
 
 InterfaceChecker::InterfaceChecker(const std::vector<std::string> &if_list,
+                                   LinkMonitor *link_monitor,
                                    IfStatusChangedCallback status_changed_cb)
-    : checks_ongoing_(false), status_changed_cb_(status_changed_cb) {
+    : checks_ongoing_(false),
+      link_monitor_(link_monitor),
+      link_cb_id_(-1),
+      links_monitored_(false),
+      status_changed_cb_(status_changed_cb) {
   for (const auto &if_name : if_list) {
-    interface_status_[if_name].status = UNKNOWN;
+    auto if_id = InterfaceRegistry::Default()->Intern(if_name);
+    if (if_id == kNoInterface) {
+      LOG(ERROR) << "Cannot check " << if_name;
+      continue;
+    }
+    auto &descriptor = SlotLocked(if_id);
+    descriptor.checked = true;
+    descriptor.status = UNKNOWN;
+    descriptor.link_up = true;
   }
+  if (link_monitor_ == nullptr) {
+    return;
+  }
+  link_cb_id_ = link_monitor_->AddLinkChangedCb(
+      [this](const std::string &if_name, bool present, bool up) {
+        auto if_id = InterfaceRegistry::Default()->Find(if_name);
+        if (if_id == kNoInterface) {
+          return;
+        }
+        if (present) {
+          // The interface may have been recreated with another index.
+          TracedRefresh(InterfaceRegistry::Default(), if_id);
+        }
+        OnLinkChanged(if_id, present && up);
+      });
 }
 
-InterfaceChecker::InterfaceChecker(const std::vector<std::string> &if_list)
-    : InterfaceChecker(if_list, nullptr){};
-InterfaceChecker::~InterfaceChecker() { StopChecks(); }
+InterfaceChecker::InterfaceChecker(const std::vector<std::string> &if_list,
+                                   LinkMonitor *link_monitor)
+    : InterfaceChecker(if_list, link_monitor, nullptr){};
+InterfaceChecker::~InterfaceChecker() {
+  StopChecks();
+  if (link_monitor_ != nullptr) {
+    link_monitor_->RemoveLinkChangedCb(link_cb_id_);
+  }
+}
 
 bool InterfaceChecker::StartChecks() {
+  // Started without mutex_, its callback takes it. The monitor may already
+  // have been started by another of its users.
+  auto link_status = link_monitor_ != nullptr
+                         ? link_monitor_->Start()
+                         : Status(Status::NOT_FOUND, "No link monitor.");
   std::unique_lock<std::mutex> lock(mutex_);
+  if (checks_ongoing_) {
+    LOG(WARNING) << "StartChecks called twice.";
+    return false;
+  }
   checks_ongoing_ = true;
-  for (const auto &interface_entry : interface_status_) {
-    const auto &interface_name = interface_entry.first;
-    interface_status_[interface_name].check_thread.reset(
-        new std::thread([interface_name, this] {
-          while (true) {
-            std::time_t timestamp = std::time(nullptr);
-            std::chrono::system_clock::time_point next_check =
-                std::chrono::system_clock::now();
-            next_check += kIfCheckInterval;
-            InterfaceStatus status;
-            TestPing(interface_name, &status);
-            {
-              std::unique_lock<std::mutex> lock(mutex_);
-              if (interface_status_[interface_name].status != status) {
-                LOG(INFO) << "Status changed for " << interface_name << " from "
-                          << InterfaceStatusAsString(
-                                 interface_status_[interface_name].status)
-                          << " to " << InterfaceStatusAsString(status);
-                std::unique_lock<std::mutex> lock(cb_mutex_);
-                if (status_changed_cb_) {
-                  // FIXME: It is possible that more than one interface changes
-                  // status at the same time, generating a rapid succession of
-                  // callbacks that could be processed in any order at the
-                  // receiver side, generating possible races.
-                  auto cb = std::bind(status_changed_cb_, interface_name,
-                                      interface_status_[interface_name].status,
-                                      status);
-                  auto t = std::thread(cb);
-                  t.detach();
-                }
-                interface_status_[interface_name].status = status;
-              }
-              interface_status_[interface_name].last_checked_at = timestamp;
-              LOG_EVERY_N(INFO, 10)
-                  << "Checked " << interface_name
-                  << " - status: " << InterfaceStatusAsString(status)
-                  << " - last checked at: "
-                  << std::asctime(std::localtime(&timestamp));
-              checks_loop_cond_.wait_until(lock, next_check,
-                                           [this] { return !checks_ongoing_; });
-              if (!checks_ongoing_) {
-                break;
-              }
-            }
-          }
-        }));
+  links_monitored_ = link_status.Error() == Status::OK ||
+                     link_status.Error() == Status::NO_OP;
+  if (!links_monitored_) {
+    LOG(WARNING) << "Links not monitored, interfaces are probed even when "
+                 << "down: " << link_status.ErrorMessage();
+  }
+  // All the probes share the reactor thread, so cost does not grow with the
+  // number of interfaces.
+  for (size_t if_id = 0; if_id < interface_status_.size(); ++if_id) {
+    auto &descriptor = interface_status_[if_id];
+    if (!descriptor.checked) {
+      continue;
+    }
+    descriptor.link_up = LinkUpLocked(if_id);
+    StartProbeLocked(if_id, descriptor.probe_targets);
+  }
+  auto status = reactor_.Start();
+  if (status.Error() != Status::OK) {
+    LOG(ERROR) << "Could not start probe reactor: " << status.ErrorMessage();
+    return false;
   }
   return true;
 }
 
+Status InterfaceChecker::AddInterface(const std::string &if_name,
+                                      const std::string &probe_targets) {
+  auto if_id = InterfaceRegistry::Default()->Intern(if_name);
+  if (if_id == kNoInterface) {
+    return Status(Status::INVALID_ARGUMENTS, "Cannot check " + if_name + ".");
+  }
+  std::unique_lock<std::mutex> lock(mutex_);
+  auto *if_desc = DescriptorLocked(if_id);
+  if (if_desc != nullptr) {
+    if (if_desc->probe_targets == probe_targets) {
+      return Status(Status::NO_OP, if_name + " already checked.");
+    }
+    LOG(INFO) << "Restarting the probes of " << if_name;
+    RetireProbeLocked(if_id);
+    if_desc->probe_targets = probe_targets;
+    if_desc->quality_state.clear();
+  } else {
+    LOG(INFO) << "Adding " << if_name << " to the checked interfaces";
+    auto &descriptor = SlotLocked(if_id);
+    descriptor.checked = true;
+    descriptor.status = UNKNOWN;
+    descriptor.probe_targets = probe_targets;
+    descriptor.link_up = LinkUpLocked(if_id);
+    descriptor.last_checked_at = 0;
+  }
+  if (checks_ongoing_) {
+    StartProbeLocked(if_id, probe_targets);
+  }
+  return Status(Status::OK, "");
+}
+
+Status InterfaceChecker::RemoveInterface(const std::string &if_name) {
+  auto if_id = InterfaceRegistry::Default()->Find(if_name);
+  std::unique_lock<std::mutex> lock(mutex_);
+  auto *if_desc = DescriptorLocked(if_id);
+  if (if_desc == nullptr) {
+    return Status(Status::NOT_FOUND, if_name + " is not checked.");
+  }
+  LOG(INFO) << "Removing " << if_name << " from the checked interfaces";
+  *if_desc = InterfaceDescriptor();
+  RetireProbeLocked(if_id);
+  return Status(Status::OK, "");
+}
+
+InterfaceChecker::InterfaceDescriptor &
+InterfaceChecker::SlotLocked(InterfaceId if_id) {
+  if (if_id >= interface_status_.size()) {
+    interface_status_.resize(if_id + 1);
+  }
+  return interface_status_[if_id];
+}
+
+void InterfaceChecker::StartProbeLocked(InterfaceId if_id,
+                                        const std::string &probe_targets) {
+  const auto &interface_name = InterfaceName(if_id);
+  std::vector<ProbeTarget> targets;
+  const std::string &spec =
+      probe_targets.empty() ? FLAGS_probe_targets : probe_targets;
+  auto parse_status = ParseProbeTargets(spec, &targets);
+  if (parse_status.Error() != Status::OK) {
+    LOG(ERROR) << parse_status.ErrorMessage() << " Probing "
+               << kDefaultProbeTargets << " through " << interface_name
+               << " instead.";
+    targets.clear();
+    ParseProbeTargets(kDefaultProbeTargets, &targets);
+  }
+  auto probe = std::make_unique<ProbeState>();
+  probe->if_id = if_id;
+  probe->retired = false;
+  probe->link_up = interface_status_[if_id].link_up;
+  auto restored = restored_quality_.find(if_id);
+  for (const auto &target : targets) {
+    TargetState target_state;
+    target_state.target = target;
+    target_state.prober = CreateProber(interface_name, target, &reactor_);
+    if (restored != restored_quality_.end()) {
+      auto saved = restored->second.find(ProbeTargetAsString(target));
+      if (saved != restored->second.end()) {
+        target_state.quality.Restore(saved->second);
+      }
+    }
+    probe->targets.push_back(std::move(target_state));
+  }
+  if (restored != restored_quality_.end()) {
+    interface_status_[if_id].quality = InterfaceQuality(*probe);
+    restored_quality_.erase(restored);
+  }
+  probe->pings_left = 0;
+  probe->pending = 0;
+  auto *registry = MetricsRegistry::Default();
+  MetricLabels labels = {{"interface", interface_name}};
+  probe->rtt = registry->GetHistogram(
+      "nfm_probe_rtt_seconds", "Round trip time of the probe replies.",
+      LatencyBuckets(), labels);
+  probe->loss_ratio = registry->GetGauge(
+      "nfm_probe_loss_ratio",
+      "Fraction of the probes of the last round that were lost.", labels);
+  probe->round_duration = registry->GetHistogram(
+      "nfm_probe_duration_seconds", "Duration of the probe rounds.",
+      LatencyBuckets(), labels);
+  probe->probe_interval = registry->GetGauge(
+      "nfm_probe_interval_seconds",
+      "Current interval between probes, in fast detection mode.", labels);
+  probe->quality_score = registry->GetGauge(
+      "nfm_link_quality_score",
+      "Quality of the interface, from 0 (unusable) to 100.", labels);
+  for (auto status : {UNKNOWN, HEALTHY, UNHEALTHY}) {
+    probe->transitions[status] = registry->GetCounter(
+        "nfm_interface_status_transitions_total",
+        "Number of times the status of an interface changed.",
+        {{"interface", interface_name},
+         {"status", InterfaceStatusAsString(status)}});
+  }
+  auto *probe_ptr = probe.get();
+  auto now = std::chrono::steady_clock::now();
+  if (FLAGS_fast_detection) {
+    reactor_.ScheduleAt(now,
+                        [this, probe_ptr] { BeginFastProbing(probe_ptr); });
+  } else {
+    reactor_.ScheduleAt(now, [this, probe_ptr] { BeginCheck(probe_ptr); });
+  }
+  probes_.push_back(std::move(probe));
+}
+
+void InterfaceChecker::RetireProbeLocked(InterfaceId if_id) {
+  for (auto &probe : probes_) {
+    if (probe->if_id != if_id || probe->retired) {
+      continue;
+    }
+    probe->retired = true;
+    // The pending handlers still point to the probe and its probers, it can
+    // only be deleted once they all ran.
+    auto *probe_ptr = probe.get();
+    reactor_.ScheduleAt(
+        std::chrono::steady_clock::now() + RetireDelay(), [this, probe_ptr] {
+          std::unique_lock<std::mutex> lock(mutex_);
+          probes_.erase(
+              std::remove_if(probes_.begin(), probes_.end(),
+                             [probe_ptr](const std::unique_ptr<ProbeState> &p) {
+                               return p.get() == probe_ptr;
+                             }),
+              probes_.end());
+        });
+  }
+}
+
+bool InterfaceChecker::LinkUpLocked(InterfaceId if_id) const {
+  if (!links_monitored_) {
+    return true;
+  }
+  auto links = link_monitor_->Links();
+  auto link = links.find(InterfaceName(if_id));
+  return link != links.end() && link->second;
+}
+
+void InterfaceChecker::OnLinkChanged(InterfaceId if_id, bool up) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  auto *if_desc = DescriptorLocked(if_id);
+  if (if_desc == nullptr || if_desc->link_up == up) {
+    return;
+  }
+  if_desc->link_up = up;
+  LOG(INFO) << "Link of " << InterfaceName(if_id)
+            << (up ? " up, resuming" : " down, pausing") << " its probes.";
+  if (!checks_ongoing_) {
+    return;
+  }
+  for (auto &probe : probes_) {
+    if (probe->if_id != if_id || probe->retired) {
+      continue;
+    }
+    auto *probe_ptr = probe.get();
+    reactor_.ScheduleAt(std::chrono::steady_clock::now(),
+                        [this, probe_ptr, up] {
+                          if (probe_ptr->retired) {
+                            return;
+                          }
+                          probe_ptr->link_up = up;
+                          if (!up) {
+                            // Reported at once, the next round would only
+                            // come later.
+                            ReportLinkDown(probe_ptr);
+                          }
+                        });
+  }
+}
+
+void InterfaceChecker::ReportLinkDown(ProbeState *probe) {
+  ProbeResult probe_result;
+  probe_result.link_down = true;
+  probe->loss_ratio->Set(1);
+  probe->last_report_at = std::chrono::steady_clock::now();
+  PublishResult(probe, probe_result, UNHEALTHY, std::time(nullptr), true);
+}
+
+void InterfaceChecker::BeginCheck(ProbeState *probe) {
+  if (probe->retired) {
+    return;
+  }
+  if (!probe->link_up) {
+    // Nothing could get through, probing would only wait for timeouts.
+    ReportLinkDown(probe);
+    reactor_.ScheduleAt(std::chrono::steady_clock::now() + kIfCheckInterval,
+                        [this, probe] { BeginCheck(probe); });
+    return;
+  }
+  probe->round_started_at = std::chrono::steady_clock::now();
+  probe->timestamp = std::time(nullptr);
+  probe->pings_left = kPingCount;
+  for (auto &target : probe->targets) {
+    target.sent = 0;
+    target.received = 0;
+    target.rtt_min = target.rtt_max = target.rtt_sum =
+        std::chrono::microseconds(0);
+  }
+  SendNextEcho(probe);
+}
+
+void InterfaceChecker::SendNextEcho(ProbeState *probe) {
+  if (probe->retired) {
+    return;
+  }
+  for (auto &target_state : probe->targets) {
+    auto *target = &target_state;
+    // Attempts that could not be started are not counted as sent.
+    if (target->prober->Probe(
+            kPingTimeout,
+            [this, probe,
+             target](std::optional<std::chrono::microseconds> rtt) {
+              RecordRoundSample(probe, target, rtt);
+            })) {
+      target->sent++;
+      probe->pending++;
+    }
+  }
+  probe->pings_left--;
+  if (probe->pings_left > 0) {
+    reactor_.ScheduleAt(std::chrono::steady_clock::now() + kPingInterval,
+                        [this, probe] { SendNextEcho(probe); });
+  } else if (probe->pending == 0) {
+    FinishCheck(probe);
+  }
+}
+
+void InterfaceChecker::RecordRoundSample(
+    ProbeState *probe, TargetState *target,
+    std::optional<std::chrono::microseconds> rtt) {
+  if (probe->retired) {
+    return;
+  }
+  probe->pending--;
+  target->quality.Add(rtt);
+  if (rtt.has_value()) {
+    probe->rtt->Observe(std::chrono::duration<double>(rtt.value()).count());
+    target->rtt_min =
+        target->received == 0 ? rtt.value() : std::min(target->rtt_min,
+                                                        rtt.value());
+    target->rtt_max = std::max(target->rtt_max, rtt.value());
+    target->rtt_sum += rtt.value();
+    target->received++;
+  }
+  if (probe->pings_left == 0 && probe->pending == 0) {
+    // Every attempt is answered or timed out, the round takes as long as the
+    // slowest target.
+    FinishCheck(probe);
+  }
+}
+
+void InterfaceChecker::FinishCheck(ProbeState *probe) {
+  const auto &interface_name = InterfaceName(probe->if_id);
+  std::vector<ProbeResult> results;
+  std::vector<InterfaceStatus> statuses;
+  std::vector<int> weights;
+  for (const auto &target : probe->targets) {
+    ProbeResult result;
+    result.sent = target.sent;
+    result.received = target.received;
+    if (target.sent > 0) {
+      result.packet_loss =
+          100.0 * (target.sent - target.received) / target.sent;
+    }
+    if (target.received > 0) {
+      result.rtt_min = target.rtt_min;
+      result.rtt_avg = target.rtt_sum / target.received;
+      result.rtt_max = target.rtt_max;
+    }
+    results.push_back(result);
+    statuses.push_back(
+        EvaluateProbeResult(result, interface_name, target.target));
+    weights.push_back(target.target.weight);
+  }
+  auto probe_result = MergeProbeResults(results);
+  InterfaceStatus status = ApplyQuorum(statuses, weights);
+  probe->round_duration->Observe(std::chrono::duration<double>(
+                                     std::chrono::steady_clock::now() -
+                                     probe->round_started_at)
+                                     .count());
+  probe->loss_ratio->Set(probe_result.packet_loss / 100);
+  reactor_.ScheduleAt(probe->round_started_at + kIfCheckInterval,
+                      [this, probe] { BeginCheck(probe); });
+
+  std::time_t timestamp = probe->timestamp;
+  PublishResult(probe, probe_result, status, timestamp, true);
+  LOG_EVERY_N(INFO, 10) << "Checked " << interface_name
+                        << " - status: " << InterfaceStatusAsString(status)
+                        << " - last checked at: "
+                        << std::asctime(std::localtime(&timestamp));
+}
+
+void InterfaceChecker::BeginFastProbing(ProbeState *probe) {
+  if (probe->retired) {
+    return;
+  }
+  for (auto &target : probe->targets) {
+    target.window = std::make_unique<ProbeWindow>(kFastWindowSize);
+  }
+  probe->interval =
+      std::chrono::milliseconds(CurrentTunables().fast_probe_interval_ms);
+  probe->probe_interval->Set(
+      std::chrono::duration<double>(probe->interval).count());
+  probe->last_report_at = ProbeReactor::TimePoint();
+  probe->stable_intervals = 0;
+  SendFastEcho(probe);
+}
+
+void InterfaceChecker::SendFastEcho(ProbeState *probe) {
+  if (probe->retired) {
+    return;
+  }
+  auto now = std::chrono::steady_clock::now();
+  if (!probe->link_up) {
+    if (now - probe->last_report_at >= kFastReportInterval) {
+      ReportLinkDown(probe);
+    }
+    reactor_.ScheduleAt(now + probe->interval,
+                        [this, probe] { SendFastEcho(probe); });
+    return;
+  }
+  // Back off gradually once every target is stable: counted once per
+  // interval, whatever the number of targets.
+  auto tunables = CurrentTunables();
+  bool stable = std::all_of(probe->targets.begin(), probe->targets.end(),
+                            [](const TargetState &t) {
+                              return t.window->ConsecutiveSuccesses() > 0;
+                            });
+  probe->stable_intervals = stable ? probe->stable_intervals + 1 : 0;
+  if (stable && probe->stable_intervals % kFastSuccessesToSlowDown == 0) {
+    probe->interval =
+        std::min(probe->interval * 2,
+                 std::chrono::milliseconds(tunables.fast_probe_interval_ms));
+    probe->probe_interval->Set(
+        std::chrono::duration<double>(probe->interval).count());
+  }
+  auto timeout = std::chrono::milliseconds(tunables.fast_probe_timeout_ms);
+  for (auto &target_state : probe->targets) {
+    auto *target = &target_state;
+    if (!target->prober->Probe(
+            timeout,
+            [this, probe,
+             target](std::optional<std::chrono::microseconds> rtt) {
+              RecordFastSample(probe, target, rtt);
+            })) {
+      // Counted as lost: an interface that cannot send is not healthy.
+      reactor_.ScheduleAt(now + timeout, [this, probe, target] {
+        RecordFastSample(probe, target, std::nullopt);
+      });
+    }
+  }
+  reactor_.ScheduleAt(now + probe->interval,
+                      [this, probe] { SendFastEcho(probe); });
+}
+
+void InterfaceChecker::RecordFastSample(
+    ProbeState *probe, TargetState *target,
+    std::optional<std::chrono::microseconds> rtt) {
+  if (probe->retired) {
+    return;
+  }
+  target->window->Add(rtt);
+  target->quality.Add(rtt);
+  if (rtt.has_value()) {
+    probe->rtt->Observe(std::chrono::duration<double>(rtt.value()).count());
+  }
+  // Probe faster as soon as something is lost, so that the failure is
+  // confirmed quickly. The back off is in SendFastEcho.
+  if (!rtt.has_value()) {
+    probe->interval = std::chrono::milliseconds(
+        CurrentTunables().fast_probe_min_interval_ms);
+    probe->stable_intervals = 0;
+    probe->probe_interval->Set(
+        std::chrono::duration<double>(probe->interval).count());
+  }
+
+  std::vector<ProbeResult> results;
+  std::vector<InterfaceStatus> statuses;
+  std::vector<int> weights;
+  for (const auto &t : probe->targets) {
+    results.push_back(t.window->Result());
+    statuses.push_back(EvaluateProbeWindow(*t.window, results.back()));
+    weights.push_back(t.target.weight);
+  }
+  auto probe_result = MergeProbeResults(results);
+  InterfaceStatus status = ApplyQuorum(statuses, weights);
+  probe->loss_ratio->Set(probe_result.packet_loss / 100);
+  auto now = std::chrono::steady_clock::now();
+  bool report = now - probe->last_report_at >= kFastReportInterval;
+  if (report) {
+    probe->last_report_at = now;
+  }
+  PublishResult(probe, probe_result, status, std::time(nullptr), report);
+}
+
+LinkQuality InterfaceChecker::InterfaceQuality(const ProbeState &probe) const {
+  std::vector<const LinkQualityEstimator *> estimators;
+  std::vector<int> weights;
+  for (const auto &target : probe.targets) {
+    estimators.push_back(&target.quality);
+    weights.push_back(target.target.weight);
+  }
+  return LinkQualityEstimator::Combine(estimators, weights);
+}
+
+void InterfaceChecker::PublishResult(
+    ProbeState *probe, const ProbeResult &probe_result,
+    InterfaceStatus status, std::time_t timestamp, bool report_result) {
+  auto if_id = probe->if_id;
+  auto quality = InterfaceQuality(*probe);
+  probe->quality_score->Set(quality.score);
+  std::unique_lock<std::mutex> lock(mutex_);
+  // Retired under mutex_, so nothing is published once RemoveInterface
+  // returned.
+  auto *if_desc = DescriptorLocked(if_id);
+  if (probe->retired || if_desc == nullptr) {
+    return;
+  }
+  TraceLog::Default()->Record(TraceLog::PROBE_RESULT, if_id,
+                              probe_result.rtt_avg, status, probe_result.sent,
+                              probe_result.received, probe_result.link_down);
+  auto &descriptor = *if_desc;
+  descriptor.last_probe_result = probe_result;
+  descriptor.quality = quality;
+  bool changed = descriptor.status != status;
+  if (report_result || changed) {
+    for (const auto &target : probe->targets) {
+      descriptor.quality_state[ProbeTargetAsString(target.target)] =
+          target.quality.Save();
+    }
+  }
+  {
+    std::unique_lock<std::mutex> lock(cb_mutex_);
+    if (probe_result_cb_) {
+      probe_result_cb_(if_id, probe_result, status, quality,
+                       report_result || changed);
+    }
+  }
+  if (changed) {
+    LOG(INFO) << "Status changed for " << InterfaceName(if_id) << " from "
+              << InterfaceStatusAsString(descriptor.status) << " to "
+              << InterfaceStatusAsString(status);
+    probe->transitions[status]->Increment();
+    std::unique_lock<std::mutex> lock(cb_mutex_);
+    if (status_changed_cb_) {
+      status_changed_cb_(if_id, descriptor.status, status);
+    }
+    descriptor.status = status;
+  }
+  descriptor.last_checked_at = timestamp;
+}
+
 bool InterfaceChecker::StopChecks() {
-  std::vector<std::thread *> threads_to_join;
   {
     std::unique_lock<std::mutex> lock(mutex_);
     if (!checks_ongoing_) {
@@ -187,21 +711,13 @@ bool InterfaceChecker::StopChecks() {
       return false;
     }
     checks_ongoing_ = false;
-    for (auto &interface_entry : interface_status_) {
-      threads_to_join.push_back(interface_entry.second.check_thread.release());
-    }
-    checks_loop_cond_.notify_all();
-    // We empty this while holding the lock, and threads change status only if
-    // already holding the lock. If they do acquire it later, the
-    // checks_ongoinh_ variable will be false already and no access to the
-    // interface will be performed. No race condidtion should be possible.
-    interface_status_.clear();
-  }
-  for (auto *thread : threads_to_join) {
-    thread->join();
-    // Threads where released earlier.
-    delete thread;
   }
+  // Waits for the handler in progress, the probes are not used after this.
+  // Link changes are ignored from now on.
+  reactor_.Stop();
+  std::unique_lock<std::mutex> lock(mutex_);
+  probes_.clear();
+  interface_status_.clear();
   return true;
 }
 
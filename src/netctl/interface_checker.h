@@ -17,14 +17,25 @@
 #ifndef NET_FAILOVER_MANAGER_NETCTL_INTERFACE_CHECKER
 #define NET_FAILOVER_MANAGER_NETCTL_INTERFACE_CHECKER
 
-#include <condition_variable>
+#include <atomic>
 #include <ctime>
 #include <functional>
+#include <map>
+#include <memory>
 #include <glog/logging.h>
 #include <optional>
 #include <string>
-#include <thread>
+#include <mutex>
 #include <unordered_map>
+#include <vector>
+
+#include "interface_registry.h"
+#include "link_monitor.h"
+#include "link_quality.h"
+#include "probe_reactor.h"
+#include "probe_window.h"
+#include "prober.h"
+#include "src/lib/metrics.h"
 
 namespace net_failover_manager {
 
@@ -38,12 +49,28 @@ public:
   } InterfaceStatus;
 
   // Callback to be called when the status of an interface changes. Callback
-  // will be called with name of the interface that changed, old status and
-  // new status.
-  typedef std::function<void(const std::string &, InterfaceStatus,
-                             InterfaceStatus)>
+  // will be called with the id of the interface that changed, see
+  // interface_registry.h, old status and new status. It runs on the probe
+  // thread with internal locks held, so it must return quickly and must not
+  // call back into this object.
+  typedef std::function<void(InterfaceId, InterfaceStatus, InterfaceStatus)>
       IfStatusChangedCallback;
 
+  // Callback to be called with the results of every probe round of an
+  // interface, the status they were evaluated to and the rolling quality of
+  // the interface. With --fast_detection it is called with every probe, and
+  // `report` is only set once a second, or when the status changes, the
+  // other calls are meant for the damping only. Same constraints as
+  // IfStatusChangedCallback.
+  typedef std::function<void(InterfaceId, const ProbeResult &,
+                             InterfaceStatus, const LinkQuality &,
+                             bool report)>
+      ProbeResultCallback;
+
+  // State of the quality estimators of the targets of an interface, keyed by
+  // ProbeTargetAsString.
+  typedef std::map<std::string, LinkQualityEstimator::State> QualityState;
+
   // Convert status into string for debugging purposes.
   static std::string InterfaceStatusAsString(InterfaceStatus interface_status) {
     switch (interface_status) {
@@ -58,42 +85,110 @@ public:
     return "N/A";
   }
 
-  // Takes list of interfaces to be checked as string.
+  // Takes list of interfaces to be checked as string. link_monitor, which
+  // must outlive this object, tells which links are up, they are all
+  // considered up if it is null.
   explicit InterfaceChecker(const std::vector<std::string> &if_list,
+                            LinkMonitor *link_monitor,
                             IfStatusChangedCallback status_changed_cb);
   // Does not set a callback.
-  explicit InterfaceChecker(const std::vector<std::string> &if_list);
+  explicit InterfaceChecker(const std::vector<std::string> &if_list,
+                            LinkMonitor *link_monitor);
   virtual ~InterfaceChecker();
 
   void RegisterIfStatusChangedCb(IfStatusChangedCallback if_status_changed_cb) {
     std::unique_lock<std::mutex> lock(cb_mutex_);
     status_changed_cb_ = if_status_changed_cb;
   }
-  // Starts a separate thread for each interface to periodically test each
-  // interface.
+  void RegisterProbeResultCb(ProbeResultCallback probe_result_cb) {
+    std::unique_lock<std::mutex> lock(cb_mutex_);
+    probe_result_cb_ = probe_result_cb;
+  }
+  // Starts periodic checks of each interface, probing every target of
+  // --probe_targets in parallel. An interface is healthy if the targets that
+  // answer weigh at least --probe_quorum of the total. All the interfaces are
+  // probed from a single event loop thread. With
+  // --fast_detection, each interface is probed continuously instead, and its
+  // status follows the loss over a sliding window of the last probes. The
+  // probes of an interface whose link is down, or missing, are paused, and
+  // its results report the link down instead.
   bool StartChecks();
   // Stop checks for all interfaces.
   bool StopChecks();
 
+  // Adds an interface, probed towards `probe_targets`, in the syntax of
+  // --probe_targets, or towards --probe_targets if empty. If the interface is
+  // already checked with other targets, its probes are restarted with the new
+  // ones and its status is kept. Probes of the other interfaces are not
+  // disturbed. Returns NO_OP if nothing changed.
+  Status AddInterface(const std::string &if_name,
+                      const std::string &probe_targets = "");
+  // Stops checking an interface, no callback is called for it once this
+  // returns. Returns NOT_FOUND if the interface is not checked.
+  Status RemoveInterface(const std::string &if_name);
+
   // Return the status of one of the interfaces. Return value has both status
   // and timestamp of the last check. Returns nullopt if interface is not known.
   std::optional<std::pair<InterfaceStatus, std::time_t>>
-  CheckStatus(const std::string &if_name) {
+  CheckStatus(InterfaceId if_id) {
     std::unique_lock<std::mutex> lock(mutex_);
-    auto if_desc = interface_status_.find(if_name);
-    if (if_desc != interface_status_.end()) {
-      auto ret = std::make_pair((*if_desc).second.status,
-                                (*if_desc).second.last_checked_at);
+    const auto *descriptor = DescriptorLocked(if_id);
+    if (descriptor != nullptr) {
+      auto ret = std::make_pair(descriptor->status,
+                                descriptor->last_checked_at);
       return std::optional<std::pair<InterfaceStatus, std::time_t>>(ret);
     }
     return std::nullopt;
   };
 
-  std::vector<std::string> InterfaceNames() const {
+  // Returns loss and round trip times measured by the last check of the
+  // interface. Returns nullopt if interface is not known.
+  std::optional<ProbeResult> LastProbeResult(InterfaceId if_id) const {
+    std::unique_lock<std::mutex> lock(mutex_);
+    const auto *descriptor = DescriptorLocked(if_id);
+    if (descriptor != nullptr) {
+      return descriptor->last_probe_result;
+    }
+    return std::nullopt;
+  }
+
+  // Returns the rolling quality of the interface, nullopt if the interface
+  // is not known.
+  std::optional<LinkQuality> Quality(InterfaceId if_id) const {
+    std::unique_lock<std::mutex> lock(mutex_);
+    const auto *descriptor = DescriptorLocked(if_id);
+    if (descriptor != nullptr) {
+      return descriptor->quality;
+    }
+    return std::nullopt;
+  }
+
+  // Returns the quality estimators of the interface as of its last reported
+  // result, nullopt if the interface is not known.
+  std::optional<QualityState> SaveQuality(InterfaceId if_id) const {
     std::unique_lock<std::mutex> lock(mutex_);
-    std::vector<std::string> ret;
-    for (const auto &entry : interface_status_) {
-      ret.push_back(entry.first);
+    const auto *descriptor = DescriptorLocked(if_id);
+    if (descriptor != nullptr) {
+      return descriptor->quality_state;
+    }
+    return std::nullopt;
+  }
+  // Seeds the estimators of the interface the next time its probes start,
+  // so that its rolling quality carries over a restart. Targets missing
+  // from `state` start from scratch.
+  void RestoreQuality(InterfaceId if_id, const QualityState &state) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    restored_quality_[if_id] = state;
+  }
+
+  // Ids of the checked interfaces, in increasing order.
+  std::vector<InterfaceId> Interfaces() const {
+    std::unique_lock<std::mutex> lock(mutex_);
+    std::vector<InterfaceId> ret;
+    for (size_t id = 0; id < interface_status_.size(); ++id) {
+      if (interface_status_[id].checked) {
+        ret.push_back(id);
+      }
     }
     return ret;
   }
@@ -105,21 +200,145 @@ protected:
 
 private:
   typedef struct {
+    // False for the ids of the registry that are not checked.
+    bool checked;
     InterfaceStatus status;
-    std::unique_ptr<std::thread> check_thread;
+    // Spec of the targets, empty for --probe_targets.
+    std::string probe_targets;
+    bool link_up;
     std::time_t last_checked_at;
+    ProbeResult last_probe_result;
+    LinkQuality quality;
+    QualityState quality_state;
   } InterfaceDescriptor;
 
+  // One target probed through an interface.
+  typedef struct {
+    ProbeTarget target;
+    std::unique_ptr<Prober> prober;
+    // Attempts of the current round.
+    int sent;
+    int received;
+    std::chrono::microseconds rtt_min;
+    std::chrono::microseconds rtt_max;
+    std::chrono::microseconds rtt_sum;
+    // Fast detection only: last attempts.
+    std::unique_ptr<ProbeWindow> window;
+    // Every attempt, across rounds.
+    LinkQualityEstimator quality;
+  } TargetState;
+
+  // State of the probe of a single interface. Only accessed from the reactor
+  // thread while checks are ongoing.
+  typedef struct {
+    InterfaceId if_id;
+    // Set when the interface is removed, or its targets changed. The
+    // handlers of a retired probe return without doing anything until it is
+    // deleted, once all of them have run.
+    std::atomic<bool> retired;
+    // Nothing is sent while false.
+    bool link_up;
+    // Never resized once checks started, callbacks point to the elements.
+    std::vector<TargetState> targets;
+    // Attempts still to be sent, and waiting for an answer, in the current
+    // round.
+    int pings_left;
+    int pending;
+    ProbeReactor::TimePoint round_started_at;
+    std::time_t timestamp;
+    // Fast detection only: current interval between probes and time the
+    // probe result callback was last called.
+    std::chrono::milliseconds interval;
+    ProbeReactor::TimePoint last_report_at;
+    // Fast detection only: intervals in a row that started with the last
+    // probe of every target answered.
+    int stable_intervals;
+    // Metrics of the interface, owned by the default registry.
+    Histogram *rtt;
+    Gauge *loss_ratio;
+    Histogram *round_duration;
+    Gauge *probe_interval;
+    Gauge *quality_score;
+    // Indexed by the new InterfaceStatus.
+    Counter *transitions[3];
+  } ProbeState;
+
+  // Creates the probe of an interface and schedules its first check. Must be
+  // called with mutex_ held.
+  void StartProbeLocked(InterfaceId if_id, const std::string &probe_targets);
+  // Retires the probe of an interface, if any. Must be called with mutex_
+  // held.
+  void RetireProbeLocked(InterfaceId if_id);
+  // Whether the link of an interface is up, true if links are not monitored.
+  // Must be called with mutex_ held.
+  bool LinkUpLocked(InterfaceId if_id) const;
+  // Descriptor of a checked interface, nullptr otherwise. Must be called
+  // with mutex_ held.
+  InterfaceDescriptor *DescriptorLocked(InterfaceId if_id) {
+    if (if_id >= interface_status_.size() ||
+        !interface_status_[if_id].checked) {
+      return nullptr;
+    }
+    return &interface_status_[if_id];
+  }
+  const InterfaceDescriptor *DescriptorLocked(InterfaceId if_id) const {
+    return const_cast<InterfaceChecker *>(this)->DescriptorLocked(if_id);
+  }
+  // Descriptor of an interface, checked or not, growing interface_status_
+  // as needed. Must be called with mutex_ held.
+  InterfaceDescriptor &SlotLocked(InterfaceId if_id);
+  // Called by link_monitor_, pauses or resumes the probes of the interface.
+  void OnLinkChanged(InterfaceId if_id, bool up);
+
+  // Steps of a check round, all run on the reactor thread. Each step probes
+  // all the targets at once.
+  void BeginCheck(ProbeState *probe);
+  void SendNextEcho(ProbeState *probe);
+  void RecordRoundSample(ProbeState *probe, TargetState *target,
+                         std::optional<std::chrono::microseconds> rtt);
+  // Evaluates the round, publishes the new status and schedules the next one.
+  void FinishCheck(ProbeState *probe);
+  // Fast detection, also on the reactor thread: every target is probed once
+  // per interval, each attempt resolved as answered or lost after a timeout.
+  void BeginFastProbing(ProbeState *probe);
+  void SendFastEcho(ProbeState *probe);
+  void RecordFastSample(ProbeState *probe, TargetState *target,
+                        std::optional<std::chrono::microseconds> rtt);
+  // Publishes an unhealthy result with link_down set, on the reactor thread.
+  void ReportLinkDown(ProbeState *probe);
+  // Rolling quality of the interface, over all its targets.
+  LinkQuality InterfaceQuality(const ProbeState &probe) const;
+  // Stores the result and status, and calls the callbacks. The probe result
+  // callback is only called if report_result is set or the status changed.
+  void PublishResult(ProbeState *probe,
+                     const ProbeResult &probe_result,
+                     InterfaceStatus status, std::time_t timestamp,
+                     bool report_result);
+
   mutable std::mutex mutex_;
-  mutable std::condition_variable checks_loop_cond_;
 
   bool checks_ongoing_; // Protected by mutex_;
 
-  // Stores the current status of the interface. Protected by mutex_.
-  std::unordered_map<std::string, InterfaceDescriptor> interface_status_;
+  // Stores the current status of the interfaces, indexed by id. Protected by
+  // mutex_.
+  std::vector<InterfaceDescriptor> interface_status_;
+  // Estimators to seed at the next start of the probes of each interface.
+  // Protected by mutex_.
+  std::unordered_map<InterfaceId, QualityState> restored_quality_;
+  // Drives the probes of all the interfaces from a single thread.
+  ProbeReactor reactor_;
+  // Probes of all the interfaces, including the retired ones not deleted
+  // yet. Protected by mutex_, the elements are only accessed from the
+  // reactor thread.
+  std::vector<std::unique_ptr<ProbeState>> probes_;
+  // Tells which interfaces have their link up. Set only at constructor.
+  LinkMonitor *link_monitor_;
+  int link_cb_id_;
+  bool links_monitored_;  // Protected by mutex_.
   // Set only at constructor.
   mutable std::mutex cb_mutex_; // Different mutex to avoid lock inversion.
   IfStatusChangedCallback status_changed_cb_;
+  ProbeResultCallback probe_result_cb_;
 
 }; // class Interface Checker.
 } // namespace net_failover_manager
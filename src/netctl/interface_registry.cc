@@ -0,0 +1,69 @@
+// This file is part of Net Failover Manager.
+//
+// Net Failover Manager is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Net Failover Manager is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Net Failover Manager.  If not, see
+// <https://www.gnu.org/licenses/>.
+
+#include "interface_registry.h"
+
+#include <glog/logging.h>
+#include <net/if.h>
+
+namespace net_failover_manager {
+
+InterfaceRegistry *InterfaceRegistry::Default() {
+  static InterfaceRegistry *registry = new InterfaceRegistry();
+  return registry;
+}
+
+InterfaceId InterfaceRegistry::Intern(const std::string &if_name) {
+  if (if_name.empty() || if_name.size() >= IF_NAMESIZE) {
+    return kNoInterface;
+  }
+  std::unique_lock<std::mutex> lock(mutex_);
+  auto known = ids_.find(if_name);
+  if (known != ids_.end()) {
+    return known->second;
+  }
+  size_t id = size_.load(std::memory_order_relaxed);
+  if (id >= kMaxInterfaces) {
+    LOG_EVERY_N(ERROR, 100) << "Too many interfaces, " << if_name
+                            << " is ignored.";
+    return kNoInterface;
+  }
+  auto &entry = entries_[id];
+  entry.name = if_name;
+  entry.if_index.store(if_nametoindex(if_name.c_str()),
+                       std::memory_order_relaxed);
+  ids_[if_name] = id;
+  // Publishes the entry to the lock free readers.
+  size_.store(id + 1, std::memory_order_release);
+  return id;
+}
+
+InterfaceId InterfaceRegistry::Find(const std::string &if_name) const {
+  std::unique_lock<std::mutex> lock(mutex_);
+  auto known = ids_.find(if_name);
+  return known != ids_.end() ? known->second : kNoInterface;
+}
+
+int InterfaceRegistry::Refresh(InterfaceId id) {
+  if (id >= size()) {
+    return 0;
+  }
+  int if_index = if_nametoindex(entries_[id].name.c_str());
+  entries_[id].if_index.store(if_index, std::memory_order_relaxed);
+  return if_index;
+}
+
+}  // namespace net_failover_manager
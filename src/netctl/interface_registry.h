@@ -0,0 +1,106 @@
+// This file is part of Net Failover Manager.
+//
+// Net Failover Manager is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Net Failover Manager is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Net Failover Manager.  If not, see
+// <https://www.gnu.org/licenses/>.
+
+// Interns the names of the interfaces into small dense ids, shared by all the
+// modules, so that per interface state can be kept in arrays indexed by id
+// and callbacks pass an integer around instead of a string. Ids are never
+// reused: an interface that is removed and added again keeps its id.
+
+#ifndef NET_FAILOVER_MANAGER_NETCTL_INTERFACE_REGISTRY
+#define NET_FAILOVER_MANAGER_NETCTL_INTERFACE_REGISTRY
+
+#include <array>
+#include <atomic>
+#include <bitset>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace net_failover_manager {
+
+typedef uint16_t InterfaceId;
+// Returned when a name cannot be interned, or is not known.
+const InterfaceId kNoInterface = UINT16_MAX;
+
+class InterfaceRegistry {
+ public:
+  // Maximum number of interfaces that can be interned.
+  static constexpr size_t kMaxInterfaces = 256;
+
+  InterfaceRegistry() : size_(0) {}
+
+  // Registry used by the daemon.
+  static InterfaceRegistry *Default();
+
+  // Returns the id of `if_name`, assigning the next one at its first use.
+  // Returns kNoInterface if the name is not a valid interface name or the
+  // registry is full. Ids are not recycled, so only the interfaces the
+  // daemon manages, configured or matching a pattern, are interned. The
+  // others, e.g. the ones of routes, are looked up with Find.
+  InterfaceId Intern(const std::string &if_name);
+  // Id of an interned name, kNoInterface otherwise. Never assigns one.
+  InterfaceId Find(const std::string &if_name) const;
+
+  // Name of an id returned by Intern, empty for kNoInterface. Lock free, the
+  // reference is valid for the lifetime of the registry.
+  const std::string &Name(InterfaceId id) const {
+    static const std::string kNoName;
+    return id < size() ? entries_[id].name : kNoName;
+  }
+  // Kernel index of the interface, as resolved at interning or at the last
+  // Refresh, 0 if the interface did not exist then or for kNoInterface.
+  // Lock free.
+  int IfIndex(InterfaceId id) const {
+    return id < size() ? entries_[id].if_index.load(std::memory_order_relaxed)
+                       : 0;
+  }
+  // Resolves the kernel index again, e.g. after the interface has been
+  // created or recreated. Returns it, 0 if it does not exist.
+  int Refresh(InterfaceId id);
+  // Ids below this have been assigned.
+  size_t size() const { return size_.load(std::memory_order_acquire); }
+
+ protected:
+  // Delete copy and move constructors.
+  InterfaceRegistry(const InterfaceRegistry &) = delete;
+  InterfaceRegistry &operator=(const InterfaceRegistry &) = delete;
+
+ private:
+  typedef struct {
+    // Written once, before the id is published.
+    std::string name;
+    std::atomic<int> if_index;
+  } Entry;
+
+  mutable std::mutex mutex_;
+  // Protected by mutex_.
+  std::unordered_map<std::string, InterfaceId> ids_;
+  std::array<Entry, kMaxInterfaces> entries_;
+  std::atomic<size_t> size_;
+};  // class InterfaceRegistry
+
+// Set of interfaces, indexed by id.
+typedef std::bitset<InterfaceRegistry::kMaxInterfaces> InterfaceSet;
+
+// Shorthand for the name of an id of the default registry.
+inline const std::string &InterfaceName(InterfaceId id) {
+  return InterfaceRegistry::Default()->Name(id);
+}
+
+}  // namespace net_failover_manager
+
+#endif  // #ifndef NET_FAILOVER_MANAGER_NETCTL_INTERFACE_REGISTRY
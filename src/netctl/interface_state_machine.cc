@@ -0,0 +1,136 @@
+// This file is part of Net Failover Manager.
+//
+// Net Failover Manager is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Net Failover Manager is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Net Failover Manager.  If not, see
+// <https://www.gnu.org/licenses/>.
+
+#include "interface_state_machine.h"
+
+#include <algorithm>
+
+namespace net_failover_manager {
+
+namespace {
+// Caps the doubling of the hold-down, well past any sensible maximum.
+const int kMaxHoldDownDoublings = 16;
+}  // namespace
+
+InterfaceStateMachine::InterfaceStateMachine(const Config &config)
+    : config_(config),
+      status_(InterfaceChecker::UNKNOWN),
+      healthy_in_a_row_(0),
+      unhealthy_in_a_row_(0),
+      flaps_(0),
+      recovered_(false) {}
+
+InterfaceStateMachine::State InterfaceStateMachine::Save() const {
+  State state;
+  state.status = status_;
+  state.status_since = status_since_;
+  state.flaps = flaps_;
+  state.recovered = recovered_;
+  state.hold_down_until = hold_down_until_;
+  return state;
+}
+
+void InterfaceStateMachine::Restore(const State &state) {
+  status_ = state.status;
+  status_since_ = state.status_since;
+  flaps_ = state.flaps;
+  recovered_ = state.recovered;
+  hold_down_until_ = state.hold_down_until;
+  healthy_in_a_row_ = 0;
+  unhealthy_in_a_row_ = 0;
+}
+
+std::optional<InterfaceStateMachine::Transition>
+InterfaceStateMachine::Update(InterfaceChecker::InterfaceStatus reading,
+                              TimePoint now) {
+  switch (reading) {
+    case InterfaceChecker::HEALTHY:
+      healthy_in_a_row_++;
+      unhealthy_in_a_row_ = 0;
+      break;
+    case InterfaceChecker::UNHEALTHY:
+      unhealthy_in_a_row_++;
+      healthy_in_a_row_ = 0;
+      break;
+    case InterfaceChecker::UNKNOWN:
+      healthy_in_a_row_ = 0;
+      unhealthy_in_a_row_ = 0;
+      return std::nullopt;
+  }
+  return Evaluate(reading, now, "");
+}
+
+std::optional<InterfaceStateMachine::Transition>
+InterfaceStateMachine::LinkDown(TimePoint now) {
+  unhealthy_in_a_row_ = std::max(unhealthy_in_a_row_ + 1,
+                                 config_.down_threshold);
+  healthy_in_a_row_ = 0;
+  return Evaluate(InterfaceChecker::UNHEALTHY, now, "link down");
+}
+
+std::optional<InterfaceStateMachine::Transition>
+InterfaceStateMachine::Evaluate(InterfaceChecker::InterfaceStatus reading,
+                                TimePoint now, const std::string &cause) {
+  Transition transition;
+  transition.old_status = status_;
+  switch (status_) {
+    case InterfaceChecker::UNKNOWN:
+      // Nothing to damp yet, the first reading is taken as it is.
+      transition.new_status = reading;
+      transition.reason = cause.empty() ? "first probe round" : cause;
+      break;
+    case InterfaceChecker::HEALTHY: {
+      if (unhealthy_in_a_row_ < config_.down_threshold) {
+        return std::nullopt;
+      }
+      transition.new_status = InterfaceChecker::UNHEALTHY;
+      transition.reason =
+          cause.empty() ? std::to_string(unhealthy_in_a_row_) +
+                              " unhealthy rounds in a row"
+                        : cause;
+      // Going down again shortly after recovering is a flap.
+      if (recovered_ && now - status_since_ < config_.hold_down_max) {
+        flaps_++;
+      } else {
+        flaps_ = 0;
+      }
+      if (flaps_ > 0) {
+        int doublings = std::min(flaps_ - 1, kMaxHoldDownDoublings);
+        auto hold_down = std::min<std::chrono::seconds>(
+            config_.hold_down_base * (1 << doublings), config_.hold_down_max);
+        hold_down_until_ = now + hold_down;
+        transition.reason += ", flap " + std::to_string(flaps_) +
+                             ", held down for " +
+                             std::to_string(hold_down.count()) + "s";
+      }
+    } break;
+    case InterfaceChecker::UNHEALTHY:
+      if (healthy_in_a_row_ < config_.up_threshold ||
+          now < hold_down_until_) {
+        return std::nullopt;
+      }
+      transition.new_status = InterfaceChecker::HEALTHY;
+      transition.reason =
+          std::to_string(healthy_in_a_row_) + " healthy rounds in a row";
+      break;
+  }
+  recovered_ = transition.old_status == InterfaceChecker::UNHEALTHY;
+  status_ = transition.new_status;
+  status_since_ = now;
+  return transition;
+}
+
+}  // namespace net_failover_manager
@@ -0,0 +1,116 @@
+// This file is part of Net Failover Manager.
+//
+// Net Failover Manager is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Net Failover Manager is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Net Failover Manager.  If not, see
+// <https://www.gnu.org/licenses/>.
+
+#ifndef NET_FAILOVER_MANAGER_NETCTL_INTERFACE_STATE_MACHINE
+#define NET_FAILOVER_MANAGER_NETCTL_INTERFACE_STATE_MACHINE
+
+#include <chrono>
+#include <optional>
+#include <string>
+
+#include "interface_checker.h"
+
+namespace net_failover_manager {
+
+// Damped status of an interface. The status measured by each probe round is
+// only adopted once it has been confirmed by a number of rounds in a row,
+// and an interface that keeps going down shortly after coming back up is
+// held down for exponentially longer periods. Not thread safe.
+class InterfaceStateMachine {
+public:
+  typedef std::chrono::steady_clock::time_point TimePoint;
+
+  typedef struct {
+    // Rounds in a row needed to become healthy, and unhealthy.
+    int up_threshold;
+    int down_threshold;
+    // Time an interface that flapped cannot become healthy, doubled at each
+    // flap up to hold_down_max. An interface that goes down after having
+    // been healthy for hold_down_max is not considered flapping.
+    std::chrono::seconds hold_down_base;
+    std::chrono::seconds hold_down_max;
+  } Config;
+
+  typedef struct {
+    InterfaceChecker::InterfaceStatus old_status;
+    InterfaceChecker::InterfaceStatus new_status;
+    // Human readable explanation of the transition.
+    std::string reason;
+  } Transition;
+
+  // What is needed to resume the damping after a restart. The streaks are
+  // not kept: a restart breaks them, like a round that could not probe.
+  typedef struct {
+    InterfaceChecker::InterfaceStatus status;
+    TimePoint status_since;
+    int flaps;
+    bool recovered;
+    TimePoint hold_down_until;
+  } State;
+
+  explicit InterfaceStateMachine(const Config &config);
+  virtual ~InterfaceStateMachine() {}
+
+  // Feeds the status measured by a probe round at `now`. Returns the
+  // transition if the damped status changed. UNKNOWN readings, from rounds
+  // that could not probe anything, break the streaks but change nothing
+  // else.
+  std::optional<Transition> Update(InterfaceChecker::InterfaceStatus reading,
+                                   TimePoint now);
+  // Feeds a link down at `now`. Unlike probe readings, it is not damped: the
+  // interface becomes unhealthy at once.
+  std::optional<Transition> LinkDown(TimePoint now);
+
+  // Thresholds apply from the next reading, the current streaks and hold
+  // down are kept.
+  void SetConfig(const Config &config) { config_ = config; }
+
+  InterfaceChecker::InterfaceStatus Status() const { return status_; }
+  // Time of the last transition.
+  TimePoint StatusSince() const { return status_since_; }
+  // The interface cannot become healthy before this time.
+  TimePoint HoldDownUntil() const { return hold_down_until_; }
+  // Flaps in a row, 0 if the interface is stable.
+  int Flaps() const { return flaps_; }
+
+  State Save() const;
+  void Restore(const State &state);
+
+protected:
+  // Delete copy and move constructors.
+  InterfaceStateMachine(const InterfaceStateMachine &) = delete;
+  InterfaceStateMachine &operator=(const InterfaceStateMachine &) = delete;
+
+private:
+  // Applies the streaks updated by a reading. `cause` explains the
+  // transition, if not empty, instead of the streaks.
+  std::optional<Transition> Evaluate(InterfaceChecker::InterfaceStatus reading,
+                                     TimePoint now, const std::string &cause);
+
+  Config config_;
+  InterfaceChecker::InterfaceStatus status_;
+  TimePoint status_since_;
+  int healthy_in_a_row_;
+  int unhealthy_in_a_row_;
+  int flaps_;
+  // Set if the current status follows an unhealthy period.
+  bool recovered_;
+  TimePoint hold_down_until_;
+}; // class InterfaceStateMachine
+
+} // namespace net_failover_manager
+
+#endif // #ifndef NET_FAILOVER_MANAGER_NETCTL_INTERFACE_STATE_MACHINE
@@ -0,0 +1,241 @@
+// This file is part of Net Failover Manager.
+//
+// Net Failover Manager is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Net Failover Manager is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Net Failover Manager.  If not, see
+// <https://www.gnu.org/licenses/>.
+
+#include "link_monitor.h"
+
+#include <glog/logging.h>
+#include <linux/rtnetlink.h>
+#include <net/if.h>
+#include <string.h>
+
+namespace net_failover_manager {
+
+namespace {
+// Maximum time the kernel has to answer a dump of the links.
+constexpr std::chrono::milliseconds kDumpTimeout = std::chrono::seconds(1);
+// Dumps interrupted by concurrent changes are retried this many times.
+const int kMaxDumpAttempts = 3;
+
+// Reads the index, name and state of a RTM_NEWLINK/RTM_DELLINK message.
+// Returns false if it does not describe a link, e.g. a bridge port.
+bool ParseLinkMessage(const nlmsghdr *message, int *if_index,
+                      std::string *if_name, bool *up) {
+  if (message->nlmsg_len < NLMSG_LENGTH(sizeof(ifinfomsg))) {
+    return false;
+  }
+  auto *link = static_cast<const ifinfomsg *>(NLMSG_DATA(message));
+  if (link->ifi_family != AF_UNSPEC) {
+    return false;
+  }
+  *if_index = link->ifi_index;
+  // IFF_RUNNING is set for the operational states up and unknown, the
+  // latter being the one of the links without a carrier, e.g. tunnels.
+  *up = (link->ifi_flags & IFF_UP) && (link->ifi_flags & IFF_RUNNING);
+  if_name->clear();
+  NetlinkSocket::ForEachAttribute(
+      message, sizeof(ifinfomsg), [if_name](const rtattr *attribute) {
+        if (attribute->rta_type == IFLA_IFNAME) {
+          auto *name = static_cast<const char *>(RTA_DATA(attribute));
+          *if_name = std::string(name, strnlen(name, RTA_PAYLOAD(attribute)));
+        }
+      });
+  return !if_name->empty();
+}
+}  // namespace
+
+LinkMonitor::LinkMonitor()
+    : started_(false),
+      events_socket_(NETLINK_ROUTE),
+      dump_socket_(NETLINK_ROUTE),
+      next_cb_id_(0) {}
+
+int LinkMonitor::AddLinkChangedCb(LinkChangedCallback link_changed_cb) {
+  std::unique_lock<std::mutex> lock(cb_mutex_);
+  int id = next_cb_id_++;
+  link_changed_cbs_[id] = link_changed_cb;
+  return id;
+}
+
+void LinkMonitor::RemoveLinkChangedCb(int cb_id) {
+  std::unique_lock<std::mutex> lock(cb_mutex_);
+  link_changed_cbs_.erase(cb_id);
+}
+
+Status LinkMonitor::Start() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (started_) {
+    return Status(Status::NO_OP, "Already started.");
+  }
+  // Subscribe before the dump, so that no change can be missed in between.
+  for (auto status : {events_socket_.Open(),
+                      events_socket_.JoinGroup(RTNLGRP_LINK),
+                      dump_socket_.Open()}) {
+    if (status.Error() != Status::OK) {
+      events_socket_.Close();
+      dump_socket_.Close();
+      return status;
+    }
+  }
+  std::vector<Change> changes;
+  auto status = DumpLocked(&changes);
+  if (status.Error() != Status::OK) {
+    events_socket_.Close();
+    dump_socket_.Close();
+    return status;
+  }
+  reactor_.WatchFd(events_socket_.fd(), [this] { OnLinkEvents(); });
+  started_ = true;
+  return reactor_.Start();
+}
+
+void LinkMonitor::Stop() {
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (!started_) {
+      return;
+    }
+    started_ = false;
+  }
+  // Waits for the callback in progress, if any.
+  reactor_.Stop();
+  std::unique_lock<std::mutex> lock(mutex_);
+  events_socket_.Close();
+  dump_socket_.Close();
+  links_.clear();
+}
+
+std::map<std::string, bool> LinkMonitor::Links() const {
+  std::unique_lock<std::mutex> lock(mutex_);
+  std::map<std::string, bool> links;
+  for (const auto &entry : links_) {
+    links[entry.second.if_name] = entry.second.up;
+  }
+  return links;
+}
+
+Status LinkMonitor::DumpLocked(std::vector<Change> *changes) {
+  std::unordered_map<int, Link> links;
+  auto status = Status(Status::UNKNOWN_ERROR, "No dump attempted.");
+  for (int attempt = 0; attempt < kMaxDumpAttempts; attempt++) {
+    links.clear();
+    NetlinkRequest request;
+    request.BeginMessage(RTM_GETLINK, 0, sizeof(ifinfomsg));
+    status = dump_socket_.Dump(
+        &request,
+        [&links](const nlmsghdr *message) {
+          Link link;
+          int if_index;
+          if (ParseLinkMessage(message, &if_index, &link.if_name, &link.up)) {
+            links[if_index] = link;
+          }
+        },
+        kDumpTimeout);
+    if (status.Error() == Status::OK) {
+      break;
+    }
+  }
+  if (status.Error() != Status::OK) {
+    LOG(WARNING) << "Could not read the links: " << status.ErrorMessage();
+    return status;
+  }
+  // Compared by name, renamed links are reported as a removal and an
+  // addition.
+  std::map<std::string, bool> old_links;
+  for (const auto &entry : links_) {
+    old_links[entry.second.if_name] = entry.second.up;
+  }
+  std::map<std::string, bool> new_links;
+  for (const auto &entry : links) {
+    new_links[entry.second.if_name] = entry.second.up;
+  }
+  for (const auto &entry : old_links) {
+    if (new_links.count(entry.first) == 0) {
+      changes->push_back({entry.first, false, false});
+    }
+  }
+  for (const auto &entry : new_links) {
+    auto old_link = old_links.find(entry.first);
+    if (old_link == old_links.end() || old_link->second != entry.second) {
+      changes->push_back({entry.first, true, entry.second});
+    }
+  }
+  links_ = std::move(links);
+  return status;
+}
+
+void LinkMonitor::ApplyLinkMessageLocked(const nlmsghdr *message,
+                                         std::vector<Change> *changes) {
+  Link link;
+  int if_index;
+  if (!ParseLinkMessage(message, &if_index, &link.if_name, &link.up)) {
+    return;
+  }
+  auto known = links_.find(if_index);
+  if (message->nlmsg_type == RTM_DELLINK) {
+    if (known != links_.end()) {
+      changes->push_back({known->second.if_name, false, false});
+      links_.erase(known);
+    }
+    return;
+  }
+  if (known == links_.end()) {
+    changes->push_back({link.if_name, true, link.up});
+    links_[if_index] = link;
+    return;
+  }
+  if (known->second.if_name != link.if_name) {
+    changes->push_back({known->second.if_name, false, false});
+    changes->push_back({link.if_name, true, link.up});
+  } else if (known->second.up != link.up) {
+    changes->push_back({link.if_name, true, link.up});
+  }
+  known->second = link;
+}
+
+void LinkMonitor::OnLinkEvents() {
+  std::vector<Change> changes;
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    bool overrun = false;
+    events_socket_.ReceiveMessages(
+        [this, &changes](const nlmsghdr *message) {
+          if (message->nlmsg_type == RTM_NEWLINK ||
+              message->nlmsg_type == RTM_DELLINK) {
+            ApplyLinkMessageLocked(message, &changes);
+          }
+        },
+        &overrun);
+    if (overrun) {
+      LOG(WARNING) << "Link events lost, reading the links again.";
+      DumpLocked(&changes);
+    }
+  }
+  Notify(changes);
+}
+
+void LinkMonitor::Notify(const std::vector<Change> &changes) {
+  std::unique_lock<std::mutex> lock(cb_mutex_);
+  for (const auto &change : changes) {
+    DLOG(INFO) << "Link " << change.if_name
+               << (!change.present ? " removed"
+                                   : change.up ? " up" : " down");
+    for (const auto &link_changed_cb : link_changed_cbs_) {
+      link_changed_cb.second(change.if_name, change.present, change.up);
+    }
+  }
+}
+
+}  // namespace net_failover_manager
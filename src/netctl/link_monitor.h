@@ -0,0 +1,112 @@
+// This file is part of Net Failover Manager.
+//
+// Net Failover Manager is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Net Failover Manager is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Net Failover Manager.  If not, see
+// <https://www.gnu.org/licenses/>.
+
+// Follows the network interfaces of the host over rtnetlink: which ones
+// exist, and which ones are operationally up. One monitor is shared by the
+// components following the links, so that they all see the same changes.
+
+#ifndef NET_FAILOVER_MANAGER_NETCTL_LINK_MONITOR
+#define NET_FAILOVER_MANAGER_NETCTL_LINK_MONITOR
+
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "netlink_socket.h"
+#include "probe_reactor.h"
+#include "src/lib/status.h"
+
+namespace net_failover_manager {
+
+class LinkMonitor {
+ public:
+  // Called when a link appears, disappears (present is false), or goes
+  // operationally up or down. Runs on the monitor thread, without any lock
+  // of this object held.
+  typedef std::function<void(const std::string &if_name, bool present,
+                             bool up)>
+      LinkChangedCallback;
+
+  LinkMonitor();
+  virtual ~LinkMonitor() { Stop(); }
+
+  // Registers a function called with every change, after Links() reflects
+  // it. Returns an id to be used to unregister it. Unregistering waits for
+  // the call in progress, if any, and cannot be done from a callback.
+  int AddLinkChangedCb(LinkChangedCallback link_changed_cb);
+  void RemoveLinkChangedCb(int cb_id);
+
+  // Reads the current links, then follows their changes from a dedicated
+  // thread. The links present at start are not reported, see Links().
+  // Returns NO_OP if already started, e.g. by another component sharing
+  // the monitor.
+  Status Start();
+  void Stop();
+
+  // Current links by name, and whether they are up: administratively up with
+  // a carrier, or without a notion of carrier like most tunnels. Empty if
+  // not started.
+  std::map<std::string, bool> Links() const;
+
+ protected:
+  // Delete copy and move constructors.
+  LinkMonitor(const LinkMonitor &) = delete;
+  LinkMonitor &operator=(const LinkMonitor &) = delete;
+
+ private:
+  typedef struct {
+    std::string if_name;
+    bool up;
+  } Link;
+
+  typedef struct {
+    std::string if_name;
+    bool present;
+    bool up;
+  } Change;
+
+  // Reads all the links again, and appends the differences with links_ to
+  // `changes`. Must be called with mutex_ held.
+  Status DumpLocked(std::vector<Change> *changes);
+  // Applies a RTM_NEWLINK/RTM_DELLINK message to links_. Must be called with
+  // mutex_ held.
+  void ApplyLinkMessageLocked(const nlmsghdr *message,
+                              std::vector<Change> *changes);
+  void Notify(const std::vector<Change> &changes);
+
+  // Run on the reactor thread.
+  void OnLinkEvents();
+
+  mutable std::mutex mutex_;
+  bool started_;  // Protected by mutex_.
+  // Links by index. Protected by mutex_.
+  std::unordered_map<int, Link> links_;
+  NetlinkSocket events_socket_;
+  // Dumps cannot share the socket receiving the events. Protected by mutex_.
+  NetlinkSocket dump_socket_;
+  ProbeReactor reactor_;
+  mutable std::mutex cb_mutex_;  // Dedicated mutex to avoid lock inversion.
+  // Protected by cb_mutex_.
+  std::map<int, LinkChangedCallback> link_changed_cbs_;
+  int next_cb_id_;  // Protected by cb_mutex_.
+};  // class LinkMonitor
+
+}  // namespace net_failover_manager
+
+#endif  // #ifndef NET_FAILOVER_MANAGER_NETCTL_LINK_MONITOR
@@ -0,0 +1,173 @@
+// This file is part of Net Failover Manager.
+//
+// Net Failover Manager is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Net Failover Manager is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Net Failover Manager.  If not, see
+// <https://www.gnu.org/licenses/>.
+
+#include "link_quality.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace net_failover_manager {
+
+namespace {
+// Gains of the moving averages: same as TCP for the round trip time, same
+// as RTP (RFC 3550) for the jitter.
+const double kRttGain = 1.0 / 8;
+const double kJitterGain = 1.0 / 16;
+const double kLossGain = 1.0 / 16;
+// The histogram is halved once it holds this many samples.
+const uint32_t kHistogramSamples = 512;
+
+double Score(const LinkQuality &quality) {
+  double rtt_ms = quality.rtt_ewma.count() / 1000.0;
+  double jitter_ms = quality.jitter.count() / 1000.0;
+  double effective_latency_ms = rtt_ms + 2 * jitter_ms + 10;
+  double r = effective_latency_ms < 160
+                 ? 93.2 - effective_latency_ms / 40
+                 : 93.2 - (effective_latency_ms - 120) / 10;
+  r -= 2.5 * quality.loss * 100;
+  return std::clamp(r, 0.0, 100.0);
+}
+}  // namespace
+
+LinkQualityEstimator::LinkQualityEstimator()
+    : samples_(0),
+      replies_(0),
+      rtt_ewma_us_(0),
+      jitter_us_(0),
+      loss_(0),
+      bucket_total_(0) {
+  buckets_.fill(0);
+}
+
+void LinkQualityEstimator::Add(std::optional<std::chrono::microseconds> rtt) {
+  double lost = rtt.has_value() ? 0 : 1;
+  loss_ = samples_ == 0 ? lost : loss_ + kLossGain * (lost - loss_);
+  samples_++;
+  if (!rtt.has_value()) {
+    return;
+  }
+  double rtt_us = std::max<double>(rtt.value().count(), 1);
+  if (replies_ == 0) {
+    rtt_ewma_us_ = rtt_us;
+  } else {
+    rtt_ewma_us_ += kRttGain * (rtt_us - rtt_ewma_us_);
+  }
+  if (last_rtt_us_.has_value()) {
+    jitter_us_ +=
+        kJitterGain * (std::abs(rtt_us - last_rtt_us_.value()) - jitter_us_);
+  }
+  last_rtt_us_ = rtt_us;
+  replies_++;
+
+  int bucket = std::min<int>(std::log2(rtt_us) * kBucketsPerOctave,
+                             kBuckets - 1);
+  buckets_[bucket]++;
+  bucket_total_++;
+  if (bucket_total_ >= kHistogramSamples) {
+    bucket_total_ = 0;
+    for (auto &count : buckets_) {
+      count /= 2;
+      bucket_total_ += count;
+    }
+  }
+}
+
+LinkQualityEstimator::State LinkQualityEstimator::Save() const {
+  State state;
+  state.samples = samples_;
+  state.replies = replies_;
+  state.rtt_ewma_us = rtt_ewma_us_;
+  state.jitter_us = jitter_us_;
+  state.loss = loss_;
+  state.last_rtt_us = last_rtt_us_.value_or(-1);
+  std::copy(buckets_.begin(), buckets_.end(), state.buckets);
+  state.bucket_total = bucket_total_;
+  return state;
+}
+
+void LinkQualityEstimator::Restore(const State &state) {
+  samples_ = std::max(state.samples, 0);
+  replies_ = std::clamp(state.replies, 0, samples_);
+  rtt_ewma_us_ = state.rtt_ewma_us;
+  jitter_us_ = state.jitter_us;
+  loss_ = std::clamp(state.loss, 0.0, 1.0);
+  last_rtt_us_.reset();
+  if (state.last_rtt_us >= 0) {
+    last_rtt_us_ = state.last_rtt_us;
+  }
+  std::copy(state.buckets, state.buckets + kBuckets, buckets_.begin());
+  bucket_total_ = state.bucket_total;
+}
+
+LinkQuality LinkQualityEstimator::Combine(
+    const std::vector<const LinkQualityEstimator *> &estimators,
+    const std::vector<int> &weights) {
+  LinkQuality quality;
+  double loss_weight = 0;
+  double rtt_weight = 0;
+  double rtt_us = 0;
+  double jitter_us = 0;
+  std::array<uint32_t, kBuckets> buckets;
+  buckets.fill(0);
+  uint32_t bucket_total = 0;
+  for (size_t i = 0; i < estimators.size(); i++) {
+    const auto *estimator = estimators[i];
+    if (estimator->samples_ == 0) {
+      continue;
+    }
+    quality.samples += estimator->samples_;
+    quality.loss += weights[i] * estimator->loss_;
+    loss_weight += weights[i];
+    if (estimator->replies_ > 0) {
+      rtt_us += weights[i] * estimator->rtt_ewma_us_;
+      jitter_us += weights[i] * estimator->jitter_us_;
+      rtt_weight += weights[i];
+    }
+    for (int bucket = 0; bucket < kBuckets; bucket++) {
+      buckets[bucket] += estimator->buckets_[bucket];
+    }
+    bucket_total += estimator->bucket_total_;
+  }
+  if (quality.samples == 0) {
+    return quality;
+  }
+  quality.loss /= loss_weight;
+  if (rtt_weight > 0) {
+    quality.rtt_ewma =
+        std::chrono::microseconds(std::llround(rtt_us / rtt_weight));
+    quality.jitter =
+        std::chrono::microseconds(std::llround(jitter_us / rtt_weight));
+  }
+  // Upper bound of the bucket holding the given fraction of the samples.
+  auto percentile = [&buckets, bucket_total](double fraction) {
+    uint32_t rank = std::ceil(fraction * bucket_total);
+    uint32_t cumulative = 0;
+    for (int bucket = 0; bucket < kBuckets; bucket++) {
+      cumulative += buckets[bucket];
+      if (cumulative >= rank && cumulative > 0) {
+        return std::chrono::microseconds(std::llround(
+            std::exp2(static_cast<double>(bucket + 1) / kBucketsPerOctave)));
+      }
+    }
+    return std::chrono::microseconds(0);
+  };
+  quality.rtt_p50 = percentile(0.5);
+  quality.rtt_p95 = percentile(0.95);
+  quality.score = Score(quality);
+  return quality;
+}
+
+}  // namespace net_failover_manager
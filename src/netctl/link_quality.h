@@ -0,0 +1,100 @@
+// This file is part of Net Failover Manager.
+//
+// Net Failover Manager is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Net Failover Manager is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Net Failover Manager.  If not, see
+// <https://www.gnu.org/licenses/>.
+
+#ifndef NET_FAILOVER_MANAGER_NETCTL_LINK_QUALITY
+#define NET_FAILOVER_MANAGER_NETCTL_LINK_QUALITY
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+namespace net_failover_manager {
+
+// Rolling statistics of the probes of a link, recent probes weigh more.
+typedef struct LinkQuality {
+  // Probes the statistics are based on, 0 if nothing was measured yet.
+  int samples = 0;
+  // Smoothed round trip time and mean deviation between consecutive round
+  // trip times, only meaningful if some probes were answered.
+  std::chrono::microseconds rtt_ewma{0};
+  std::chrono::microseconds jitter{0};
+  // Fraction of the probes that were lost, from 0 to 1.
+  double loss = 0;
+  // Round trip time percentiles, rounded up to the histogram resolution.
+  std::chrono::microseconds rtt_p50{0};
+  std::chrono::microseconds rtt_p95{0};
+  // Simplified R factor of the ITU-T G.107 E-model, from 0 to 100: above 80
+  // is good, below 50 is barely usable.
+  double score = 0;
+} LinkQuality;
+
+// Accumulates the probes towards one target. Not thread safe.
+class LinkQualityEstimator {
+ public:
+  // Round trip times are bucketed on a logarithmic scale, with 4 buckets
+  // per power of 2 microseconds, up to about a minute.
+  static const int kBucketsPerOctave = 4;
+  static const int kBuckets = 26 * kBucketsPerOctave;
+
+  // Plain data copy of everything the estimator accumulated, to carry it
+  // across restarts.
+  typedef struct {
+    int32_t samples;
+    int32_t replies;
+    double rtt_ewma_us;
+    double jitter_us;
+    double loss;
+    // Negative if no probe was answered yet.
+    double last_rtt_us;
+    uint32_t buckets[kBuckets];
+    uint32_t bucket_total;
+  } State;
+
+  LinkQualityEstimator();
+
+  // Adds a probe, with its round trip time or nullopt if it was lost.
+  void Add(std::optional<std::chrono::microseconds> rtt);
+
+  LinkQuality Quality() const { return Combine({this}, {1}); }
+
+  // Quality of a link probed towards several targets, weights[i] being the
+  // weight of estimators[i]. Estimators without samples are ignored, and
+  // the percentiles are over all the samples regardless of the weights.
+  static LinkQuality
+  Combine(const std::vector<const LinkQualityEstimator *> &estimators,
+          const std::vector<int> &weights);
+
+  State Save() const;
+  // Replaces everything accumulated so far with `state`.
+  void Restore(const State &state);
+
+ private:
+  int samples_;
+  int replies_;
+  double rtt_ewma_us_;
+  double jitter_us_;
+  double loss_;
+  std::optional<double> last_rtt_us_;
+  // Halved when full, so that old samples fade away.
+  std::array<uint32_t, kBuckets> buckets_;
+  uint32_t bucket_total_;
+};  // class LinkQualityEstimator
+
+}  // namespace net_failover_manager
+
+#endif  // #ifndef NET_FAILOVER_MANAGER_NETCTL_LINK_QUALITY
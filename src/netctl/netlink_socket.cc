@@ -0,0 +1,387 @@
+// This file is part of Net Failover Manager.
+//
+// Net Failover Manager is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Net Failover Manager is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Net Failover Manager.  If not, see
+// <https://www.gnu.org/licenses/>.
+
+#include "netlink_socket.h"
+
+#include <errno.h>
+#include <glog/logging.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "trace_log.h"
+
+namespace net_failover_manager {
+
+namespace {
+// Recommended by the netlink documentation to avoid truncated messages.
+const size_t kReceiveBufferSize = 32768;
+
+// Maps the errors reported in netlink ACKs to a Status.
+Status StatusFromErrno(int error, const std::string &message) {
+  switch (error) {
+    case EPERM:
+    case EACCES:
+      return Status(Status::PERMISSION_ERROR, message + strerror(error));
+    case ENOENT:
+    case ESRCH:
+    case ENODEV:
+      return Status(Status::NOT_FOUND, message + strerror(error));
+    case EINVAL:
+    case EEXIST:
+      return Status(Status::INVALID_ARGUMENTS, message + strerror(error));
+    default:
+      return Status(Status::UNKNOWN_ERROR, message + strerror(error));
+  }
+}
+
+// Records a request and its outcome in the trace.
+void TraceOperation(int protocol, NetlinkRequest *request, int messages,
+                    std::chrono::steady_clock::time_point start,
+                    const Status &status) {
+  auto *trace = TraceLog::Default();
+  if (!trace->enabled()) {
+    return;
+  }
+  const auto &buffer = request->Buffer();
+  uint16_t type =
+      buffer.size() >= sizeof(nlmsghdr)
+          ? reinterpret_cast<const nlmsghdr *>(buffer.data())->nlmsg_type
+          : 0;
+  trace->Record(TraceLog::NETLINK_OP, kNoInterface,
+                std::chrono::steady_clock::now() - start, protocol, type,
+                messages, status.Error());
+}
+}  // namespace
+
+void *NetlinkRequest::BeginMessage(uint16_t type, uint16_t flags,
+                                   size_t header_len) {
+  current_message_ = buffer_.size();
+  buffer_.resize(current_message_ + NLMSG_SPACE(header_len), 0);
+  auto *header = reinterpret_cast<nlmsghdr *>(At(current_message_));
+  header->nlmsg_len = NLMSG_LENGTH(header_len);
+  header->nlmsg_type = type;
+  header->nlmsg_flags = flags;
+  message_count_++;
+  return NLMSG_DATA(header);
+}
+
+size_t NetlinkRequest::Append(const void *data, size_t len) {
+  size_t offset = buffer_.size();
+  buffer_.resize(offset + NLMSG_ALIGN(len), 0);
+  memcpy(At(offset), data, len);
+  reinterpret_cast<nlmsghdr *>(At(current_message_))->nlmsg_len =
+      buffer_.size() - current_message_;
+  return offset;
+}
+
+void NetlinkRequest::AddAttribute(uint16_t type, const void *data,
+                                  size_t len) {
+  rtattr attribute;
+  attribute.rta_type = type;
+  attribute.rta_len = RTA_LENGTH(len);
+  size_t offset = Append(&attribute, sizeof(attribute));
+  buffer_.resize(offset + RTA_SPACE(len), 0);
+  memcpy(RTA_DATA(reinterpret_cast<rtattr *>(At(offset))), data, len);
+  reinterpret_cast<nlmsghdr *>(At(current_message_))->nlmsg_len =
+      buffer_.size() - current_message_;
+}
+
+size_t NetlinkRequest::BeginNested(uint16_t type) {
+  rtattr attribute;
+  attribute.rta_type = type;
+  attribute.rta_len = RTA_LENGTH(0);
+  return Append(&attribute, sizeof(attribute));
+}
+
+void NetlinkRequest::EndNested(size_t offset) {
+  reinterpret_cast<rtattr *>(At(offset))->rta_len = buffer_.size() - offset;
+}
+
+NetlinkSocket::NetlinkSocket(int protocol)
+    : protocol_(protocol),
+      fd_(-1),
+      next_sequence_(1),
+      buffer_(kReceiveBufferSize) {}
+
+NetlinkSocket::~NetlinkSocket() { Close(); }
+
+Status NetlinkSocket::Open() {
+  if (fd_ >= 0) {
+    return Status(Status::NO_OP, "Netlink socket already open.");
+  }
+  fd_ = socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, protocol_);
+  if (fd_ < 0) {
+    LOG(ERROR) << "Could not open netlink socket: " << strerror(errno);
+    return Status(Status::UNKNOWN_ERROR, "Could not open netlink socket.");
+  }
+  sockaddr_nl local = {};
+  local.nl_family = AF_NETLINK;
+  if (bind(fd_, reinterpret_cast<sockaddr *>(&local), sizeof(local)) < 0) {
+    LOG(ERROR) << "Could not bind netlink socket: " << strerror(errno);
+    Close();
+    return Status(Status::UNKNOWN_ERROR, "Could not bind netlink socket.");
+  }
+  return Status::Ok();
+}
+
+void NetlinkSocket::Close() {
+  if (fd_ >= 0) {
+    close(fd_);
+    fd_ = -1;
+  }
+}
+
+Status NetlinkSocket::JoinGroup(int group) {
+  if (setsockopt(fd_, SOL_NETLINK, NETLINK_ADD_MEMBERSHIP, &group,
+                 sizeof(group)) < 0) {
+    LOG(ERROR) << "Could not join netlink group " << group << ": "
+               << strerror(errno);
+    return Status(errno == EPERM ? Status::PERMISSION_ERROR
+                                 : Status::INVALID_ARGUMENTS,
+                  "Could not join netlink group.");
+  }
+  return Status::Ok();
+}
+
+Status NetlinkSocket::ReceiveMessages(const MessageHandler &handler,
+                                      bool *overrun) {
+  *overrun = false;
+  bool received = false;
+  while (true) {
+    ssize_t len = recv(fd_, buffer_.data(), buffer_.size(), 0);
+    if (len < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        break;
+      }
+      if (errno == ENOBUFS) {
+        // The kernel dropped messages because the socket buffer was full.
+        LOG(WARNING) << "Netlink socket overrun, events were lost.";
+        *overrun = true;
+        return Status(Status::UNKNOWN_ERROR, "Netlink overrun.");
+      }
+      LOG(ERROR) << "Error reading netlink socket: " << strerror(errno);
+      return Status(Status::UNKNOWN_ERROR, "Error reading netlink socket.");
+    }
+    received = true;
+    int remaining = len;
+    for (auto *message = reinterpret_cast<const nlmsghdr *>(buffer_.data());
+         NLMSG_OK(message, remaining);
+         message = NLMSG_NEXT(message, remaining)) {
+      switch (message->nlmsg_type) {
+        case NLMSG_DONE:
+        case NLMSG_NOOP:
+          break;
+        case NLMSG_OVERRUN:
+          *overrun = true;
+          break;
+        default:
+          handler(message);
+      }
+    }
+  }
+  if (*overrun) {
+    return Status(Status::UNKNOWN_ERROR, "Netlink overrun.");
+  }
+  return received ? Status::Ok()
+                  : Status(Status::NOT_FOUND, "No netlink messages.");
+}
+
+Status NetlinkSocket::Send(NetlinkRequest *request, uint16_t flags,
+                          uint32_t *first_sequence) {
+  if (fd_ < 0) {
+    return Status(Status::INVALID_ARGUMENTS, "Netlink socket not open.");
+  }
+  auto &buffer = request->Buffer();
+  *first_sequence = next_sequence_;
+  int remaining = buffer.size();
+  for (auto *message = reinterpret_cast<nlmsghdr *>(buffer.data());
+       NLMSG_OK(message, remaining); message = NLMSG_NEXT(message, remaining)) {
+    message->nlmsg_flags |= NLM_F_REQUEST | flags;
+    message->nlmsg_seq = next_sequence_++;
+  }
+
+  sockaddr_nl kernel = {};
+  kernel.nl_family = AF_NETLINK;
+  iovec iov = {buffer.data(), buffer.size()};
+  msghdr msg = {};
+  msg.msg_name = &kernel;
+  msg.msg_namelen = sizeof(kernel);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  if (sendmsg(fd_, &msg, 0) < 0) {
+    LOG(ERROR) << "Could not send netlink request: " << strerror(errno);
+    return StatusFromErrno(errno, "Could not send netlink request: ");
+  }
+  return Status::Ok();
+}
+
+Status NetlinkSocket::Transact(NetlinkRequest *request,
+                               std::chrono::milliseconds timeout,
+                               int *failed) {
+  auto start = std::chrono::steady_clock::now();
+  auto status = TransactUntraced(request, timeout, failed);
+  TraceOperation(protocol_, request, request->MessageCount(), start, status);
+  return status;
+}
+
+Status NetlinkSocket::Dump(NetlinkRequest *request,
+                           const MessageHandler &handler,
+                           std::chrono::milliseconds timeout) {
+  auto start = std::chrono::steady_clock::now();
+  int received = 0;
+  auto status = DumpUntraced(
+      request,
+      [&](const nlmsghdr *message) {
+        received++;
+        handler(message);
+      },
+      timeout);
+  TraceOperation(protocol_, request, received, start, status);
+  return status;
+}
+
+Status NetlinkSocket::TransactUntraced(NetlinkRequest *request,
+                                       std::chrono::milliseconds timeout,
+                                       int *failed) {
+  if (failed != nullptr) {
+    *failed = 0;
+  }
+  uint32_t first_sequence;
+  auto status = Send(request, NLM_F_ACK, &first_sequence);
+  if (status.Error() != Status::OK) {
+    return status;
+  }
+  uint32_t last_sequence = next_sequence_ - 1;
+
+  Status result = Status::Ok();
+  int pending_acks = request->MessageCount();
+  auto deadline = std::chrono::steady_clock::now() + timeout;
+  while (pending_acks > 0) {
+    auto wait_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                       deadline - std::chrono::steady_clock::now())
+                       .count();
+    pollfd pfd = {fd_, POLLIN, 0};
+    if (wait_ms <= 0 || poll(&pfd, 1, wait_ms) <= 0) {
+      LOG(ERROR) << "Timed out waiting for netlink ACKs, " << pending_acks
+                 << " missing.";
+      return Status(Status::UNKNOWN_ERROR, "Timed out waiting for ACKs.");
+    }
+    bool overrun;
+    ReceiveMessages(
+        [&](const nlmsghdr *message) {
+          if (message->nlmsg_type != NLMSG_ERROR ||
+              message->nlmsg_seq < first_sequence ||
+              message->nlmsg_seq > last_sequence) {
+            return;
+          }
+          pending_acks--;
+          auto *error = reinterpret_cast<const nlmsgerr *>(NLMSG_DATA(message));
+          if (error->error != 0 && failed != nullptr) {
+            (*failed)++;
+          }
+          if (error->error != 0 && result.Error() == Status::OK) {
+            result = StatusFromErrno(
+                -error->error, "Netlink message " +
+                                   std::to_string(message->nlmsg_seq -
+                                                  first_sequence) +
+                                   " failed: ");
+          }
+        },
+        &overrun);
+  }
+  return result;
+}
+
+Status NetlinkSocket::DumpUntraced(NetlinkRequest *request,
+                                   const MessageHandler &handler,
+                                   std::chrono::milliseconds timeout) {
+  uint32_t sequence;
+  auto status = Send(request, NLM_F_DUMP, &sequence);
+  if (status.Error() != Status::OK) {
+    return status;
+  }
+  // Unlike ReceiveMessages, the end of the dump must be seen.
+  bool interrupted = false;
+  auto deadline = std::chrono::steady_clock::now() + timeout;
+  while (true) {
+    ssize_t len = recv(fd_, buffer_.data(), buffer_.size(), 0);
+    if (len < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        LOG(ERROR) << "Error reading netlink dump: " << strerror(errno);
+        return StatusFromErrno(errno, "Error reading netlink dump: ");
+      }
+      auto wait_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                         deadline - std::chrono::steady_clock::now())
+                         .count();
+      pollfd pfd = {fd_, POLLIN, 0};
+      if (wait_ms <= 0 || poll(&pfd, 1, wait_ms) <= 0) {
+        LOG(ERROR) << "Timed out waiting for netlink dump.";
+        return Status(Status::UNKNOWN_ERROR, "Timed out waiting for dump.");
+      }
+      continue;
+    }
+    int remaining = len;
+    for (auto *message = reinterpret_cast<const nlmsghdr *>(buffer_.data());
+         NLMSG_OK(message, remaining);
+         message = NLMSG_NEXT(message, remaining)) {
+      if (message->nlmsg_seq != sequence) {
+        continue;
+      }
+      interrupted |= (message->nlmsg_flags & NLM_F_DUMP_INTR) != 0;
+      switch (message->nlmsg_type) {
+        case NLMSG_DONE:
+          return interrupted ? Status(Status::UNKNOWN_ERROR,
+                                      "Netlink dump interrupted.")
+                             : Status::Ok();
+        case NLMSG_ERROR: {
+          auto *error =
+              reinterpret_cast<const nlmsgerr *>(NLMSG_DATA(message));
+          return StatusFromErrno(-error->error, "Netlink dump failed: ");
+        }
+        case NLMSG_NOOP:
+          break;
+        default:
+          handler(message);
+      }
+    }
+  }
+}
+
+void NetlinkSocket::ForEachAttribute(
+    const nlmsghdr *message, size_t offset,
+    const std::function<void(const rtattr *)> &handler) {
+  if (message->nlmsg_len < NLMSG_LENGTH(offset)) {
+    return;
+  }
+  auto *attribute = reinterpret_cast<const rtattr *>(
+      reinterpret_cast<const char *>(NLMSG_DATA(message)) +
+      NLMSG_ALIGN(offset));
+  int remaining = message->nlmsg_len - NLMSG_LENGTH(NLMSG_ALIGN(offset));
+  for (; RTA_OK(attribute, remaining);
+       attribute = RTA_NEXT(attribute, remaining)) {
+    handler(attribute);
+  }
+}
+
+}  // namespace net_failover_manager
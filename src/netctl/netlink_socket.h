@@ -0,0 +1,143 @@
+// This file is part of Net Failover Manager.
+//
+// Net Failover Manager is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Net Failover Manager is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Net Failover Manager.  If not, see
+// <https://www.gnu.org/licenses/>.
+
+// Thin wrapper around a netlink socket: multicast group subscriptions,
+// iteration over the received messages and batched requests.
+
+#ifndef NET_FAILOVER_MANAGER_NETCTL_NETLINK_SOCKET
+#define NET_FAILOVER_MANAGER_NETCTL_NETLINK_SOCKET
+
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+#include "src/lib/status.h"
+
+namespace net_failover_manager {
+
+// Builds a batch of netlink messages that can be sent with a single syscall.
+class NetlinkRequest {
+ public:
+  NetlinkRequest() : current_message_(0), message_count_(0) {}
+
+  // Starts a new message followed by a zeroed family specific header of
+  // `header_len` bytes, which is returned to be filled by the caller. The
+  // pointer is only valid until the next call on this object.
+  void *BeginMessage(uint16_t type, uint16_t flags, size_t header_len);
+  // Appends an attribute to the current message.
+  void AddAttribute(uint16_t type, const void *data, size_t len);
+  template <typename T>
+  void AddAttribute(uint16_t type, T value) {
+    AddAttribute(type, &value, sizeof(value));
+  }
+  // Nested attributes, e.g. RTA_MULTIPATH. Returns the offset to be passed to
+  // EndNested once all the nested content has been appended.
+  size_t BeginNested(uint16_t type);
+  void EndNested(size_t offset);
+  // Appends raw bytes, aligned, to the current message. Returns their offset
+  // in the buffer.
+  size_t Append(const void *data, size_t len);
+  char *At(size_t offset) { return buffer_.data() + offset; }
+
+  int MessageCount() const { return message_count_; }
+  std::vector<char> &Buffer() { return buffer_; }
+
+ private:
+  std::vector<char> buffer_;
+  // Offset of the message being built.
+  size_t current_message_;
+  int message_count_;
+};  // class NetlinkRequest
+
+class NetlinkSocket {
+ public:
+  // Called for each message received. Messages of type NLMSG_DONE,
+  // NLMSG_NOOP and NLMSG_OVERRUN are not passed to the handler.
+  typedef std::function<void(const nlmsghdr *)> MessageHandler;
+
+  // Args:
+  //   protocol: netlink family, e.g. NETLINK_ROUTE.
+  explicit NetlinkSocket(int protocol);
+  virtual ~NetlinkSocket();
+
+  // Opens a non blocking socket.
+  Status Open();
+  void Close();
+  int fd() const { return fd_; }
+
+  // Subscribes to a multicast group, e.g. RTNLGRP_LINK.
+  Status JoinGroup(int group);
+
+  // Reads all the messages currently queued on the socket, without blocking.
+  // Returns NOT_FOUND if nothing was queued. An UNKNOWN_ERROR status with
+  // overrun set means that events have been lost and the caller should
+  // resynchronize its state from scratch.
+  Status ReceiveMessages(const MessageHandler &handler, bool *overrun);
+
+  // Sends all the messages of `request` in a single syscall, each one asking
+  // for an acknowledgement, and waits at most `timeout` for all the ACKs.
+  // The kernel applies the messages in order. Returns the first error
+  // reported by the kernel, if any, and the number of messages that failed
+  // in `failed` if not null. Must not be used on a socket that receives
+  // multicast events. Transact and Dump are recorded in the trace.
+  Status Transact(NetlinkRequest *request, std::chrono::milliseconds timeout,
+                  int *failed = nullptr);
+
+  // Sends the single dump request of `request`, e.g. RTM_GETROUTE, and calls
+  // `handler` for each message of the answer, waiting at most `timeout` for
+  // all of it. Returns UNKNOWN_ERROR if the dump was interrupted by a
+  // concurrent change, the caller should then dump again. Same restrictions
+  // as Transact.
+  Status Dump(NetlinkRequest *request, const MessageHandler &handler,
+              std::chrono::milliseconds timeout);
+
+  // Iterates over the attributes of a message, `offset` is the size of the
+  // family specific header that follows the netlink header.
+  static void ForEachAttribute(
+      const nlmsghdr *message, size_t offset,
+      const std::function<void(const rtattr *)> &handler);
+
+ protected:
+  // Delete copy and move constructors.
+  NetlinkSocket(const NetlinkSocket &) = delete;
+  NetlinkSocket &operator=(const NetlinkSocket &) = delete;
+
+ private:
+  // Adds `flags` and a sequence number to all the messages of `request`,
+  // then sends them. Returns the sequence number of the first message in
+  // `first_sequence`.
+  Status Send(NetlinkRequest *request, uint16_t flags,
+              uint32_t *first_sequence);
+  // Transact and Dump, without the trace.
+  Status TransactUntraced(NetlinkRequest *request,
+                          std::chrono::milliseconds timeout, int *failed);
+  Status DumpUntraced(NetlinkRequest *request, const MessageHandler &handler,
+                      std::chrono::milliseconds timeout);
+
+  const int protocol_;
+  int fd_;
+  uint32_t next_sequence_;
+  // Reused for every read.
+  std::vector<char> buffer_;
+};  // class NetlinkSocket
+
+}  // namespace net_failover_manager
+
+#endif  // #ifndef NET_FAILOVER_MANAGER_NETCTL_NETLINK_SOCKET
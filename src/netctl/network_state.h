@@ -0,0 +1,79 @@
+// This file is part of Net Failover Manager.
+//
+// Net Failover Manager is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Net Failover Manager is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Net Failover Manager.  If not, see
+// <https://www.gnu.org/licenses/>.
+
+// Point in time view of the interfaces and of the default gateway, published
+// as an immutable value so that it can be read without taking the locks of
+// the probe and route threads.
+
+#ifndef NET_FAILOVER_MANAGER_NETCTL_NETWORK_STATE
+#define NET_FAILOVER_MANAGER_NETCTL_NETWORK_STATE
+
+#include <algorithm>
+#include <cstdint>
+#include <ctime>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "interface_checker.h"
+#include "interface_registry.h"
+#include "interface_state_machine.h"
+#include "link_quality.h"
+#include "prober.h"
+
+namespace net_failover_manager {
+
+typedef struct {
+  InterfaceId id;
+  InterfaceChecker::InterfaceStatus status;
+  // 0 if the interface has not been checked yet.
+  std::time_t last_checked_at;
+  std::optional<ProbeResult> last_probe_result;
+  // samples is 0 until the interface has been probed.
+  LinkQuality quality;
+  // Damping of the status, as of its last transition. Unset until the
+  // status changed once.
+  std::optional<InterfaceStateMachine::State> damping;
+} InterfaceState;
+
+typedef struct NetworkState {
+  // Incremented at every published change.
+  uint64_t version;
+  std::optional<InterfaceId> default_gw_interface;
+  // Sorted by interface id.
+  std::vector<InterfaceState> interfaces;
+
+  // Returns nullptr if the interface is not monitored.
+  const InterfaceState *Find(InterfaceId id) const {
+    auto interface = std::lower_bound(
+        interfaces.begin(), interfaces.end(), id,
+        [](const InterfaceState &state, InterfaceId id) {
+          return state.id < id;
+        });
+    if (interface == interfaces.end() || interface->id != id) {
+      return nullptr;
+    }
+    return &*interface;
+  }
+  InterfaceState *Find(InterfaceId id) {
+    return const_cast<InterfaceState *>(
+        static_cast<const NetworkState *>(this)->Find(id));
+  }
+} NetworkState;
+
+}  // namespace net_failover_manager
+
+#endif  // #ifndef NET_FAILOVER_MANAGER_NETCTL_NETWORK_STATE
@@ -0,0 +1,127 @@
+// This file is part of Net Failover Manager.
+//
+// Net Failover Manager is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Net Failover Manager is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Net Failover Manager.  If not, see
+// <https://www.gnu.org/licenses/>.
+
+#include "policy_routing.h"
+
+#include <errno.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <linux/fib_rules.h>
+#include <net/if.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "interface_registry.h"
+#include "trace_log.h"
+
+DEFINE_bool(policy_routing, false,
+            "Give each interface a routing table and a firewall mark of its "
+            "own, and fail over by rewriting a single ip rule instead of the "
+            "default routes of the main table.");
+DEFINE_int32(policy_table_base, 1000,
+             "Policy routing: the table of an interface is this plus its "
+             "index.");
+DEFINE_int32(policy_fwmark_base, 0x10000,
+             "Policy routing: the firewall mark of an interface is this "
+             "plus its index.");
+DEFINE_int32(policy_rule_priority, 1000,
+             "Policy routing: priority of the first rule, the rules use "
+             "this and the next 3 priorities.");
+
+namespace net_failover_manager {
+
+bool PolicyRoutingEnabled() { return FLAGS_policy_routing; }
+
+uint32_t PolicyTable(int if_index) {
+  return FLAGS_policy_table_base + if_index;
+}
+
+uint32_t PolicyFwmark(int if_index) {
+  return FLAGS_policy_fwmark_base + if_index;
+}
+
+uint32_t PolicyRulePriority(PolicyRuleKind kind) {
+  return FLAGS_policy_rule_priority + kind;
+}
+
+void AddPolicyRouteMessage(uint16_t type, const PolicyRoute &route,
+                           NetlinkRequest *request) {
+  auto *header = static_cast<rtmsg *>(request->BeginMessage(
+      type, type == RTM_NEWROUTE ? NLM_F_CREATE | NLM_F_REPLACE : 0,
+      sizeof(rtmsg)));
+  bool has_gw = !IN6_IS_ADDR_UNSPECIFIED(&route.gw);
+  header->rtm_family = route.family;
+  header->rtm_dst_len = 0;
+  // Tables above 255 only fit in the attribute.
+  header->rtm_table = RT_TABLE_UNSPEC;
+  header->rtm_protocol = RTPROT_BOOT;
+  header->rtm_scope = has_gw ? RT_SCOPE_UNIVERSE : RT_SCOPE_LINK;
+  header->rtm_type = RTN_UNICAST;
+  request->AddAttribute<uint32_t>(RTA_TABLE, route.table);
+  if (has_gw) {
+    request->AddAttribute(
+        RTA_GATEWAY, &route.gw,
+        route.family == AF_INET6 ? sizeof(in6_addr) : sizeof(in_addr));
+  }
+  request->AddAttribute<uint32_t>(RTA_OIF, route.if_index);
+}
+
+void AddPolicyRuleMessage(uint16_t type, const PolicyRule &rule,
+                          NetlinkRequest *request) {
+  auto *header = static_cast<fib_rule_hdr *>(request->BeginMessage(
+      type, type == RTM_NEWRULE ? NLM_F_CREATE : 0, sizeof(fib_rule_hdr)));
+  header->family = rule.family;
+  header->src_len = rule.src_len;
+  header->table = RT_TABLE_UNSPEC;
+  header->action = FR_ACT_TO_TBL;
+  request->AddAttribute<uint32_t>(FRA_PRIORITY, rule.priority);
+  request->AddAttribute<uint32_t>(FRA_TABLE, rule.table);
+  if (rule.fwmark != 0) {
+    request->AddAttribute<uint32_t>(FRA_FWMARK, rule.fwmark);
+    request->AddAttribute<uint32_t>(FRA_FWMASK, 0xffffffff);
+  }
+  if (rule.src_len > 0) {
+    request->AddAttribute(
+        FRA_SRC, &rule.src,
+        rule.family == AF_INET6 ? sizeof(in6_addr) : sizeof(in_addr));
+  }
+  if (rule.suppress_default) {
+    request->AddAttribute<uint32_t>(FRA_SUPPRESS_PREFIXLEN, 0);
+  }
+}
+
+void ApplyPolicyFwmark(int fd, const std::string &if_name) {
+  if (!FLAGS_policy_routing) {
+    return;
+  }
+  // Called for every probe socket: the registry keeps the index of the
+  // managed interfaces, only others cost an ioctl.
+  auto *registry = InterfaceRegistry::Default();
+  auto if_id = registry->Find(if_name);
+  int if_index = if_id != kNoInterface
+                     ? registry->IfIndex(if_id)
+                     : TracedIfNameToIndex(if_name.c_str());
+  if (if_index == 0) {
+    return;
+  }
+  uint32_t mark = PolicyFwmark(if_index);
+  if (setsockopt(fd, SOL_SOCKET, SO_MARK, &mark, sizeof(mark)) < 0) {
+    LOG_EVERY_N(WARNING, 100) << "Could not mark probe socket of " << if_name
+                              << ": " << strerror(errno);
+  }
+}
+
+}  // namespace net_failover_manager
@@ -0,0 +1,109 @@
+// This file is part of Net Failover Manager.
+//
+// Net Failover Manager is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Net Failover Manager is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Net Failover Manager.  If not, see
+// <https://www.gnu.org/licenses/>.
+
+// Policy routing mode. Each interface with a default route gets a routing
+// table of its own, holding a copy of that route, and a firewall mark. Rules
+// send the marked packets, and the packets sourced from the addresses of the
+// interface, to its table, and everything else to the table of the primary
+// interface. A failover then only rewrites that last rule, and probes leave
+// through the right uplink whatever the primary interface is.
+
+#ifndef NET_FAILOVER_MANAGER_NETCTL_POLICY_ROUTING
+#define NET_FAILOVER_MANAGER_NETCTL_POLICY_ROUTING
+
+#include <netinet/in.h>
+#include <string.h>
+
+#include <cstdint>
+#include <string>
+
+#include "netlink_socket.h"
+
+namespace net_failover_manager {
+
+// Set by --policy_routing.
+bool PolicyRoutingEnabled();
+
+// Routing table and firewall mark dedicated to the interface `if_index`.
+uint32_t PolicyTable(int if_index);
+uint32_t PolicyFwmark(int if_index);
+
+// Priorities of the rules, in the order they are evaluated. The rule that
+// consults the main table for everything but its default routes keeps the
+// directly connected networks reachable whatever the primary interface is.
+typedef enum {
+  FWMARK_RULES = 0,
+  CONNECTED_RULE = 1,
+  SOURCE_RULES = 2,
+  PRIMARY_RULE = 3,
+  RULE_KINDS = 4,
+} PolicyRuleKind;
+uint32_t PolicyRulePriority(PolicyRuleKind kind);
+
+// Default route of the table of an interface.
+typedef struct PolicyRoute {
+  // AF_INET or AF_INET6.
+  int family;
+  uint32_t table;
+  int if_index;
+  // In network byte order, unspecified for routes without a gateway.
+  in6_addr gw;
+
+  bool operator==(const struct PolicyRoute &other) const {
+    return family == other.family && table == other.table &&
+           if_index == other.if_index &&
+           memcmp(&gw, &other.gw, sizeof(gw)) == 0;
+  }
+} PolicyRoute;
+
+typedef struct PolicyRule {
+  // AF_INET or AF_INET6.
+  int family;
+  uint32_t priority;
+  uint32_t table;
+  // 0 if the rule does not match on the mark.
+  uint32_t fwmark;
+  // Matched source prefix, src_len 0 for any source.
+  in6_addr src;
+  int src_len;
+  // The default routes of the table are ignored.
+  bool suppress_default;
+
+  bool operator==(const struct PolicyRule &other) const {
+    return family == other.family && priority == other.priority &&
+           table == other.table && fwmark == other.fwmark &&
+           memcmp(&src, &other.src, sizeof(src)) == 0 &&
+           src_len == other.src_len &&
+           suppress_default == other.suppress_default;
+  }
+} PolicyRule;
+
+// Appends to `request` a message that adds, with RTM_NEWROUTE/RTM_NEWRULE, or
+// removes, with RTM_DELROUTE/RTM_DELRULE, a route or a rule. Added routes
+// replace the default route of the table, if any.
+void AddPolicyRouteMessage(uint16_t type, const PolicyRoute &route,
+                           NetlinkRequest *request);
+void AddPolicyRuleMessage(uint16_t type, const PolicyRule &rule,
+                          NetlinkRequest *request);
+
+// Marks the packets of `fd` so that they use the table of `if_name`, if
+// policy routing is enabled. Needs CAP_NET_ADMIN, failures are only logged
+// since the socket is also bound to the interface.
+void ApplyPolicyFwmark(int fd, const std::string &if_name);
+
+}  // namespace net_failover_manager
+
+#endif  // #ifndef NET_FAILOVER_MANAGER_NETCTL_POLICY_ROUTING
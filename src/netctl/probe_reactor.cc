@@ -0,0 +1,225 @@
+// This file is part of Net Failover Manager.
+//
+// Net Failover Manager is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Net Failover Manager is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Net Failover Manager.  If not, see
+// <https://www.gnu.org/licenses/>.
+
+#include "probe_reactor.h"
+
+#include <errno.h>
+#include <glog/logging.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+namespace net_failover_manager {
+
+namespace {
+// Maximum number of events processed for each epoll_wait call.
+const int kMaxEvents = 32;
+}  // namespace
+
+ProbeReactor::ProbeReactor()
+    : epoll_fd_(epoll_create1(EPOLL_CLOEXEC)),
+      // steady_clock is CLOCK_MONOTONIC on Linux.
+      timer_fd_(timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)),
+      wake_fd_(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+      running_(false),
+      next_timer_sequence_(0),
+      loop_thread_(nullptr) {
+  if (epoll_fd_ < 0 || timer_fd_ < 0 || wake_fd_ < 0) {
+    LOG(ERROR) << "Could not create reactor fds: " << strerror(errno);
+    return;
+  }
+  epoll_event event = {};
+  event.events = EPOLLIN;
+  event.data.fd = timer_fd_;
+  epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, timer_fd_, &event);
+  event.data.fd = wake_fd_;
+  epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, wake_fd_, &event);
+}
+
+ProbeReactor::~ProbeReactor() {
+  Stop();
+  for (int fd : {epoll_fd_, timer_fd_, wake_fd_}) {
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+}
+
+Status ProbeReactor::Start() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (epoll_fd_ < 0 || timer_fd_ < 0 || wake_fd_ < 0) {
+    return Status(Status::UNKNOWN_ERROR, "Reactor was not initialized.");
+  }
+  if (running_) {
+    return Status(Status::NO_OP, "Reactor already running.");
+  }
+  running_ = true;
+  ArmTimerLocked();
+  loop_thread_ = std::make_unique<std::thread>([this] { Loop(); });
+  return Status::Ok();
+}
+
+void ProbeReactor::Stop() {
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (!running_) {
+      return;
+    }
+    running_ = false;
+  }
+  Wake();
+  loop_thread_->join();
+  loop_thread_.reset();
+  std::unique_lock<std::mutex> lock(mutex_);
+  for (const auto &entry : fd_handlers_) {
+    epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, entry.first, nullptr);
+  }
+  fd_handlers_.clear();
+  timers_ = decltype(timers_)();
+}
+
+Status ProbeReactor::WatchFd(int fd, Handler on_readable) {
+  return WatchFdEvents(fd, EPOLLIN, std::move(on_readable));
+}
+
+Status ProbeReactor::WatchFdWritable(int fd, Handler on_writable) {
+  return WatchFdEvents(fd, EPOLLOUT, std::move(on_writable));
+}
+
+Status ProbeReactor::WatchFdEvents(int fd, uint32_t events, Handler handler) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  epoll_event event = {};
+  event.events = events;
+  event.data.fd = fd;
+  if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &event) < 0) {
+    LOG(ERROR) << "Could not watch fd " << fd << ": " << strerror(errno);
+    return Status(Status::INVALID_ARGUMENTS, "Could not watch fd.");
+  }
+  fd_handlers_[fd] = std::make_shared<Handler>(std::move(handler));
+  return Status::Ok();
+}
+
+void ProbeReactor::UnwatchFd(int fd) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (fd_handlers_.erase(fd) > 0) {
+    epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+  }
+}
+
+void ProbeReactor::ScheduleAt(TimePoint when, Handler handler) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  bool new_earliest = timers_.empty() || when < timers_.top().when;
+  timers_.push({when, next_timer_sequence_++, std::move(handler)});
+  if (new_earliest && running_) {
+    ArmTimerLocked();
+  }
+}
+
+void ProbeReactor::ArmTimerLocked() {
+  itimerspec spec = {};
+  if (!timers_.empty()) {
+    auto deadline = timers_.top().when.time_since_epoch();
+    auto seconds = std::chrono::duration_cast<std::chrono::seconds>(deadline);
+    spec.it_value.tv_sec = seconds.count();
+    spec.it_value.tv_nsec =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(deadline - seconds)
+            .count();
+    if (spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0) {
+      // An all zero value would disarm the timer.
+      spec.it_value.tv_nsec = 1;
+    }
+  }
+  if (timerfd_settime(timer_fd_, TFD_TIMER_ABSTIME, &spec, nullptr) < 0) {
+    LOG(ERROR) << "Could not arm reactor timer: " << strerror(errno);
+  }
+}
+
+void ProbeReactor::Wake() {
+  uint64_t one = 1;
+  if (write(wake_fd_, &one, sizeof(one)) < 0) {
+    LOG(ERROR) << "Could not wake reactor: " << strerror(errno);
+  }
+}
+
+void ProbeReactor::RunTimers() {
+  uint64_t expirations;
+  while (read(timer_fd_, &expirations, sizeof(expirations)) > 0) {
+  }
+  while (true) {
+    Handler handler;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      if (!running_) {
+        return;
+      }
+      if (timers_.empty() ||
+          timers_.top().when > std::chrono::steady_clock::now()) {
+        ArmTimerLocked();
+        return;
+      }
+      handler = std::move(const_cast<Timer &>(timers_.top()).handler);
+      timers_.pop();
+    }
+    handler();
+  }
+}
+
+void ProbeReactor::Loop() {
+  epoll_event events[kMaxEvents];
+  while (true) {
+    int count = epoll_wait(epoll_fd_, events, kMaxEvents, -1);
+    if (count < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      LOG(ERROR) << "epoll_wait failed: " << strerror(errno);
+      return;
+    }
+    for (int i = 0; i < count; i++) {
+      int fd = events[i].data.fd;
+      if (fd == wake_fd_) {
+        uint64_t value;
+        while (read(wake_fd_, &value, sizeof(value)) > 0) {
+        }
+        continue;
+      }
+      if (fd == timer_fd_) {
+        RunTimers();
+        continue;
+      }
+      std::shared_ptr<Handler> handler;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        auto it = fd_handlers_.find(fd);
+        if (it == fd_handlers_.end()) {
+          // Unwatched by a previous handler in this batch.
+          continue;
+        }
+        // Keeps the handler alive even if it unwatches its own fd.
+        handler = it->second;
+      }
+      (*handler)();
+    }
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (!running_) {
+      return;
+    }
+  }
+}
+
+}  // namespace net_failover_manager
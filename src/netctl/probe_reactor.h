@@ -0,0 +1,110 @@
+// This file is part of Net Failover Manager.
+//
+// Net Failover Manager is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Net Failover Manager is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Net Failover Manager.  If not, see
+// <https://www.gnu.org/licenses/>.
+
+// Single threaded event loop, based on epoll and timerfd, that multiplexes the
+// sockets and the deadlines of all the probes.
+
+#ifndef NET_FAILOVER_MANAGER_NETCTL_PROBE_REACTOR
+#define NET_FAILOVER_MANAGER_NETCTL_PROBE_REACTOR
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "src/lib/status.h"
+
+namespace net_failover_manager {
+
+class ProbeReactor {
+ public:
+  // Handlers always run on the reactor thread, one at a time, so they do not
+  // need to synchronize among themselves.
+  typedef std::function<void()> Handler;
+  typedef std::chrono::steady_clock::time_point TimePoint;
+
+  ProbeReactor();
+  virtual ~ProbeReactor();
+
+  // Starts/Stops the event loop thread. Stop waits for the handler in
+  // progress, if any, and discards all pending timers and watched fds.
+  Status Start();
+  void Stop();
+
+  // Calls `on_readable` every time `fd` has data to read. The fd must be non
+  // blocking. Can be called from any thread, including from handlers.
+  // Handlers can be called spuriously, e.g. if the fd was closed and its
+  // number reused while the event was being dispatched.
+  Status WatchFd(int fd, Handler on_readable);
+  // Same, when `fd` can be written to, e.g. once a connect has completed.
+  // An fd is watched either for reading or for writing, not both.
+  Status WatchFdWritable(int fd, Handler on_writable);
+  void UnwatchFd(int fd);
+
+  // Runs `handler` once, as soon as possible after `when`. Can be called from
+  // any thread, including from handlers.
+  void ScheduleAt(TimePoint when, Handler handler);
+
+ protected:
+  // Delete copy and move constructors.
+  ProbeReactor(const ProbeReactor &) = delete;
+  ProbeReactor &operator=(const ProbeReactor &) = delete;
+
+ private:
+  typedef struct Timer {
+    TimePoint when;
+    // Breaks ties so that timers with the same deadline run in FIFO order.
+    uint64_t sequence;
+    Handler handler;
+
+    bool operator>(const struct Timer &other) const {
+      return when != other.when ? when > other.when
+                                : sequence > other.sequence;
+    }
+  } Timer;
+
+  Status WatchFdEvents(int fd, uint32_t events, Handler handler);
+  void Loop();
+  // Runs all expired timers and re-arms the timerfd for the next one.
+  void RunTimers();
+  // Programs the timerfd for the earliest deadline. Must be called with
+  // mutex_ held.
+  void ArmTimerLocked();
+  void Wake();
+
+  int epoll_fd_;
+  int timer_fd_;
+  // Used to interrupt epoll_wait, for stopping.
+  int wake_fd_;
+
+  std::mutex mutex_;
+  bool running_;  // Protected by mutex_.
+  // Pending timers, earliest on top. Protected by mutex_.
+  std::priority_queue<Timer, std::vector<Timer>, std::greater<Timer>> timers_;
+  uint64_t next_timer_sequence_;  // Protected by mutex_.
+  // Handlers for the watched fds. Protected by mutex_.
+  std::unordered_map<int, std::shared_ptr<Handler>> fd_handlers_;
+  std::unique_ptr<std::thread> loop_thread_;
+};  // class ProbeReactor
+
+}  // namespace net_failover_manager
+
+#endif  // #ifndef NET_FAILOVER_MANAGER_NETCTL_PROBE_REACTOR
@@ -0,0 +1,85 @@
+// This file is part of Net Failover Manager.
+//
+// Net Failover Manager is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Net Failover Manager is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Net Failover Manager.  If not, see
+// <https://www.gnu.org/licenses/>.
+
+#include "probe_window.h"
+
+#include <algorithm>
+
+namespace net_failover_manager {
+
+ProbeWindow::ProbeWindow(size_t capacity)
+    : samples_(std::max<size_t>(capacity, 1)) {
+  Clear();
+}
+
+void ProbeWindow::Clear() {
+  next_ = 0;
+  size_ = 0;
+  lost_ = 0;
+  rtt_sum_ = std::chrono::microseconds(0);
+  consecutive_losses_ = 0;
+  consecutive_successes_ = 0;
+}
+
+void ProbeWindow::Add(std::optional<std::chrono::microseconds> rtt) {
+  auto &sample = samples_[next_];
+  if (size_ == samples_.size()) {
+    // Evict the oldest sample, which is the one being overwritten.
+    if (sample.lost) {
+      lost_--;
+    } else {
+      rtt_sum_ -= sample.rtt;
+    }
+  } else {
+    size_++;
+  }
+  sample.lost = !rtt.has_value();
+  sample.rtt = rtt.value_or(std::chrono::microseconds(0));
+  if (sample.lost) {
+    lost_++;
+    consecutive_losses_++;
+    consecutive_successes_ = 0;
+  } else {
+    rtt_sum_ += sample.rtt;
+    consecutive_successes_++;
+    consecutive_losses_ = 0;
+  }
+  next_ = (next_ + 1) % samples_.size();
+}
+
+ProbeResult ProbeWindow::Result() const {
+  ProbeResult result;
+  result.sent = size_;
+  result.received = size_ - lost_;
+  if (size_ > 0) {
+    result.packet_loss = 100.0 * lost_ / size_;
+  }
+  if (result.received > 0) {
+    result.rtt_min = std::chrono::microseconds::max();
+    // The window is small, a scan is cheaper than keeping ordered samples.
+    for (size_t i = 0; i < size_; i++) {
+      const auto &sample = samples_[i];
+      if (!sample.lost) {
+        result.rtt_min = std::min(result.rtt_min, sample.rtt);
+        result.rtt_max = std::max(result.rtt_max, sample.rtt);
+      }
+    }
+    result.rtt_avg = rtt_sum_ / result.received;
+  }
+  return result;
+}
+
+}  // namespace net_failover_manager
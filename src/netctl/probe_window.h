@@ -0,0 +1,69 @@
+// This file is part of Net Failover Manager.
+//
+// Net Failover Manager is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Net Failover Manager is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Net Failover Manager.  If not, see
+// <https://www.gnu.org/licenses/>.
+
+// Loss and round trip time over the last N probes of an interface, for
+// continuous probing where there are no rounds.
+
+#ifndef NET_FAILOVER_MANAGER_NETCTL_PROBE_WINDOW
+#define NET_FAILOVER_MANAGER_NETCTL_PROBE_WINDOW
+
+#include <chrono>
+#include <cstddef>
+#include <optional>
+#include <vector>
+
+#include "prober.h"
+
+namespace net_failover_manager {
+
+class ProbeWindow {
+ public:
+  // Args:
+  //   capacity: number of probes the statistics are computed on.
+  explicit ProbeWindow(size_t capacity);
+
+  // Records the outcome of a probe, the oldest one leaves the window once it
+  // is full. `rtt` is nullopt if the probe was lost.
+  void Add(std::optional<std::chrono::microseconds> rtt);
+  void Clear();
+
+  size_t Size() const { return size_; }
+  // Length of the current streak of lost, or answered, probes.
+  int ConsecutiveLosses() const { return consecutive_losses_; }
+  int ConsecutiveSuccesses() const { return consecutive_successes_; }
+
+  // Statistics of the probes in the window, as if they were a single round.
+  ProbeResult Result() const;
+
+ private:
+  typedef struct {
+    bool lost;
+    std::chrono::microseconds rtt;
+  } Sample;
+
+  // Circular buffer, next_ is where the next sample goes.
+  std::vector<Sample> samples_;
+  size_t next_;
+  size_t size_;
+  int lost_;
+  std::chrono::microseconds rtt_sum_;
+  int consecutive_losses_;
+  int consecutive_successes_;
+};  // class ProbeWindow
+
+}  // namespace net_failover_manager
+
+#endif  // #ifndef NET_FAILOVER_MANAGER_NETCTL_PROBE_WINDOW
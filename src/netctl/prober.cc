@@ -0,0 +1,210 @@
+// This file is part of Net Failover Manager.
+//
+// Net Failover Manager is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Net Failover Manager is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Net Failover Manager.  If not, see
+// <https://www.gnu.org/licenses/>.
+
+#include "prober.h"
+
+#include <arpa/inet.h>
+
+#include <algorithm>
+#include <cstdlib>
+
+namespace net_failover_manager {
+
+namespace {
+const uint16_t kDefaultDnsPort = 53;
+const uint16_t kDefaultHttpPort = 80;
+const char kDefaultDnsName[] = "example.com";
+const char kDefaultHttpPath[] = "/";
+
+// Parses a decimal number in [min, max].
+bool ParseNumber(const std::string &text, long min, long max, long *value) {
+  if (text.empty()) {
+    return false;
+  }
+  char *end;
+  *value = strtol(text.c_str(), &end, 10);
+  return *end == '\0' && *value >= min && *value <= max;
+}
+
+Status ParseProbeTarget(const std::string &spec, ProbeTarget *target) {
+  auto invalid = [&spec](const std::string &reason) {
+    return Status(Status::INVALID_ARGUMENTS,
+                  "Invalid probe target \"" + spec + "\": " + reason);
+  };
+  auto colon = spec.find(':');
+  if (colon == std::string::npos) {
+    return invalid("missing type.");
+  }
+  std::string type = spec.substr(0, colon);
+  std::string rest = spec.substr(colon + 1);
+  if (type == "icmp") {
+    target->type = ProbeTarget::ICMP;
+  } else if (type == "tcp") {
+    target->type = ProbeTarget::TCP;
+  } else if (type == "dns") {
+    target->type = ProbeTarget::DNS;
+  } else if (type == "http") {
+    target->type = ProbeTarget::HTTP;
+  } else {
+    return invalid("unknown type " + type + ".");
+  }
+
+  target->weight = 1;
+  auto at = rest.rfind('@');
+  if (at != std::string::npos) {
+    long weight;
+    if (!ParseNumber(rest.substr(at + 1), 1, 1000, &weight)) {
+      return invalid("weight must be between 1 and 1000.");
+    }
+    target->weight = weight;
+    rest = rest.substr(0, at);
+  }
+
+  auto slash = rest.find('/');
+  target->path.clear();
+  if (slash != std::string::npos) {
+    target->path = rest.substr(slash);
+    rest = rest.substr(0, slash);
+  }
+  if (target->type == ProbeTarget::DNS) {
+    // The name does not start with a slash.
+    target->path = target->path.empty() ? kDefaultDnsName
+                                        : target->path.substr(1);
+  } else if (target->type == ProbeTarget::HTTP && target->path.empty()) {
+    target->path = kDefaultHttpPath;
+  } else if (!target->path.empty() && target->type != ProbeTarget::HTTP) {
+    return invalid("only HTTP and DNS targets have a path.");
+  }
+
+  // An IPv6 address followed by a port is in brackets, otherwise any second
+  // colon belongs to the address.
+  if (!rest.empty() && rest[0] == '[') {
+    auto bracket = rest.find(']');
+    if (bracket == std::string::npos ||
+        (bracket + 1 < rest.size() && rest[bracket + 1] != ':')) {
+      return invalid("bad brackets.");
+    }
+    target->address = rest.substr(1, bracket - 1);
+    colon = bracket + 1 < rest.size() ? bracket + 1 : std::string::npos;
+  } else {
+    colon = rest.find(':');
+    if (colon != std::string::npos &&
+        rest.find(':', colon + 1) != std::string::npos) {
+      colon = std::string::npos;
+    }
+    target->address = rest.substr(0, colon);
+  }
+  in6_addr address;
+  if (inet_pton(AF_INET, target->address.c_str(), &address) == 1) {
+    target->family = AF_INET;
+  } else if (inet_pton(AF_INET6, target->address.c_str(), &address) == 1) {
+    target->family = AF_INET6;
+  } else {
+    return invalid("address must be an IPv4 or IPv6 literal.");
+  }
+  target->port = 0;
+  if (colon != std::string::npos) {
+    long port;
+    if (target->type == ProbeTarget::ICMP ||
+        !ParseNumber(rest.substr(colon + 1), 1, 65535, &port)) {
+      return invalid("bad port.");
+    }
+    target->port = port;
+  } else if (target->type == ProbeTarget::TCP) {
+    return invalid("TCP targets need a port.");
+  } else if (target->type == ProbeTarget::DNS) {
+    target->port = kDefaultDnsPort;
+  } else if (target->type == ProbeTarget::HTTP) {
+    target->port = kDefaultHttpPort;
+  }
+  return Status::Ok();
+}
+}  // namespace
+
+ProbeResult MergeProbeResults(const std::vector<ProbeResult> &results) {
+  ProbeResult merged;
+  std::chrono::microseconds rtt_sum(0);
+  for (const auto &result : results) {
+    merged.sent += result.sent;
+    if (result.received == 0) {
+      continue;
+    }
+    merged.rtt_min = merged.received == 0
+                         ? result.rtt_min
+                         : std::min(merged.rtt_min, result.rtt_min);
+    merged.rtt_max = std::max(merged.rtt_max, result.rtt_max);
+    merged.received += result.received;
+    rtt_sum += result.rtt_avg * result.received;
+  }
+  if (merged.sent > 0) {
+    merged.packet_loss =
+        100.0 * (merged.sent - merged.received) / merged.sent;
+  }
+  if (merged.received > 0) {
+    merged.rtt_avg = rtt_sum / merged.received;
+  }
+  return merged;
+}
+
+Status ParseProbeTargets(const std::string &spec,
+                         std::vector<ProbeTarget> *targets) {
+  targets->clear();
+  size_t start = 0;
+  while (start <= spec.size()) {
+    auto end = spec.find(',', start);
+    if (end == std::string::npos) {
+      end = spec.size();
+    }
+    ProbeTarget target;
+    auto status = ParseProbeTarget(spec.substr(start, end - start), &target);
+    if (status.Error() != Status::OK) {
+      return status;
+    }
+    targets->push_back(target);
+    start = end + 1;
+  }
+  return Status::Ok();
+}
+
+std::string ProbeTargetAsString(const ProbeTarget &target) {
+  std::string ret;
+  // With a port, the address must be unambiguous.
+  std::string address = target.family == AF_INET6
+                            ? "[" + target.address + "]"
+                            : target.address;
+  switch (target.type) {
+    case ProbeTarget::ICMP:
+      ret = "icmp:" + target.address;
+      break;
+    case ProbeTarget::TCP:
+      ret = "tcp:" + address + ":" + std::to_string(target.port);
+      break;
+    case ProbeTarget::DNS:
+      ret = "dns:" + address + ":" + std::to_string(target.port) + "/" +
+            target.path;
+      break;
+    case ProbeTarget::HTTP:
+      ret = "http:" + address + ":" + std::to_string(target.port) +
+            target.path;
+      break;
+  }
+  if (target.weight != 1) {
+    ret += "@" + std::to_string(target.weight);
+  }
+  return ret;
+}
+
+}  // namespace net_failover_manager
@@ -0,0 +1,115 @@
+// This file is part of Net Failover Manager.
+//
+// Net Failover Manager is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Net Failover Manager is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Net Failover Manager.  If not, see
+// <https://www.gnu.org/licenses/>.
+
+// Health probes of an uplink: the targets they are sent to, the interface
+// implemented by each kind of probe, and the statistics they produce.
+
+#ifndef NET_FAILOVER_MANAGER_NETCTL_PROBER
+#define NET_FAILOVER_MANAGER_NETCTL_PROBER
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "src/lib/status.h"
+
+namespace net_failover_manager {
+
+// Aggregated results of a number of probes.
+typedef struct ProbeResult {
+  int sent = 0;
+  int received = 0;
+  // Percentage of probes that were not answered in time.
+  float packet_loss = 100;
+  // Round trip times, only meaningful if received > 0.
+  std::chrono::microseconds rtt_min{0};
+  std::chrono::microseconds rtt_avg{0};
+  std::chrono::microseconds rtt_max{0};
+  // Nothing was sent because the link of the interface is down.
+  bool link_down = false;
+
+  const std::string toString() const {
+    return std::to_string(sent) + " sent - " + std::to_string(received) +
+           " received - " + std::to_string(packet_loss) +
+           "% packet loss - rtt min/avg/max " +
+           std::to_string(rtt_min.count()) + "/" +
+           std::to_string(rtt_avg.count()) + "/" +
+           std::to_string(rtt_max.count()) + " us";
+  }
+} ProbeResult;
+
+// Combines the results of probes sent to different targets.
+ProbeResult MergeProbeResults(const std::vector<ProbeResult> &results);
+
+// Where and how to probe.
+typedef struct ProbeTarget {
+  typedef enum {
+    ICMP,  // Echo request.
+    TCP,   // Connection establishment, a reset counts as an answer.
+    DNS,   // Query for an A record, any answer counts.
+    HTTP,  // HEAD request, any response status counts.
+  } ProbeType;
+
+  ProbeType type;
+  // IPv4 or IPv6 address literal, without brackets. Names are not resolved,
+  // since the resolution would not go through the probed interface.
+  std::string address;
+  // AF_INET or AF_INET6, the family of address.
+  int family;
+  // Unused for ICMP.
+  uint16_t port;
+  // HTTP: request path. DNS: name to query.
+  std::string path;
+  // Relative importance of the target when the results are combined.
+  int weight;
+} ProbeTarget;
+
+// Parses a comma separated list of targets, each one in the form
+// "type:address[:port][/path][@weight]", for example
+// "icmp:8.8.8.8,tcp:1.1.1.1:443,dns:9.9.9.9/example.com,http:1.1.1.1/@2".
+// IPv6 addresses are written in brackets if a port follows, for example
+// "icmp:2001:4860:4860::8888,tcp:[2606:4700:4700::1111]:443". Default
+// ports are 53 for DNS and 80 for HTTP, TCP requires one. The default DNS
+// name is "example.com", the default HTTP path "/" and the default weight 1.
+Status ParseProbeTargets(const std::string &spec,
+                         std::vector<ProbeTarget> *targets);
+// Inverse of ParseProbeTargets for a single target.
+std::string ProbeTargetAsString(const ProbeTarget &target);
+
+// One kind of probe towards one target, through one interface. Probers are
+// driven by a ProbeReactor and must only be used from its thread.
+class Prober {
+ public:
+  // Called with the round trip time of an attempt, or nullopt if the attempt
+  // failed or timed out.
+  typedef std::function<void(std::optional<std::chrono::microseconds>)>
+      DoneCallback;
+
+  virtual ~Prober() {}
+
+  // Starts an attempt. `done` is called exactly once, from the reactor
+  // thread and never before this returns, at the latest `timeout` later.
+  // Returns false, without calling `done`, if nothing could be sent, e.g. if
+  // the interface does not exist.
+  virtual bool Probe(std::chrono::milliseconds timeout, DoneCallback done) = 0;
+};  // class Prober
+
+}  // namespace net_failover_manager
+
+#endif  // #ifndef NET_FAILOVER_MANAGER_NETCTL_PROBER
@@ -19,146 +19,71 @@
 #include <arpa/inet.h>
 #include <errno.h>
 #include <glog/logging.h>
-#include <net/route.h>
-#include <sys/ioctl.h>
+#include <ifaddrs.h>
+#include <linux/fib_rules.h>
+#include <net/if.h>
 #include <sys/socket.h>
 #include <sys/types.h>
-#include <boost/tokenizer.hpp>
-#include <fstream>
+#include <algorithm>
 #include <iostream>
 #include <string>
-#include <thread>
 #include <vector>
 
+#include "trace_log.h"
+
 namespace net_failover_manager {
 
 namespace {
-// Constants used to parse entries in the routing table.
-static const char *kRoutingTablePath = "/proc/net/route";
-static const int kIfNameOffset = 0;
-static const int kDstAddressOffset = 1;
-static const int kGwAddressOffset = 2;
-static const int kMetricOffset = 6;
 
+// Interval between full reads of the routing table when route events are not
+// available.
 static constexpr std::chrono::duration kCheckInterval = std::chrono::seconds(5);
-// Transforms an IP represented as a string representing an int into a boost
-// IP Address object. Currently only works for IPv4.
-boost::asio::ip::address MakeAddressFromIntAsStr(const std::string &s) {
-  char buf[INET_ADDRSTRLEN];
-  char *dummy;
-  uint32_t addr_int = strtol(s.c_str(), &dummy, 16);
-  in_addr address;
-  address.s_addr = addr_int;
-  return boost::asio::ip::make_address(
-      inet_ntop(AF_INET, &address, buf, sizeof(buf)));
-}
-
-// Checks if IPv4 address represents default route.
-bool isAnyV4Address(::boost::asio::ip::address addr) {
-  return addr == boost::asio::ip::address_v4::any();
+// Interval between full reads of the routing table when the table is kept in
+// sync through route events. Only a safety net.
+static constexpr std::chrono::duration kResyncInterval =
+    std::chrono::minutes(5);
+// Maximum time the kernel has to acknowledge route changes, or to answer a
+// dump of the routing table.
+static constexpr std::chrono::milliseconds kRouteChangeTimeout =
+    std::chrono::seconds(1);
+// Dumps interrupted by concurrent changes are retried this many times.
+static const int kMaxDumpAttempts = 3;
+
+const char *FamilyName(int family) {
+  return family == AF_INET6 ? "IPv6" : "IPv4";
 }
 
-// Configures a routing entry struct for a default route, that can then be
-// programmed with ioctl.
+// Appends to `request` a message that makes `gateway` the default route with
+// priority `metric`, taking the place of the default route that currently
+// has that priority. The replacement is atomic, there is no moment without a
+// route for that priority.
 //
 // Args:
-//   if_name : the name of the interface this route refers to.
-//   metric : the route priority (note that when checked through proc/net/route
-//            the actual value is metric + 1
-//   gw_addr : the address of the gateway
-//   route : a pointer to the struct that will be configured. All existing data
-//           will be erased.
-void ConfigureRoute(char *if_name, int metric, in_addr_t gw_addr,
-                    struct rtentry *route) {
-  memset(route, 0, sizeof(*route));
-
-  // Destination address for a default route is always 0.0.0.0
-  struct sockaddr_in *dst_sockaddr;
-  dst_sockaddr = (struct sockaddr_in *)&(route->rt_dst);
-  dst_sockaddr->sin_family = AF_INET;
-  dst_sockaddr->sin_addr.s_addr = INADDR_ANY;
-
-  // Default routes mask is always 0.0.0.0
-  struct sockaddr_in *rt_mask;
-  rt_mask = (struct sockaddr_in *)&(route->rt_genmask);
-  rt_mask->sin_family = AF_INET;
-  rt_mask->sin_addr.s_addr = INADDR_ANY;
-
-  // Destination GW must be reacheable from the selected interface
-  struct sockaddr_in *gw_sockaddr;
-  gw_sockaddr = (struct sockaddr_in *)&(route->rt_gateway);
-  gw_sockaddr->sin_family = AF_INET;
-  gw_sockaddr->sin_addr.s_addr = gw_addr;
-
-  // Metric represents the route priority. Lower numbers mean higher priority.
-  // The value set here will be displayed as metric+1 in /net/proc/route
-  route->rt_metric = metric;
-  route->rt_flags = RTF_UP | RTF_GATEWAY;
-  route->rt_dev = if_name;
-}
-
-// Converts an IP address (v4 or v6) into a string.
-// Args:
-//   sa : IP address to be converted.
-//   output : char* that will be filled with the IP string.
-//   maxlen : lenght of the char array passed in with output.
-void get_ip_str(const struct sockaddr *sa, char *output, size_t maxlen) {
-  switch (sa->sa_family) {
-    case AF_INET:
-      inet_ntop(AF_INET, &(((struct sockaddr_in *)sa)->sin_addr), output,
-                maxlen);
-      break;
-
-    case AF_INET6:
-      inet_ntop(AF_INET6, &(((struct sockaddr_in6 *)sa)->sin6_addr), output,
-                maxlen);
-      break;
-
-    default:
-      strncpy(output, "Unknown AF", maxlen);
-  }
-}
-
-std::ostream &operator<<(std::ostream &strm, rtentry route) {
-  char rt_dst_str[16];
-  char rt_gateway_str[16];
-  char rt_genmask_str[16];
-  get_ip_str(&route.rt_dst, rt_dst_str, /*maxlen=*/16);
-  get_ip_str(&route.rt_gateway, rt_gateway_str, /*maxlen=*/16);
-  get_ip_str(&route.rt_genmask, rt_genmask_str, /*maxlen=*/16);
-
-  strm << "Rt DST: " << rt_dst_str << " - Rt GW: " << rt_gateway_str
-       << " - Rt GenMask: " << rt_genmask_str
-       << " - Rt Metric: " << route.rt_metric << " - Rt dev " << route.rt_dev;
-  return strm;
-}
-
-bool AddRoute(struct rtentry &route) {
-  int fd;
-  fd = socket(AF_INET, SOCK_DGRAM, 0);
-  LOG(INFO) << "Adding route: " << route;
-
-  if (ioctl(fd, SIOCADDRT, &route) < 0) {
-    LOG(ERROR) << "Error while adding route for if: " << route.rt_dev
-               << " - error: " << strerror(errno);
-    return false;
+//   gateway : the routing entry of the gateway that will be used.
+//   metric : the route priority, as displayed in /proc/net/route.
+//   request : the batch the message will be appended to.
+Status AddReplaceDefaultRoute(const RouteManager::RoutingEntry &gateway,
+                              int metric, NetlinkRequest *request) {
+  if (gateway.if_index == 0) {
+    return Status(Status::NOT_FOUND,
+                  "Unknown interface " + std::string(gateway.if_name));
   }
-
-  LOG(INFO) << "Route added successfully";
-  return true;
-}
-
-bool DeleteRoute(struct rtentry &route) {
-  int fd;
-  fd = socket(AF_INET, SOCK_DGRAM, 0);
-  LOG(INFO) << "Deleting route: " << route;
-  if (ioctl(fd, SIOCDELRT, &route) < 0) {
-    LOG(ERROR) << "Error while deleting route for if: " << route.rt_dev
-               << " - error:" << strerror(errno);
-    return false;
+  auto *route = static_cast<rtmsg *>(
+      request->BeginMessage(RTM_NEWROUTE, NLM_F_REPLACE, sizeof(rtmsg)));
+  route->rtm_family = gateway.family;
+  route->rtm_dst_len = 0;
+  route->rtm_table = RT_TABLE_MAIN;
+  // Same protocol the routes added through ioctl used to have.
+  route->rtm_protocol = RTPROT_BOOT;
+  route->rtm_scope = gateway.HasGateway() ? RT_SCOPE_UNIVERSE : RT_SCOPE_LINK;
+  route->rtm_type = RTN_UNICAST;
+  // The kernel rejects an IPv6 gateway of ::, the interface is enough.
+  if (gateway.HasGateway()) {
+    request->AddAttribute(RTA_GATEWAY, &gateway.gw, gateway.AddressLen());
   }
-  LOG(INFO) << "Route deleted successfully";
-  return true;
+  request->AddAttribute<uint32_t>(RTA_OIF, gateway.if_index);
+  request->AddAttribute<uint32_t>(RTA_PRIORITY, metric);
+  return Status::Ok();
 }
 
 std::ostream &operator<<(std::ostream &strm,
@@ -178,178 +103,746 @@ std::ostream &operator<<(std::ostream &strm,
 RouteManager::RouteManager() : RouteManager(nullptr){};
 
 RouteManager::RouteManager(GwChangedCallback default_gw_changed_cb)
+    : RouteManager(default_gw_changed_cb,
+                   std::make_unique<KernelRouteTableSource>()) {}
+
+RouteManager::RouteManager(GwChangedCallback default_gw_changed_cb,
+                           std::unique_ptr<RouteTableSource> table_source)
     : checks_on_(false),
-      route_check_thread_(nullptr),
+      event_driven_(false),
+      last_table_hash_(0),
+      current_default_interface_(kNoInterface),
+      policy_primary_(kNoInterface),
+      events_socket_(NETLINK_ROUTE),
+      table_source_(std::move(table_source)),
+      request_socket_(NETLINK_ROUTE),
+      proc_sync_duration_(MetricsRegistry::Default()->GetHistogram(
+          "nfm_route_sync_duration_seconds",
+          "Time spent bringing the routing table up to date.",
+          LatencyBuckets(), {{"source", "proc"}})),
+      event_sync_duration_(MetricsRegistry::Default()->GetHistogram(
+          "nfm_route_sync_duration_seconds",
+          "Time spent bringing the routing table up to date.",
+          LatencyBuckets(), {{"source", "netlink"}})),
       default_gw_changed_cb_(default_gw_changed_cb){};
 
 void RouteManager::StartChecks() {
   std::unique_lock<std::mutex> lock(mutex_);
+  if (checks_on_) {
+    return;
+  }
   checks_on_ = true;
-  route_check_thread_ = std::make_unique<std::thread>([this] {
-    while (true) {
-      {
-        std::unique_lock<std::mutex> lock(mutex_);
-        if (!checks_on_) {
-          break;
-        }
-        SyncRoutingTable();
-        checks_loop_cond_.wait_for(lock, kCheckInterval,
-                                   [this] { return !checks_on_; });
-        if (!checks_on_) {
-          break;
+  // Subscribe before the first read, so that no change can be missed in
+  // between.
+  event_driven_ = events_socket_.Open().Error() == Status::OK &&
+                  events_socket_.JoinGroup(RTNLGRP_IPV4_ROUTE).Error() ==
+                      Status::OK &&
+                  events_socket_.JoinGroup(RTNLGRP_LINK).Error() ==
+                      Status::OK &&
+                  reactor_
+                          .WatchFd(events_socket_.fd(),
+                                   [this] { OnRouteEvents(); })
+                          .Error() == Status::OK;
+  if (!event_driven_) {
+    LOG(WARNING) << "Route events not available, polling the routing table.";
+    events_socket_.Close();
+  } else if (events_socket_.JoinGroup(RTNLGRP_IPV6_ROUTE).Error() !=
+             Status::OK) {
+    // E.g. IPv6 is disabled, the periodic resync still covers it.
+    LOG(WARNING) << "IPv6 route events not available.";
+  }
+  if (PolicyRoutingEnabled()) {
+    FlushPolicyRules();
+  }
+  SyncRoutingTable();
+  reactor_.ScheduleAt(std::chrono::steady_clock::now() +
+                          (event_driven_ ? kResyncInterval : kCheckInterval),
+                      [this] { Resync(); });
+  reactor_.Start();
+};
+
+void RouteManager::StopChecks() {
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (!checks_on_) {
+      return;
+    }
+    checks_on_ = false;
+  }
+  reactor_.Stop();
+  events_socket_.Close();
+}
+
+void RouteManager::Resync() {
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (!checks_on_) {
+      return;
+    }
+    SyncRoutingTable();
+  }
+  DLOG(INFO) << "=======\nRouting Table:\n=======";
+  DLOG(INFO) << GetRoutingTableAsStr();
+  reactor_.ScheduleAt(std::chrono::steady_clock::now() +
+                          (event_driven_ ? kResyncInterval : kCheckInterval),
+                      [this] { Resync(); });
+}
+
+void RouteManager::OnRouteEvents() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  auto started_at = std::chrono::steady_clock::now();
+  bool table_changed = false;
+  bool needs_resync = false;
+  bool overrun = false;
+  events_socket_.ReceiveMessages(
+      [this, &table_changed, &needs_resync](const nlmsghdr *message) {
+        switch (message->nlmsg_type) {
+          case RTM_NEWROUTE:
+          case RTM_DELROUTE:
+            table_changed |= ApplyRouteMessage(message);
+            break;
+          case RTM_NEWLINK:
+          case RTM_DELLINK: {
+            // The kernel removes the routes of a link that goes down without
+            // sending route events, the table must be read again.
+            auto *link = reinterpret_cast<const ifinfomsg *>(
+                NLMSG_DATA(message));
+            if (message->nlmsg_type == RTM_DELLINK ||
+                !(link->ifi_flags & IFF_UP)) {
+              needs_resync = true;
+            }
+          } break;
+          default:
+            break;
         }
-      }
-      DLOG(INFO) << "=======\nRouting Table:\n=======";
-      DLOG(INFO) << GetRoutingTableAsStr();
+      },
+      &overrun);
+  if (overrun || needs_resync) {
+    DLOG(INFO) << "Reading routing table after link change or lost events.";
+    SyncRoutingTable();
+  } else if (table_changed) {
+    OnRoutingTableChanged();
+  }
+  event_sync_duration_->Observe(std::chrono::duration<double>(
+                                    std::chrono::steady_clock::now() -
+                                    started_at)
+                                    .count());
+}
+
+bool RouteManager::ApplyRouteMessage(const nlmsghdr *message) {
+  // Lock must be held by caller.
+  RoutingEntry entry;
+  // Resolved here rather than by the store, so that it is logged by name.
+  if (!ParseRouteMessage(message, &entry) ||
+      !routes_.ResolveInterface(&entry)) {
+    return false;
+  }
+  // IPv4 changes make the next read of /proc/net/route differ from the
+  // table.
+  bool ipv4 = entry.family == AF_INET;
+
+  if (message->nlmsg_type == RTM_DELROUTE) {
+    if (!routes_.Remove(entry)) {
+      return false;
     }
-  });
-};
+    DLOG(INFO) << "Route removed: " << entry;
+    if (ipv4) {
+      last_table_hash_ = 0;
+    }
+    return true;
+  }
+  RoutingEntry replaced;
+  if ((message->nlmsg_flags & NLM_F_REPLACE) &&
+      routes_.Replace(entry, &replaced)) {
+    // The new entry has taken the place of the one with the same key.
+    DLOG(INFO) << "Route replaced: " << replaced << " by " << entry;
+    if (ipv4) {
+      last_table_hash_ = 0;
+    }
+    return true;
+  }
+  if (!routes_.Add(entry)) {
+    return false;
+  }
+  DLOG(INFO) << "Route added: " << entry;
+  if (ipv4) {
+    last_table_hash_ = 0;
+  }
+  return true;
+}
 
 const std::string RouteManager::GetRoutingTableAsStr() const {
   std::string ret;
   std::unique_lock<std::mutex> lock(mutex_);
-  for (const auto &entry : routing_entries_) {
+  routes_.ForEachEntry([&ret](const RoutingEntry &entry) {
     ret.append(entry.toString());
     ret.append("\n");
-  }
+  });
   return ret;
 };
 
 Status RouteManager::SetDefaultGw(const std::string &new_gw_name) {
+  // Only the managed interfaces are interned. The others are refused even
+  // with a default route, their health is unknown.
+  auto new_gw = InterfaceRegistry::Default()->Find(new_gw_name);
+  if (new_gw == kNoInterface) {
+    return Status(Status::NOT_FOUND,
+                  "Interface " + new_gw_name + " is not a managed interface.");
+  }
+  return SetDefaultGw(new_gw);
+}
+
+Status RouteManager::SetDefaultGw(InterfaceId new_gw) {
+  const auto &new_gw_name = InterfaceName(new_gw);
   // Step 1 locate current interface in list of default gws
   // The entire operation should be atomic.
   std::unique_lock<std::mutex> lock(mutex_);
-  std::vector<RoutingEntry> gateways;
-  for (const auto &entry : routing_entries_) {
-    if (isAnyV4Address(entry.dst)) {
-      gateways.push_back(entry);
+  if (PolicyRoutingEnabled()) {
+    if (policy_primary_ == new_gw) {
+      return Status(Status::NO_OP,
+                    "Interface " + new_gw_name + " was already default.");
     }
+    auto has_policy_route = [this](int if_index) {
+      return std::any_of(policy_routes_.begin(), policy_routes_.end(),
+                         [if_index](const PolicyRoute &x) {
+                           return x.if_index == if_index;
+                         });
+    };
+    int if_index = ResolveIfIndex(new_gw, has_policy_route);
+    if (if_index == 0 || !has_policy_route(if_index)) {
+      return Status(Status::NOT_FOUND, "Interface " + new_gw_name +
+                                           " does not have a routing entry.");
+    }
+    DLOG(INFO) << "Switching the primary rule from "
+               << InterfaceName(policy_primary_) << " to " << new_gw_name;
+    auto previous_primary = policy_primary_;
+    policy_primary_ = new_gw;
+    auto status = SyncPolicyRouting();
+    if (status.Error() != Status::OK) {
+      policy_primary_ = previous_primary;
+      return status;
+    }
+    DetectPrimaryDefaultGwInterface();
+    return Status::Ok();
   }
-  std::sort(gateways.begin(), gateways.end());
-  LOG(INFO) << "Current order of gateways:";
-  for (const auto &gw : gateways) {
-    LOG(INFO) << gw.if_name;
+  int new_gw_index = ResolveIfIndex(new_gw, [this](int if_index) {
+    for (int family : {AF_INET, AF_INET6}) {
+      if (routes_.DefaultRoute(family, if_index, multipath_metric_)) {
+        return true;
+      }
+    }
+    return false;
+  });
+  // The swaps of both families are sent in a single batch.
+  NetlinkRequest request;
+  bool any_gateway = false;
+  bool found = false;
+  for (int family : {AF_INET, AF_INET6}) {
+    // The multipath route is not a gateway of its own.
+    const RoutingEntry *primary =
+        routes_.PrimaryDefaultRoute(family, multipath_metric_);
+    if (primary == nullptr) {
+      continue;
+    }
+    any_gateway = true;
+    // Debug only: this runs on every switch, which is traced as
+    // GATEWAY_SWITCH.
+    DLOG(INFO) << "Current order of " << FamilyName(family) << " gateways:";
+    for (const auto &gw : routes_.DefaultRoutesOf(family)) {
+      if (gw.first != multipath_metric_) {
+        DLOG(INFO) << gw.second.if_name;
+      }
+    }
+    const RoutingEntry *new_gw_routing_entry =
+        routes_.DefaultRoute(family, new_gw_index, multipath_metric_);
+    if (new_gw_routing_entry == nullptr) {
+      // E.g. an IPv4 only uplink on a dual stack host.
+      continue;
+    }
+    found = true;
+    if (primary->if_index == new_gw_routing_entry->if_index) {
+      DLOG(INFO) << "Interface " << new_gw_name << " is already the default "
+                 << FamilyName(family) << " GW";
+      continue;
+    }
+
+    if (new_gw_routing_entry->metric == primary->metric) {
+      LOG(ERROR) << "Gateways " << new_gw_name << " and " << primary->if_name
+                 << " have the same metric, they cannot be swapped.";
+      return Status(Status::INVALID_ARGUMENTS,
+                    "Default routes with the same metric.");
+    }
+
+    // The two default routes swap priorities. Both messages are sent in a
+    // single batch and each one replaces the route holding that priority,
+    // so a default route exists at every moment: first the new gateway
+    // takes the primary priority, then the old gateway takes the priority
+    // that the new gateway had.
+    DLOG(INFO) << "Reprogramming Network Routes: " << *new_gw_routing_entry
+               << " becomes primary, " << *primary << " becomes secondary.";
+    auto status = AddReplaceDefaultRoute(*new_gw_routing_entry,
+                                         primary->metric, &request);
+    if (status.Error() == Status::OK) {
+      status = AddReplaceDefaultRoute(*primary, new_gw_routing_entry->metric,
+                                      &request);
+    }
+    if (status.Error() != Status::OK) {
+      LOG(ERROR) << "Could not build route change: " << status.ErrorMessage();
+      return status;
+    }
   }
-  if (gateways.empty()) {
+  if (!any_gateway) {
     LOG(WARNING) << "There are no default gateways.";
     return Status(Status::NOT_FOUND, "There are no default gateways");
   }
-  if (gateways[0].if_name == new_gw_name) {
-    LOG(INFO) << "Interface " << new_gw_name << " is already the default GW";
-    return Status(Status::NO_OP,
-                  "Interface " + new_gw_name + " was already default.");
-  }
-
-  auto new_gw_routing_entry = std::find_if(
-      gateways.begin(), gateways.end(), [&new_gw_name](const RoutingEntry &x) {
-        return x.if_name == new_gw_name;
-      });
-  if (new_gw_routing_entry == gateways.end()) {
+  if (!found) {
     LOG(WARNING) << "Interface " << new_gw_name
                  << " does not have a routing entry.";
     return Status(Status::NOT_FOUND, "Interface " + new_gw_name +
                                          " does not have a routing entry.");
   }
+  if (request.MessageCount() == 0) {
+    return Status(Status::NO_OP,
+                  "Interface " + new_gw_name + " was already default.");
+  }
+  auto status = SendRouteRequest(&request);
+  if (status.Error() != Status::OK) {
+    return status;
+  }
+  DLOG(INFO) << "Reprogramming done";
 
-  LOG(INFO) << "DELETE: " << *new_gw_routing_entry;
-  LOG(INFO) << "DELETE: " << gateways[0];
-
-  struct rtentry old_route_for_old_gw;
-  struct rtentry old_route_for_new_gw;
-  struct rtentry new_route_for_old_gw;
-  struct rtentry new_route_for_new_gw;
-  int current_new_gw_metric = new_gw_routing_entry->metric + 1;
-  int current_default_gw_metric = gateways[0].metric + 1;
-  char *default_gw_if = const_cast<char *>(gateways[0].if_name.c_str());
-  char *new_gw_if = const_cast<char *>(new_gw_routing_entry->if_name.c_str());
-  in_addr_t current_gw_addr = inet_addr(gateways[0].gw.to_string().c_str());
-  in_addr_t new_gw_addr =
-      inet_addr(new_gw_routing_entry->gw.to_string().c_str());
-
-  ConfigureRoute(default_gw_if, current_default_gw_metric, current_gw_addr,
-                 &old_route_for_old_gw);
-  ConfigureRoute(new_gw_if, current_new_gw_metric, new_gw_addr,
-                 &old_route_for_new_gw);
-
-  ConfigureRoute(default_gw_if, current_new_gw_metric, current_gw_addr,
-                 &new_route_for_old_gw);
-  ConfigureRoute(new_gw_if, current_default_gw_metric, new_gw_addr,
-                 &new_route_for_new_gw);
-
-  LOG(INFO) << "Reprogramming Network Routes";
-  if (!DeleteRoute(old_route_for_new_gw)) {
-    return Status(Status::UNKNOWN_ERROR,
-                  "Could not delete old route for new gw");
+  return Status::Ok();
+}
+
+Status RouteManager::SetMultipathDefaultGw(
+    const std::vector<Nexthop> &nexthops, int metric) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (multipath_metric_.has_value() && multipath_metric_.value() != metric) {
+    return Status(Status::INVALID_ARGUMENTS,
+                  "A multipath route already exists with metric " +
+                      std::to_string(multipath_metric_.value()));
+  }
+  NetlinkRequest request;
+  std::string description;
+  std::unordered_set<int> families;
+  for (int family : {AF_INET, AF_INET6}) {
+    bool installed = false;
+    auto status = AddMultipathRouteChange(family, nexthops, metric, &request,
+                                          &description, &installed);
+    if (status.Error() != Status::OK && status.Error() != Status::NO_OP) {
+      return status;
+    }
+    if (installed) {
+      families.insert(family);
+    }
+  }
+  if (request.MessageCount() == 0) {
+    multipath_families_.clear();
+    multipath_metric_.reset();
+    return Status(Status::NO_OP, "No multipath route to change.");
+  }
+  LOG(INFO) << "Programming the multipath default route:" << description;
+  auto status = SendRouteRequest(&request);
+  if (status.Error() != Status::OK) {
+    return status;
+  }
+  multipath_families_ = families;
+  if (families.empty()) {
+    multipath_metric_.reset();
+  } else {
+    multipath_metric_ = metric;
+  }
+  if (PolicyRoutingEnabled()) {
+    // The primary rule gives way to the multipath route, or comes back.
+    SyncPolicyRouting();
+  }
+  return Status::Ok();
+}
+
+Status RouteManager::AddMultipathRouteChange(
+    int family, const std::vector<Nexthop> &nexthops, int metric,
+    NetlinkRequest *request, std::string *description, bool *installed) {
+  // Lock must be held by caller.
+  bool existing = false;
+  auto same_metric = routes_.DefaultRoutesOf(family).equal_range(metric);
+  for (auto entry = same_metric.first; entry != same_metric.second; ++entry) {
+    if (multipath_families_.count(family) == 0) {
+      // It would be replaced.
+      return Status(Status::INVALID_ARGUMENTS,
+                    "Metric " + std::to_string(metric) +
+                        " is used by the default route of " +
+                        entry->second.if_name);
+    }
+    existing = true;
+  }
+  std::vector<std::pair<const RoutingEntry *, int>> gateways;
+  auto has_default_route = [this, family, metric](int if_index) {
+    return routes_.DefaultRoute(family, if_index, metric) != nullptr;
+  };
+  for (const auto &nexthop : nexthops) {
+    const RoutingEntry *gateway = routes_.DefaultRoute(
+        family, ResolveIfIndex(nexthop.if_id, has_default_route), metric);
+    if (gateway == nullptr) {
+      DLOG(INFO) << "Interface " << InterfaceName(nexthop.if_id)
+                 << " does not have an " << FamilyName(family)
+                 << " routing entry, not used.";
+      continue;
+    }
+    if (family == AF_INET6 && !gateway->HasGateway()) {
+      // The kernel only accepts IPv6 nexthops with a gateway.
+      DLOG(INFO) << "Interface " << InterfaceName(nexthop.if_id)
+                 << " has no IPv6 gateway, not used.";
+      continue;
+    }
+    if (gateway->metric < metric) {
+      return Status(Status::INVALID_ARGUMENTS,
+                    "Default route of " + InterfaceName(nexthop.if_id) +
+                        " has a lower metric than the multipath route.");
+    }
+    gateways.emplace_back(gateway, std::clamp(nexthop.weight, 1, 256));
+  }
+
+  if (gateways.empty()) {
+    if (!existing) {
+      return Status(Status::NO_OP, "No multipath route to remove.");
+    }
+    auto *route = static_cast<rtmsg *>(
+        request->BeginMessage(RTM_DELROUTE, 0, sizeof(rtmsg)));
+    route->rtm_family = family;
+    route->rtm_table = RT_TABLE_MAIN;
+    route->rtm_scope = RT_SCOPE_NOWHERE;
+    request->AddAttribute<uint32_t>(RTA_PRIORITY, metric);
+    *description += std::string(" ") + FamilyName(family) + " removed";
+    return Status::Ok();
+  }
+  // Replacing the whole route adds and removes nexthops in one step, the
+  // default route never disappears.
+  auto *route = static_cast<rtmsg *>(request->BeginMessage(
+      RTM_NEWROUTE, NLM_F_CREATE | NLM_F_REPLACE, sizeof(rtmsg)));
+  route->rtm_family = family;
+  route->rtm_dst_len = 0;
+  route->rtm_table = RT_TABLE_MAIN;
+  route->rtm_protocol = RTPROT_BOOT;
+  route->rtm_scope = RT_SCOPE_UNIVERSE;
+  route->rtm_type = RTN_UNICAST;
+  request->AddAttribute<uint32_t>(RTA_PRIORITY, metric);
+  size_t multipath = request->BeginNested(RTA_MULTIPATH);
+  *description += std::string(" ") + FamilyName(family) + ":";
+  for (const auto &gateway : gateways) {
+    rtnexthop nexthop = {};
+    nexthop.rtnh_hops = gateway.second - 1;
+    nexthop.rtnh_ifindex = gateway.first->if_index;
+    size_t offset = request->Append(&nexthop, sizeof(nexthop));
+    if (gateway.first->HasGateway()) {
+      request->AddAttribute(RTA_GATEWAY, &gateway.first->gw,
+                            gateway.first->AddressLen());
+    }
+    reinterpret_cast<rtnexthop *>(request->At(offset))->rtnh_len =
+        request->Buffer().size() - offset;
+    *description += " " + std::string(gateway.first->if_name) + "@" +
+                    std::to_string(gateway.second);
+  }
+  request->EndNested(multipath);
+  *installed = true;
+  return Status::Ok();
+}
+
+Status RouteManager::SendRouteRequest(NetlinkRequest *request) {
+  // Lock must be held by caller.
+  if (request_socket_.fd() < 0) {
+    auto status = request_socket_.Open();
+    if (status.Error() != Status::OK) {
+      return status;
+    }
+  }
+  auto status = request_socket_.Transact(request, kRouteChangeTimeout);
+  if (status.Error() != Status::OK) {
+    LOG(ERROR) << "Route change failed: " << status.ErrorMessage();
+  }
+  return status;
+}
+
+Status RouteManager::SyncPolicyRouting() {
+  // Lock must be held by caller.
+  ifaddrs *addresses = nullptr;
+  if (getifaddrs(&addresses) < 0) {
+    LOG(WARNING) << "Could not list the interface addresses: "
+                 << strerror(errno);
+    addresses = nullptr;
+  }
+  std::vector<PolicyRoute> routes;
+  std::vector<PolicyRule> rules;
+  // Interface of the preferred default route of the main table, IPv4 first.
+  InterfaceId main_primary = kNoInterface;
+  int main_primary_index = 0;
+  for (int family : {AF_INET, AF_INET6}) {
+    const RoutingEntry *primary =
+        routes_.PrimaryDefaultRoute(family, multipath_metric_);
+    if (primary == nullptr) {
+      continue;
+    }
+    if (main_primary_index == 0) {
+      main_primary = InterfaceRegistry::Default()->Find(primary->if_name);
+      main_primary_index = primary->if_index;
+    }
+    for (const auto &entry : routes_.DefaultRoutesOf(family)) {
+      if (entry.first == multipath_metric_) {
+        continue;
+      }
+      const RoutingEntry *gateway = &entry.second;
+      int if_index = gateway->if_index;
+      uint32_t table = PolicyTable(if_index);
+      if (if_index == 0 ||
+          std::any_of(routes.begin(), routes.end(),
+                      [family, table](const PolicyRoute &x) {
+                        return x.family == family && x.table == table;
+                      })) {
+        // Only the preferred default route of an interface is copied.
+        continue;
+      }
+      routes.push_back({family, table, if_index, gateway->gw});
+      PolicyRule fwmark_rule = {};
+      fwmark_rule.family = family;
+      fwmark_rule.priority = PolicyRulePriority(FWMARK_RULES);
+      fwmark_rule.table = table;
+      fwmark_rule.fwmark = PolicyFwmark(if_index);
+      rules.push_back(fwmark_rule);
+      for (auto *address = addresses; address != nullptr;
+           address = address->ifa_next) {
+        if (address->ifa_addr == nullptr ||
+            address->ifa_addr->sa_family != family ||
+            strcmp(address->ifa_name, gateway->if_name) != 0) {
+          continue;
+        }
+        PolicyRule source_rule = {};
+        source_rule.family = family;
+        source_rule.priority = PolicyRulePriority(SOURCE_RULES);
+        source_rule.table = table;
+        if (family == AF_INET) {
+          memcpy(&source_rule.src,
+                 &reinterpret_cast<sockaddr_in *>(address->ifa_addr)->sin_addr,
+                 sizeof(in_addr));
+          source_rule.src_len = 32;
+        } else {
+          source_rule.src =
+              reinterpret_cast<sockaddr_in6 *>(address->ifa_addr)->sin6_addr;
+          source_rule.src_len = 128;
+          if (IN6_IS_ADDR_LINKLOCAL(&source_rule.src)) {
+            // Link local traffic never needs a gateway.
+            continue;
+          }
+        }
+        rules.push_back(source_rule);
+      }
+    }
+    PolicyRule connected_rule = {};
+    connected_rule.family = family;
+    connected_rule.priority = PolicyRulePriority(CONNECTED_RULE);
+    connected_rule.table = RT_TABLE_MAIN;
+    connected_rule.suppress_default = true;
+    rules.push_back(connected_rule);
+  }
+  if (addresses != nullptr) {
+    freeifaddrs(addresses);
+  }
+
+  auto has_policy_route = [&routes](int if_index) {
+    return std::any_of(routes.begin(), routes.end(),
+                       [if_index](const PolicyRoute &x) {
+                         return x.if_index == if_index;
+                       });
   };
-  if (!DeleteRoute(old_route_for_old_gw)) {
-    return Status(Status::UNKNOWN_ERROR,
-                  "Could not delete old route for old gw");
+  int primary_index = ResolveIfIndex(policy_primary_, has_policy_route);
+  if (policy_primary_ == kNoInterface || !has_policy_route(primary_index)) {
+    // First run, or the primary interface lost its default routes.
+    if (policy_primary_ != main_primary) {
+      LOG(INFO) << "Policy routing primary interface is now "
+                << InterfaceName(main_primary);
+    }
+    policy_primary_ = main_primary;
+    primary_index = main_primary_index;
   }
-  // Regardless of the success of each operation, we should try to add both
-  // routes.
-  bool res_add_old = AddRoute(new_route_for_old_gw);
-  bool res_add_new = AddRoute(new_route_for_new_gw);
-  if (!res_add_old || !res_add_new) {
-    return Status(Status::UNKNOWN_ERROR,
-                  "Could not successfuly add one of the routes.");
+  // The multipath route of the main table, if any, replaces the primary
+  // interface.
+  if (!multipath_metric_.has_value()) {
+    for (const auto &route : routes) {
+      if (route.if_index != primary_index) {
+        continue;
+      }
+      PolicyRule primary_rule = {};
+      primary_rule.family = route.family;
+      primary_rule.priority = PolicyRulePriority(PRIMARY_RULE);
+      primary_rule.table = route.table;
+      rules.push_back(primary_rule);
+    }
   }
-  LOG(INFO) << "Reprogramming done";
 
+  // Everything is added before anything is removed. The new primary rule
+  // goes after the old one, which has the same priority, so the old one is
+  // used until its removal and there is no window without a primary rule.
+  NetlinkRequest additions;
+  NetlinkRequest removals;
+  for (const auto &route : routes) {
+    if (std::find(policy_routes_.begin(), policy_routes_.end(), route) ==
+        policy_routes_.end()) {
+      AddPolicyRouteMessage(RTM_NEWROUTE, route, &additions);
+    }
+  }
+  for (const auto &route : policy_routes_) {
+    if (std::none_of(routes.begin(), routes.end(),
+                     [&route](const PolicyRoute &x) {
+                       return x.family == route.family &&
+                              x.table == route.table;
+                     })) {
+      AddPolicyRouteMessage(RTM_DELROUTE, route, &removals);
+    }
+  }
+  for (const auto &rule : rules) {
+    if (std::find(policy_rules_.begin(), policy_rules_.end(), rule) ==
+        policy_rules_.end()) {
+      AddPolicyRuleMessage(RTM_NEWRULE, rule, &additions);
+    }
+  }
+  for (const auto &rule : policy_rules_) {
+    if (std::find(rules.begin(), rules.end(), rule) == rules.end()) {
+      AddPolicyRuleMessage(RTM_DELRULE, rule, &removals);
+    }
+  }
+  if (additions.MessageCount() > 0) {
+    auto status = SendRouteRequest(&additions);
+    if (status.Error() != Status::OK) {
+      // Some rules may have been added, start again from scratch at the
+      // next change.
+      FlushPolicyRules();
+      policy_routes_.clear();
+      return status;
+    }
+  }
+  if (removals.MessageCount() > 0) {
+    // The kernel removes by itself the routes of the interfaces that go
+    // down.
+    auto status = request_socket_.Transact(&removals, kRouteChangeTimeout);
+    if (status.Error() != Status::OK && status.Error() != Status::NOT_FOUND) {
+      LOG(ERROR) << "Policy routing cleanup failed: "
+                 << status.ErrorMessage();
+    }
+  }
+  if (additions.MessageCount() > 0 || removals.MessageCount() > 0) {
+    DLOG(INFO) << "Policy routing updated: " << routes.size() << " tables, "
+               << rules.size() << " rules.";
+  }
+  policy_routes_ = routes;
+  policy_rules_ = rules;
   return Status::Ok();
 }
 
+void RouteManager::FlushPolicyRules() {
+  // Lock must be held by caller.
+  policy_rules_.clear();
+  if (request_socket_.fd() < 0 &&
+      request_socket_.Open().Error() != Status::OK) {
+    return;
+  }
+  NetlinkRequest deletions;
+  for (int family : {AF_INET, AF_INET6}) {
+    NetlinkRequest request;
+    auto *header = static_cast<fib_rule_hdr *>(
+        request.BeginMessage(RTM_GETRULE, 0, sizeof(fib_rule_hdr)));
+    header->family = family;
+    request_socket_.Dump(
+        &request,
+        [&deletions](const nlmsghdr *message) {
+          uint32_t priority = 0;
+          NetlinkSocket::ForEachAttribute(
+              message, sizeof(fib_rule_hdr), [&priority](const rtattr *x) {
+                if (x->rta_type == FRA_PRIORITY) {
+                  priority = *reinterpret_cast<const uint32_t *>(RTA_DATA(x));
+                }
+              });
+          if (priority < PolicyRulePriority(FWMARK_RULES) ||
+              priority >= PolicyRulePriority(RULE_KINDS)) {
+            return;
+          }
+          // A rule is removed by sending it back.
+          size_t len = message->nlmsg_len - NLMSG_HDRLEN;
+          memcpy(deletions.BeginMessage(RTM_DELRULE, 0, len),
+                 NLMSG_DATA(message), len);
+        },
+        kRouteChangeTimeout);
+  }
+  if (deletions.MessageCount() > 0) {
+    LOG(INFO) << "Removing " << deletions.MessageCount()
+              << " policy routing rules.";
+    SendRouteRequest(&deletions);
+  }
+}
+
 bool RouteManager::SyncRoutingTable() {
   // Lock must be held by caller.
-  routing_entries_.clear();
-  // Read routing table to vector of strings
-  std::ifstream route_in(kRoutingTablePath);
-  if (!route_in) {
-    LOG(ERROR) << "Could not open path " << kRoutingTablePath;
+  auto started_at = std::chrono::steady_clock::now();
+  bool changed = SyncIpv4Table();
+  changed |= SyncIpv6Table();
+  if (changed) {
+    OnRoutingTableChanged();
+  }
+  proc_sync_duration_->Observe(std::chrono::duration<double>(
+                                   std::chrono::steady_clock::now() -
+                                   started_at)
+                                   .count());
+  return true;
+}
+
+bool RouteManager::SyncIpv4Table() {
+  // Lock must be held by caller.
+  size_t len = 0;
+  auto status = table_source_->ReadIpv4Table(&proc_buffer_, &len);
+  if (status.Error() != Status::OK) {
+    LOG(ERROR) << status.ErrorMessage();
+    return false;
+  }
+  uint64_t hash = HashContent(proc_buffer_.data(), len);
+  if (hash == last_table_hash_) {
+    // Nothing changed since the last rebuild.
     return false;
   }
-  std::vector<std::string> routing_lines;
-  std::string line;
-  // Skip first line, it's headers.
-  std::getline(route_in, line);
-  while (std::getline(route_in, line)) {
-    // Empty lines shouldn not happen, but just in case.
-    if (line.size() > 0) {
-      routing_lines.push_back(line);
-    }
-  }
-  route_in.close();
-  typedef boost::tokenizer<boost::char_separator<char>> tokenizer;
-  boost::char_separator<char> sep{"\t"};
-  for (auto line : routing_lines) {
-    RoutingEntry new_entry;
-    line.erase(std::remove(line.begin(), line.end(), '\n'), line.end());
-    tokenizer tok{line, sep};
-    int count = 0;
-    for (const auto &t : tok) {
-      switch (count) {
-        case kIfNameOffset:
-          new_entry.if_name = t;
-          break;
-        case kDstAddressOffset:
-          new_entry.dst = MakeAddressFromIntAsStr(t);
-          break;
-        case kGwAddressOffset:
-          new_entry.gw = MakeAddressFromIntAsStr(t);
-          break;
-        case kMetricOffset:
-          new_entry.metric = stoi(t);
-          break;
-        default:
-          break;
+  last_table_hash_ = hash;
+  scratch_entries_.clear();
+  ParseRouteTable(proc_buffer_.data(), len, &scratch_entries_);
+  return routes_.ReplaceFamily(AF_INET, scratch_entries_);
+}
+
+bool RouteManager::SyncIpv6Table() {
+  // Lock must be held by caller.
+  auto status = Status(Status::UNKNOWN_ERROR, "No dump attempted.");
+  for (int attempt = 0; attempt < kMaxDumpAttempts; attempt++) {
+    scratch_entries_.clear();
+    status = table_source_->DumpIpv6Routes([this](const nlmsghdr *message) {
+      RoutingEntry entry;
+      if (ParseRouteMessage(message, &entry)) {
+        scratch_entries_.push_back(entry);
       }
-      count++;
+    });
+    if (status.Error() == Status::OK) {
+      break;
     }
-    routing_entries_.push_back(new_entry);
   }
+  if (status.Error() != Status::OK) {
+    // The IPv6 part of the table is kept as it is.
+    LOG_EVERY_N(WARNING, 100) << "Could not read the IPv6 routing table: "
+                              << status.ErrorMessage();
+    return false;
+  }
+
+  return routes_.ReplaceFamily(AF_INET6, scratch_entries_);
+}
+
+void RouteManager::OnRoutingTableChanged() {
+  // Lock must be held by caller.
   auto missing_gateways = DetectMissingGateways();
-  if (!missing_gateways.empty()) {
-    for (auto entry : missing_gateways) {
-      LOG(WARNING) << "Missing expected gateway from routing table:" << entry;
+  for (size_t if_id = 0; if_id < InterfaceRegistry::kMaxInterfaces; ++if_id) {
+    if (missing_gateways.test(if_id)) {
+      LOG(WARNING) << "Missing expected gateway from routing table:"
+                   << InterfaceName(if_id);
       // TODO(crepric): debug why this happens and figure out if we need to
       // re-run dhcp here, or if we should let it be handled with the other
       // GW changes logic. The problem is if the interface somehow goes
@@ -357,58 +850,76 @@ bool RouteManager::SyncRoutingTable() {
       // shouldn't happen.
     }
   }
+  if (PolicyRoutingEnabled()) {
+    SyncPolicyRouting();
+  }
   DetectPrimaryDefaultGwInterface();
-  return true;
 }
 
-const std::unordered_set<std::string> RouteManager::DetectMissingGateways() {
-  // Mutex must be locked by caller.
-  std::unordered_set<std::string> ret = known_gateway_interfaces_;
-  for (const auto &entry : routing_entries_) {
-    if (isAnyV4Address(entry.dst)) {
-      DLOG(INFO) << "Inserting known gateway " << entry.if_name;
-      known_gateway_interfaces_.insert(entry.if_name);
-      ret.erase(entry.if_name);
+std::vector<InterfaceId> RouteManager::KnownGatewayInterfaces() const {
+  std::unique_lock<std::mutex> lock(mutex_);
+  std::vector<InterfaceId> ret;
+  for (size_t if_id = 0; if_id < InterfaceRegistry::kMaxInterfaces; ++if_id) {
+    if (known_gateway_interfaces_.test(if_id)) {
+      ret.push_back(if_id);
     }
   }
   return ret;
 }
 
-const std::string &RouteManager::DetectPrimaryDefaultGwInterface() {
-  // Mutex must be locked by caller.
-  int min_metric = INT_MAX;  // Lower priority number means higher priority.
-  std::string ret;
-  for (const auto &entry : routing_entries_) {
-    if (entry.metric >= min_metric) {
-      continue;
-    }
-    if (isAnyV4Address(entry.dst)) {
-      if (entry.metric == min_metric) {
-        // This shouldn't happen.
-        LOG(ERROR) << "Two default routes with the same metric. Second one is: "
-                   << entry;
-      }
-      min_metric = entry.metric;
-      ret = entry.if_name;
+void RouteManager::RestoreKnownGatewayInterfaces(
+    const std::vector<InterfaceId> &interfaces) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  for (auto if_id : interfaces) {
+    if (if_id != kNoInterface) {
+      known_gateway_interfaces_.set(if_id);
     }
   }
-  if (ret != current_default_interface_) {
+}
+
+InterfaceSet RouteManager::DetectMissingGateways() {
+  // Mutex must be locked by caller.
+  return FindMissingGateways(routes_, InterfaceRegistry::Default(),
+                             &known_gateway_interfaces_);
+}
+
+InterfaceId RouteManager::DetectPrimaryDefaultGwInterface() {
+  // Mutex must be locked by caller.
+  const RoutingEntry *primary = routes_.PrimaryDefaultRoute();
+  // Interfaces the daemon does not manage are not interned, they would fill
+  // the registry. Their default routes are reported as kNoInterface.
+  InterfaceId ret =
+      primary != nullptr ? InterfaceRegistry::Default()->Find(primary->if_name)
+                         : kNoInterface;
+  if (PolicyRoutingEnabled() && policy_primary_ != kNoInterface &&
+      !multipath_metric_.has_value()) {
+    // The main table is not what decides.
+    ret = policy_primary_;
+  }
+  auto current = current_default_interface_.load(std::memory_order_relaxed);
+  if (ret != current) {
     LOG(INFO) << "Default interface has changed from "
-              << current_default_interface_ << " to: " << ret;
-    current_default_interface_ = ret;
+              << InterfaceName(current) << " to: " << InterfaceName(ret);
+    TraceLog::Default()->Record(TraceLog::GATEWAY_DETECTED, ret,
+                                std::chrono::nanoseconds(0), current);
+    current_default_interface_.store(ret, std::memory_order_release);
     std::unique_lock<std::mutex> cb_lock(cb_mutex_);
     if (default_gw_changed_cb_) {
       DLOG(INFO) << "Calling gw change callback.";
-      auto cb = std::bind(default_gw_changed_cb_, current_default_interface_);
-      // FIXME: if two changes happen very close to each other, they may be
-      // scheduled in reverse order. This shouldn't happen since only one change
-      // per check can happem and they are spaced off by several seconds, but an
-      // event queue is a better solution.
-      auto t = std::thread(cb);
-      t.detach();
+      default_gw_changed_cb_(ret);
     }
   }
-  return current_default_interface_;
+  return ret;
+}
+
+int RouteManager::ResolveIfIndex(InterfaceId if_id,
+                                 const std::function<bool(int)> &usable) {
+  auto *registry = InterfaceRegistry::Default();
+  int if_index = registry->IfIndex(if_id);
+  if (if_index != 0 && usable(if_index)) {
+    return if_index;
+  }
+  return TracedRefresh(registry, if_id);
 }
 
 }  // namespace net_failover_manager
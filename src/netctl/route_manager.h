@@ -14,86 +14,121 @@
 // along with Net Failover Manager.  If not, see
 // <https://www.gnu.org/licenses/>.
 
-// Monitors the system routing table periodically, checks for the highest
-// priority default gateway, and optionally triggers a callback if default gw
-// has changed.
+// Monitors the system routing table, checks for the highest priority default
+// gateway, and optionally triggers a callback if default gw has changed.
+// Both IPv4 and IPv6 routes are tracked. Changes are received as rtnetlink
+// events, a periodic full read of the routing table is kept as a safety net.
 
 #ifndef NET_FAILOVER_MANAGER_NETCTL_ROUTE_MANAGER
 #define NET_FAILOVER_MANAGER_NETCTL_ROUTE_MANAGER
 
-#include <boost/asio/ip/address.hpp>
-#include <condition_variable>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <string.h>
+
+#include <atomic>
+#include <cstdint>
 #include <functional>
 #include <iostream>
+#include <memory>
+#include <optional>
 #include <string>
-#include <thread>
+#include <mutex>
 #include <unordered_set>
+#include <vector>
+#include "interface_registry.h"
+#include "netlink_socket.h"
+#include "policy_routing.h"
+#include "probe_reactor.h"
+#include "route_table.h"
+#include "src/lib/metrics.h"
 #include "src/lib/status.h"
 
 namespace net_failover_manager {
 
 class RouteManager {
  public:
-  // Holds relevant details for each routing entry.
-  typedef struct RoutingEntry {
-    std::string if_name;
-    boost::asio::ip::address dst;
-    boost::asio::ip::address gw;
-    int metric;
-
-    const std::string toString() const {
-      return "If: " + if_name + " - Dst: " + dst.to_string() +
-             " - Gw: " + gw.to_string() +
-             " - Metric: " + std::to_string(metric);
-    }
+  typedef net_failover_manager::RoutingEntry RoutingEntry;
 
-    bool operator<(const struct RoutingEntry &other) const {
-      return (metric < other.metric);
-    }
+  // One interface of a multipath default route.
+  typedef struct Nexthop {
+    InterfaceId if_id;
+    // Relative share of the traffic, from 1 to 256.
+    int weight;
 
-  } RoutingEntry;
+    bool operator==(const struct Nexthop &other) const {
+      return if_id == other.if_id && weight == other.weight;
+    }
+  } Nexthop;
 
   // Callback gets called if default gateway is changed. It will always be
   // called at least once at the beginning of execution when the routing table
-  // is read for the first time.
-  typedef std::function<void(const std::string &)> GwChangedCallback;
+  // is read for the first time, with kNoInterface if there is no default
+  // route. It runs with internal locks held, so it must return quickly and
+  // must not call back into this object.
+  typedef std::function<void(InterfaceId)> GwChangedCallback;
 
   // Default constructor does not specify a callback.
   RouteManager();
   // Callback must outlive this object.
   explicit RouteManager(GwChangedCallback default_gw_changed_cb);
-  virtual ~RouteManager() {
-    StopChecks();
-    // FIXME: not thread safe.
-    route_check_thread_->join();
-  };
+  // Reads the routing table from `table_source` instead of the kernel. Route
+  // events are still received from the kernel.
+  RouteManager(GwChangedCallback default_gw_changed_cb,
+               std::unique_ptr<RouteTableSource> table_source);
+  virtual ~RouteManager() { StopChecks(); };
 
   void RegisterGwChangedCb(GwChangedCallback default_gw_changed_cb) {
     std::unique_lock<std::mutex> lock(cb_mutex_);
     default_gw_changed_cb_ = default_gw_changed_cb;
   }
 
-  // Start/Stop periodic reads of the routing table and notifies callback of
-  // default gw changes if a callback is specified.
+  // Start/Stop monitoring the routing table and notifies callback of
+  // default gw changes if a callback is specified. The table is read once
+  // before StartChecks returns.
   // Acquire lock.
   void StartChecks();
-  void StopChecks() {
-    std::unique_lock<std::mutex> lock(mutex_);
-    checks_on_ = false;
-    checks_loop_cond_.notify_all();
-  }
+  void StopChecks();
 
   // Returns a string representing the routing table, one line for each entry.
   // Acquires lock.
   const std::string GetRoutingTableAsStr() const;
-  std::optional<std::string> PrimaryDefaultGwInterface() const {
-    return current_default_interface_;
+  // Interface of the preferred IPv4 default route, or of the preferred IPv6
+  // one on hosts without IPv4 default routes, kNoInterface if there is none
+  // or if its interface is not in the registry. Never blocks.
+  InterfaceId PrimaryDefaultGwInterface() const {
+    return current_default_interface_.load(std::memory_order_acquire);
   }
 
+  // Interfaces that have had a default route since the start, or since the
+  // last run if restored. Acquires lock.
+  std::vector<InterfaceId> KnownGatewayInterfaces() const;
+  // Adds interfaces known from a previous run, so that a gateway that
+  // disappeared meanwhile is reported. Acquires lock.
+  void RestoreKnownGatewayInterfaces(
+      const std::vector<InterfaceId> &interfaces);
+
   // Reorganizes the entries of the existing gateway interfaces so that the
-  // one specified in the argument becomes the preferred one.
+  // one specified in the argument becomes the preferred one, for each
+  // address family in which the interface has a default route. The change is
+  // applied with a single rtnetlink request, and there is no window without
+  // a default route. In policy routing mode only the rule pointing to the
+  // table of the primary interface changes, the main table is left alone.
+  Status SetDefaultGw(InterfaceId new_gw);
+  // Same, NOT_FOUND if `new_gw_name` is not a managed interface.
   Status SetDefaultGw(const std::string &new_gw_name);
 
+  // Installs, in each address family, a single default route with priority
+  // `metric` that spreads the traffic over `nexthops`, each one through the
+  // gateway of the default route of its interface. An existing multipath
+  // route is replaced atomically, an empty list removes it. `metric` must be
+  // lower than, and different from, the metrics of the default routes of the
+  // interfaces. Interfaces without a default route in a family are skipped
+  // in that family.
+  Status SetMultipathDefaultGw(const std::vector<Nexthop> &nexthops,
+                               int metric);
+
  protected:
   // Delete copy and move constructors.
   RouteManager(const RouteManager &) = delete;
@@ -101,27 +136,96 @@ class RouteManager {
 
  private:
   // These functions Must be called with lock held.
+  // Reads both routing tables, see below.
   bool SyncRoutingTable();
+  // Reads /proc/net/route, through table_source_, and replaces the IPv4
+  // routes of routes_, unless the content of the file has not changed since
+  // the last read. Returns true if the table has changed.
+  bool SyncIpv4Table();
+  // Dumps the IPv6 routes, through table_source_, and replaces the IPv6
+  // routes of routes_. /proc/net/ipv6_route is not used since it mixes the
+  // routes of all the tables. Returns true if the table has changed.
+  bool SyncIpv6Table();
   // Compares the routing table with the list of interfaces that are expected
   // to have an entry, and reports if an entry has disappeared.
-  const std::unordered_set<std::string> DetectMissingGateways();
-  const std::string &DetectPrimaryDefaultGwInterface();
+  InterfaceSet DetectMissingGateways();
+  InterfaceId DetectPrimaryDefaultGwInterface();
+  // Kernel index of an interface. The cached index of the registry is
+  // resolved again if `usable` rejects it, in case the interface was
+  // recreated since.
+  int ResolveIfIndex(InterfaceId if_id,
+                     const std::function<bool(int)> &usable);
+  // Runs the checks that follow any change of routes_.
+  void OnRoutingTableChanged();
+  // Applies a RTM_NEWROUTE/RTM_DELROUTE message to routes_. Returns
+  // true if the table has changed.
+  bool ApplyRouteMessage(const nlmsghdr *message);
+  // Appends to `request` the change of the multipath route of `family`, and
+  // sets `installed` if the route exists in that family after the change.
+  // Returns NO_OP if there is nothing to change in that family.
+  Status AddMultipathRouteChange(int family,
+                                 const std::vector<Nexthop> &nexthops,
+                                 int metric, NetlinkRequest *request,
+                                 std::string *description, bool *installed);
+
+  // Sends route changes on request_socket_, opening it if needed.
+  Status SendRouteRequest(NetlinkRequest *request);
+
+  // Policy routing, see policy_routing.h. Brings the tables and rules in
+  // line with the default routes of the main table and policy_primary_.
+  Status SyncPolicyRouting();
+  // Removes the rules left by a previous run.
+  void FlushPolicyRules();
+
+  // Run on the reactor thread. Acquire lock.
+  void OnRouteEvents();
+  void Resync();
 
   mutable std::mutex mutex_;
-  mutable std::condition_variable checks_loop_cond_;
   bool checks_on_;
+  // False if the netlink subscription failed and the table is polled.
+  bool event_driven_;
 
   // Stores the current entries for the routing table. Protected by mutex_.
-  std::vector<RoutingEntry> routing_entries_;
+  RouteStore routes_;
+  // Scratch space for the full reads of the table. Protected by mutex_.
+  std::vector<RoutingEntry> scratch_entries_;
+  // Content of /proc/net/route, reused across reads. Protected by mutex_.
+  std::vector<char> proc_buffer_;
+  // Hash of the content of /proc/net/route at the last replacement of the
+  // IPv4 routes, reset when route events change the table. Protected by
+  // mutex_.
+  uint64_t last_table_hash_;
   // Highest priority (lowest number in the routing table) route for
-  // a default Gateway. Protected by mutex_.
-  std::string current_default_interface_;
+  // a default Gateway, see PrimaryDefaultGwInterface. Written with mutex_
+  // held.
+  std::atomic<InterfaceId> current_default_interface_;
   // List of all known default gateways, used to track the disappearance of
-  // an entry and restore it if necessary.
-  std::unordered_set<std::string> known_gateway_interfaces_;
-  // Stores the thread that periodically reads the routing table and keeps it in
-  // sync.
-  std::unique_ptr<std::thread> route_check_thread_;
+  // an entry and restore it if necessary. Protected by mutex_.
+  InterfaceSet known_gateway_interfaces_;
+  // Metric of the multipath default route installed by
+  // SetMultipathDefaultGw, if any, and the address families in which it is
+  // installed. Protected by mutex_.
+  std::optional<int> multipath_metric_;
+  std::unordered_set<int> multipath_families_;
+  // Policy routing: the interface whose table is used by default, and the
+  // routes and rules installed. Protected by mutex_.
+  InterfaceId policy_primary_;
+  std::vector<PolicyRoute> policy_routes_;
+  std::vector<PolicyRule> policy_rules_;
+  // Receives route and link change events.
+  NetlinkSocket events_socket_;
+  // Where the whole table is read from. Protected by mutex_.
+  std::unique_ptr<RouteTableSource> table_source_;
+  // Used to program routes and to dump the policy rules, kept open across
+  // changes. Protected by mutex_.
+  NetlinkSocket request_socket_;
+  // Runs the event handling and the periodic resync.
+  ProbeReactor reactor_;
+  // Time spent reading the whole table from /proc, and handling a batch of
+  // netlink events.
+  Histogram *proc_sync_duration_;
+  Histogram *event_sync_duration_;
   // If set, this callback is called every time a default gateway interface
   // changes.
   mutable std::mutex cb_mutex_;  // Dedicated mutex to avoid lock inversion.
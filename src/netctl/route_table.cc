@@ -0,0 +1,543 @@
+// This file is part of Net Failover Manager.
+//
+// Net Failover Manager is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Net Failover Manager is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Net Failover Manager.  If not, see
+// <https://www.gnu.org/licenses/>.
+
+#include "route_table.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <glog/logging.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <climits>
+
+#include "trace_log.h"
+
+namespace net_failover_manager {
+
+namespace {
+// Constants used to parse entries in the routing table.
+static const int kIfNameOffset = 0;
+static const int kDstAddressOffset = 1;
+static const int kGwAddressOffset = 2;
+static const int kMetricOffset = 6;
+static const int kMaskOffset = 7;
+// Enough for a few hundred entries, grows as needed.
+static const size_t kInitialProcBufferSize = 16384;
+// Maximum time the kernel has to answer a dump of the routing table.
+static constexpr std::chrono::milliseconds kDumpTimeout =
+    std::chrono::seconds(1);
+
+// Reads an IPv4 or IPv6 address from a netlink attribute.
+in6_addr AddressFromAttribute(const rtattr *attribute) {
+  in6_addr address = {};
+  memcpy(&address, RTA_DATA(attribute),
+         std::min<size_t>(RTA_PAYLOAD(attribute), sizeof(address)));
+  return address;
+}
+
+// Parses an hexadecimal field, advancing `p` past it.
+uint32_t ParseHexField(const char *&p, const char *end) {
+  uint32_t value = 0;
+  for (; p < end; p++) {
+    char c = *p;
+    if (c >= '0' && c <= '9') {
+      value = (value << 4) | (c - '0');
+    } else if (c >= 'A' && c <= 'F') {
+      value = (value << 4) | (c - 'A' + 10);
+    } else if (c >= 'a' && c <= 'f') {
+      value = (value << 4) | (c - 'a' + 10);
+    } else {
+      break;
+    }
+  }
+  return value;
+}
+
+// Parses a decimal field, advancing `p` past it.
+int ParseDecimalField(const char *&p, const char *end) {
+  int value = 0;
+  for (; p < end && *p >= '0' && *p <= '9'; p++) {
+    value = value * 10 + (*p - '0');
+  }
+  return value;
+}
+}  // namespace
+
+// Addresses are printed as the hexadecimal value of the in memory
+// representation, so they can be stored as they are.
+bool ParseRouteLine(const char *begin, const char *end, RoutingEntry *entry) {
+  const char *p = begin;
+  int field = 0;
+  entry->family = AF_INET;
+  while (p < end) {
+    const char *field_start = p;
+    switch (field) {
+      case kIfNameOffset: {
+        while (p < end && *p != '\t') {
+          p++;
+        }
+        size_t len = p - field_start;
+        if (len == 0 || len >= sizeof(entry->if_name)) {
+          return false;
+        }
+        memcpy(entry->if_name, field_start, len);
+        entry->if_name[len] = '\0';
+      } break;
+      case kDstAddressOffset: {
+        uint32_t dst = ParseHexField(p, end);
+        memcpy(&entry->dst, &dst, sizeof(dst));
+      } break;
+      case kGwAddressOffset: {
+        uint32_t gw = ParseHexField(p, end);
+        memcpy(&entry->gw, &gw, sizeof(gw));
+      } break;
+      case kMetricOffset:
+        entry->metric = ParseDecimalField(p, end);
+        break;
+      case kMaskOffset:
+        entry->prefix_len = __builtin_popcount(ParseHexField(p, end));
+        break;
+      default:
+        break;
+    }
+    // Skips what is left of the field and the separator.
+    while (p < end && *p != '\t') {
+      p++;
+    }
+    while (p < end && (*p == '\t' || *p == ' ')) {
+      p++;
+    }
+    field++;
+  }
+  return field > kMaskOffset;
+}
+
+size_t ParseRouteTable(const char *data, size_t len,
+                       std::vector<RoutingEntry> *entries) {
+  size_t parsed = 0;
+  const char *end = data + len;
+  // Skip first line, it's headers.
+  const char *line = static_cast<const char *>(memchr(data, '\n', len));
+  while (line != nullptr && ++line < end) {
+    const char *line_end =
+        static_cast<const char *>(memchr(line, '\n', end - line));
+    if (line_end == nullptr) {
+      line_end = end;
+    }
+    RoutingEntry new_entry = {};
+    if (ParseRouteLine(line, line_end, &new_entry)) {
+      entries->push_back(new_entry);
+      parsed++;
+    } else if (line_end > line) {
+      LOG(WARNING) << "Malformed routing table line: "
+                   << std::string(line, line_end);
+    }
+    line = line_end;
+  }
+  return parsed;
+}
+
+bool ParseRouteMessage(const nlmsghdr *message, RoutingEntry *entry) {
+  if (message->nlmsg_len < NLMSG_LENGTH(sizeof(rtmsg))) {
+    return false;
+  }
+  auto *route = reinterpret_cast<const rtmsg *>(NLMSG_DATA(message));
+  if ((route->rtm_family != AF_INET && route->rtm_family != AF_INET6) ||
+      route->rtm_type != RTN_UNICAST || (route->rtm_flags & RTM_F_CLONED)) {
+    return false;
+  }
+  uint32_t table = route->rtm_table;
+  int oif = 0;
+  *entry = {};
+  entry->family = route->rtm_family;
+  entry->prefix_len = route->rtm_dst_len;
+  NetlinkSocket::ForEachAttribute(
+      message, sizeof(rtmsg), [&](const rtattr *attribute) {
+        switch (attribute->rta_type) {
+          case RTA_TABLE:
+            table = *reinterpret_cast<const uint32_t *>(RTA_DATA(attribute));
+            break;
+          case RTA_DST:
+            entry->dst = AddressFromAttribute(attribute);
+            break;
+          case RTA_GATEWAY:
+            entry->gw = AddressFromAttribute(attribute);
+            break;
+          case RTA_OIF:
+            oif = *reinterpret_cast<const int *>(RTA_DATA(attribute));
+            break;
+          case RTA_PRIORITY:
+            entry->metric =
+                *reinterpret_cast<const uint32_t *>(RTA_DATA(attribute));
+            break;
+          case RTA_MULTIPATH: {
+            // Tracked through its first nexthop, like /proc/net/route does.
+            auto *nexthop =
+                reinterpret_cast<const rtnexthop *>(RTA_DATA(attribute));
+            if (RTA_PAYLOAD(attribute) < sizeof(rtnexthop) ||
+                nexthop->rtnh_len < sizeof(rtnexthop) ||
+                nexthop->rtnh_len > RTA_PAYLOAD(attribute)) {
+              break;
+            }
+            oif = nexthop->rtnh_ifindex;
+            int len = nexthop->rtnh_len - RTNH_LENGTH(0);
+            for (auto *nested = RTNH_DATA(nexthop); RTA_OK(nested, len);
+                 nested = RTA_NEXT(nested, len)) {
+              if (nested->rta_type == RTA_GATEWAY) {
+                entry->gw = AddressFromAttribute(nested);
+              }
+            }
+          } break;
+          default:
+            break;
+        }
+      });
+  entry->if_index = oif;
+  return table == RT_TABLE_MAIN && oif != 0;
+}
+
+uint64_t HashContent(const char *data, size_t len) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < len; i++) {
+    hash ^= static_cast<uint8_t>(data[i]);
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+bool RouteStore::ReplaceFamily(int family,
+                               const std::vector<RoutingEntry> &entries) {
+  if (family == AF_INET) {
+    // Interfaces may have been recreated with another index since.
+    if_indexes_.clear();
+    if_names_.clear();
+  }
+  new_defaults_.clear();
+  new_others_.clear();
+  for (const auto &entry : entries) {
+    if (entry.IsDefault()) {
+      new_defaults_.push_back(entry);
+      if (!ResolveInterface(&new_defaults_.back())) {
+        new_defaults_.pop_back();
+      }
+    } else {
+      // Only listed, the index is not needed.
+      new_others_.push_back(entry);
+      if (!ResolveName(&new_others_.back())) {
+        new_others_.pop_back();
+      }
+    }
+  }
+  std::stable_sort(new_defaults_.begin(), new_defaults_.end());
+  FamilyRoutes &routes = Family(family);
+  bool defaults_changed = !std::equal(
+      new_defaults_.begin(), new_defaults_.end(), routes.defaults.begin(),
+      routes.defaults.end(),
+      [](const RoutingEntry &a, const DefaultRoutes::value_type &b) {
+        return a == b.second && a.if_index == b.second.if_index;
+      });
+  bool others_changed = new_others_ != routes.others;
+  if (others_changed) {
+    // The previous routes are kept as scratch space for the next time.
+    routes.others.swap(new_others_);
+  }
+  if (defaults_changed) {
+    routes.defaults.clear();
+    routes.defaults_by_if.clear();
+    for (const auto &entry : new_defaults_) {
+      AddDefault(&routes, entry);
+    }
+  }
+  return defaults_changed || others_changed;
+}
+
+bool RouteStore::Add(const RoutingEntry &entry) {
+  FamilyRoutes &routes = Family(entry.family);
+  RoutingEntry new_entry = entry;
+  if (!ResolveInterface(&new_entry)) {
+    return false;
+  }
+  if (!entry.IsDefault()) {
+    if (std::find(routes.others.begin(), routes.others.end(), new_entry) !=
+        routes.others.end()) {
+      return false;
+    }
+    routes.others.push_back(new_entry);
+    return true;
+  }
+  auto range = routes.defaults.equal_range(entry.metric);
+  for (auto it = range.first; it != range.second; ++it) {
+    if (it->second == new_entry) {
+      return false;
+    }
+  }
+  AddDefault(&routes, new_entry);
+  return true;
+}
+
+bool RouteStore::Remove(const RoutingEntry &entry) {
+  FamilyRoutes &routes = Family(entry.family);
+  RoutingEntry old_entry = entry;
+  if (!ResolveInterface(&old_entry)) {
+    return false;
+  }
+  if (!entry.IsDefault()) {
+    auto existing =
+        std::find(routes.others.begin(), routes.others.end(), old_entry);
+    if (existing == routes.others.end()) {
+      return false;
+    }
+    routes.others.erase(existing);
+    return true;
+  }
+  auto range = routes.defaults.equal_range(entry.metric);
+  for (auto it = range.first; it != range.second; ++it) {
+    if (it->second == old_entry) {
+      EraseDefault(&routes, it);
+      return true;
+    }
+  }
+  return false;
+}
+
+bool RouteStore::Replace(const RoutingEntry &entry, RoutingEntry *replaced) {
+  FamilyRoutes &routes = Family(entry.family);
+  RoutingEntry new_entry = entry;
+  if (!ResolveInterface(&new_entry)) {
+    return false;
+  }
+  if (!entry.IsDefault()) {
+    auto existing = std::find_if(
+        routes.others.begin(), routes.others.end(),
+        [&entry](const RoutingEntry &x) {
+          return memcmp(&x.dst, &entry.dst, sizeof(x.dst)) == 0 &&
+                 x.prefix_len == entry.prefix_len && x.metric == entry.metric;
+        });
+    if (existing == routes.others.end()) {
+      return false;
+    }
+    *replaced = *existing;
+    *existing = new_entry;
+    return true;
+  }
+  auto existing = routes.defaults.find(entry.metric);
+  if (existing == routes.defaults.end()) {
+    return false;
+  }
+  *replaced = existing->second;
+  EraseDefault(&routes, existing);
+  AddDefault(&routes, new_entry);
+  return true;
+}
+
+const RoutingEntry *RouteStore::PrimaryDefaultRoute() const {
+  const RoutingEntry *ret = PrimaryDefaultRoute(AF_INET);
+  return ret != nullptr ? ret : PrimaryDefaultRoute(AF_INET6);
+}
+
+const RoutingEntry *RouteStore::PrimaryDefaultRoute(
+    int family, std::optional<int> excluded_metric) const {
+  for (const auto &entry : Family(family).defaults) {
+    if (entry.first != excluded_metric) {
+      return &entry.second;
+    }
+  }
+  return nullptr;
+}
+
+const RoutingEntry *RouteStore::DefaultRoute(
+    int family, int if_index, std::optional<int> excluded_metric) const {
+  if (if_index == 0) {
+    return nullptr;
+  }
+  const RoutingEntry *ret = nullptr;
+  auto range = Family(family).defaults_by_if.equal_range(if_index);
+  for (auto it = range.first; it != range.second; ++it) {
+    const RoutingEntry &entry = it->second->second;
+    if (entry.metric != excluded_metric &&
+        (ret == nullptr || entry.metric < ret->metric)) {
+      ret = &entry;
+    }
+  }
+  return ret;
+}
+
+void RouteStore::ForEachEntry(
+    const std::function<void(const RoutingEntry &)> &handler) const {
+  for (const auto &routes : families_) {
+    for (const auto &entry : routes.defaults) {
+      handler(entry.second);
+    }
+    for (const auto &entry : routes.others) {
+      handler(entry);
+    }
+  }
+}
+
+size_t RouteStore::size() const {
+  size_t ret = 0;
+  for (const auto &routes : families_) {
+    ret += routes.defaults.size() + routes.others.size();
+  }
+  return ret;
+}
+
+int RouteStore::IfIndex(const char *if_name) {
+  // Interface names always fit in the inline buffer of std::string.
+  std::string name(if_name);
+  auto known = if_indexes_.find(name);
+  if (known != if_indexes_.end()) {
+    return known->second;
+  }
+  int if_index = TracedIfNameToIndex(if_name);
+  if (if_index != 0) {
+    if_names_.emplace(if_index, name);
+    if_indexes_.emplace(std::move(name), if_index);
+  }
+  return if_index;
+}
+
+bool RouteStore::ResolveInterface(RoutingEntry *entry) {
+  if (!ResolveName(entry)) {
+    return false;
+  }
+  if (entry->if_index == 0) {
+    entry->if_index = IfIndex(entry->if_name);
+  }
+  return true;
+}
+
+bool RouteStore::ResolveName(RoutingEntry *entry) {
+  if (entry->if_name[0] != '\0') {
+    return true;
+  }
+  auto known = if_names_.find(entry->if_index);
+  if (known != if_names_.end()) {
+    memcpy(entry->if_name, known->second.c_str(), known->second.size() + 1);
+    return true;
+  }
+  if (TracedIfIndexToName(entry->if_index, entry->if_name) == nullptr) {
+    return false;
+  }
+  // Names already known keep their index.
+  if_names_.emplace(entry->if_index, entry->if_name);
+  if_indexes_.emplace(entry->if_name, entry->if_index);
+  return true;
+}
+
+void RouteStore::AddDefault(FamilyRoutes *routes, const RoutingEntry &entry) {
+  auto it = routes->defaults.emplace(entry.metric, entry);
+  routes->defaults_by_if.emplace(entry.if_index, it);
+}
+
+void RouteStore::EraseDefault(FamilyRoutes *routes,
+                              DefaultRoutes::iterator it) {
+  auto range = routes->defaults_by_if.equal_range(it->second.if_index);
+  for (auto by_if = range.first; by_if != range.second; ++by_if) {
+    if (by_if->second == it) {
+      routes->defaults_by_if.erase(by_if);
+      break;
+    }
+  }
+  routes->defaults.erase(it);
+}
+
+InterfaceSet FindMissingGateways(const RouteStore &routes,
+                                 const InterfaceRegistry *registry,
+                                 InterfaceSet *known) {
+  InterfaceSet present;
+  for (int family : {AF_INET, AF_INET6}) {
+    for (const auto &entry : routes.DefaultRoutesOf(family)) {
+      auto if_id = registry->Find(entry.second.if_name);
+      if (if_id != kNoInterface) {
+        present.set(if_id);
+      }
+    }
+  }
+  *known |= present;
+  return *known & ~present;
+}
+
+KernelRouteTableSource::KernelRouteTableSource(const std::string &ipv4_path)
+    : ipv4_path_(ipv4_path), socket_(NETLINK_ROUTE) {}
+
+Status KernelRouteTableSource::ReadIpv4Table(std::vector<char> *buffer,
+                                             size_t *len) {
+  int fd = open(ipv4_path_.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return Status(Status::NOT_FOUND, "Could not open path " + ipv4_path_);
+  }
+  if (buffer->empty()) {
+    buffer->resize(kInitialProcBufferSize);
+  }
+  *len = 0;
+  while (true) {
+    if (*len == buffer->size()) {
+      buffer->resize(buffer->size() * 2);
+    }
+    ssize_t ret = read(fd, buffer->data() + *len, buffer->size() - *len);
+    if (ret < 0 && errno == EINTR) {
+      continue;
+    }
+    if (ret <= 0) {
+      break;
+    }
+    *len += ret;
+  }
+  close(fd);
+  return Status::Ok();
+}
+
+Status KernelRouteTableSource::DumpIpv6Routes(
+    const NetlinkSocket::MessageHandler &handler) {
+  if (socket_.fd() < 0) {
+    auto status = socket_.Open();
+    if (status.Error() != Status::OK) {
+      return status;
+    }
+  }
+  NetlinkRequest request;
+  auto *route = static_cast<rtmsg *>(
+      request.BeginMessage(RTM_GETROUTE, 0, sizeof(rtmsg)));
+  route->rtm_family = AF_INET6;
+  return socket_.Dump(&request, handler, kDumpTimeout);
+}
+
+Status RecordedRouteTableSource::ReadIpv4Table(std::vector<char> *buffer,
+                                               size_t *len) {
+  if (buffer->size() < ipv4_table_.size()) {
+    buffer->resize(ipv4_table_.size());
+  }
+  memcpy(buffer->data(), ipv4_table_.data(), ipv4_table_.size());
+  *len = ipv4_table_.size();
+  return Status::Ok();
+}
+
+Status RecordedRouteTableSource::DumpIpv6Routes(
+    const NetlinkSocket::MessageHandler &handler) {
+  int len = ipv6_dump_.size();
+  for (auto *message = reinterpret_cast<const nlmsghdr *>(ipv6_dump_.data());
+       NLMSG_OK(message, len); message = NLMSG_NEXT(message, len)) {
+    if (message->nlmsg_type == NLMSG_DONE) {
+      break;
+    }
+    handler(message);
+  }
+  return Status::Ok();
+}
+
+}  // namespace net_failover_manager
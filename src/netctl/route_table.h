@@ -0,0 +1,266 @@
+// This file is part of Net Failover Manager.
+//
+// Net Failover Manager is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Net Failover Manager is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Net Failover Manager.  If not, see
+// <https://www.gnu.org/licenses/>.
+
+// Parsing of the routing table, from /proc/net/route or rtnetlink, fed by a
+// RouteTableSource so that recorded tables can be used in place of the
+// kernel ones, and the store the parsed routes are indexed in.
+
+#ifndef NET_FAILOVER_MANAGER_NETCTL_ROUTE_TABLE
+#define NET_FAILOVER_MANAGER_NETCTL_ROUTE_TABLE
+
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <string.h>
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "interface_registry.h"
+#include "netlink_socket.h"
+#include "src/lib/status.h"
+
+namespace net_failover_manager {
+
+// Holds relevant details for each routing entry. Plain data, so that the
+// table can be rebuilt without heap allocations.
+typedef struct RoutingEntry {
+  // NUL terminated. Empty until resolved for the entries read from
+  // rtnetlink, see RouteStore::ResolveInterface.
+  char if_name[IF_NAMESIZE];
+  // Index of the interface, 0 until resolved for the entries read from
+  // /proc/net/route.
+  int if_index;
+  // AF_INET or AF_INET6.
+  int family;
+  // Addresses in network byte order. IPv4 addresses only use the first 4
+  // bytes, the rest is zero.
+  in6_addr dst;
+  in6_addr gw;
+  int prefix_len;
+  int metric;
+
+  bool IsDefault() const {
+    return IN6_IS_ADDR_UNSPECIFIED(&dst) && prefix_len == 0;
+  }
+
+  // False for the routes through point to point links, e.g.
+  // `default dev wg0`.
+  bool HasGateway() const { return !IN6_IS_ADDR_UNSPECIFIED(&gw); }
+
+  // Size of the addresses of the family.
+  size_t AddressLen() const {
+    return family == AF_INET6 ? sizeof(in6_addr) : sizeof(in_addr);
+  }
+
+  const std::string toString() const {
+    char dst_str[INET6_ADDRSTRLEN];
+    char gw_str[INET6_ADDRSTRLEN];
+    inet_ntop(family, &dst, dst_str, sizeof(dst_str));
+    inet_ntop(family, &gw, gw_str, sizeof(gw_str));
+    return "If: " + std::string(if_name) + " - Dst: " + dst_str + "/" +
+           std::to_string(prefix_len) + " - Gw: " + gw_str +
+           " - Metric: " + std::to_string(metric);
+  }
+
+  bool operator==(const struct RoutingEntry &other) const {
+    return strncmp(if_name, other.if_name, sizeof(if_name)) == 0 &&
+           family == other.family &&
+           memcmp(&dst, &other.dst, sizeof(dst)) == 0 &&
+           prefix_len == other.prefix_len &&
+           memcmp(&gw, &other.gw, sizeof(gw)) == 0 && metric == other.metric;
+  }
+
+  bool operator<(const struct RoutingEntry &other) const {
+    return (metric < other.metric);
+  }
+
+} RoutingEntry;
+
+// Parses one line of /proc/net/route, between `begin` and `end` (excluded),
+// into `entry`. Returns false if the line is malformed.
+bool ParseRouteLine(const char *begin, const char *end, RoutingEntry *entry);
+// Appends the entries of the whole content of /proc/net/route, header line
+// included, to `entries`. Malformed lines are logged and skipped. Returns the
+// number of entries appended.
+size_t ParseRouteTable(const char *data, size_t len,
+                       std::vector<RoutingEntry> *entries);
+// Parses a RTM_NEWROUTE/RTM_DELROUTE message into `entry`, leaving its
+// if_name empty. Returns false for the routes that are not tracked: only the
+// unicast routes of the main table are, like in /proc/net/route.
+bool ParseRouteMessage(const nlmsghdr *message, RoutingEntry *entry);
+// FNV-1a hash, used to detect whether the routing table has changed.
+uint64_t HashContent(const char *data, size_t len);
+
+// The routes of the main table. Default routes, the only ones that matter
+// to the gateway selection, are kept ordered by metric and indexed by
+// interface index. The other routes are only kept to be listed. Not thread
+// safe.
+class RouteStore {
+ public:
+  // Default routes of a family, by increasing metric. Routes with the same
+  // metric are kept in the order they were added.
+  typedef std::multimap<int, RoutingEntry> DefaultRoutes;
+
+  RouteStore() {}
+
+  // Replaces all the routes of `family` with `entries`. Returns true if the
+  // routes have changed.
+  bool ReplaceFamily(int family, const std::vector<RoutingEntry> &entries);
+  // Adds a route, unless an identical one exists. Returns true if added.
+  bool Add(const RoutingEntry &entry);
+  // Removes a route identical to `entry`. Returns true if found.
+  bool Remove(const RoutingEntry &entry);
+  // Replaces the route with the same destination and metric, like
+  // NLM_F_REPLACE. Returns true, and the previous route in `replaced`, if
+  // there was one.
+  bool Replace(const RoutingEntry &entry, RoutingEntry *replaced);
+
+  // The preferred default route: the one with the lowest metric, IPv4 first,
+  // IPv6 only counting on hosts without IPv4 default routes. nullptr if there
+  // is no default route.
+  const RoutingEntry *PrimaryDefaultRoute() const;
+  // The preferred default route of `family`, ignoring the routes with
+  // `excluded_metric`.
+  const RoutingEntry *PrimaryDefaultRoute(
+      int family, std::optional<int> excluded_metric = std::nullopt) const;
+  // The preferred default route of `family` through the interface
+  // `if_index`, ignoring the routes with `excluded_metric`.
+  const RoutingEntry *DefaultRoute(
+      int family, int if_index,
+      std::optional<int> excluded_metric = std::nullopt) const;
+  const DefaultRoutes &DefaultRoutesOf(int family) const {
+    return Family(family).defaults;
+  }
+  // Calls `handler` with every route, IPv4 first.
+  void ForEachEntry(
+      const std::function<void(const RoutingEntry &)> &handler) const;
+  size_t size() const;
+
+  // Index of an interface, resolved once and kept until the next full
+  // replacement of the IPv4 routes. 0 if the interface does not exist.
+  int IfIndex(const char *if_name);
+  // Sets whichever of the interface name and index `entry` lacks, from the
+  // same cache as IfIndex. Returns false if the route has no interface name
+  // and its interface no longer exists. The other methods resolve the
+  // entries they are given.
+  bool ResolveInterface(RoutingEntry *entry);
+
+ protected:
+  // Delete copy and move constructors.
+  RouteStore(const RouteStore &) = delete;
+  RouteStore &operator=(const RouteStore &) = delete;
+
+ private:
+  typedef struct {
+    DefaultRoutes defaults;
+    // Default routes of each interface, by if_index.
+    std::unordered_multimap<int, DefaultRoutes::iterator> defaults_by_if;
+    // All the other routes, in the order of the table.
+    std::vector<RoutingEntry> others;
+  } FamilyRoutes;
+
+  FamilyRoutes &Family(int family) {
+    return families_[family == AF_INET6 ? 1 : 0];
+  }
+  const FamilyRoutes &Family(int family) const {
+    return families_[family == AF_INET6 ? 1 : 0];
+  }
+  // Sets the if_name of the entry if empty. Returns false if the interface
+  // no longer exists.
+  bool ResolveName(RoutingEntry *entry);
+  void AddDefault(FamilyRoutes *routes, const RoutingEntry &entry);
+  void EraseDefault(FamilyRoutes *routes, DefaultRoutes::iterator it);
+
+  FamilyRoutes families_[2];
+  // Interned interface indexes, by name, and names, by index.
+  std::unordered_map<std::string, int> if_indexes_;
+  std::unordered_map<int, std::string> if_names_;
+  // Scratch space for ReplaceFamily.
+  std::vector<RoutingEntry> new_defaults_;
+  std::vector<RoutingEntry> new_others_;
+};  // class RouteStore
+
+// Adds the interfaces of the default routes that are in `registry` to
+// `known`, and returns the interfaces of `known` that have no default route.
+InterfaceSet FindMissingGateways(const RouteStore &routes,
+                                 const InterfaceRegistry *registry,
+                                 InterfaceSet *known);
+
+// Where the routing table is read from. Not thread safe.
+class RouteTableSource {
+ public:
+  virtual ~RouteTableSource() {}
+
+  // Reads the IPv4 table, in the format of /proc/net/route, into `buffer`,
+  // grown as needed, and its length into `len`.
+  virtual Status ReadIpv4Table(std::vector<char> *buffer, size_t *len) = 0;
+  // Calls `handler` with each message of a dump of the IPv6 routes. Returns
+  // UNKNOWN_ERROR if the dump was interrupted, and should be retried.
+  virtual Status DumpIpv6Routes(
+      const NetlinkSocket::MessageHandler &handler) = 0;
+};
+
+// The tables of the kernel: /proc/net/route, or another file in the same
+// format, and a RTM_GETROUTE dump.
+class KernelRouteTableSource : public RouteTableSource {
+ public:
+  explicit KernelRouteTableSource(
+      const std::string &ipv4_path = "/proc/net/route");
+
+  Status ReadIpv4Table(std::vector<char> *buffer, size_t *len) override;
+  Status DumpIpv6Routes(
+      const NetlinkSocket::MessageHandler &handler) override;
+
+ protected:
+  // Delete copy and move constructors.
+  KernelRouteTableSource(const KernelRouteTableSource &) = delete;
+  KernelRouteTableSource &operator=(const KernelRouteTableSource &) = delete;
+
+ private:
+  const std::string ipv4_path_;
+  // Opened at the first dump, and kept open.
+  NetlinkSocket socket_;
+};  // class KernelRouteTableSource
+
+// Tables recorded beforehand, returned as they are at every read.
+class RecordedRouteTableSource : public RouteTableSource {
+ public:
+  // Args:
+  //   ipv4_table: content of /proc/net/route.
+  //   ipv6_dump: netlink messages of a dump of the IPv6 routes, one after
+  //     the other, e.g. the buffer of a NetlinkRequest.
+  RecordedRouteTableSource(const std::string &ipv4_table,
+                           const std::vector<char> &ipv6_dump)
+      : ipv4_table_(ipv4_table), ipv6_dump_(ipv6_dump) {}
+
+  Status ReadIpv4Table(std::vector<char> *buffer, size_t *len) override;
+  Status DumpIpv6Routes(
+      const NetlinkSocket::MessageHandler &handler) override;
+
+ private:
+  const std::string ipv4_table_;
+  const std::vector<char> ipv6_dump_;
+};  // class RecordedRouteTableSource
+
+}  // namespace net_failover_manager
+
+#endif  // #ifndef NET_FAILOVER_MANAGER_NETCTL_ROUTE_TABLE
@@ -0,0 +1,241 @@
+// This file is part of Net Failover Manager.
+//
+// Net Failover Manager is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Net Failover Manager is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Net Failover Manager.  If not, see
+// <https://www.gnu.org/licenses/>.
+
+#include "socket_prober.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <glog/logging.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "policy_routing.h"
+
+namespace net_failover_manager {
+
+namespace {
+// Size of the DNS header, and flag of the responses.
+const size_t kDnsHeaderSize = 12;
+const uint8_t kDnsResponseFlag = 0x80;
+// Enough to see the status line of an HTTP response.
+const size_t kHttpStatusLineSize = 12;
+
+// A recursive query for the A record of `name`.
+std::vector<uint8_t> BuildDnsQuery(uint16_t id, const std::string &name) {
+  std::vector<uint8_t> query = {
+      static_cast<uint8_t>(id >> 8), static_cast<uint8_t>(id & 0xff),
+      0x01, 0x00,  // Recursion desired.
+      0x00, 0x01,  // One question.
+      0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
+  size_t start = 0;
+  while (start < name.size()) {
+    auto end = name.find('.', start);
+    if (end == std::string::npos) {
+      end = name.size();
+    }
+    size_t len = std::min<size_t>(end - start, 63);
+    query.push_back(len);
+    query.insert(query.end(), name.begin() + start, name.begin() + start + len);
+    start = end + 1;
+  }
+  query.push_back(0);
+  // Type A, class IN.
+  query.insert(query.end(), {0x00, 0x01, 0x00, 0x01});
+  return query;
+}
+}  // namespace
+
+SocketProber::SocketProber(const std::string &if_name,
+                           const ProbeTarget &target, ProbeReactor *reactor)
+    : if_name_(if_name), target_(target), reactor_(reactor), next_id_(0) {
+  address_ = {};
+  if (target_.family == AF_INET6) {
+    auto *address = reinterpret_cast<sockaddr_in6 *>(&address_);
+    address->sin6_family = AF_INET6;
+    address->sin6_port = htons(target_.port);
+    inet_pton(AF_INET6, target_.address.c_str(), &address->sin6_addr);
+    address_len_ = sizeof(sockaddr_in6);
+  } else {
+    auto *address = reinterpret_cast<sockaddr_in *>(&address_);
+    address->sin_family = AF_INET;
+    address->sin_port = htons(target_.port);
+    inet_pton(AF_INET, target_.address.c_str(), &address->sin_addr);
+    address_len_ = sizeof(sockaddr_in);
+  }
+}
+
+SocketProber::~SocketProber() {
+  for (const auto &entry : attempts_) {
+    reactor_->UnwatchFd(entry.second->fd);
+    close(entry.second->fd);
+  }
+}
+
+bool SocketProber::Probe(std::chrono::milliseconds timeout,
+                         DoneCallback done) {
+  bool datagram = target_.type == ProbeTarget::DNS;
+  int fd = socket(target_.family,
+                  (datagram ? SOCK_DGRAM : SOCK_STREAM) | SOCK_NONBLOCK |
+                      SOCK_CLOEXEC,
+                  0);
+  if (fd < 0) {
+    LOG_EVERY_N(ERROR, 100) << "Could not open probe socket: "
+                            << strerror(errno);
+    return false;
+  }
+  if (setsockopt(fd, SOL_SOCKET, SO_BINDTODEVICE, if_name_.c_str(),
+                 if_name_.size() + 1) < 0) {
+    LOG_EVERY_N(ERROR, 100) << "Could not bind probe socket to " << if_name_
+                            << ": " << strerror(errno);
+    close(fd);
+    return false;
+  }
+  ApplyPolicyFwmark(fd, if_name_);
+
+  uint64_t id = next_id_++;
+  auto attempt = std::make_unique<Attempt>();
+  attempt->fd = fd;
+  attempt->started_at = std::chrono::steady_clock::now();
+  attempt->done = std::move(done);
+  attempt->query_id = static_cast<uint16_t>(id * 40503u + getpid());
+  attempts_[id] = std::move(attempt);
+  reactor_->ScheduleAt(std::chrono::steady_clock::now() + timeout,
+                       [this, id] { Complete(id, false); });
+
+  bool failed = false;
+  if (connect(fd, reinterpret_cast<sockaddr *>(&address_), address_len_) < 0 &&
+      errno != EINPROGRESS) {
+    // E.g. no route through the interface, the attempt has failed.
+    failed = true;
+  } else if (datagram) {
+    auto query = BuildDnsQuery(attempts_[id]->query_id, target_.path);
+    failed = send(fd, query.data(), query.size(), 0) < 0 ||
+             reactor_->WatchFd(fd, [this, id] { OnReadable(id); }).Error() !=
+                 Status::OK;
+  } else {
+    failed = reactor_->WatchFdWritable(fd, [this, id] { OnConnected(id); })
+                 .Error() != Status::OK;
+  }
+  if (failed) {
+    // Reported from the reactor, never from within Probe.
+    reactor_->ScheduleAt(std::chrono::steady_clock::now(),
+                         [this, id] { Complete(id, false); });
+  }
+  return true;
+}
+
+void SocketProber::OnConnected(uint64_t id) {
+  auto it = attempts_.find(id);
+  if (it == attempts_.end()) {
+    return;
+  }
+  int fd = it->second->fd;
+  int error = 0;
+  socklen_t len = sizeof(error);
+  getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len);
+  if (error == 0) {
+    sockaddr_storage peer;
+    socklen_t peer_len = sizeof(peer);
+    if (getpeername(fd, reinterpret_cast<sockaddr *>(&peer), &peer_len) < 0) {
+      // Spurious event, still connecting.
+      return;
+    }
+  }
+  if (target_.type == ProbeTarget::TCP) {
+    // A reset still proves that the target can be reached.
+    Complete(id, error == 0 || error == ECONNREFUSED);
+    return;
+  }
+  if (error != 0) {
+    Complete(id, false);
+    return;
+  }
+  std::string host = target_.family == AF_INET6
+                         ? "[" + target_.address + "]"
+                         : target_.address;
+  std::string request = "HEAD " + target_.path + " HTTP/1.1\r\nHost: " +
+                        host + "\r\nConnection: close\r\n\r\n";
+  reactor_->UnwatchFd(fd);
+  if (send(fd, request.data(), request.size(), MSG_NOSIGNAL) < 0 ||
+      reactor_->WatchFd(fd, [this, id] { OnReadable(id); }).Error() !=
+          Status::OK) {
+    Complete(id, false);
+  }
+}
+
+void SocketProber::OnReadable(uint64_t id) {
+  auto it = attempts_.find(id);
+  if (it == attempts_.end()) {
+    return;
+  }
+  auto *attempt = it->second.get();
+  char buffer[512];
+  while (true) {
+    ssize_t len = recv(attempt->fd, buffer, sizeof(buffer), 0);
+    if (len < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        // E.g. port unreachable: the server is not answering.
+        Complete(id, false);
+      }
+      return;
+    }
+    if (target_.type == ProbeTarget::DNS) {
+      auto *header = reinterpret_cast<const uint8_t *>(buffer);
+      if (static_cast<size_t>(len) >= kDnsHeaderSize &&
+          header[0] == (attempt->query_id >> 8) &&
+          header[1] == (attempt->query_id & 0xff) &&
+          (header[2] & kDnsResponseFlag)) {
+        // Any response code counts, the server answered.
+        Complete(id, true);
+        return;
+      }
+      // Not ours, keep waiting.
+      continue;
+    }
+    attempt->response.append(buffer, len);
+    if (len == 0 || attempt->response.size() >= kHttpStatusLineSize) {
+      // Any status counts, the server answered.
+      Complete(id, attempt->response.compare(0, 5, "HTTP/") == 0);
+      return;
+    }
+  }
+}
+
+void SocketProber::Complete(uint64_t id, bool answered) {
+  auto it = attempts_.find(id);
+  if (it == attempts_.end()) {
+    return;
+  }
+  auto attempt = std::move(it->second);
+  attempts_.erase(it);
+  reactor_->UnwatchFd(attempt->fd);
+  close(attempt->fd);
+  std::optional<std::chrono::microseconds> rtt;
+  if (answered) {
+    rtt = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - attempt->started_at);
+  }
+  attempt->done(rtt);
+}
+
+}  // namespace net_failover_manager
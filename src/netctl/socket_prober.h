@@ -0,0 +1,86 @@
+// This file is part of Net Failover Manager.
+//
+// Net Failover Manager is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Net Failover Manager is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Net Failover Manager.  If not, see
+// <https://www.gnu.org/licenses/>.
+
+#ifndef NET_FAILOVER_MANAGER_NETCTL_SOCKET_PROBER
+#define NET_FAILOVER_MANAGER_NETCTL_SOCKET_PROBER
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+
+#include "probe_reactor.h"
+#include "prober.h"
+
+namespace net_failover_manager {
+
+// Probes that need a socket of their own for each attempt: TCP connect, DNS
+// query over UDP and HTTP HEAD request. The socket is bound to the interface
+// and everything is non blocking.
+class SocketProber : public Prober {
+ public:
+  // Args:
+  //   if_name: the interface the probes must leave from.
+  //   target: a TCP, DNS or HTTP target.
+  //   reactor: drives the prober, must outlive it.
+  SocketProber(const std::string &if_name, const ProbeTarget &target,
+               ProbeReactor *reactor);
+  ~SocketProber() override;
+
+  bool Probe(std::chrono::milliseconds timeout, DoneCallback done) override;
+
+ protected:
+  // Delete copy and move constructors.
+  SocketProber(const SocketProber &) = delete;
+  SocketProber &operator=(const SocketProber &) = delete;
+
+ private:
+  typedef struct {
+    int fd;
+    std::chrono::steady_clock::time_point started_at;
+    DoneCallback done;
+    // DNS only, to match the answer.
+    uint16_t query_id;
+    // HTTP only, the response read so far.
+    std::string response;
+  } Attempt;
+
+  // Socket events of attempt `id`.
+  void OnConnected(uint64_t id);
+  void OnReadable(uint64_t id);
+  // Closes the socket and reports the result, if the attempt is still
+  // running.
+  void Complete(uint64_t id, bool answered);
+
+  const std::string if_name_;
+  const ProbeTarget target_;
+  sockaddr_storage address_;
+  socklen_t address_len_;
+  ProbeReactor *reactor_;
+  uint64_t next_id_;
+  // Attempts in progress. Ids, unlike fds, are never reused, so that late
+  // events and timers of a finished attempt are recognized.
+  std::map<uint64_t, std::unique_ptr<Attempt>> attempts_;
+};  // class SocketProber
+
+}  // namespace net_failover_manager
+
+#endif  // #ifndef NET_FAILOVER_MANAGER_NETCTL_SOCKET_PROBER
@@ -0,0 +1,507 @@
+// This file is part of Net Failover Manager.
+//
+// Net Failover Manager is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Net Failover Manager is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Net Failover Manager.  If not, see
+// <https://www.gnu.org/licenses/>.
+
+#include "state_snapshot.h"
+
+#include <fcntl.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <net/if.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <map>
+
+DEFINE_int32(state_save_interval_s, 10,
+             "Interval at which the state is saved while no interface "
+             "changes status.");
+DEFINE_int32(state_max_age_s, 600,
+             "Saved state older than this is not restored at startup.");
+
+namespace net_failover_manager {
+
+namespace {
+// "NFMS" in little endian.
+const uint32_t kMagic = 0x534d464e;
+// To be incremented at every change of the layout below.
+const uint32_t kVersion = 1;
+const int kMaxInterfaces = 16;
+const int kMaxTargets = 4;
+const int kMaxGateways = 16;
+const size_t kTargetKeyLen = 96;
+
+// The layout below is the file format: plain data only, strings NUL
+// terminated, times on the wall clock in milliseconds since the epoch and 0
+// if unset.
+typedef struct {
+  char key[kTargetKeyLen];
+  LinkQualityEstimator::State quality;
+} TargetRecord;
+
+typedef struct {
+  char if_name[IF_NAMESIZE];
+  // InterfaceChecker::InterfaceStatus.
+  int32_t status;
+  int64_t last_checked_at;
+  // Damping, only meaningful if has_damping is set.
+  int32_t has_damping;
+  int32_t flaps;
+  int32_t recovered;
+  int64_t status_since_ms;
+  int64_t hold_down_until_ms;
+  // Last probe result, only meaningful if has_probe_result is set.
+  int32_t has_probe_result;
+  int32_t sent;
+  int32_t received;
+  float packet_loss;
+  int64_t rtt_min_us;
+  int64_t rtt_avg_us;
+  int64_t rtt_max_us;
+  int32_t link_down;
+  // Quality of the interface, and the estimators of its targets.
+  int32_t samples;
+  int64_t rtt_ewma_us;
+  int64_t jitter_us;
+  double loss;
+  int64_t rtt_p50_us;
+  int64_t rtt_p95_us;
+  double score;
+  int32_t target_count;
+  TargetRecord targets[kMaxTargets];
+} InterfaceRecord;
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  // Higher for newer copies, 0 if never written. The copy of sequence n is
+  // slots[n % 2].
+  uint64_t sequence;
+  // FNV-1a hash of the whole slot, with checksum set to 0.
+  uint64_t checksum;
+  int64_t written_at_ms;
+  int32_t interface_count;
+  int32_t known_gateway_count;
+  int32_t preferred_count;
+  InterfaceRecord interfaces[kMaxInterfaces];
+  char known_gateways[kMaxGateways][IF_NAMESIZE];
+  // Most preferred first.
+  char preferred[kMaxInterfaces][IF_NAMESIZE];
+} Slot;
+
+typedef struct {
+  Slot slots[2];
+} SnapshotFile;
+
+uint64_t Checksum(const Slot &slot) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  auto add = [&hash](const char *data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+      hash ^= static_cast<uint8_t>(data[i]);
+      hash *= 0x100000001b3ULL;
+    }
+  };
+  const char *bytes = reinterpret_cast<const char *>(&slot);
+  size_t checksum_offset = offsetof(Slot, checksum);
+  add(bytes, checksum_offset);
+  const uint64_t zero = 0;
+  add(reinterpret_cast<const char *>(&zero), sizeof(zero));
+  add(bytes + checksum_offset + sizeof(zero),
+      sizeof(Slot) - checksum_offset - sizeof(zero));
+  return hash;
+}
+
+bool SlotValid(const SnapshotFile &file, int index) {
+  const Slot &slot = file.slots[index];
+  return slot.magic == kMagic && slot.version == kVersion &&
+         slot.sequence != 0 && slot.sequence % 2 == uint64_t(index) &&
+         slot.checksum == Checksum(slot);
+}
+
+void CopyName(const std::string &name, char *dst, size_t len) {
+  strncpy(dst, name.c_str(), len - 1);
+  dst[len - 1] = '\0';
+}
+
+std::string ReadName(const char *src, size_t len) {
+  return std::string(src, strnlen(src, len));
+}
+
+int64_t WallNowMs() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+             std::chrono::system_clock::now().time_since_epoch())
+      .count();
+}
+
+// The steady clock does not survive a reboot, times are stored relative to
+// the wall clock.
+int64_t ToWallMs(std::chrono::steady_clock::time_point time,
+                 std::chrono::steady_clock::time_point steady_now,
+                 int64_t wall_now_ms) {
+  if (time == std::chrono::steady_clock::time_point()) {
+    return 0;
+  }
+  return wall_now_ms - std::chrono::duration_cast<std::chrono::milliseconds>(
+                           steady_now - time)
+                           .count();
+}
+
+std::chrono::steady_clock::time_point FromWallMs(
+    int64_t ms, std::chrono::steady_clock::time_point steady_now,
+    int64_t wall_now_ms) {
+  if (ms == 0) {
+    return std::chrono::steady_clock::time_point();
+  }
+  return steady_now - std::chrono::milliseconds(wall_now_ms - ms);
+}
+
+void FillRecord(const InterfaceState &interface,
+                const InterfaceChecker::QualityState &quality_state,
+                std::chrono::steady_clock::time_point steady_now,
+                int64_t wall_now_ms, InterfaceRecord *record) {
+  CopyName(InterfaceName(interface.id), record->if_name,
+           sizeof(record->if_name));
+  record->status = interface.status;
+  record->last_checked_at = interface.last_checked_at;
+  if (interface.damping.has_value()) {
+    const auto &damping = interface.damping.value();
+    record->has_damping = 1;
+    record->flaps = damping.flaps;
+    record->recovered = damping.recovered;
+    record->status_since_ms =
+        ToWallMs(damping.status_since, steady_now, wall_now_ms);
+    record->hold_down_until_ms =
+        ToWallMs(damping.hold_down_until, steady_now, wall_now_ms);
+  }
+  if (interface.last_probe_result.has_value()) {
+    const auto &result = interface.last_probe_result.value();
+    record->has_probe_result = 1;
+    record->sent = result.sent;
+    record->received = result.received;
+    record->packet_loss = result.packet_loss;
+    record->rtt_min_us = result.rtt_min.count();
+    record->rtt_avg_us = result.rtt_avg.count();
+    record->rtt_max_us = result.rtt_max.count();
+    record->link_down = result.link_down;
+  }
+  const auto &quality = interface.quality;
+  record->samples = quality.samples;
+  record->rtt_ewma_us = quality.rtt_ewma.count();
+  record->jitter_us = quality.jitter.count();
+  record->loss = quality.loss;
+  record->rtt_p50_us = quality.rtt_p50.count();
+  record->rtt_p95_us = quality.rtt_p95.count();
+  record->score = quality.score;
+  for (const auto &target : quality_state) {
+    if (record->target_count == kMaxTargets ||
+        target.first.size() >= kTargetKeyLen) {
+      continue;
+    }
+    auto &target_record = record->targets[record->target_count++];
+    CopyName(target.first, target_record.key, sizeof(target_record.key));
+    target_record.quality = target.second;
+  }
+}
+
+InterfaceState ReadRecord(const InterfaceRecord &record,
+                          std::chrono::steady_clock::time_point steady_now,
+                          int64_t wall_now_ms,
+                          InterfaceChecker::QualityState *quality_state) {
+  InterfaceState interface;
+  // Interfaces no longer configured are skipped.
+  interface.id = InterfaceRegistry::Default()->Find(
+      ReadName(record.if_name, sizeof(record.if_name)));
+  interface.status = InterfaceChecker::UNKNOWN;
+  if (record.status == InterfaceChecker::HEALTHY ||
+      record.status == InterfaceChecker::UNHEALTHY) {
+    interface.status =
+        static_cast<InterfaceChecker::InterfaceStatus>(record.status);
+  }
+  interface.last_checked_at = record.last_checked_at;
+  if (record.has_damping) {
+    InterfaceStateMachine::State damping;
+    damping.status = interface.status;
+    damping.flaps = std::max(record.flaps, 0);
+    damping.recovered = record.recovered;
+    damping.status_since =
+        FromWallMs(record.status_since_ms, steady_now, wall_now_ms);
+    damping.hold_down_until =
+        FromWallMs(record.hold_down_until_ms, steady_now, wall_now_ms);
+    interface.damping = damping;
+  }
+  if (record.has_probe_result) {
+    ProbeResult result;
+    result.sent = record.sent;
+    result.received = record.received;
+    result.packet_loss = record.packet_loss;
+    result.rtt_min = std::chrono::microseconds(record.rtt_min_us);
+    result.rtt_avg = std::chrono::microseconds(record.rtt_avg_us);
+    result.rtt_max = std::chrono::microseconds(record.rtt_max_us);
+    result.link_down = record.link_down;
+    interface.last_probe_result = result;
+  }
+  auto &quality = interface.quality;
+  quality.samples = record.samples;
+  quality.rtt_ewma = std::chrono::microseconds(record.rtt_ewma_us);
+  quality.jitter = std::chrono::microseconds(record.jitter_us);
+  quality.loss = record.loss;
+  quality.rtt_p50 = std::chrono::microseconds(record.rtt_p50_us);
+  quality.rtt_p95 = std::chrono::microseconds(record.rtt_p95_us);
+  quality.score = record.score;
+  int target_count = std::clamp(record.target_count, 0, kMaxTargets);
+  for (int i = 0; i < target_count; i++) {
+    const auto &target = record.targets[i];
+    (*quality_state)[ReadName(target.key, sizeof(target.key))] =
+        target.quality;
+  }
+  return interface;
+}
+}  // namespace
+
+StateSnapshot::StateSnapshot(const std::string &path, InterfaceChecker *ic,
+                             RouteManager *rm, GatewayConfigManager *gm)
+    : path_(path),
+      ic_(ic),
+      rm_(rm),
+      gm_(gm),
+      file_(nullptr),
+      sequence_(0),
+      observer_id_(-1) {}
+
+StateSnapshot::~StateSnapshot() {
+  Stop();
+  if (file_ != nullptr) {
+    munmap(file_, sizeof(SnapshotFile));
+  }
+}
+
+Status StateSnapshot::MapLocked() {
+  if (file_ != nullptr) {
+    return Status(Status::OK, "");
+  }
+  int fd = open(path_.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    return Status(Status::PERMISSION_ERROR,
+                  "Could not open " + path_ + ": " + strerror(errno));
+  }
+  struct stat file_stat;
+  auto status = Status(Status::OK, "");
+  if (fstat(fd, &file_stat) < 0) {
+    status = Status(Status::UNKNOWN_ERROR,
+                    "Could not stat " + path_ + ": " + strerror(errno));
+  } else if (file_stat.st_size != sizeof(SnapshotFile)) {
+    // New file, or older layout: starts over from zeroes.
+    if (file_stat.st_size != 0) {
+      LOG(WARNING) << path_ << " has an unknown layout, it is reset.";
+    }
+    if (ftruncate(fd, 0) < 0 || ftruncate(fd, sizeof(SnapshotFile)) < 0) {
+      status = Status(Status::UNKNOWN_ERROR,
+                      "Could not resize " + path_ + ": " + strerror(errno));
+    }
+  }
+  if (status.Error() == Status::OK) {
+    void *file = mmap(nullptr, sizeof(SnapshotFile), PROT_READ | PROT_WRITE,
+                      MAP_SHARED, fd, 0);
+    if (file == MAP_FAILED) {
+      status = Status(Status::UNKNOWN_ERROR,
+                      "Could not map " + path_ + ": " + strerror(errno));
+    } else {
+      file_ = file;
+      const auto *snapshot = static_cast<const SnapshotFile *>(file_);
+      for (int i = 0; i < 2; i++) {
+        if (SlotValid(*snapshot, i)) {
+          sequence_ = std::max(sequence_, snapshot->slots[i].sequence);
+        }
+      }
+    }
+  }
+  close(fd);
+  return status;
+}
+
+Status StateSnapshot::Restore() {
+  auto started_at = std::chrono::steady_clock::now();
+  std::unique_lock<std::mutex> lock(mutex_);
+  auto status = MapLocked();
+  if (status.Error() != Status::OK) {
+    return status;
+  }
+  if (sequence_ == 0) {
+    return Status(Status::NOT_FOUND, "No saved state in " + path_);
+  }
+  const auto &slot =
+      static_cast<const SnapshotFile *>(file_)->slots[sequence_ % 2];
+  int64_t wall_now_ms = WallNowMs();
+  int64_t age_ms = wall_now_ms - slot.written_at_ms;
+  if (age_ms > int64_t(FLAGS_state_max_age_s) * 1000) {
+    return Status(Status::NOT_FOUND, "State saved in " + path_ + " " +
+                                         std::to_string(age_ms / 1000) +
+                                         "s ago, too old to be restored.");
+  }
+
+  NetworkState saved;
+  saved.version = 0;
+  std::map<InterfaceId, InterfaceChecker::QualityState> quality_states;
+  int interface_count = std::clamp(slot.interface_count, 0, kMaxInterfaces);
+  for (int i = 0; i < interface_count; i++) {
+    InterfaceChecker::QualityState quality_state;
+    auto interface = ReadRecord(slot.interfaces[i], started_at, wall_now_ms,
+                                &quality_state);
+    if (interface.id == kNoInterface) {
+      continue;
+    }
+    quality_states[interface.id] = quality_state;
+    saved.interfaces.push_back(std::move(interface));
+  }
+  std::vector<InterfaceId> known_gateways;
+  int known_gateway_count =
+      std::clamp(slot.known_gateway_count, 0, kMaxGateways);
+  for (int i = 0; i < known_gateway_count; i++) {
+    known_gateways.push_back(InterfaceRegistry::Default()->Find(
+        ReadName(slot.known_gateways[i], IF_NAMESIZE)));
+  }
+  std::vector<std::string> preferred;
+  int preferred_count = std::clamp(slot.preferred_count, 0, kMaxInterfaces);
+  for (int i = 0; i < preferred_count; i++) {
+    preferred.push_back(ReadName(slot.preferred[i], IF_NAMESIZE));
+  }
+  lock.unlock();
+
+  rm_->RestoreKnownGatewayInterfaces(known_gateways);
+  for (const auto &quality_state : quality_states) {
+    ic_->RestoreQuality(quality_state.first, quality_state.second);
+  }
+  // The configured order, if any, prevails.
+  if (gm_->PreferredGatewayInterfaces().empty() && !preferred.empty()) {
+    gm_->SetPreferredGatewayInterfaces(preferred);
+  }
+  int restored = gm_->RestoreState(saved);
+  LOG(INFO) << "Restored the state of " << restored << " interfaces, saved "
+            << age_ms << "ms ago, in "
+            << std::chrono::duration_cast<std::chrono::microseconds>(
+                   std::chrono::steady_clock::now() - started_at)
+                   .count()
+            << "us.";
+  return Status(Status::OK, "");
+}
+
+Status StateSnapshot::Start() {
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    auto status = MapLocked();
+    if (status.Error() != Status::OK) {
+      return status;
+    }
+  }
+  if (observer_id_ >= 0) {
+    return Status(Status::NO_OP, "Already started.");
+  }
+  observer_id_ =
+      gm_->AddEventObserver([this](const EventDispatcher::NetworkEvent &event) {
+        if (event.type == EventDispatcher::NetworkEvent::PROBE_RESULT) {
+          std::unique_lock<std::mutex> lock(mutex_);
+          if (std::chrono::steady_clock::now() - last_saved_at_ <
+              std::chrono::seconds(FLAGS_state_save_interval_s)) {
+            return;
+          }
+        }
+        auto status = Save();
+        if (status.Error() != Status::OK) {
+          LOG_EVERY_N(ERROR, 100) << "State not saved: "
+                                  << status.ErrorMessage();
+        }
+      });
+  return Status(Status::OK, "");
+}
+
+void StateSnapshot::Stop() {
+  if (observer_id_ < 0) {
+    return;
+  }
+  // No observer call is in progress once removed.
+  gm_->RemoveEventObserver(observer_id_);
+  observer_id_ = -1;
+  auto status = Save();
+  if (status.Error() != Status::OK) {
+    LOG(ERROR) << "State not saved: " << status.ErrorMessage();
+  }
+}
+
+Status StateSnapshot::Save() {
+  // Gathered first, none of these calls back into this object.
+  auto state = gm_->State();
+  auto preferred = gm_->PreferredGatewayInterfaces();
+  auto known_gateways = rm_->KnownGatewayInterfaces();
+  std::map<InterfaceId, InterfaceChecker::QualityState> quality_states;
+  for (const auto &interface : state->interfaces) {
+    auto quality_state = ic_->SaveQuality(interface.id);
+    if (quality_state.has_value()) {
+      quality_states[interface.id] = std::move(quality_state.value());
+    }
+  }
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  auto status = MapLocked();
+  if (status.Error() != Status::OK) {
+    return status;
+  }
+  auto steady_now = std::chrono::steady_clock::now();
+  int64_t wall_now_ms = WallNowMs();
+  uint64_t sequence = sequence_ + 1;
+  // The other copy stays valid while this one is written.
+  Slot &slot = static_cast<SnapshotFile *>(file_)->slots[sequence % 2];
+  memset(&slot, 0, sizeof(slot));
+  for (const auto &interface : state->interfaces) {
+    if (slot.interface_count == kMaxInterfaces) {
+      LOG_EVERY_N(WARNING, 100) << "Only the state of " << kMaxInterfaces
+                                << " interfaces is saved.";
+      break;
+    }
+    FillRecord(interface, quality_states[interface.id], steady_now,
+               wall_now_ms, &slot.interfaces[slot.interface_count++]);
+  }
+  // Ids are only valid in this process, names are saved.
+  for (auto if_id : known_gateways) {
+    if (slot.known_gateway_count == kMaxGateways) {
+      break;
+    }
+    CopyName(InterfaceName(if_id),
+             slot.known_gateways[slot.known_gateway_count++], IF_NAMESIZE);
+  }
+  for (auto if_id : preferred) {
+    if (slot.preferred_count == kMaxInterfaces) {
+      break;
+    }
+    CopyName(InterfaceName(if_id), slot.preferred[slot.preferred_count++],
+             IF_NAMESIZE);
+  }
+  slot.magic = kMagic;
+  slot.version = kVersion;
+  slot.sequence = sequence;
+  slot.written_at_ms = wall_now_ms;
+  slot.checksum = Checksum(slot);
+  // Written back by the kernel even if the process dies, the sync only
+  // matters for a crash of the host.
+  msync(file_, sizeof(SnapshotFile), MS_ASYNC);
+  sequence_ = sequence;
+  last_saved_at_ = steady_now;
+  return Status(Status::OK, "");
+}
+
+}  // namespace net_failover_manager
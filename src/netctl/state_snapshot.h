@@ -0,0 +1,88 @@
+// This file is part of Net Failover Manager.
+//
+// Net Failover Manager is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Net Failover Manager is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Net Failover Manager.  If not, see
+// <https://www.gnu.org/licenses/>.
+
+// Persists what the failover decisions depend on, so that a restarted daemon
+// resumes where the previous one stopped instead of probing every interface
+// from scratch: the damped status and rolling quality of each interface, the
+// known gateways and the preference order. The file is memory mapped and
+// holds two copies of the state, written alternately, each one versioned and
+// checksummed: a copy torn by a crash is ignored in favour of the other one.
+
+#ifndef NET_FAILOVER_MANAGER_NETCTL_STATE_SNAPSHOT
+#define NET_FAILOVER_MANAGER_NETCTL_STATE_SNAPSHOT
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+#include "gateway_config_manager.h"
+#include "interface_checker.h"
+#include "route_manager.h"
+#include "src/lib/status.h"
+
+namespace net_failover_manager {
+
+class StateSnapshot {
+ public:
+  // Objects must outlive this one.
+  StateSnapshot(const std::string &path, InterfaceChecker *ic,
+                RouteManager *rm, GatewayConfigManager *gm);
+  virtual ~StateSnapshot();
+
+  // Restores the latest valid copy of the state. Must be called once the
+  // interfaces are configured, before the checks start. Returns NOT_FOUND
+  // if there is nothing to restore: new file, other layout version, or
+  // state older than --state_max_age_s.
+  Status Restore();
+
+  // Saves the state whenever the damped status of an interface or the
+  // default gateway changes, and at most every --state_save_interval_s
+  // otherwise.
+  Status Start();
+  // Saves the state one last time and stops saving it.
+  void Stop();
+
+  // Writes the current state over the oldest copy. Thread safe.
+  Status Save();
+
+ protected:
+  // Delete copy and move constructors.
+  StateSnapshot(const StateSnapshot &) = delete;
+  StateSnapshot &operator=(const StateSnapshot &) = delete;
+
+ private:
+  // Maps the file, creating or resizing it if needed. Must be called with
+  // mutex_ held.
+  Status MapLocked();
+
+  const std::string path_;
+  InterfaceChecker *ic_;
+  RouteManager *rm_;
+  GatewayConfigManager *gm_;
+  std::mutex mutex_;
+  // The mapped file, nullptr until mapped. Protected by mutex_.
+  void *file_;
+  // Sequence number of the latest copy. Protected by mutex_.
+  uint64_t sequence_;
+  std::chrono::steady_clock::time_point last_saved_at_;  // Protected by mutex_.
+  // -1 if not started.
+  int observer_id_;
+};  // class StateSnapshot
+
+}  // namespace net_failover_manager
+
+#endif  // #ifndef NET_FAILOVER_MANAGER_NETCTL_STATE_SNAPSHOT
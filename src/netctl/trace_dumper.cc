@@ -0,0 +1,125 @@
+// This file is part of Net Failover Manager.
+//
+// Net Failover Manager is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Net Failover Manager is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Net Failover Manager.  If not, see
+// <https://www.gnu.org/licenses/>.
+
+#include "trace_dumper.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <glog/logging.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+
+namespace net_failover_manager {
+
+namespace {
+
+// Written to by the SIGUSR1 handler, watched by the started TraceDumper.
+int signal_pipe[2] = {-1, -1};
+struct sigaction previous_sigusr1_action;
+
+void OnSigusr1(int) {
+  int saved_errno = errno;
+  char byte = 0;
+  if (write(signal_pipe[1], &byte, 1) < 0) {
+    // Pipe full: a dump is already pending.
+  }
+  errno = saved_errno;
+}
+
+}  // namespace
+
+TraceDumper::TraceDumper(TraceLog *trace, const std::string &path)
+    : trace_(trace), path_(path), started_(false) {}
+
+Status TraceDumper::Start() {
+  if (signal_pipe[0] >= 0) {
+    return Status(Status::UNKNOWN_ERROR, "A TraceDumper is already started.");
+  }
+  if (pipe2(signal_pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+    return Status(Status::UNKNOWN_ERROR,
+                  std::string("pipe2 failed: ") + strerror(errno));
+  }
+  started_ = true;
+  struct sigaction action = {};
+  action.sa_handler = OnSigusr1;
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGUSR1, &action, &previous_sigusr1_action);
+  reactor_.WatchFd(signal_pipe[0], [this] { OnSignal(); });
+  return reactor_.Start();
+}
+
+void TraceDumper::Stop() {
+  if (!started_) {
+    return;
+  }
+  started_ = false;
+  sigaction(SIGUSR1, &previous_sigusr1_action, nullptr);
+  reactor_.Stop();
+  for (int &fd : signal_pipe) {
+    close(fd);
+    fd = -1;
+  }
+}
+
+Status TraceDumper::DumpToFile() {
+  std::string data = trace_->Dump();
+  std::string tmp_path = path_ + ".tmp";
+  int fd = open(tmp_path.c_str(),
+                O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_NOFOLLOW, 0600);
+  if (fd < 0) {
+    return Status(Status::UNKNOWN_ERROR,
+                  "Cannot open " + tmp_path + ": " + strerror(errno));
+  }
+  size_t written = 0;
+  while (written < data.size()) {
+    ssize_t len = write(fd, data.data() + written, data.size() - written);
+    if (len < 0 && errno == EINTR) {
+      continue;
+    }
+    if (len < 0) {
+      int error = errno;
+      close(fd);
+      unlink(tmp_path.c_str());
+      return Status(Status::UNKNOWN_ERROR,
+                    "Cannot write " + tmp_path + ": " + strerror(error));
+    }
+    written += len;
+  }
+  close(fd);
+  if (rename(tmp_path.c_str(), path_.c_str()) < 0) {
+    int error = errno;
+    unlink(tmp_path.c_str());
+    return Status(Status::UNKNOWN_ERROR,
+                  "Cannot rename " + tmp_path + ": " + strerror(error));
+  }
+  return Status::Ok();
+}
+
+void TraceDumper::OnSignal() {
+  char buffer[64];
+  while (read(signal_pipe[0], buffer, sizeof(buffer)) > 0) {
+  }
+  auto status = DumpToFile();
+  if (status.Error() != Status::OK) {
+    LOG(ERROR) << "Trace not dumped: " << status.ErrorMessage();
+    return;
+  }
+  LOG(INFO) << "SIGUSR1 received, trace dumped to " << path_ << ".";
+}
+
+}  // namespace net_failover_manager
@@ -0,0 +1,63 @@
+// This file is part of Net Failover Manager.
+//
+// Net Failover Manager is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Net Failover Manager is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Net Failover Manager.  If not, see
+// <https://www.gnu.org/licenses/>.
+
+// Writes the trace to a file on SIGUSR1, for when the gRPC service cannot be
+// reached.
+
+#ifndef NET_FAILOVER_MANAGER_NETCTL_TRACE_DUMPER
+#define NET_FAILOVER_MANAGER_NETCTL_TRACE_DUMPER
+
+#include <string>
+
+#include "probe_reactor.h"
+#include "src/lib/status.h"
+#include "trace_log.h"
+
+namespace net_failover_manager {
+
+class TraceDumper {
+ public:
+  // `trace` must outlive this object.
+  TraceDumper(TraceLog *trace, const std::string &path);
+  virtual ~TraceDumper() { Stop(); }
+
+  // Dumps the trace to `path` at each SIGUSR1. Only one TraceDumper can be
+  // started at a time.
+  Status Start();
+  void Stop();
+
+  // Writes the dump to a temporary file renamed over `path`, so readers
+  // never see a partial dump.
+  Status DumpToFile();
+
+ protected:
+  // Delete copy and move constructors.
+  TraceDumper(const TraceDumper &) = delete;
+  TraceDumper &operator=(const TraceDumper &) = delete;
+
+ private:
+  // Run on the reactor thread.
+  void OnSignal();
+
+  TraceLog *trace_;
+  const std::string path_;
+  bool started_;
+  ProbeReactor reactor_;
+};  // class TraceDumper
+
+}  // namespace net_failover_manager
+
+#endif  // #ifndef NET_FAILOVER_MANAGER_NETCTL_TRACE_DUMPER
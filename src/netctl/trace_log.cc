@@ -0,0 +1,306 @@
+// This file is part of Net Failover Manager.
+//
+// Net Failover Manager is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Net Failover Manager is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Net Failover Manager.  If not, see
+// <https://www.gnu.org/licenses/>.
+
+#include "trace_log.h"
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <net/if.h>
+#include <string.h>
+#include <linux/sockios.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+DEFINE_int32(trace_events_per_thread, 4096,
+             "Number of events kept in memory for each thread by the trace "
+             "of the failover decisions, see GetTrace. 0 disables the trace.");
+
+namespace net_failover_manager {
+
+namespace {
+
+// Threads beyond this many do not record anything.
+const size_t kMaxThreadBuffers = 64;
+
+const char kDumpMagic[8] = {'N', 'F', 'M', 'T', 'R', 'A', 'C', 'E'};
+const uint32_t kDumpVersion = 1;
+
+// A dump is a DumpHeader, event_count events, then name_count interface
+// names of IF_NAMESIZE bytes, NUL padded, in id order. Host byte order.
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t event_size;
+  uint32_t event_count;
+  uint32_t name_count;
+  int64_t steady_ns;
+  int64_t wall_ns;
+} DumpHeader;
+
+static_assert(sizeof(TraceLog::Event) == 56, "Event must not be padded.");
+
+std::atomic<uint64_t> next_instance_id(1);
+
+template <typename Clock>
+int64_t NowNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             Clock::now().time_since_epoch())
+      .count();
+}
+
+}  // namespace
+
+// Ring written by a single thread. Each slot is a seqlock: its sequence is
+// odd while the slot is being written, and readers skip the events that
+// changed under them.
+class TraceLog::ThreadBuffer {
+ public:
+  explicit ThreadBuffer(size_t capacity)
+      : in_use(true), slots_(capacity), next_(0) {}
+
+  void Append(const Event &event) {
+    uint64_t words[kWords];
+    memcpy(words, &event, sizeof(words));
+    uint64_t index = next_.load(std::memory_order_relaxed);
+    auto &slot = slots_[index % slots_.size()];
+    slot.sequence.store(2 * index + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    for (size_t i = 0; i < kWords; i++) {
+      slot.words[i].store(words[i], std::memory_order_relaxed);
+    }
+    slot.sequence.store(2 * index + 2, std::memory_order_release);
+    next_.store(index + 1, std::memory_order_release);
+  }
+
+  void AppendTo(std::vector<Event> *events) const {
+    uint64_t end = next_.load(std::memory_order_acquire);
+    uint64_t begin = end > slots_.size() ? end - slots_.size() : 0;
+    for (uint64_t index = begin; index < end; index++) {
+      const auto &slot = slots_[index % slots_.size()];
+      uint64_t sequence = slot.sequence.load(std::memory_order_acquire);
+      if (sequence != 2 * index + 2) {
+        continue;
+      }
+      uint64_t words[kWords];
+      for (size_t i = 0; i < kWords; i++) {
+        words[i] = slot.words[i].load(std::memory_order_relaxed);
+      }
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (slot.sequence.load(std::memory_order_relaxed) != sequence) {
+        continue;
+      }
+      Event event;
+      memcpy(&event, words, sizeof(event));
+      events->push_back(event);
+    }
+  }
+
+  // Cleared when the owning thread exits, set again under the mutex of the
+  // TraceLog when another thread takes the buffer over.
+  std::atomic<bool> in_use;
+
+ private:
+  static constexpr size_t kWords = sizeof(Event) / sizeof(uint64_t);
+
+  typedef struct alignas(64) {
+    std::atomic<uint64_t> sequence;
+    std::atomic<uint64_t> words[kWords];
+  } Slot;
+
+  std::vector<Slot> slots_;
+  // Number of events ever appended.
+  std::atomic<uint64_t> next_;
+};  // class TraceLog::ThreadBuffer
+
+TraceLog::TraceLog(size_t events_per_thread)
+    : events_per_thread_(events_per_thread),
+      instance_id_(next_instance_id.fetch_add(1)) {}
+
+TraceLog *TraceLog::Default() {
+  static TraceLog *trace =
+      new TraceLog(std::max(FLAGS_trace_events_per_thread, 0));
+  return trace;
+}
+
+TraceLog::ThreadBuffer *TraceLog::BufferOfThisThread() {
+  // Gives the buffer back when the thread exits, its events stay readable.
+  struct Lease {
+    ~Lease() {
+      if (buffer) {
+        buffer->in_use.store(false, std::memory_order_release);
+      }
+    }
+    uint64_t instance_id = 0;
+    std::shared_ptr<ThreadBuffer> buffer;
+  };
+  thread_local Lease lease;
+  if (lease.instance_id == instance_id_) {
+    return lease.buffer.get();
+  }
+  if (lease.buffer) {
+    lease.buffer->in_use.store(false, std::memory_order_release);
+    lease.buffer.reset();
+  }
+  lease.instance_id = instance_id_;
+  std::unique_lock<std::mutex> lock(mutex_);
+  for (const auto &buffer : buffers_) {
+    if (!buffer->in_use.load(std::memory_order_acquire)) {
+      buffer->in_use.store(true, std::memory_order_relaxed);
+      lease.buffer = buffer;
+      return buffer.get();
+    }
+  }
+  if (buffers_.size() >= kMaxThreadBuffers) {
+    LOG_FIRST_N(WARNING, 1) << "Too many threads, some are not traced.";
+    return nullptr;
+  }
+  buffers_.push_back(std::make_shared<ThreadBuffer>(events_per_thread_));
+  lease.buffer = buffers_.back();
+  return lease.buffer.get();
+}
+
+void TraceLog::Record(EventType type, InterfaceId if_id,
+                      std::chrono::nanoseconds duration, int64_t arg0,
+                      int64_t arg1, int64_t arg2, int64_t arg3) {
+  if (events_per_thread_ == 0) {
+    return;
+  }
+  auto *buffer = BufferOfThisThread();
+  if (buffer == nullptr) {
+    return;
+  }
+  thread_local uint32_t thread_id = syscall(SYS_gettid);
+  Event event;
+  event.timestamp_ns = NowNs<std::chrono::steady_clock>();
+  event.duration_ns = std::max<int64_t>(duration.count(), 0);
+  event.type = type;
+  event.if_id = if_id;
+  event.thread_id = thread_id;
+  event.args[0] = arg0;
+  event.args[1] = arg1;
+  event.args[2] = arg2;
+  event.args[3] = arg3;
+  buffer->Append(event);
+}
+
+std::vector<TraceLog::Event> TraceLog::Events() const {
+  std::vector<std::shared_ptr<ThreadBuffer>> buffers;
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    buffers = buffers_;
+  }
+  std::vector<Event> events;
+  for (const auto &buffer : buffers) {
+    buffer->AppendTo(&events);
+  }
+  std::stable_sort(events.begin(), events.end(),
+                   [](const Event &a, const Event &b) {
+                     return a.timestamp_ns < b.timestamp_ns;
+                   });
+  return events;
+}
+
+std::string TraceLog::Dump() const {
+  auto events = Events();
+  auto *registry = InterfaceRegistry::Default();
+  size_t name_count = registry->size();
+  DumpHeader header = {};
+  memcpy(header.magic, kDumpMagic, sizeof(header.magic));
+  header.version = kDumpVersion;
+  header.event_size = sizeof(Event);
+  header.event_count = events.size();
+  header.name_count = name_count;
+  header.steady_ns = NowNs<std::chrono::steady_clock>();
+  header.wall_ns = NowNs<std::chrono::system_clock>();
+
+  std::string data;
+  data.reserve(sizeof(header) + events.size() * sizeof(Event) +
+               name_count * IF_NAMESIZE);
+  data.append(reinterpret_cast<const char *>(&header), sizeof(header));
+  data.append(reinterpret_cast<const char *>(events.data()),
+              events.size() * sizeof(Event));
+  for (size_t id = 0; id < name_count; id++) {
+    char name[IF_NAMESIZE] = {};
+    strncpy(name, registry->Name(id).c_str(), IF_NAMESIZE - 1);
+    data.append(name, IF_NAMESIZE);
+  }
+  return data;
+}
+
+Status TraceLog::ParseDump(const std::string &data, DumpContents *contents) {
+  DumpHeader header;
+  if (data.size() < sizeof(header)) {
+    return Status(Status::INVALID_ARGUMENTS, "Trace dump truncated.");
+  }
+  memcpy(&header, data.data(), sizeof(header));
+  if (memcmp(header.magic, kDumpMagic, sizeof(header.magic)) != 0) {
+    return Status(Status::INVALID_ARGUMENTS, "Not a trace dump.");
+  }
+  if (header.version != kDumpVersion || header.event_size != sizeof(Event)) {
+    return Status(Status::NOT_IMPLEMENTED,
+                  "Unsupported trace dump version " +
+                      std::to_string(header.version) + ".");
+  }
+  size_t events_size = size_t{header.event_count} * sizeof(Event);
+  size_t names_size = size_t{header.name_count} * IF_NAMESIZE;
+  if (data.size() != sizeof(header) + events_size + names_size) {
+    return Status(Status::INVALID_ARGUMENTS,
+                  "Trace dump truncated or corrupted.");
+  }
+  contents->steady_ns = header.steady_ns;
+  contents->wall_ns = header.wall_ns;
+  contents->events.resize(header.event_count);
+  memcpy(contents->events.data(), data.data() + sizeof(header), events_size);
+  contents->interface_names.clear();
+  const char *names = data.data() + sizeof(header) + events_size;
+  for (size_t id = 0; id < header.name_count; id++) {
+    const char *name = names + id * IF_NAMESIZE;
+    contents->interface_names.emplace_back(name,
+                                           strnlen(name, IF_NAMESIZE));
+  }
+  return Status::Ok();
+}
+
+int TracedIfNameToIndex(const char *if_name, InterfaceId if_id) {
+  auto start = std::chrono::steady_clock::now();
+  int if_index = if_nametoindex(if_name);
+  TraceLog::Default()->Record(TraceLog::IOCTL_OP, if_id,
+                              std::chrono::steady_clock::now() - start,
+                              SIOCGIFINDEX, if_index);
+  return if_index;
+}
+
+char *TracedIfIndexToName(int if_index, char *if_name) {
+  auto start = std::chrono::steady_clock::now();
+  char *ret = if_indextoname(if_index, if_name);
+  TraceLog::Default()->Record(TraceLog::IOCTL_OP, kNoInterface,
+                              std::chrono::steady_clock::now() - start,
+                              SIOCGIFNAME, ret != nullptr ? if_index : 0);
+  return ret;
+}
+
+int TracedRefresh(InterfaceRegistry *registry, InterfaceId id) {
+  auto start = std::chrono::steady_clock::now();
+  int if_index = registry->Refresh(id);
+  TraceLog::Default()->Record(TraceLog::IOCTL_OP, id,
+                              std::chrono::steady_clock::now() - start,
+                              SIOCGIFINDEX, if_index);
+  return if_index;
+}
+
+}  // namespace net_failover_manager
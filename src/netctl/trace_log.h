@@ -0,0 +1,162 @@
+// This file is part of Net Failover Manager.
+//
+// Net Failover Manager is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Net Failover Manager is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Net Failover Manager.  If not, see
+// <https://www.gnu.org/licenses/>.
+
+// In-memory trace of the failover decisions: probe results, damped status
+// transitions, handling of the queued events, gateway selections and
+// switches, netlink operations and interface lookups. Each thread appends
+// fixed size binary records to a ring buffer of its own, without locks or
+// string formatting, so the trace can stay on in production. The dump is a
+// binary blob, see src/trace_decoder for a decoder.
+
+#ifndef NET_FAILOVER_MANAGER_NETCTL_TRACE_LOG
+#define NET_FAILOVER_MANAGER_NETCTL_TRACE_LOG
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "interface_registry.h"
+#include "src/lib/status.h"
+
+namespace net_failover_manager {
+
+class TraceLog {
+ public:
+  // Stored as uint16_t, values must not change, decoders depend on them.
+  typedef enum {
+    // A probe round finished. duration: average RTT. args: status,
+    // probes sent, answers received, 1 if the link was down.
+    PROBE_RESULT = 1,
+    // The damped status changed. args: old status, new status.
+    STATUS_TRANSITION = 2,
+    // An event was taken off the queue and handled. duration: time spent in
+    // the handler. args: event type, time spent in the queue in ns.
+    EVENT_DISPATCH = 3,
+    // A gateway was considered for a switch. if_id: the candidate.
+    // args: Decision, current gateway.
+    GATEWAY_SELECTION = 4,
+    // The default gateway was moved. duration: time since the status change
+    // that triggered it. args: previous gateway, Status::ErrorCode.
+    GATEWAY_SWITCH = 5,
+    // The routing table changed the primary gateway. args: previous one.
+    GATEWAY_DETECTED = 6,
+    // A netlink request. duration: until the last ACK or the end of the
+    // dump. args: netlink protocol, type of the first message, messages
+    // sent, or received for a dump, Status::ErrorCode.
+    NETLINK_OP = 7,
+    // An interface lookup, an ioctl. if_id: the interface if known.
+    // duration: of the call. args: SIOCGIFINDEX or SIOCGIFNAME, interface
+    // index, 0 if not found.
+    IOCTL_OP = 8,
+  } EventType;
+
+  // Outcome of GATEWAY_SELECTION. Values must not change either.
+  typedef enum {
+    // Failover away from an unhealthy gateway.
+    FAILOVER = 1,
+    // Back to a preferred interface that became healthy.
+    FAILBACK = 2,
+    // The preferred interface must stay healthy for a while first.
+    FAILBACK_DEFERRED = 3,
+    ALREADY_GATEWAY = 4,
+    NOT_PREFERRED = 5,
+    LOWER_PRIORITY = 6,
+    // The unhealthy interface did not carry the default route.
+    NOT_GATEWAY = 7,
+    // The gateway is unhealthy but no other interface is healthy.
+    NO_HEALTHY_ALTERNATIVE = 8,
+  } Decision;
+
+  typedef struct {
+    // Steady clock, in ns.
+    uint64_t timestamp_ns;
+    uint64_t duration_ns;
+    uint16_t type;
+    InterfaceId if_id;
+    // Kernel id of the recording thread.
+    uint32_t thread_id;
+    int64_t args[4];
+  } Event;
+
+  // Content of a dump, see ParseDump.
+  typedef struct {
+    // Clocks read when the dump was taken, to turn the timestamps into wall
+    // clock time.
+    int64_t steady_ns;
+    int64_t wall_ns;
+    // Oldest first.
+    std::vector<Event> events;
+    // Indexed by InterfaceId.
+    std::vector<std::string> interface_names;
+  } DumpContents;
+
+  // Keeps the last `events_per_thread` events of each thread. 0 disables
+  // recording.
+  explicit TraceLog(size_t events_per_thread);
+
+  // Trace used by the daemon, sized by --trace_events_per_thread.
+  static TraceLog *Default();
+
+  bool enabled() const { return events_per_thread_ > 0; }
+
+  // Appends an event to the buffer of the calling thread, overwriting its
+  // oldest one if full. Lock free, except for the first event of a thread.
+  void Record(EventType type, InterfaceId if_id,
+              std::chrono::nanoseconds duration, int64_t arg0 = 0,
+              int64_t arg1 = 0, int64_t arg2 = 0, int64_t arg3 = 0);
+
+  // Events of all the threads, oldest first. Does not stop the writers,
+  // events overwritten while being read are skipped.
+  std::vector<Event> Events() const;
+  // Events and names of the interfaces of the default registry, in the
+  // binary format read by ParseDump.
+  std::string Dump() const;
+  static Status ParseDump(const std::string &data, DumpContents *contents);
+
+ protected:
+  // Delete copy and move constructors.
+  TraceLog(const TraceLog &) = delete;
+  TraceLog &operator=(const TraceLog &) = delete;
+
+ private:
+  class ThreadBuffer;
+
+  // Buffer owned by the calling thread, assigned at its first event. Null if
+  // there are too many threads.
+  ThreadBuffer *BufferOfThisThread();
+
+  const size_t events_per_thread_;
+  // Distinguishes the instances in the per thread cache.
+  const uint64_t instance_id_;
+  mutable std::mutex mutex_;
+  // Buffers of the live threads, and of the exited ones, kept for their
+  // events and reused by new threads. Protected by mutex_.
+  std::vector<std::shared_ptr<ThreadBuffer>> buffers_;
+};  // class TraceLog
+
+// if_nametoindex, if_indextoname and InterfaceRegistry::Refresh, recorded as
+// IOCTL_OP in the default trace.
+int TracedIfNameToIndex(const char *if_name, InterfaceId if_id = kNoInterface);
+char *TracedIfIndexToName(int if_index, char *if_name);
+int TracedRefresh(InterfaceRegistry *registry, InterfaceId id);
+
+}  // namespace net_failover_manager
+
+#endif  // #ifndef NET_FAILOVER_MANAGER_NETCTL_TRACE_LOG
@@ -0,0 +1,86 @@
+// This file is part of Net Failover Manager.
+//
+// Net Failover Manager is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Net Failover Manager is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Net Failover Manager.  If not, see
+// <https://www.gnu.org/licenses/>.
+
+#include "tunables.h"
+
+#include <gflags/gflags.h>
+
+#include <memory>
+
+#include "src/lib/atomic_snapshot.h"
+
+DEFINE_double(probe_quorum, 0.5,
+              "Fraction of the total weight of the targets that must answer "
+              "for an interface to be healthy, in (0, 1].");
+DEFINE_int32(fast_probe_interval_ms, 200,
+             "Fast detection: interval between probes of a stable interface.");
+DEFINE_int32(fast_probe_min_interval_ms, 50,
+             "Fast detection: interval between probes while losses are seen.");
+DEFINE_int32(fast_probe_timeout_ms, 250,
+             "Fast detection: time after which a probe is counted as lost.");
+DEFINE_int32(probes_to_healthy, 3,
+             "Healthy probe rounds in a row before an interface is considered "
+             "healthy again. Probes, not rounds, with --fast_detection.");
+DEFINE_int32(probes_to_unhealthy, 2,
+             "Unhealthy probe rounds in a row before an interface is "
+             "considered unhealthy. Probes, not rounds, with "
+             "--fast_detection.");
+DEFINE_int32(flap_hold_down_s, 30,
+             "Time an interface that went down again shortly after "
+             "recovering is kept unhealthy, doubled at each further flap.");
+DEFINE_int32(flap_hold_down_max_s, 900,
+             "Maximum hold-down of a flapping interface, and time it must "
+             "stay healthy to no longer be considered flapping.");
+DEFINE_int32(max_p95_rtt_ms, 0,
+             "Healthy interfaces whose 95th percentile round trip time is "
+             "above this are treated as unhealthy, 0 for no limit.");
+DEFINE_double(min_quality_score, 0,
+              "Healthy interfaces whose quality score, from 0 to 100, is "
+              "below this are treated as unhealthy, 0 for no limit.");
+DEFINE_int32(failback_dwell_s, 60,
+             "Time a preferred interface must have been healthy before the "
+             "default gateway fails back to it from a healthy one.");
+
+namespace net_failover_manager {
+
+namespace {
+// Empty until the first reload.
+AtomicSnapshot<Tunables> published(nullptr);
+}  // namespace
+
+Tunables CurrentTunables() {
+  auto tunables = published.Load();
+  if (tunables != nullptr) {
+    return *tunables;
+  }
+  return {FLAGS_probe_quorum,
+          FLAGS_fast_probe_interval_ms,
+          FLAGS_fast_probe_min_interval_ms,
+          FLAGS_fast_probe_timeout_ms,
+          FLAGS_probes_to_healthy,
+          FLAGS_probes_to_unhealthy,
+          FLAGS_flap_hold_down_s,
+          FLAGS_flap_hold_down_max_s,
+          FLAGS_max_p95_rtt_ms,
+          FLAGS_min_quality_score,
+          FLAGS_failback_dwell_s};
+}
+
+void PublishTunables(const Tunables &tunables) {
+  published.Publish(std::make_shared<const Tunables>(tunables));
+}
+
+}  // namespace net_failover_manager
@@ -0,0 +1,50 @@
+// This file is part of Net Failover Manager.
+//
+// Net Failover Manager is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Net Failover Manager is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Net Failover Manager.  If not, see
+// <https://www.gnu.org/licenses/>.
+
+// Settings that a configuration reload can change while the daemon runs.
+// The threads reading them get a consistent version through
+// CurrentTunables(), their flags are only written before they start.
+
+#ifndef NET_FAILOVER_MANAGER_NETCTL_TUNABLES
+#define NET_FAILOVER_MANAGER_NETCTL_TUNABLES
+
+namespace net_failover_manager {
+
+// See the flags of the same names.
+typedef struct {
+  double probe_quorum;
+  int fast_probe_interval_ms;
+  int fast_probe_min_interval_ms;
+  int fast_probe_timeout_ms;
+  int probes_to_healthy;
+  int probes_to_unhealthy;
+  int flap_hold_down_s;
+  int flap_hold_down_max_s;
+  int max_p95_rtt_ms;
+  double min_quality_score;
+  int failback_dwell_s;
+} Tunables;
+
+// The tunables last published, the values of the flags until then. Can be
+// called from any thread.
+Tunables CurrentTunables();
+// Replaces the tunables. Only called by the configuration reloads, which
+// are serialized.
+void PublishTunables(const Tunables &tunables);
+
+}  // namespace net_failover_manager
+
+#endif  // #ifndef NET_FAILOVER_MANAGER_NETCTL_TUNABLES
@@ -0,0 +1,164 @@
+// This file is part of Net Failover Manager.
+//
+// Net Failover Manager is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Net Failover Manager is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Net Failover Manager.  If not, see
+// <https://www.gnu.org/licenses/>.
+
+#include "metrics_http_server.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <glog/logging.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace net_failover_manager {
+
+namespace {
+// A slow client can hold the server at most this long.
+const struct timeval kConnectionTimeout = {1, 0};
+// Requests are a single line and a few headers, anything larger is refused.
+const size_t kMaxRequestSize = 4096;
+
+bool WriteAll(int fd, const std::string &data) {
+  size_t written = 0;
+  while (written < data.size()) {
+    ssize_t ret = send(fd, data.data() + written, data.size() - written,
+                       MSG_NOSIGNAL);
+    if (ret < 0 && errno == EINTR) {
+      continue;
+    }
+    if (ret <= 0) {
+      return false;
+    }
+    written += ret;
+  }
+  return true;
+}
+
+std::string Response(const std::string &status, const std::string &body,
+                     const std::string &content_type) {
+  return "HTTP/1.0 " + status + "\r\nContent-Type: " + content_type +
+         "\r\nContent-Length: " + std::to_string(body.size()) +
+         "\r\nConnection: close\r\n\r\n" + body;
+}
+}  // namespace
+
+MetricsHttpServer::MetricsHttpServer(MetricsRegistry *registry,
+                                     const std::string &address, int port)
+    : registry_(registry), address_(address), port_(port), listen_fd_(-1) {}
+
+MetricsHttpServer::~MetricsHttpServer() { Stop(); }
+
+Status MetricsHttpServer::Start() {
+  if (listen_fd_ >= 0) {
+    return Status(Status::NO_OP, "Metrics server already started.");
+  }
+  sockaddr_in local = {};
+  local.sin_family = AF_INET;
+  local.sin_port = htons(port_);
+  if (inet_pton(AF_INET, address_.c_str(), &local.sin_addr) != 1) {
+    return Status(Status::INVALID_ARGUMENTS,
+                  "Invalid metrics address " + address_);
+  }
+  listen_fd_ = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (listen_fd_ < 0) {
+    return Status(Status::UNKNOWN_ERROR,
+                  std::string("Could not open socket: ") + strerror(errno));
+  }
+  int one = 1;
+  setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  if (bind(listen_fd_, reinterpret_cast<sockaddr *>(&local), sizeof(local)) <
+          0 ||
+      listen(listen_fd_, 16) < 0) {
+    Status status(errno == EACCES ? Status::PERMISSION_ERROR
+                                  : Status::UNKNOWN_ERROR,
+                  "Could not listen on " + address_ + ":" +
+                      std::to_string(port_) + ": " + strerror(errno));
+    close(listen_fd_);
+    listen_fd_ = -1;
+    return status;
+  }
+  reactor_.WatchFd(listen_fd_, [this] { OnAcceptable(); });
+  LOG(INFO) << "Serving metrics on http://" << address_ << ":" << port_
+            << "/metrics";
+  return reactor_.Start();
+}
+
+void MetricsHttpServer::Stop() {
+  reactor_.Stop();
+  if (listen_fd_ >= 0) {
+    close(listen_fd_);
+    listen_fd_ = -1;
+  }
+}
+
+void MetricsHttpServer::OnAcceptable() {
+  while (true) {
+    int fd = accept4(listen_fd_, nullptr, nullptr, SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        LOG(WARNING) << "Could not accept metrics connection: "
+                     << strerror(errno);
+      }
+      return;
+    }
+    ServeConnection(fd);
+    close(fd);
+  }
+}
+
+void MetricsHttpServer::ServeConnection(int fd) {
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &kConnectionTimeout,
+             sizeof(kConnectionTimeout));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &kConnectionTimeout,
+             sizeof(kConnectionTimeout));
+  std::string request;
+  char buffer[1024];
+  while (request.find("\r\n\r\n") == std::string::npos) {
+    if (request.size() > kMaxRequestSize) {
+      WriteAll(fd, Response("413 Payload Too Large", "", "text/plain"));
+      return;
+    }
+    ssize_t len = recv(fd, buffer, sizeof(buffer), 0);
+    if (len < 0 && errno == EINTR) {
+      continue;
+    }
+    if (len <= 0) {
+      // Timed out or closed before the end of the headers.
+      return;
+    }
+    request.append(buffer, len);
+  }
+  auto line_end = request.find("\r\n");
+  std::string request_line = request.substr(0, line_end);
+  if (request_line.compare(0, 4, "GET ") != 0) {
+    WriteAll(fd, Response("405 Method Not Allowed", "", "text/plain"));
+    return;
+  }
+  auto path_end = request_line.find(' ', 4);
+  std::string path = request_line.substr(4, path_end - 4);
+  if (path != "/metrics") {
+    WriteAll(fd, Response("404 Not Found", "", "text/plain"));
+    return;
+  }
+  WriteAll(fd, Response("200 OK", registry_->Render(),
+                        "text/plain; version=0.0.4; charset=utf-8"));
+}
+
+}  // namespace net_failover_manager
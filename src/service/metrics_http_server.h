@@ -0,0 +1,64 @@
+// This file is part of Net Failover Manager.
+//
+// Net Failover Manager is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Net Failover Manager is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Net Failover Manager.  If not, see
+// <https://www.gnu.org/licenses/>.
+
+// Minimal HTTP server answering GET /metrics with the content of a metrics
+// registry, for Prometheus to scrape. Meant to listen on a local address:
+// requests are served one at a time and there is no authentication.
+
+#ifndef NET_FAILOVER_MANAGER_SERVICE_METRICS_HTTP_SERVER
+#define NET_FAILOVER_MANAGER_SERVICE_METRICS_HTTP_SERVER
+
+#include <string>
+
+#include "src/lib/metrics.h"
+#include "src/lib/status.h"
+#include "src/netctl/probe_reactor.h"
+
+namespace net_failover_manager {
+
+class MetricsHttpServer {
+ public:
+  // Args:
+  //   registry: metrics to serve, must outlive this object.
+  //   address: IPv4 address to listen on, in dotted notation.
+  //   port: TCP port to listen on.
+  MetricsHttpServer(MetricsRegistry *registry, const std::string &address,
+                    int port);
+  virtual ~MetricsHttpServer();
+
+  Status Start();
+  void Stop();
+
+ protected:
+  // Delete copy and move constructors.
+  MetricsHttpServer(const MetricsHttpServer &) = delete;
+  MetricsHttpServer &operator=(const MetricsHttpServer &) = delete;
+
+ private:
+  // Accepts and serves all the pending connections.
+  void OnAcceptable();
+  void ServeConnection(int fd);
+
+  MetricsRegistry *registry_;
+  const std::string address_;
+  const int port_;
+  int listen_fd_;
+  ProbeReactor reactor_;
+};  // class MetricsHttpServer
+
+}  // namespace net_failover_manager
+
+#endif  // #ifndef NET_FAILOVER_MANAGER_SERVICE_METRICS_HTTP_SERVER
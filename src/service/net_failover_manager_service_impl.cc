@@ -17,47 +17,252 @@
 #include "net_failover_manager_service_impl.h"
 
 #include <ctime>
+#include <functional>
 
 namespace net_failover_manager {
 
-NetworkConfigImpl::NetworkConfigImpl(RouteManager *rm, InterfaceChecker *ic)
-    : rm_(rm), ic_(ic){};
+namespace {
+// Maximum number of updates buffered for a slow WatchNetworkState client.
+const size_t kMaxPendingUpdates = 256;
+// How often a stream with nothing to send checks for cancellation.
+const std::chrono::seconds kWatchCancellationCheckInterval(1);
 
-grpc::Status NetworkConfigImpl::GetDefaultGw(grpc::ServerContext *context,
-                                             const DefaultGwRequest *request,
+void FillProbeMetrics(const ProbeResult &result,
+                      ProbeMetrics *metrics) {
+  metrics->set_sent(result.sent);
+  metrics->set_received(result.received);
+  metrics->set_packet_loss(result.packet_loss);
+  metrics->set_rtt_min_us(result.rtt_min.count());
+  metrics->set_rtt_avg_us(result.rtt_avg.count());
+  metrics->set_rtt_max_us(result.rtt_max.count());
+  metrics->set_link_down(result.link_down);
+}
+
+std::string FormatTime(std::time_t time) {
+  std::tm local_time;
+  localtime_r(&time, &local_time);
+  char buffer[64];
+  // Same format as asctime.
+  std::strftime(buffer, sizeof(buffer), "%a %b %e %H:%M:%S %Y\n",
+                &local_time);
+  return buffer;
+}
+
+void FillIfStatus(const InterfaceState &interface, IfStatus *if_status) {
+  if_status->set_if_name(InterfaceName(interface.id));
+  if_status->set_status(
+      InterfaceChecker::InterfaceStatusAsString(interface.status));
+  if (interface.last_checked_at != 0) {
+    if_status->set_last_checked_at(FormatTime(interface.last_checked_at));
+  }
+  if (interface.last_probe_result.has_value()) {
+    FillProbeMetrics(interface.last_probe_result.value(),
+                     if_status->mutable_probe_metrics());
+  }
+  if (interface.quality.samples > 0) {
+    auto *quality = if_status->mutable_quality();
+    quality->set_samples(interface.quality.samples);
+    quality->set_rtt_ewma_us(interface.quality.rtt_ewma.count());
+    quality->set_jitter_us(interface.quality.jitter.count());
+    quality->set_loss_percent(interface.quality.loss * 100);
+    quality->set_rtt_p50_us(interface.quality.rtt_p50.count());
+    quality->set_rtt_p95_us(interface.quality.rtt_p95.count());
+    quality->set_score(interface.quality.score);
+  }
+}
+
+// Tag of a call waiting on the completion queue.
+class AsyncCall {
+ public:
+  virtual ~AsyncCall() {}
+  // Called with the result of the last operation started on the call.
+  virtual void Proceed(bool ok) = 0;
+};
+
+// A unary call: waits for a request, replies with the result of the handler
+// and deletes itself. Each received call queues its successor, so that one
+// call of each method is always waiting.
+template <typename Request, typename Response>
+class AsyncUnaryCall : public AsyncCall {
+ public:
+  typedef std::function<void(grpc::ServerContext *, Request *,
+                             grpc::ServerAsyncResponseWriter<Response> *,
+                             grpc::ServerCompletionQueue *, void *)>
+      RequestFunction;
+  typedef std::function<grpc::Status(const Request &, Response *)> Handler;
+
+  static void Start(RequestFunction request_function, Handler handler,
+                    grpc::ServerCompletionQueue *cq) {
+    new AsyncUnaryCall(request_function, handler, cq);
+  }
+
+  void Proceed(bool ok) override {
+    if (finished_ || !ok) {
+      // Reply sent, or the queue is shutting down.
+      delete this;
+      return;
+    }
+    Start(request_function_, handler_, cq_);
+    Response response;
+    grpc::Status status = handler_(request_, &response);
+    finished_ = true;
+    responder_.Finish(response, status, this);
+  }
+
+ private:
+  AsyncUnaryCall(RequestFunction request_function, Handler handler,
+                 grpc::ServerCompletionQueue *cq)
+      : request_function_(request_function),
+        handler_(handler),
+        cq_(cq),
+        responder_(&context_),
+        finished_(false) {
+    request_function_(&context_, &request_, &responder_, cq_, this);
+  }
+
+  const RequestFunction request_function_;
+  const Handler handler_;
+  grpc::ServerCompletionQueue *cq_;
+  grpc::ServerContext context_;
+  Request request_;
+  grpc::ServerAsyncResponseWriter<Response> responder_;
+  bool finished_;
+};
+}  // namespace
+
+NetworkConfigImpl::NetworkConfigImpl(RouteManager *rm,
+                                     GatewayConfigManager *gm)
+    : rm_(rm), gm_(gm) {
+  observer_id_ = gm_->AddEventObserver(
+      [this](const EventDispatcher::NetworkEvent &event) {
+        OnNetworkEvent(event);
+      });
+}
+
+NetworkConfigImpl::~NetworkConfigImpl() {
+  gm_->RemoveEventObserver(observer_id_);
+}
+
+void NetworkConfigImpl::HandleRpcs(grpc::ServerCompletionQueue *cq) {
+  AsyncUnaryCall<DefaultGwRequest, DefaultGwResponse>::Start(
+      [this](grpc::ServerContext *context, DefaultGwRequest *request,
+             grpc::ServerAsyncResponseWriter<DefaultGwResponse> *responder,
+             grpc::ServerCompletionQueue *cq, void *tag) {
+        RequestGetDefaultGw(context, request, responder, cq, cq, tag);
+      },
+      [this](const DefaultGwRequest &request, DefaultGwResponse *response) {
+        return GetDefaultGw(request, response);
+      },
+      cq);
+  AsyncUnaryCall<IfStatusRequest, IfStatusResponse>::Start(
+      [this](grpc::ServerContext *context, IfStatusRequest *request,
+             grpc::ServerAsyncResponseWriter<IfStatusResponse> *responder,
+             grpc::ServerCompletionQueue *cq, void *tag) {
+        RequestGetIfStatus(context, request, responder, cq, cq, tag);
+      },
+      [this](const IfStatusRequest &request, IfStatusResponse *response) {
+        return GetIfStatus(request, response);
+      },
+      cq);
+  AsyncUnaryCall<GetMetricsRequest, GetMetricsResponse>::Start(
+      [this](grpc::ServerContext *context, GetMetricsRequest *request,
+             grpc::ServerAsyncResponseWriter<GetMetricsResponse> *responder,
+             grpc::ServerCompletionQueue *cq, void *tag) {
+        RequestGetMetrics(context, request, responder, cq, cq, tag);
+      },
+      [this](const GetMetricsRequest &request, GetMetricsResponse *response) {
+        return GetMetrics(request, response);
+      },
+      cq);
+  AsyncUnaryCall<StatusHistoryRequest, StatusHistoryResponse>::Start(
+      [this](grpc::ServerContext *context, StatusHistoryRequest *request,
+             grpc::ServerAsyncResponseWriter<StatusHistoryResponse> *responder,
+             grpc::ServerCompletionQueue *cq, void *tag) {
+        RequestGetStatusHistory(context, request, responder, cq, cq, tag);
+      },
+      [this](const StatusHistoryRequest &request,
+             StatusHistoryResponse *response) {
+        return GetStatusHistory(request, response);
+      },
+      cq);
+  AsyncUnaryCall<GetTraceRequest, GetTraceResponse>::Start(
+      [this](grpc::ServerContext *context, GetTraceRequest *request,
+             grpc::ServerAsyncResponseWriter<GetTraceResponse> *responder,
+             grpc::ServerCompletionQueue *cq, void *tag) {
+        RequestGetTrace(context, request, responder, cq, cq, tag);
+      },
+      [this](const GetTraceRequest &request, GetTraceResponse *response) {
+        return GetTrace(request, response);
+      },
+      cq);
+
+  void *tag;
+  bool ok;
+  while (cq->Next(&tag, &ok)) {
+    static_cast<AsyncCall *>(tag)->Proceed(ok);
+  }
+}
+
+grpc::Status NetworkConfigImpl::GetDefaultGw(const DefaultGwRequest &request,
                                              DefaultGwResponse *response) {
-  std::unique_lock<std::mutex> lock(mutex_);
-  auto gw = rm_->PrimaryDefaultGwInterface();
-  if (gw.has_value()) {
-    response->set_default_gw_interface(gw.value());
+  auto state = gm_->State();
+  if (state->default_gw_interface.has_value()) {
+    response->set_default_gw_interface(
+        InterfaceName(state->default_gw_interface.value()));
     return grpc::Status::OK;
   }
   return grpc::Status(grpc::StatusCode::NOT_FOUND,
                       "Could not identify default GW");
 }
 
-grpc::Status NetworkConfigImpl::GetIfStatus(grpc::ServerContext *context,
-                                            const IfStatusRequest *request,
+void NetworkConfigImpl::FillSnapshot(NetworkStateSnapshot *snapshot) {
+  auto state = gm_->State();
+  if (state->default_gw_interface.has_value()) {
+    snapshot->set_default_gw_interface(
+        InterfaceName(state->default_gw_interface.value()));
+  }
+  for (const auto &interface : state->interfaces) {
+    FillIfStatus(interface, snapshot->add_interface_status());
+  }
+}
+
+grpc::Status NetworkConfigImpl::GetIfStatus(const IfStatusRequest &request,
                                             IfStatusResponse *response) {
-  std::unique_lock<std::mutex> lock(mutex_);
-  auto interfaces = ic_->InterfaceNames();
-
-  for (const auto &name : interfaces) {
-    auto *if_status_response = response->add_interface_status();
-    if_status_response->set_if_name(name);
-    auto if_status = ic_->CheckStatus(name);
-    if (if_status.has_value()) {
-      if_status_response->set_status(
-          InterfaceChecker::InterfaceStatusAsString(if_status.value().first));
-      if_status_response->set_last_checked_at(
-          std::asctime(std::localtime(&(if_status.value().second))));
-    } else {
-      LOG(ERROR) << "Could not retrieve status for interface: " << name;
-    }
+  auto state = gm_->State();
+  for (const auto &interface : state->interfaces) {
+    FillIfStatus(interface, response->add_interface_status());
+  }
+  return grpc::Status::OK;
+}
+
+grpc::Status NetworkConfigImpl::GetMetrics(const GetMetricsRequest &request,
+                                           GetMetricsResponse *response) {
+  response->set_text(MetricsRegistry::Default()->Render());
+  return grpc::Status::OK;
+}
+
+grpc::Status
+NetworkConfigImpl::GetStatusHistory(const StatusHistoryRequest &request,
+                                    StatusHistoryResponse *response) {
+  for (const auto &record : gm_->TransitionHistory()) {
+    auto *transition = response->add_transitions();
+    transition->set_if_name(InterfaceName(record.if_id));
+    transition->set_old_status(
+        InterfaceChecker::InterfaceStatusAsString(record.old_status));
+    transition->set_new_status(
+        InterfaceChecker::InterfaceStatusAsString(record.new_status));
+    transition->set_at(FormatTime(record.at));
+    transition->set_reason(record.reason);
   }
   return grpc::Status::OK;
 }
 
+grpc::Status NetworkConfigImpl::GetTrace(const GetTraceRequest &request,
+                                         GetTraceResponse *response) {
+  response->set_trace(TraceLog::Default()->Dump());
+  return grpc::Status::OK;
+}
+
 grpc::Status NetworkConfigImpl::ForceNewGateway(
     grpc::ServerContext *context, const ForceNewGatewayRequest *request,
     ForceNewGatewayResponse *response) {
@@ -66,4 +271,100 @@ grpc::Status NetworkConfigImpl::ForceNewGateway(
   rm_->SetDefaultGw(request->if_name());
   return grpc::Status::OK;
 }
+
+grpc::Status NetworkConfigImpl::WatchNetworkState(
+    grpc::ServerContext *context, const WatchNetworkStateRequest *request,
+    grpc::ServerWriter<NetworkStateUpdate> *writer) {
+  auto stream = std::make_shared<WatchStream>();
+  // Registered before taking the snapshot, so that no change can fall in
+  // between. An update may repeat what the snapshot already shows.
+  stream->needs_snapshot = true;
+  {
+    std::unique_lock<std::mutex> lock(watchers_mutex_);
+    watchers_.insert(stream);
+  }
+  while (!context->IsCancelled()) {
+    std::deque<NetworkStateUpdate> to_send;
+    bool send_snapshot;
+    {
+      std::unique_lock<std::mutex> lock(stream->mutex);
+      stream->cond.wait_for(lock, kWatchCancellationCheckInterval, [&stream] {
+        return stream->needs_snapshot || !stream->pending.empty();
+      });
+      send_snapshot = stream->needs_snapshot;
+      stream->needs_snapshot = false;
+      to_send.swap(stream->pending);
+    }
+    bool ok = true;
+    if (send_snapshot) {
+      // Covers whatever was discarded.
+      to_send.clear();
+      NetworkStateUpdate update;
+      FillSnapshot(update.mutable_snapshot());
+      ok = writer->Write(update);
+    }
+    for (const auto &update : to_send) {
+      if (!ok) {
+        break;
+      }
+      ok = writer->Write(update);
+    }
+    if (!ok) {
+      // The client went away.
+      break;
+    }
+  }
+  std::unique_lock<std::mutex> lock(watchers_mutex_);
+  watchers_.erase(stream);
+  return grpc::Status::OK;
+}
+
+void NetworkConfigImpl::OnNetworkEvent(
+    const EventDispatcher::NetworkEvent &event) {
+  NetworkStateUpdate update;
+  switch (event.type) {
+    case EventDispatcher::NetworkEvent::IF_STATUS_CHANGED: {
+      auto *change = update.mutable_if_status_change();
+      change->set_if_name(InterfaceName(event.if_id));
+      change->set_old_status(
+          InterfaceChecker::InterfaceStatusAsString(event.old_status));
+      change->set_new_status(
+          InterfaceChecker::InterfaceStatusAsString(event.new_status));
+    } break;
+    case EventDispatcher::NetworkEvent::GW_CHANGED:
+      update.mutable_default_gw_change()->set_default_gw_interface(
+          InterfaceName(event.if_id));
+      break;
+    case EventDispatcher::NetworkEvent::PROBE_RESULT: {
+      auto *metrics = update.mutable_probe_metrics();
+      metrics->set_if_name(InterfaceName(event.if_id));
+      FillProbeMetrics(event.probe_result, metrics->mutable_probe_metrics());
+    } break;
+    case EventDispatcher::NetworkEvent::IF_REMOVED: {
+      // There is no update for it, the watchers get a new snapshot instead.
+      std::unique_lock<std::mutex> lock(watchers_mutex_);
+      for (const auto &stream : watchers_) {
+        std::unique_lock<std::mutex> stream_lock(stream->mutex);
+        stream->pending.clear();
+        stream->needs_snapshot = true;
+        stream->cond.notify_one();
+      }
+      return;
+    }
+    case EventDispatcher::NetworkEvent::STATE_RESTORE:
+      // Never reported.
+      return;
+  }
+  std::unique_lock<std::mutex> lock(watchers_mutex_);
+  for (const auto &stream : watchers_) {
+    std::unique_lock<std::mutex> stream_lock(stream->mutex);
+    if (stream->pending.size() >= kMaxPendingUpdates) {
+      stream->pending.clear();
+      stream->needs_snapshot = true;
+    } else if (!stream->needs_snapshot) {
+      stream->pending.push_back(update);
+    }
+    stream->cond.notify_one();
+  }
+}
 }  // namespace net_failover_manager
@@ -17,38 +17,90 @@
 #ifndef NET_FAILOVER_MANAGER_SERVICE_SERVICE_IMPL
 #define NET_FAILOVER_MANAGER_SERVICE_SERVICE_IMPL
 
-#include "src/netctl/interface_checker.h"
+#include "src/lib/metrics.h"
+#include "src/netctl/gateway_config_manager.h"
+#include "src/netctl/interface_registry.h"
+#include "src/netctl/network_state.h"
 #include "src/netctl/route_manager.h"
+#include "src/netctl/trace_log.h"
 #include "src/proto/net_failover_manager_service.grpc.pb.h"
 
+#include <condition_variable>
+#include <deque>
 #include <grpcpp/grpcpp.h>
+#include <memory>
+#include <set>
 #include <string>
 #include <thread>
 
 namespace net_failover_manager {
 
-class NetworkConfigImpl final : public NetworkConfig::Service {
-public:
-  NetworkConfigImpl(RouteManager *rm, InterfaceChecker *ic);
-  ~NetworkConfigImpl() override{};
+// Read only unary calls are served asynchronously from a completion queue,
+// the streaming and mutating calls keep using the synchronous thread pool.
+typedef NetworkConfig::WithAsyncMethod_GetDefaultGw<
+    NetworkConfig::WithAsyncMethod_GetIfStatus<
+        NetworkConfig::WithAsyncMethod_GetMetrics<
+            NetworkConfig::WithAsyncMethod_GetStatusHistory<
+                NetworkConfig::WithAsyncMethod_GetTrace<
+                    NetworkConfig::Service>>>>>
+    NetworkConfigAsyncReads;
 
-  grpc::Status GetDefaultGw(grpc::ServerContext *context,
-                            const DefaultGwRequest *request,
-                            DefaultGwResponse *response) override;
+class NetworkConfigImpl final : public NetworkConfigAsyncReads {
+public:
+  NetworkConfigImpl(RouteManager *rm, GatewayConfigManager *gm);
+  ~NetworkConfigImpl() override;
 
-  grpc::Status GetIfStatus(grpc::ServerContext *context,
-                           const IfStatusRequest *request,
-                           IfStatusResponse *response) override;
+  // Serves the asynchronous calls until `cq` is shut down. The replies come
+  // from the state published by the GatewayConfigManager, so they never wait
+  // for the probe or route threads. Must be called from a single thread
+  // per queue, after the server has been started.
+  void HandleRpcs(grpc::ServerCompletionQueue *cq);
 
   grpc::Status ForceNewGateway(grpc::ServerContext *context,
                                const ForceNewGatewayRequest *request,
                                ForceNewGatewayResponse *response) override;
 
+  grpc::Status
+  WatchNetworkState(grpc::ServerContext *context,
+                    const WatchNetworkStateRequest *request,
+                    grpc::ServerWriter<NetworkStateUpdate> *writer) override;
+
 private:
-  mutable std::mutex mutex_;
+  // Updates waiting to be written to one WatchNetworkState stream.
+  typedef struct {
+    std::mutex mutex;
+    std::condition_variable cond;
+    // Protected by mutex.
+    std::deque<NetworkStateUpdate> pending;
+    // Set if updates were discarded because the client is too slow, a new
+    // snapshot replaces them. Protected by mutex.
+    bool needs_snapshot;
+  } WatchStream;
+
+  grpc::Status GetDefaultGw(const DefaultGwRequest &request,
+                            DefaultGwResponse *response);
+  grpc::Status GetIfStatus(const IfStatusRequest &request,
+                           IfStatusResponse *response);
+  grpc::Status GetMetrics(const GetMetricsRequest &request,
+                          GetMetricsResponse *response);
+  grpc::Status GetStatusHistory(const StatusHistoryRequest &request,
+                                StatusHistoryResponse *response);
+  grpc::Status GetTrace(const GetTraceRequest &request,
+                        GetTraceResponse *response);
+
+  void FillSnapshot(NetworkStateSnapshot *snapshot);
+  // Called on the dispatcher thread of gm_, turns the event into an update
+  // for every open stream.
+  void OnNetworkEvent(const EventDispatcher::NetworkEvent &event);
+
   // Ownership remains with the parent.
   RouteManager *rm_;
-  InterfaceChecker *ic_;
+  GatewayConfigManager *gm_;
+  int observer_id_;
+
+  std::mutex watchers_mutex_;
+  // Open WatchNetworkState streams. Protected by watchers_mutex_.
+  std::set<std::shared_ptr<WatchStream>> watchers_;
 
 }; // class NetworkConfigImpl
 
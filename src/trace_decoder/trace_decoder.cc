@@ -0,0 +1,285 @@
+// This file is part of Net Failover Manager.
+//
+// Net Failover Manager is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Net Failover Manager is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Net Failover Manager.  If not, see
+// <https://www.gnu.org/licenses/>.
+
+// Prints the trace of the failover decisions of the daemon, one event per
+// line, oldest first. The trace is read from a file written on SIGUSR1, or
+// fetched with GetTrace:
+//   trace_decoder /run/net_failover_manager.trace
+//   trace_decoder --server=localhost:50051
+// Must be built from the same sources as the daemon that wrote the trace.
+
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/sockios.h>
+#include <time.h>
+
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <grpcpp/grpcpp.h>
+#include "src/lib/status.h"
+#include "src/netctl/event_dispatcher.h"
+#include "src/netctl/interface_checker.h"
+#include "src/netctl/trace_log.h"
+#include "src/proto/net_failover_manager_service.grpc.pb.h"
+
+DEFINE_string(server, "",
+              "Address of the daemon, e.g. localhost:50051, to fetch the "
+              "trace from instead of reading a file.");
+
+using net_failover_manager::EventDispatcher;
+using net_failover_manager::InterfaceChecker;
+using net_failover_manager::Status;
+using net_failover_manager::TraceLog;
+
+namespace {
+
+std::string FormatWallTime(int64_t wall_ns) {
+  time_t seconds = wall_ns / 1000000000;
+  struct tm local;
+  localtime_r(&seconds, &local);
+  char date[32];
+  strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", &local);
+  char result[48];
+  snprintf(result, sizeof(result), "%s.%09" PRId64, date,
+           wall_ns % 1000000000);
+  return result;
+}
+
+std::string FormatDuration(uint64_t ns) {
+  char result[32];
+  if (ns < 1000) {
+    snprintf(result, sizeof(result), "%" PRIu64 "ns", ns);
+  } else if (ns < 1000000) {
+    snprintf(result, sizeof(result), "%.3fus", ns / 1e3);
+  } else if (ns < 1000000000) {
+    snprintf(result, sizeof(result), "%.3fms", ns / 1e6);
+  } else {
+    snprintf(result, sizeof(result), "%.3fs", ns / 1e9);
+  }
+  return result;
+}
+
+std::string InterfaceStatusName(int64_t status) {
+  return InterfaceChecker::InterfaceStatusAsString(
+      static_cast<InterfaceChecker::InterfaceStatus>(status));
+}
+
+std::string StatusName(int64_t code) {
+  switch (code) {
+    case Status::OK:
+      return "OK";
+    case Status::NO_OP:
+      return "NO_OP";
+    case Status::UNKNOWN_ERROR:
+      return "UNKNOWN_ERROR";
+    case Status::NOT_FOUND:
+      return "NOT_FOUND";
+    case Status::NOT_IMPLEMENTED:
+      return "NOT_IMPLEMENTED";
+    case Status::PERMISSION_ERROR:
+      return "PERMISSION_ERROR";
+    case Status::INVALID_ARGUMENTS:
+      return "INVALID_ARGUMENTS";
+  }
+  return std::to_string(code);
+}
+
+std::string NetworkEventName(int64_t type) {
+  switch (type) {
+    case EventDispatcher::NetworkEvent::IF_STATUS_CHANGED:
+      return "IF_STATUS_CHANGED";
+    case EventDispatcher::NetworkEvent::GW_CHANGED:
+      return "GW_CHANGED";
+    case EventDispatcher::NetworkEvent::PROBE_RESULT:
+      return "PROBE_RESULT";
+    case EventDispatcher::NetworkEvent::IF_REMOVED:
+      return "IF_REMOVED";
+    case EventDispatcher::NetworkEvent::STATE_RESTORE:
+      return "STATE_RESTORE";
+  }
+  return std::to_string(type);
+}
+
+std::string DecisionName(int64_t decision) {
+  switch (decision) {
+    case TraceLog::FAILOVER:
+      return "FAILOVER";
+    case TraceLog::FAILBACK:
+      return "FAILBACK";
+    case TraceLog::FAILBACK_DEFERRED:
+      return "FAILBACK_DEFERRED";
+    case TraceLog::ALREADY_GATEWAY:
+      return "ALREADY_GATEWAY";
+    case TraceLog::NOT_PREFERRED:
+      return "NOT_PREFERRED";
+    case TraceLog::LOWER_PRIORITY:
+      return "LOWER_PRIORITY";
+    case TraceLog::NOT_GATEWAY:
+      return "NOT_GATEWAY";
+    case TraceLog::NO_HEALTHY_ALTERNATIVE:
+      return "NO_HEALTHY_ALTERNATIVE";
+  }
+  return std::to_string(decision);
+}
+
+// Only the requests sent by the daemon are named.
+std::string NetlinkOperationName(int64_t protocol, int64_t type) {
+  if (protocol == NETLINK_ROUTE) {
+    switch (type) {
+      case RTM_GETLINK:
+        return "route RTM_GETLINK";
+      case RTM_GETADDR:
+        return "route RTM_GETADDR";
+      case RTM_NEWROUTE:
+        return "route RTM_NEWROUTE";
+      case RTM_DELROUTE:
+        return "route RTM_DELROUTE";
+      case RTM_GETROUTE:
+        return "route RTM_GETROUTE";
+      case RTM_NEWRULE:
+        return "route RTM_NEWRULE";
+      case RTM_DELRULE:
+        return "route RTM_DELRULE";
+      case RTM_GETRULE:
+        return "route RTM_GETRULE";
+    }
+    return "route type " + std::to_string(type);
+  }
+  if (protocol == NETLINK_NETFILTER) {
+    // Subsystem in the high byte, message in the low one.
+    return "netfilter subsys " + std::to_string(type >> 8) + " message " +
+           std::to_string(type & 0xff);
+  }
+  return "protocol " + std::to_string(protocol) + " type " +
+         std::to_string(type);
+}
+
+std::string FormatEvent(const TraceLog::Event &event,
+                        const TraceLog::DumpContents &contents) {
+  auto name = [&](int64_t id) -> std::string {
+    if (id == net_failover_manager::kNoInterface) {
+      return "-";
+    }
+    if (id >= 0 && static_cast<size_t>(id) < contents.interface_names.size()) {
+      return contents.interface_names[id];
+    }
+    return "#" + std::to_string(id);
+  };
+  const auto *args = event.args;
+  std::stringstream line;
+  line << FormatWallTime(contents.wall_ns -
+                         (contents.steady_ns -
+                          static_cast<int64_t>(event.timestamp_ns)))
+       << " " << event.thread_id << " ";
+  switch (event.type) {
+    case TraceLog::PROBE_RESULT:
+      line << "PROBE_RESULT " << name(event.if_id) << " "
+           << InterfaceStatusName(args[0]) << " received " << args[2] << "/"
+           << args[1] << " rtt_avg " << FormatDuration(event.duration_ns)
+           << (args[3] ? " link down" : "");
+      break;
+    case TraceLog::STATUS_TRANSITION:
+      line << "STATUS_TRANSITION " << name(event.if_id) << " "
+           << InterfaceStatusName(args[0]) << " -> "
+           << InterfaceStatusName(args[1]);
+      break;
+    case TraceLog::EVENT_DISPATCH:
+      line << "EVENT_DISPATCH " << name(event.if_id) << " "
+           << NetworkEventName(args[0]) << " queued "
+           << FormatDuration(args[1]) << " handled in "
+           << FormatDuration(event.duration_ns);
+      break;
+    case TraceLog::GATEWAY_SELECTION:
+      line << "GATEWAY_SELECTION " << name(event.if_id) << " "
+           << DecisionName(args[0]) << " current " << name(args[1]);
+      break;
+    case TraceLog::GATEWAY_SWITCH:
+      line << "GATEWAY_SWITCH " << name(args[0]) << " -> "
+           << name(event.if_id) << " " << StatusName(args[1]) << " "
+           << FormatDuration(event.duration_ns) << " after detection";
+      break;
+    case TraceLog::GATEWAY_DETECTED:
+      line << "GATEWAY_DETECTED " << name(args[0]) << " -> "
+           << name(event.if_id);
+      break;
+    case TraceLog::NETLINK_OP:
+      line << "NETLINK_OP " << NetlinkOperationName(args[0], args[1]) << " x"
+           << args[2] << " " << StatusName(args[3]) << " in "
+           << FormatDuration(event.duration_ns);
+      break;
+    case TraceLog::IOCTL_OP:
+      line << "IOCTL_OP "
+           << (args[0] == SIOCGIFNAME ? "SIOCGIFNAME" : "SIOCGIFINDEX") << " "
+           << name(event.if_id) << " index " << args[1] << " in "
+           << FormatDuration(event.duration_ns);
+      break;
+    default:
+      line << "type " << event.type << " " << name(event.if_id) << " "
+           << args[0] << " " << args[1] << " " << args[2] << " " << args[3];
+      break;
+  }
+  return line.str();
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+  std::string data;
+  if (!FLAGS_server.empty()) {
+    auto stub = net_failover_manager::NetworkConfig::NewStub(
+        grpc::CreateChannel(FLAGS_server, grpc::InsecureChannelCredentials()));
+    grpc::ClientContext context;
+    net_failover_manager::GetTraceRequest request;
+    net_failover_manager::GetTraceResponse response;
+    auto status = stub->GetTrace(&context, request, &response);
+    if (!status.ok()) {
+      LOG(ERROR) << "GetTrace failed: " << status.error_message();
+      return EXIT_FAILURE;
+    }
+    data = response.trace();
+  } else if (argc == 2) {
+    std::ifstream file(argv[1], std::ios::binary);
+    if (!file) {
+      LOG(ERROR) << "Cannot read " << argv[1];
+      return EXIT_FAILURE;
+    }
+    std::stringstream content;
+    content << file.rdbuf();
+    data = content.str();
+  } else {
+    LOG(ERROR) << "Usage: " << argv[0] << " [--server=address] [file]";
+    return EXIT_FAILURE;
+  }
+  TraceLog::DumpContents contents;
+  auto status = TraceLog::ParseDump(data, &contents);
+  if (status.Error() != Status::OK) {
+    LOG(ERROR) << status.ErrorMessage();
+    return EXIT_FAILURE;
+  }
+  for (const auto &event : contents.events) {
+    printf("%s\n", FormatEvent(event, contents).c_str());
+  }
+  return EXIT_SUCCESS;
+}
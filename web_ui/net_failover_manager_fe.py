@@ -16,7 +16,7 @@ along with Net Failover Manager.  If not, see <https://www.gnu.org/licenses/>.
 """
 
 import os
-from flask import Flask, render_template, jsonify, request
+from flask import Flask, Response, render_template, jsonify, request
 from absl import app
 from absl import flags
 from absl import logging
@@ -62,6 +62,23 @@ def getInterfaceStatuses():
     return MessageToJson(grpc_response)
 
 
+@flaskapp.route('/watch_network_state', methods=['GET'])
+def watchNetworkState():
+    """Forwards the daemon updates to the browser as server-sent events."""
+    grpc_request = net_failover_manager_service_pb2.WatchNetworkStateRequest()
+    updates = stub.WatchNetworkState(grpc_request)
+
+    def generate():
+        try:
+            for update in updates:
+                yield 'data: %s\n\n' % MessageToJson(update, indent=None)
+        finally:
+            # The browser went away, stop the stream on the daemon as well.
+            updates.cancel()
+
+    return Response(generate(), mimetype='text/event-stream')
+
+
 @flaskapp.route('/set_default_gw', methods=['GET'])
 def setDefaultGateway():
     new_interface = request.args.get('interface')
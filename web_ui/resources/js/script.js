@@ -14,11 +14,47 @@
 // along with Net Failover Manager.  If not, see
 // <https://www.gnu.org/licenses/>.
 
+// Latest known status of each interface, keyed by interface name.
+let interfaceStatus = {};
+
 window.onload =
     () => {
       console.log("Initialized");
-      setInterval(readDefaultGw, 3000);
-      setInterval(readInterfaceStatus, 3000);
+      if (!window.EventSource) {
+        setInterval(readDefaultGw, 3000);
+        setInterval(readInterfaceStatus, 3000);
+        return;
+      }
+      // The daemon pushes a snapshot followed by the changes, the browser
+      // reconnects on its own if the stream breaks.
+      let updates = new EventSource('/watch_network_state');
+      updates.onmessage = (event) => {
+        applyUpdate(JSON.parse(event.data));
+      };
+    }
+
+applyUpdate =
+    (update) => {
+      if (update.snapshot) {
+        showDefaultGw(update.snapshot.defaultGwInterface);
+        interfaceStatus = {};
+        (update.snapshot.interfaceStatus || []).forEach((element) => {
+          interfaceStatus[element.ifName] = element.status;
+        });
+        renderInterfaceStatus();
+      } else if (update.defaultGwChange) {
+        showDefaultGw(update.defaultGwChange.defaultGwInterface);
+      } else if (update.ifStatusChange) {
+        interfaceStatus[update.ifStatusChange.ifName] =
+            update.ifStatusChange.newStatus;
+        renderInterfaceStatus();
+      }
+    }
+
+showDefaultGw =
+    (defaultGw) => {
+      document.getElementById('default_gw').innerHTML =
+          "Default Gateway: " + (defaultGw || "");
     }
 
 setDefaultGw =
@@ -58,24 +94,32 @@ readInterfaceStatus = () => {
   ifRequest.onreadystatechange = function() {
     if (ifRequest.readyState === 4 && ifRequest.status == 200) {
       let parsedResponse = JSON.parse(ifRequest.responseText);
-      let ifStatusDiv = document.getElementById('if_status');
-      ifStatusDiv.innerHTML = "";
+      interfaceStatus = {};
       parsedResponse.interfaceStatus.forEach((element) => {
-        let newDiv = document.createElement("div");
-        let ifNameText = document.createElement("span");
-        ifNameText.setAttribute("class", "if_name");
-        ifNameText.innerHTML = element.ifName;
-        let ifStatusText = document.createTextNode(element.status);
-        let setDefaultGwButton = document.createElement("button");
-        setDefaultGwButton.innerText = "Set Default";
-        setDefaultGwButton.onclick = setDefaultGw;
-        newDiv.appendChild(ifNameText);
-        newDiv.appendChild(document.createTextNode(" - "));
-        newDiv.appendChild(ifStatusText);
-        newDiv.appendChild(setDefaultGwButton);
-        ifStatusDiv.appendChild(newDiv);
+        interfaceStatus[element.ifName] = element.status;
       });
+      renderInterfaceStatus();
     }
   };
   ifRequest.send();
 }
+
+renderInterfaceStatus = () => {
+  let ifStatusDiv = document.getElementById('if_status');
+  ifStatusDiv.innerHTML = "";
+  Object.keys(interfaceStatus).sort().forEach((ifName) => {
+    let newDiv = document.createElement("div");
+    let ifNameText = document.createElement("span");
+    ifNameText.setAttribute("class", "if_name");
+    ifNameText.innerHTML = ifName;
+    let ifStatusText = document.createTextNode(interfaceStatus[ifName]);
+    let setDefaultGwButton = document.createElement("button");
+    setDefaultGwButton.innerText = "Set Default";
+    setDefaultGwButton.onclick = setDefaultGw;
+    newDiv.appendChild(ifNameText);
+    newDiv.appendChild(document.createTextNode(" - "));
+    newDiv.appendChild(ifStatusText);
+    newDiv.appendChild(setDefaultGwButton);
+    ifStatusDiv.appendChild(newDiv);
+  });
+}